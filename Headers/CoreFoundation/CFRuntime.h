@@ -169,6 +169,44 @@ CF_EXPORT void
 _CFRuntimeInitStaticInstance (void *memory, CFTypeID typeID);
 #define CF_HAS_INIT_STATIC_INSTANCE 1
 
+
+
+/** \name Instance Statistics
+    The runtime can count, for every type, how many instances were
+    allocated and deallocated, how many bytes were requested for them and
+    how many times they were retained and released.  Counting is off by
+    default.  It is switched on by setting the \c CFInstanceStatistics
+    environment variable to anything other than \c NO or \c 0, in which
+    case a table of the counts is also written to standard error when the
+    program exits, or by calling _CFRuntimeSetInstanceStatisticsEnabled().
+    \{
+ */
+/** Starts or stops counting.
+    \param enabled true to start counting, false to stop.
+    \note Objects created before counting started are still counted when
+    they are deallocated, so the number of live instances of a type may be
+    negative.
+ */
+CF_EXPORT void
+_CFRuntimeSetInstanceStatisticsEnabled (Boolean enabled);
+
+/** Returns true if the runtime is counting instances.
+ */
+CF_EXPORT Boolean
+_CFRuntimeGetInstanceStatisticsEnabled (void);
+
+/** Returns a snapshot of the counts collected so far.
+    \return A dictionary keyed by class name.  Each value is a
+    dictionary with the CFNumber values \c LiveInstances, \c Allocations,
+    \c Bytes, \c Retains and \c Releases.  Types that were never counted
+    are omitted.  Ownership follows the Create Rule.
+    \note Counts updated by other threads while the snapshot is taken
+    may or may not be included.
+ */
+CF_EXPORT CFDictionaryRef
+_CFRuntimeCopyInstanceStatistics (void);
+/** \} */
+
 /** \} */
 
 /** \example EXUInt32.h
@@ -96,7 +96,9 @@ enum CFStringBuiltInEncodings
 /** \def CFSTR(x)
     \brief Creates a constant string object.
     
-    \note This macro will create the constant string at runtime.
+    \note With GCC and Clang the string object is emitted by the compiler
+    and only needs a one time initialization the first time the expression
+    is evaluated.  Other compilers create the constant string at runtime.
  */
 /* The 'pure' attribute tells the compiler that this function will always
    return the same result with the same input.  If it has any skill, then
@@ -104,7 +106,39 @@ enum CFStringBuiltInEncodings
    called as few times as possible. */
 CF_EXPORT CFStringRef
 __CFStringMakeConstantString (const char *str) GS_PURE_FUNCTION;
+
+#if defined(__GNUC__) && defined(__ATOMIC_ACQUIRE)
+/* This structure must have the same layout as a CFRuntimeBase followed by
+   the fields of an immutable CFString.  For internal use only. */
+struct __CFConstantStringLiteral
+{
+  void *_isa;
+  SInt16 _typeID;
+  struct
+    {
+      SInt16 ro:       1;
+      SInt16 reserved: 7;
+      SInt16 info:     8;
+    } _flags;
+  const char *_contents;
+  CFIndex _count;
+  CFHashCode _hash;
+  CFAllocatorRef _deallocator;
+};
+
+CF_EXPORT CFStringRef
+__CFStringInitializeConstantString (struct __CFConstantStringLiteral *str);
+
+#define CFSTR(x) (__extension__ ({ \
+  static struct __CFConstantStringLiteral __cfstr = \
+    { 0, 0, { 1, 0, 0 }, "" x "", sizeof ("" x "") - 1, 0, 0 }; \
+  __builtin_expect (__atomic_load_n (&__cfstr._typeID, __ATOMIC_ACQUIRE) \
+                    != 0, 1) \
+    ? (CFStringRef) &__cfstr : __CFStringInitializeConstantString (&__cfstr); \
+}))
+#else
 #define CFSTR(x) __CFStringMakeConstantString("" x "")
+#endif
 
 /** \name Creating a CFString
     \{
@@ -170,6 +204,35 @@ CFStringCreateWithBytesNoCopy (CFAllocatorRef alloc, const UInt8 *bytes,
 #endif
 /** \} */
 
+/** \name Interning CFStrings
+    Interning returns the same immutable string for all strings with equal
+    contents, so that programs holding many copies of the same text keep
+    only one, and so that comparing two interned strings only needs to
+    compare pointers.  The table of interned strings does not retain them:
+    a string leaves the table when its last reference is released.
+    These functions are a GNUstep extension.
+    \{
+ */
+/** Returns the interned string with the same contents as str.
+    \param alloc The allocator used if a new string has to be created.
+    \param str The string to intern.  If str is immutable it may itself
+    become the interned string.
+    \return The interned string.  Ownership follows the Create Rule.
+ */
+CF_EXPORT CFStringRef
+CFStringCreateInterned (CFAllocatorRef alloc, CFStringRef str);
+
+/** Returns counters describing the use of CFStringCreateInterned().
+    \return A dictionary with the CFNumber values \c Lookups (calls to
+    CFStringCreateInterned()), \c Hits (calls that returned an existing
+    string), \c Entries (strings currently interned) and \c BytesSaved
+    (total size of the characters of strings that were replaced by an
+    existing string).  Ownership follows the Create Rule.
+ */
+CF_EXPORT CFDictionaryRef
+_CFStringCopyInternStatistics (void);
+/** \} */
+
 /** \name Searching CFStrings
     \{
  */
@@ -206,6 +269,34 @@ CF_EXPORT void
 CFStringGetParagraphBounds (CFStringRef string, CFRange range,
   CFIndex *parBeginIndex, CFIndex *parEndIndex, CFIndex *contentsEndIndex);
 #endif
+
+/** Returns the number of lines in str.  Lines end where
+    CFStringGetLineBounds() ends them, and a line ending at the end of the
+    string does not start another line.  The line starts of large immutable
+    strings are remembered, so that this and the two functions below take
+    logarithmic time after the first call.
+    \param str The string.
+    \return The number of lines, which is 0 for an empty string.
+ */
+CF_EXPORT CFIndex
+_CFStringGetLineCount (CFStringRef str);
+
+/** Returns the number of the line holding a character.
+    \param str The string.
+    \param idx The index of the character.
+    \return The line number, counting from 0, or kCFNotFound if idx is
+    outside the string.
+ */
+CF_EXPORT CFIndex
+_CFStringGetLineAtIndex (CFStringRef str, CFIndex idx);
+
+/** Returns the index of the first character of a line.
+    \param str The string.
+    \param line The line number, counting from 0.
+    \return The index, or kCFNotFound if str has no such line.
+ */
+CF_EXPORT CFIndex
+_CFStringGetLineStartIndex (CFStringRef str, CFIndex line);
 /** \} */
 
 /** \name Comparing String
@@ -341,13 +432,52 @@ CFStringGetMaximumSizeOfFileSystemRepresentation (CFStringRef string);
 /** \} */
 
 /** \name Getting Numeric Values
+    These functions skip leading white space and read as much of a number
+    as they can.  The decimal separator is always '.'; use CFNumberFormatter
+    to read numbers written for a locale.
     \{
  */
+/** Returns the number at the start of str, or 0.0 if there is none.
+ */
 CF_EXPORT double
 CFStringGetDoubleValue (CFStringRef str);
 
+/** Returns the integer at the start of str, or 0 if there is none.  Values
+    that do not fit are returned as INT_MAX or INT_MIN.
+ */
 CF_EXPORT SInt32
 CFStringGetIntValue (CFStringRef str);
+
+/** Reads a decimal integer with an optional sign from a range of a string.
+    \param str The string to read from.
+    \param range The characters to read.
+    \param value On return, the integer read.  If it does not fit in an
+    SInt64 this is the nearest limit.
+    \param overflow On return, whether the integer did not fit.  May be
+    NULL.
+    \return The range of the integer in str, or a range of length 0 at
+    range.location if there is none.
+    This function is a GNUstep extension.
+ */
+CF_EXPORT CFRange
+CFStringScanIntValue (CFStringRef str, CFRange range, SInt64 *value,
+  Boolean *overflow);
+
+/** Reads a floating point number from a range of a string.  The number
+    may have a fraction and an exponent, or be "inf", "infinity" or "nan"
+    in any case, and is correctly rounded.
+    \param str The string to read from.
+    \param range The characters to read.
+    \param value On return, the number read.
+    \param overflow On return, whether the number was too large and
+    value is infinity.  May be NULL.
+    \return The range of the number in str, or a range of length 0 at
+    range.location if there is none.
+    This function is a GNUstep extension.
+ */
+CF_EXPORT CFRange
+CFStringScanDoubleValue (CFStringRef str, CFRange range, double *value,
+  Boolean *overflow);
 /** \} */
 
 /** \name Getting String Properties
@@ -529,19 +659,35 @@ struct CFStringInlineBuffer
   UniChar buffer[__kCFStringInlineBufferLength];
   CFStringRef theString;
   const UniChar *directBuffer;
+  const char *directCStringBuffer;
   CFRange rangeToBuffer;
   CFIndex bufferedRangeStart;
   CFIndex bufferedRangeEnd;
 };
 typedef struct CFStringInlineBuffer CFStringInlineBuffer;
 
+/* Same as CFStringGetCharactersPtr() but never changes the way the
+   string is stored, so it returns NULL where that function would have to
+   gather the characters into one buffer first.  For internal use only. */
+CF_EXPORT const UniChar *
+__CFStringGetContiguousCharactersPtr (CFStringRef str);
+
+/* Returns the contents of a string stored as ASCII or ISO-8859-1, one
+   byte for each character, or NULL.  Unlike CFStringGetCStringPtr() this
+   also works for substrings, which are not followed by a null byte.  For
+   internal use only. */
+CF_EXPORT const char *
+__CFStringGetContiguousLatin1Ptr (CFStringRef str);
+
 CF_INLINE void
 CFStringInitInlineBuffer (CFStringRef str, CFStringInlineBuffer *buf,
   CFRange range)
 {
   buf->theString = str;
   buf->rangeToBuffer = range;
-  buf->directBuffer = CFStringGetCharactersPtr (str);
+  buf->directBuffer = __CFStringGetContiguousCharactersPtr (str);
+  buf->directCStringBuffer = buf->directBuffer
+    ? NULL : __CFStringGetContiguousLatin1Ptr (str);
   buf->bufferedRangeStart = 0;
   buf->bufferedRangeEnd = 0;
 }
@@ -555,6 +701,13 @@ CFStringGetCharacterFromInlineBuffer (CFStringInlineBuffer *buf, CFIndex idx)
         return 0;
       return buf->directBuffer[idx + buf->rangeToBuffer.location];
     }
+  else if (buf->directCStringBuffer)
+    {
+      if (idx < 0 || idx >= buf->rangeToBuffer.length)
+        return 0;
+      return (UInt8)
+        buf->directCStringBuffer[idx + buf->rangeToBuffer.location];
+    }
   else if (idx >= buf->bufferedRangeEnd || idx < buf->bufferedRangeStart)
     {
       CFRange range;
@@ -562,8 +715,17 @@ CFStringGetCharacterFromInlineBuffer (CFStringInlineBuffer *buf, CFIndex idx)
       if (idx < 0 || idx >= buf->rangeToBuffer.length)
         return 0;
       
-      /* Use 16 here so it's efficient to go backwards, too */
-      buf->bufferedRangeStart = idx - 16;
+      /* Fill the buffer ahead of idx when reading forwards and behind it
+         when reading backwards.  After a jump, keep 16 characters before
+         idx so it's efficient to go backwards, too. */
+      if (idx >= buf->bufferedRangeEnd
+          && idx < buf->bufferedRangeEnd + __kCFStringInlineBufferLength)
+        buf->bufferedRangeStart = idx;
+      else if (idx < buf->bufferedRangeStart && idx
+               >= buf->bufferedRangeStart - __kCFStringInlineBufferLength)
+        buf->bufferedRangeStart = idx + 1 - __kCFStringInlineBufferLength;
+      else
+        buf->bufferedRangeStart = idx - 16;
       if (buf->bufferedRangeStart < 0)
         buf->bufferedRangeStart = 0;
       buf->bufferedRangeEnd =
@@ -174,7 +174,7 @@ GSUTF8CharacterSkipByteOrderMark (const UTF8Char ** s, const UTF8Char * limit)
   const UTF8Char *p;
 
   p = *s;
-  if ((limit - p) > 3)
+  if ((limit - p) >= 3)
     {
       if (*p++ == 0xEF && *p++ == 0xBB && *p++ == 0xBF)
         {
@@ -204,7 +204,7 @@ GSUTF8CharacterAppend (UTF8Char * d, const UTF8Char * limit, UTF32Char c)
     return 0;
 
   l = GSUTF8CharacterLength (c);
-  if (l && limit - d > l)
+  if (l && limit - d >= l)
     {
       switch (l)
         {
@@ -319,13 +319,13 @@ GSUTF16CharacterAppend (UTF16Char * d, const UTF16Char * limit, UTF32Char c)
 {
   if (c <= 0xFFFF)
     {
-      if ((limit - d) > 1)
+      if ((limit - d) >= 1)
         *d = c;
       return 1;
     }
   else if (c <= 0x10FFFF)
     {
-      if ((limit - d) > 2)
+      if ((limit - d) >= 2)
         {
           d[0] = (c >> 10) + 0xD7C0;
           d[1] = (c & 0x3FF) + 0xDC00;
@@ -28,6 +28,7 @@
 #define __GSUNICODE_H__ 1
 
 #include <CoreFoundation/CFBase.h>
+#include <CoreFoundation/CFString.h>
 #include <stdarg.h>
 
 /** @defgroup UnicodeUtils Unicode String Utilities
@@ -126,6 +127,79 @@ GSUnicodeToEncoding (UInt8 ** d, const UInt8 * const dLimit,
                      Boolean addBOM);
 /** @} */
 
+/** @name Incremental Decoding
+    @{
+ */
+/** @brief An opaque decoder for text that arrives in pieces. */
+typedef struct GSUnicodeDecoder *GSUnicodeDecoderRef;
+
+/** @brief Create a decoder for text in the given encoding.
+    @details A decoder converts its input to UTF-16 a piece at a time.
+      Byte sequences that are split between two pieces, and the state of
+      stateful encodings such as ISO-2022-JP, are kept in the decoder until
+      the next piece arrives, so the input never needs to be buffered as a
+      whole.  A byte order mark is only looked for at the start of the
+      input.
+    @param[in] enc Encoding of the input.
+    @param[in] loss A substitute character for invalid input, typically
+      <b>U+FFFD</b>.  Specify <code>0</code> to stop at invalid input.
+    @return A new decoder, or <code>NULL</code> if the encoding is not
+      supported.  Destroy it with GSUnicodeDecoderDestroy().
+ */
+CF_EXPORT GSUnicodeDecoderRef
+GSUnicodeDecoderCreate (CFStringEncoding enc, UniChar loss);
+
+/** @brief Destroy a decoder created with GSUnicodeDecoderCreate().
+ */
+CF_EXPORT void
+GSUnicodeDecoderDestroy (GSUnicodeDecoderRef decoder);
+
+/** @brief Forget any partial input and start decoding anew.
+ */
+CF_EXPORT void
+GSUnicodeDecoderReset (GSUnicodeDecoderRef decoder);
+
+/** @brief Decode the next piece of input into a buffer.
+    @details Decoding stops when the input is used up or when the
+      destination buffer is full.  A partial sequence at the end of the
+      input is consumed and kept in the decoder.  The destination buffer
+      should have room for at least two characters.
+    @param[in] decoder The decoder.
+    @param[in] d The destination buffer.
+    @param[in] dLength The number of characters that fit in <b>d</b>.
+    @param[in,out] s Pointer to the first byte of input.  On return,
+      points to the first byte that was not consumed.
+    @param[in] sLimit A pointer to memory immediately after the end of the
+      input.
+    @param[in] flush If <code>true</code>, this is the last piece of input
+      and a partial sequence at its end is invalid.  When the return value
+      is <b>dLength</b>, call again to receive the rest of the output.
+    @return The number of characters written to <b>d</b>, or <b>-1</b> if
+      invalid input was found and the decoder has no <b>loss</b>
+      character.  After an error the decoder must be reset.
+ */
+CF_EXPORT CFIndex
+GSUnicodeDecoderDecode (GSUnicodeDecoderRef decoder, UniChar * d,
+                        CFIndex dLength, const UInt8 ** s,
+                        const UInt8 * const sLimit, Boolean flush);
+
+/** @brief Decode the next piece of input and append it to a string.
+    @param[in] decoder The decoder.
+    @param[in] str The mutable string to append to.
+    @param[in] bytes The input.
+    @param[in] length The number of bytes of input.
+    @param[in] flush If <code>true</code>, this is the last piece of input.
+    @return <code>true</code> if successful, or <code>false</code> if
+      invalid input was found and the decoder has no <b>loss</b>
+      character.  Only part of the text before the invalid input may have
+      been appended.
+ */
+CF_EXPORT Boolean
+GSUnicodeDecoderAppend (GSUnicodeDecoderRef decoder,
+                        CFMutableStringRef str, const UInt8 * bytes,
+                        CFIndex length, Boolean flush);
+/** @} */
+
 
 
 CFIndex
@@ -167,7 +167,8 @@ CFArrayCopyFormattingDesc (CFTypeRef cf, CFDictionaryRef formatOptions)
                               array->_contents[idx]);
     }
 
-  CFStringDelete (str, CFRangeMake (CFStringGetLength (str), 2));
+  if (array->_count > 0)
+    CFStringDelete (str, CFRangeMake (CFStringGetLength (str) - 2, 2));
   CFStringAppend (str, CFSTR ("}"));
 
   ret = CFStringCreateCopy (NULL, str);
@@ -38,11 +38,14 @@
 #include <string.h>
 
 static CFTypeID _kCFAttributedStringTypeID = 0;
+static CFIndex _kCFAttributedStringInitialized = 0;
 static CFDictionaryRef _kCFAttributedStringBlankAttribute = NULL;
 static CFMutableBagRef _kCFAttributedStringCache = NULL;
 static GSMutex _kCFAttributedStringCacheLock;
 static GSMutex _kCFAttributedStringBlankAttributeLock;
 
+static void CFAttributedStringInitialize (void);
+
 typedef struct
 {
   CFIndex         index;
@@ -104,6 +107,7 @@ CFAttributedStringCacheAttribute (CFDictionaryRef attribs)
 {
   CFDictionaryRef cachedAttr = NULL;
   
+  GSOnce (&_kCFAttributedStringInitialized, CFAttributedStringInitialize);
   GSMutexLock (&_kCFAttributedStringCacheLock);
   
   if (_kCFAttributedStringCache == NULL)
@@ -144,6 +148,7 @@ CFAttributedStringUncacheAttribute (CFDictionaryRef attribs)
 static CFDictionaryRef
 CFAttributedStringGetBlankAttribute (void)
 {
+  GSOnce (&_kCFAttributedStringInitialized, CFAttributedStringInitialize);
   if (_kCFAttributedStringBlankAttribute == NULL)
     {
       GSMutexLock (&_kCFAttributedStringBlankAttributeLock);
@@ -268,7 +273,7 @@ CFRuntimeClass CFAttributedStringClass =
   NULL
 };
 
-void CFAttributedStringInitialize (void)
+static void CFAttributedStringInitialize (void)
 {
   _kCFAttributedStringTypeID =
     _CFRuntimeRegisterClass (&CFAttributedStringClass);
@@ -281,6 +286,7 @@ void CFAttributedStringInitialize (void)
 CFTypeID
 CFAttributedStringGetTypeID (void)
 {
+  GSOnce (&_kCFAttributedStringInitialized, CFAttributedStringInitialize);
   return _kCFAttributedStringTypeID;
 }
 
@@ -294,7 +300,7 @@ CFAttributedStringCreateInlined (CFAllocatorRef alloc, CFStringRef str,
   struct __CFAttributedString *new;
   
   new = (struct __CFAttributedString *)_CFRuntimeCreateInstance (alloc,
-    _kCFAttributedStringTypeID,
+    CFAttributedStringGetTypeID (),
     CFATTRIBUTESTRING_SIZE + (sizeof(Attr) * count), 0);
   if (new)
     {
@@ -592,7 +598,7 @@ CFAttributedStringCreateMutable (CFAllocatorRef alloc, CFIndex maxLength)
   struct __CFMutableAttributedString *new;
   
   new = (struct __CFMutableAttributedString*)_CFRuntimeCreateInstance (alloc,
-    _kCFAttributedStringTypeID, CFMUTABLEATTRIBUTESTRING_SIZE, 0);
+    CFAttributedStringGetTypeID (), CFMUTABLEATTRIBUTESTRING_SIZE, 0);
   if (new)
     {
       new->_string = CFStringCreateMutable (alloc, maxLength);
@@ -31,10 +31,12 @@
 
 #include "GSHashTable.h"
 #include "GSObjCRuntime.h"
+#include "GSPrivate.h"
 
 
 
 static CFTypeID _kCFBagTypeID = 0;
+static CFIndex _kCFBagInitialized = 0;
 
 static void
 CFBagFinalize (CFTypeRef cf)
@@ -73,7 +75,7 @@ static CFRuntimeClass CFBagClass =
   NULL
 };
 
-void CFBagInitialize (void)
+static void CFBagInitialize (void)
 {
   _kCFBagTypeID = _CFRuntimeRegisterClass (&CFBagClass);
 }
@@ -106,7 +108,7 @@ CFBagRef
 CFBagCreate (CFAllocatorRef allocator, const void **values, CFIndex numValues,
   const CFBagCallBacks *callBacks)
 {
-  return (CFBagRef)GSHashTableCreate (allocator, _kCFBagTypeID,
+  return (CFBagRef)GSHashTableCreate (allocator, CFBagGetTypeID (),
     values, values, numValues,
     (const GSHashTableKeyCallBacks*)callBacks, NULL);
 }
@@ -174,6 +176,7 @@ CFBagGetValueIfPresent (CFBagRef bag,
 CFTypeID
 CFBagGetTypeID (void)
 {
+  GSOnce (&_kCFBagInitialized, CFBagInitialize);
   return _kCFBagTypeID;
 }
 
@@ -183,7 +186,7 @@ CFMutableBagRef
 CFBagCreateMutable (CFAllocatorRef allocator, CFIndex capacity,
   const CFBagCallBacks *callBacks)
 {
-  return (CFMutableBagRef)GSHashTableCreateMutable (allocator, _kCFBagTypeID,
+  return (CFMutableBagRef)GSHashTableCreateMutable (allocator, CFBagGetTypeID (),
     capacity, (const GSHashTableKeyCallBacks*)callBacks, NULL);
 }
 
@@ -27,10 +27,12 @@
 #include "CoreFoundation/CFRuntime.h"
 #include "CoreFoundation/CFBase.h"
 #include "CoreFoundation/CFBinaryHeap.h"
+#include "GSPrivate.h"
 
 #include <string.h>
 
 static CFTypeID _kCFBinaryHeapTypeID = 0;
+static CFIndex _kCFBinaryHeapInitialized = 0;
 
 static const CFBinaryHeapCallBacks _kCFNullBinaryHeapCallBacks =
 {
@@ -122,7 +124,7 @@ static CFRuntimeClass CFBinaryHeapClass =
   NULL
 };
 
-void CFBinaryHeapInitialize (void)
+static void CFBinaryHeapInitialize (void)
 {
   _kCFBinaryHeapTypeID = _CFRuntimeRegisterClass (&CFBinaryHeapClass);
 }
@@ -132,6 +134,7 @@ void CFBinaryHeapInitialize (void)
 CFTypeID
 CFBinaryHeapGetTypeID (void)
 {
+  GSOnce (&_kCFBinaryHeapInitialized, CFBinaryHeapInitialize);
   return _kCFBinaryHeapTypeID;
 }
 
@@ -161,7 +164,7 @@ CFBinaryHeapCreate (CFAllocatorRef alloc, CFIndex capacity,
 {
   CFBinaryHeapRef new;
   
-  new = (CFBinaryHeapRef)_CFRuntimeCreateInstance (alloc, _kCFBinaryHeapTypeID,
+  new = (CFBinaryHeapRef)_CFRuntimeCreateInstance (alloc, CFBinaryHeapGetTypeID (),
     CFBINARYHEAP_SIZE, 0);
   if (new)
     {
@@ -27,10 +27,12 @@
 #include "CoreFoundation/CFRuntime.h"
 #include "CoreFoundation/CFBase.h"
 #include "CoreFoundation/CFBitVector.h"
+#include "GSPrivate.h"
 
 #include <string.h>
 
 static CFTypeID _kCFBitVectorTypeID = 0;
+static CFIndex _kCFBitVectorInitialized = 0;
 
 struct __CFBitVector
 {
@@ -106,7 +108,7 @@ static CFRuntimeClass CFBitVectorClass =
   NULL
 };
 
-void CFBitVectorInitialize (void)
+static void CFBitVectorInitialize (void)
 {
   _kCFBitVectorTypeID = _CFRuntimeRegisterClass (&CFBitVectorClass);
 }
@@ -178,6 +180,7 @@ CFBitVectorOperation (CFBitVectorRef bv, CFRange range,
 CFTypeID
 CFBitVectorGetTypeID (void)
 {
+  GSOnce (&_kCFBitVectorInitialized, CFBitVectorInitialize);
   return _kCFBitVectorTypeID;
 }
 
@@ -192,7 +195,7 @@ CFBitVectorCreate (CFAllocatorRef alloc, const UInt8 *bytes,
   
   byteCount = CFBitVectorGetByteCount (numBits);
   new = (struct __CFBitVector*)_CFRuntimeCreateInstance (alloc,
-    _kCFBitVectorTypeID, CFBITVECTOR_SIZE + byteCount, 0);
+    CFBitVectorGetTypeID (), CFBITVECTOR_SIZE + byteCount, 0);
   if (new)
     {
       new->_count = numBits;
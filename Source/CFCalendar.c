@@ -45,6 +45,7 @@ struct __CFCalendar
 };
 
 static CFTypeID _kCFCalendarTypeID = 0;
+static CFIndex _kCFCalendarInitialized = 0;
 static CFCalendarRef _kCFCalendarCurrent = NULL;
 static GSMutex _kCFCalendarLock;
 
@@ -138,7 +139,7 @@ static const CFRuntimeClass CFCalendarClass =
   NULL
 };
 
-void CFCalendarInitialize (void)
+static void CFCalendarInitialize (void)
 {
   _kCFCalendarTypeID = _CFRuntimeRegisterClass (&CFCalendarClass);
   GSMutexInitialize (&_kCFCalendarLock);
@@ -231,12 +232,14 @@ CFCalendarGetCalendarUnitFromDescription (const char **description,
 CFTypeID
 CFCalendarGetTypeID (void)
 {
+  GSOnce (&_kCFCalendarInitialized, CFCalendarInitialize);
   return _kCFCalendarTypeID;
 }
 
 CFCalendarRef
 CFCalendarCopyCurrent (void)
 {
+  GSOnce (&_kCFCalendarInitialized, CFCalendarInitialize);
   if (_kCFCalendarCurrent == NULL)
     {
       GSMutexLock (&_kCFCalendarLock);
@@ -305,7 +308,7 @@ CFCalendarCreateWithIdentifier (CFAllocatorRef allocator, CFStringRef ident)
         return NULL;
     }
   
-  new = (CFCalendarRef)_CFRuntimeCreateInstance (allocator, _kCFCalendarTypeID,
+  new = (CFCalendarRef)_CFRuntimeCreateInstance (allocator, CFCalendarGetTypeID (),
     sizeof(struct __CFCalendar) - sizeof(CFRuntimeBase), NULL);
   new->_ident = ident;
   
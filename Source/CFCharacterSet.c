@@ -30,15 +30,37 @@
 #include "CoreFoundation/CFString.h"
 #include "GSPrivate.h"
 
+#include <string.h>
 #include <unicode/uset.h>
 
+#if (defined(__x86_64__) || defined(__i386__)) \
+  && (defined(__clang__) || __GNUC__ >= 5)
+#include <immintrin.h>
+#define GS_HAVE_AVX2_KERNELS 1
+#endif
+
+/* Membership of the Basic Multilingual Plane, one bit per code unit.  The
+ * surrogate code units are all set if the set may contain a surrogate or a
+ * supplementary character, in which case the caller must ask the USet.
+ * The nibbles table holds the ISO-8859-1 members in the form used by the
+ * vector kernels: entry lo has bit hi set if character hi * 16 + lo is a
+ * member, with characters U+0080 to U+00FF in the second 16 entries.
+ */
+typedef struct
+{
+  UInt8 nibbles[32];
+  UInt8 bits[8192];
+} GSCharacterSetBitmap;
+
 struct __CFCharacterSet
 {
   CFRuntimeBase _parent;
   USet         *_uset;
+  GSCharacterSetBitmap *_bitmap;
 };
 
 static CFTypeID _kCFCharacterSetTypeID = 0;
+static CFIndex _kCFCharacterSetInitialized = 0;
 static CFMutableDictionaryRef _kCFPredefinedCharacterSets = NULL;
 static GSMutex _kCFPredefinedCharacterSetLock;
 
@@ -47,6 +69,8 @@ CFCharacterSetFinalize (CFTypeRef cf)
 {
   CFCharacterSetRef cs = (CFCharacterSetRef)cf;
   uset_close (cs->_uset);
+  if (cs->_bitmap)
+    CFAllocatorDeallocate (kCFAllocatorSystemDefault, cs->_bitmap);
 }
 
 static Boolean
@@ -75,7 +99,7 @@ static const CFRuntimeClass CFCharacterSetClass =
   NULL
 };
 
-void CFCharacterSetInitialize (void)
+static void CFCharacterSetInitialize (void)
 {
   _kCFCharacterSetTypeID = _CFRuntimeRegisterClass (&CFCharacterSetClass);
   GSMutexInitialize (&_kCFPredefinedCharacterSetLock);
@@ -86,6 +110,7 @@ void CFCharacterSetInitialize (void)
 CFTypeID
 CFCharacterSetGetTypeID (void)
 {
+  GSOnce (&_kCFCharacterSetInitialized, CFCharacterSetInitialize);
   return _kCFCharacterSetTypeID;
 }
 
@@ -98,7 +123,7 @@ CFCharacterSetCreateCopy (CFAllocatorRef alloc, CFCharacterSetRef set)
   struct __CFCharacterSet *new;
   
   new = (struct __CFCharacterSet*)_CFRuntimeCreateInstance (alloc,
-    _kCFCharacterSetTypeID, CFCHARACTERSET_SIZE, 0);
+    CFCharacterSetGetTypeID (), CFCHARACTERSET_SIZE, 0);
   if (new)
     {
       new->_uset = uset_clone (set->_uset);
@@ -114,7 +139,7 @@ CFCharacterSetCreateInvertedSet (CFAllocatorRef alloc, CFCharacterSetRef set)
   struct __CFCharacterSet *new;
   
   new = (struct __CFCharacterSet*)_CFRuntimeCreateInstance (alloc,
-    _kCFCharacterSetTypeID, CFCHARACTERSET_SIZE, 0);
+    CFCharacterSetGetTypeID (), CFCHARACTERSET_SIZE, 0);
   if (new)
     {
       new->_uset = uset_cloneAsThawed (set->_uset);
@@ -132,7 +157,7 @@ CFCharacterSetCreateWithCharactersInRange (CFAllocatorRef alloc,
   struct __CFCharacterSet *new;
   
   new = (struct __CFCharacterSet*)_CFRuntimeCreateInstance (alloc,
-    _kCFCharacterSetTypeID, CFCHARACTERSET_SIZE, 0);
+    CFCharacterSetGetTypeID (), CFCHARACTERSET_SIZE, 0);
   if (new)
     {
       new->_uset = uset_open ((UChar32)range.location,
@@ -165,7 +190,7 @@ CFCharacterSetCreateWithCharactersInString (CFAllocatorRef alloc,
   struct __CFCharacterSet *new;
   
   new = (struct __CFCharacterSet*)_CFRuntimeCreateInstance (alloc,
-    _kCFCharacterSetTypeID, CFCHARACTERSET_SIZE, 0);
+    CFCharacterSetGetTypeID (), CFCHARACTERSET_SIZE, 0);
   if (new)
     {
       new->_uset = uset_openEmpty ();
@@ -261,6 +286,7 @@ CFCharacterSetGetPredefined (CFCharacterSetPredefinedSet setIdentifier)
 {
   struct __CFCharacterSet *ret;
   
+  GSOnce (&_kCFCharacterSetInitialized, CFCharacterSetInitialize);
   if (_kCFPredefinedCharacterSets == NULL)
     {
       GSMutexLock (&_kCFPredefinedCharacterSetLock);
@@ -280,7 +306,7 @@ CFCharacterSetGetPredefined (CFCharacterSetPredefinedSet setIdentifier)
     {
       GSMutexLock (&_kCFPredefinedCharacterSetLock);
       ret = (struct __CFCharacterSet*)_CFRuntimeCreateInstance (NULL,
-        _kCFCharacterSetTypeID, CFCHARACTERSET_SIZE, 0);
+        CFCharacterSetGetTypeID (), CFCHARACTERSET_SIZE, 0);
       if (ret)
         {
           UErrorCode err = U_ZERO_ERROR;
@@ -312,9 +338,462 @@ CFCharacterSetCreateBitmapRepresentation (CFAllocatorRef alloc,
   return NULL;
 }
 
+static GSCharacterSetBitmap *
+CFCharacterSetBuildBitmap (CFCharacterSetRef set)
+{
+  GSCharacterSetBitmap *bitmap;
+  UErrorCode err;
+  UChar32 start;
+  UChar32 end;
+  UChar32 c;
+  Boolean surrogates;
+  int32_t count;
+  int32_t idx;
+
+  bitmap = CFAllocatorAllocate (kCFAllocatorSystemDefault,
+                                sizeof (GSCharacterSetBitmap), 0);
+  if (bitmap == NULL)
+    return NULL;
+  memset (bitmap, 0, sizeof (GSCharacterSetBitmap));
+
+  surrogates = false;
+  count = uset_getItemCount (set->_uset);
+  for (idx = 0; idx < count; ++idx)
+    {
+      err = U_ZERO_ERROR;
+      /* Items with a non-zero length are strings, not ranges. */
+      if (uset_getItem (set->_uset, idx, &start, &end, NULL, 0, &err) != 0
+          || U_FAILURE (err))
+        continue;
+      if (end > 0xFFFF || (start <= 0xDFFF && end >= 0xD800))
+        surrogates = true;
+      if (end > 0xFFFF)
+        end = 0xFFFF;
+      for (c = start; c <= end && (c & 7) != 0; ++c)
+        bitmap->bits[c >> 3] |= 1 << (c & 7);
+      if (c + 8 <= end + 1)
+        {
+          memset (bitmap->bits + (c >> 3), 0xFF, (end + 1 - c) >> 3);
+          c += (end + 1 - c) & ~7;
+        }
+      for (; c <= end; ++c)
+        bitmap->bits[c >> 3] |= 1 << (c & 7);
+    }
+  if (surrogates)
+    memset (bitmap->bits + (0xD800 >> 3), 0xFF, 0x800 >> 3);
+
+  for (c = 0; c < 0x100; ++c)
+    if (bitmap->bits[c >> 3] & (1 << (c & 7)))
+      bitmap->nibbles[(c & 0x0F) + (c & 0x80 ? 16 : 0)] |= 1 << ((c >> 4) & 7);
+
+  return bitmap;
+}
+
+static const GSCharacterSetBitmap *
+CFCharacterSetGetBitmap (CFCharacterSetRef set)
+{
+  GSCharacterSetBitmap *bitmap;
+
+  bitmap = set->_bitmap;
+  if (bitmap == NULL)
+    {
+      bitmap = CFCharacterSetBuildBitmap (set);
+      if (bitmap == NULL)
+        return NULL;
+      if (GSAtomicCompareAndSwapPointer (&((struct __CFCharacterSet *)
+                                           set)->_bitmap, NULL, bitmap)
+          != NULL)
+        {
+          CFAllocatorDeallocate (kCFAllocatorSystemDefault, bitmap);
+          bitmap = set->_bitmap;
+        }
+    }
+
+  return bitmap;
+}
+
+/* Called by every function that changes a mutable set. */
+CF_INLINE void
+CFCharacterSetInvalidateBitmap (CFMutableCharacterSetRef set)
+{
+  if (set->_bitmap)
+    {
+      CFAllocatorDeallocate (kCFAllocatorSystemDefault, set->_bitmap);
+      set->_bitmap = NULL;
+    }
+}
+
+CF_INLINE Boolean
+GSBitmapIsMember (const GSCharacterSetBitmap *bitmap, UniChar c)
+{
+  return bitmap->bits[c >> 3] & (1 << (c & 7)) ? true : false;
+}
+
+
+
+/* Scanning kernels.  Each returns the index of the first (or, if
+ * backwards, the last) character of s that is set in the bitmap, or
+ * kCFNotFound.  The UTF-16 kernels may return a surrogate that is not a
+ * member; GSCharacterSetFindCharacters() checks those with the USet.
+ */
+typedef struct
+{
+  CFIndex (*find8) (const GSCharacterSetBitmap *bitmap, const UInt8 *s,
+                    CFIndex n, Boolean backwards);
+  CFIndex (*find16) (const GSCharacterSetBitmap *bitmap, const UniChar *s,
+                     CFIndex n, Boolean backwards);
+} GSCharacterSetKernels;
+
+static CFIndex
+GSCharacterSetFind8Scalar (const GSCharacterSetBitmap *bitmap,
+                           const UInt8 *s, CFIndex n, Boolean backwards)
+{
+  CFIndex i;
+
+  if (backwards)
+    {
+      for (i = n - 1; i >= 0; --i)
+        if (GSBitmapIsMember (bitmap, s[i]))
+          return i;
+    }
+  else
+    {
+      for (i = 0; i < n; ++i)
+        if (GSBitmapIsMember (bitmap, s[i]))
+          return i;
+    }
+
+  return kCFNotFound;
+}
+
+static CFIndex
+GSCharacterSetFind16Scalar (const GSCharacterSetBitmap *bitmap,
+                            const UniChar *s, CFIndex n, Boolean backwards)
+{
+  CFIndex i;
+
+  if (backwards)
+    {
+      for (i = n - 1; i >= 0; --i)
+        if (GSBitmapIsMember (bitmap, s[i]))
+          return i;
+    }
+  else
+    {
+      for (i = 0; i < n; ++i)
+        if (GSBitmapIsMember (bitmap, s[i]))
+          return i;
+    }
+
+  return kCFNotFound;
+}
+
+#if defined(GS_HAVE_AVX2_KERNELS)
+/* Looks up 32 ISO-8859-1 characters at once.  The low nibble of each
+ * character selects a row of the nibbles table and the high nibble selects
+ * the bit within it.  Returns a mask with a bit set for each member.
+ */
+__attribute__ ((target ("avx2"))) static inline UInt32
+GSCharacterSetMatch32 (__m256i v, __m256i lowRows, __m256i highRows,
+                       __m256i bits)
+{
+  __m256i nibble;
+  __m256i lo;
+  __m256i hi;
+  __m256i row;
+  __m256i bit;
+
+  nibble = _mm256_set1_epi8 (0x0F);
+  lo = _mm256_and_si256 (v, nibble);
+  hi = _mm256_and_si256 (_mm256_srli_epi16 (v, 4), nibble);
+  /* The sign bit of each character picks the row for U+0080 to U+00FF. */
+  row = _mm256_blendv_epi8 (_mm256_shuffle_epi8 (lowRows, lo),
+                            _mm256_shuffle_epi8 (highRows, lo), v);
+  bit = _mm256_shuffle_epi8 (bits, hi);
+
+  return (UInt32) _mm256_movemask_epi8
+    (_mm256_cmpeq_epi8 (_mm256_and_si256 (row, bit), bit));
+}
+
+#define GS_CHARACTER_SET_AVX2_TABLES(bitmap) \
+  __m256i lowRows = _mm256_broadcastsi128_si256 \
+    (_mm_loadu_si128 ((const __m128i *) (bitmap)->nibbles)); \
+  __m256i highRows = _mm256_broadcastsi128_si256 \
+    (_mm_loadu_si128 ((const __m128i *) ((bitmap)->nibbles + 16))); \
+  __m256i bits = _mm256_setr_epi8 (1, 2, 4, 8, 16, 32, 64, -128, \
+                                   1, 2, 4, 8, 16, 32, 64, -128, \
+                                   1, 2, 4, 8, 16, 32, 64, -128, \
+                                   1, 2, 4, 8, 16, 32, 64, -128)
+
+__attribute__ ((target ("avx2"))) static CFIndex
+GSCharacterSetFind8AVX2 (const GSCharacterSetBitmap *bitmap,
+                         const UInt8 *s, CFIndex n, Boolean backwards)
+{
+  GS_CHARACTER_SET_AVX2_TABLES (bitmap);
+  CFIndex i;
+  CFIndex r;
+  UInt32 m;
+
+  if (backwards)
+    {
+      for (i = n; i >= 32; i -= 32)
+        {
+          m = GSCharacterSetMatch32 (_mm256_loadu_si256
+                                     ((const __m256i *) (s + i - 32)),
+                                     lowRows, highRows, bits);
+          if (m)
+            return i - 1 - __builtin_clz (m);
+        }
+      return GSCharacterSetFind8Scalar (bitmap, s, i, true);
+    }
+
+  for (i = 0; i + 32 <= n; i += 32)
+    {
+      m = GSCharacterSetMatch32 (_mm256_loadu_si256 ((const __m256i *) (s + i)),
+                                 lowRows, highRows, bits);
+      if (m)
+        return i + __builtin_ctz (m);
+    }
+  r = GSCharacterSetFind8Scalar (bitmap, s + i, n - i, false);
+
+  return r == kCFNotFound ? kCFNotFound : i + r;
+}
+
+/* Blocks of 32 UTF-16 code units that are all ISO-8859-1 are narrowed and
+ * looked up as above; other blocks use the bitmap one unit at a time.
+ */
+__attribute__ ((target ("avx2"))) static CFIndex
+GSCharacterSetFind16AVX2 (const GSCharacterSetBitmap *bitmap,
+                          const UniChar *s, CFIndex n, Boolean backwards)
+{
+  GS_CHARACTER_SET_AVX2_TABLES (bitmap);
+  __m256i high = _mm256_set1_epi16 ((short) 0xFF00);
+  __m256i a;
+  __m256i b;
+  CFIndex i;
+  CFIndex r;
+  UInt32 m;
+
+  if (backwards)
+    {
+      for (i = n; i >= 32; i -= 32)
+        {
+          a = _mm256_loadu_si256 ((const __m256i *) (s + i - 32));
+          b = _mm256_loadu_si256 ((const __m256i *) (s + i - 16));
+          if (_mm256_testz_si256 (_mm256_or_si256 (a, b), high))
+            {
+              m = GSCharacterSetMatch32 (_mm256_permute4x64_epi64
+                                         (_mm256_packus_epi16 (a, b), 0xD8),
+                                         lowRows, highRows, bits);
+              if (m)
+                return i - 1 - __builtin_clz (m);
+            }
+          else
+            {
+              r = GSCharacterSetFind16Scalar (bitmap, s + i - 32, 32, true);
+              if (r != kCFNotFound)
+                return i - 32 + r;
+            }
+        }
+      return GSCharacterSetFind16Scalar (bitmap, s, i, true);
+    }
+
+  for (i = 0; i + 32 <= n; i += 32)
+    {
+      a = _mm256_loadu_si256 ((const __m256i *) (s + i));
+      b = _mm256_loadu_si256 ((const __m256i *) (s + i + 16));
+      if (_mm256_testz_si256 (_mm256_or_si256 (a, b), high))
+        {
+          m = GSCharacterSetMatch32 (_mm256_permute4x64_epi64
+                                     (_mm256_packus_epi16 (a, b), 0xD8),
+                                     lowRows, highRows, bits);
+          if (m)
+            return i + __builtin_ctz (m);
+        }
+      else
+        {
+          r = GSCharacterSetFind16Scalar (bitmap, s + i, 32, false);
+          if (r != kCFNotFound)
+            return i + r;
+        }
+    }
+  r = GSCharacterSetFind16Scalar (bitmap, s + i, n - i, false);
+
+  return r == kCFNotFound ? kCFNotFound : i + r;
+}
+#endif
+
+static GSCharacterSetKernels _kGSCharacterSetKernels;
+static CFIndex _kGSCharacterSetKernelsInitialized = 0;
+
+static void
+GSCharacterSetKernelsInitialize (void)
+{
+  _kGSCharacterSetKernels.find8 = GSCharacterSetFind8Scalar;
+  _kGSCharacterSetKernels.find16 = GSCharacterSetFind16Scalar;
+#if defined(GS_HAVE_AVX2_KERNELS)
+  if (GSCPUHasAVX2 ())
+    {
+      _kGSCharacterSetKernels.find8 = GSCharacterSetFind8AVX2;
+      _kGSCharacterSetKernels.find16 = GSCharacterSetFind16AVX2;
+    }
+#endif
+}
+
+CF_INLINE const GSCharacterSetKernels *
+GSCharacterSetKernelsGet (void)
+{
+  GSOnce (&_kGSCharacterSetKernelsInitialized,
+          GSCharacterSetKernelsInitialize);
+  return &_kGSCharacterSetKernels;
+}
+
+/* Searches with the USet alone, for when the bitmap cannot be allocated. */
+static CFIndex
+GSCharacterSetFind8USet (CFCharacterSetRef set, const UInt8 *s, CFIndex n,
+                         Boolean backwards)
+{
+  CFIndex i;
+
+  if (backwards)
+    {
+      for (i = n - 1; i >= 0; --i)
+        if (uset_contains (set->_uset, s[i]))
+          return i;
+    }
+  else
+    {
+      for (i = 0; i < n; ++i)
+        if (uset_contains (set->_uset, s[i]))
+          return i;
+    }
+
+  return kCFNotFound;
+}
+
+static CFIndex
+GSCharacterSetFind16USet (CFCharacterSetRef set, const UniChar *s,
+                          CFIndex n, Boolean backwards, CFIndex *length)
+{
+  CFIndex i;
+  CFIndex next;
+  UChar32 c;
+
+  if (backwards)
+    {
+      i = n;
+      while (i > 0)
+        {
+          next = i;
+          U16_PREV (s, 0, i, c);
+          if (uset_contains (set->_uset, c))
+            {
+              *length = next - i;
+              return i;
+            }
+        }
+    }
+  else
+    {
+      i = 0;
+      while (i < n)
+        {
+          next = i;
+          U16_NEXT (s, next, n, c);
+          if (uset_contains (set->_uset, c))
+            {
+              *length = next - i;
+              return i;
+            }
+          i = next;
+        }
+    }
+
+  return kCFNotFound;
+}
+
+CFIndex
+GSCharacterSetFindLatin1 (CFCharacterSetRef set, const UInt8 *s, CFIndex n,
+                          Boolean backwards)
+{
+  const GSCharacterSetBitmap *bitmap;
+
+  bitmap = CFCharacterSetGetBitmap (set);
+  if (bitmap == NULL)
+    return GSCharacterSetFind8USet (set, s, n, backwards);
+
+  return GSCharacterSetKernelsGet ()->find8 (bitmap, s, n, backwards);
+}
+
+CFIndex
+GSCharacterSetFindCharacters (CFCharacterSetRef set, const UniChar *s,
+                              CFIndex n, Boolean backwards, CFIndex *length)
+{
+  const GSCharacterSetBitmap *bitmap;
+  CFIndex (*find16) (const GSCharacterSetBitmap *, const UniChar *, CFIndex,
+                     Boolean);
+  CFIndex start;
+  CFIndex end;
+  CFIndex idx;
+  UChar32 c;
+
+  bitmap = CFCharacterSetGetBitmap (set);
+  if (bitmap == NULL)
+    return GSCharacterSetFind16USet (set, s, n, backwards, length);
+  find16 = GSCharacterSetKernelsGet ()->find16;
+  start = 0;
+  end = n;
+  while (start < end)
+    {
+      idx = find16 (bitmap, s + start, end - start, backwards);
+      if (idx == kCFNotFound)
+        break;
+      idx += start;
+      c = s[idx];
+      *length = 1;
+      if (U16_IS_SURROGATE (c))
+        {
+          /* Find the whole character, which may start before idx. */
+          if (U16_IS_LEAD (c) && idx + 1 < n && U16_IS_TRAIL (s[idx + 1]))
+            {
+              c = U16_GET_SUPPLEMENTARY (c, s[idx + 1]);
+              *length = 2;
+            }
+          else if (U16_IS_TRAIL (c) && idx > 0 && U16_IS_LEAD (s[idx - 1]))
+            {
+              idx -= 1;
+              c = U16_GET_SUPPLEMENTARY (s[idx], c);
+              *length = 2;
+            }
+          if (!uset_contains (set->_uset, c))
+            {
+              if (backwards)
+                end = idx;
+              else
+                start = idx + *length;
+              continue;
+            }
+        }
+      return idx;
+    }
+
+  return kCFNotFound;
+}
+
+
+
 Boolean
 CFCharacterSetIsCharacterMember (CFCharacterSetRef set, UniChar c)
 {
+  const GSCharacterSetBitmap *bitmap;
+
+  /* Mutable sets only use a bitmap that a search has already built. */
+  bitmap = set->_bitmap;
+  if (bitmap == NULL && uset_isFrozen (set->_uset))
+    bitmap = CFCharacterSetGetBitmap (set);
+  if (bitmap != NULL && !U16_IS_SURROGATE (c))
+    return GSBitmapIsMember (bitmap, c);
+
   return (Boolean)uset_contains (set->_uset, (UChar32)c);
 }
 
@@ -327,6 +806,8 @@ CFCharacterSetHasMemberInPlane (CFCharacterSetRef set, CFIndex plane)
 Boolean
 CFCharacterSetIsLongCharacterMember (CFCharacterSetRef set, UTF32Char c)
 {
+  if (c <= 0xFFFF)
+    return CFCharacterSetIsCharacterMember (set, (UniChar)c);
   return (Boolean)uset_contains (set->_uset, (UChar32)c);
 }
 
@@ -345,7 +826,7 @@ CFCharacterSetCreateMutable (CFAllocatorRef alloc)
   struct __CFCharacterSet *new;
   
   new = (struct __CFCharacterSet*)_CFRuntimeCreateInstance (alloc,
-    _kCFCharacterSetTypeID, CFCHARACTERSET_SIZE, 0);
+    CFCharacterSetGetTypeID (), CFCHARACTERSET_SIZE, 0);
   if (new)
     {
       new->_uset = uset_openEmpty ();
@@ -360,7 +841,7 @@ CFCharacterSetCreateMutableCopy (CFAllocatorRef alloc, CFCharacterSetRef set)
   struct __CFCharacterSet *new;
   
   new = (struct __CFCharacterSet*)_CFRuntimeCreateInstance (alloc,
-    _kCFCharacterSetTypeID, CFCHARACTERSET_SIZE, 0);
+    CFCharacterSetGetTypeID (), CFCHARACTERSET_SIZE, 0);
   if (new)
     {
       new->_uset = uset_cloneAsThawed (set->_uset);
@@ -373,6 +854,7 @@ void
 CFCharacterSetAddCharactersInRange (CFMutableCharacterSetRef set,
   CFRange range)
 {
+  CFCharacterSetInvalidateBitmap (set);
   uset_addRange (set->_uset, (UChar32)range.location,
     (UChar32)(range.location + range.length));
 }
@@ -381,6 +863,7 @@ void
 CFCharacterSetAddCharactersInString (CFMutableCharacterSetRef set,
   CFStringRef string)
 {
+  CFCharacterSetInvalidateBitmap (set);
   USetAddString (set->_uset, string);
 }
 
@@ -388,6 +871,7 @@ void
 CFCharacterSetRemoveCharactersInRange (CFMutableCharacterSetRef set,
   CFRange range)
 {
+  CFCharacterSetInvalidateBitmap (set);
   uset_removeRange (set->_uset, (UChar32)range.location,
     (UChar32)(range.location + range.length));
 }
@@ -403,6 +887,7 @@ CFCharacterSetRemoveCharactersInString (CFMutableCharacterSetRef set,
   str = CFAllocatorAllocate (NULL, sizeof(UniChar) * len, 0);
   CFStringGetCharacters (string, CFRangeMake(0, len), str);
   
+  CFCharacterSetInvalidateBitmap (set);
   uset_removeString (set->_uset, str, len);
   
   CFAllocatorDeallocate (NULL, str);
@@ -412,18 +897,21 @@ void
 CFCharacterSetIntersect (CFMutableCharacterSetRef set,
   CFCharacterSetRef otherSet)
 {
+  CFCharacterSetInvalidateBitmap (set);
   uset_retainAll (set->_uset, otherSet->_uset);
 }
 
 void
 CFCharacterSetInvert (CFMutableCharacterSetRef set)
 {
+  CFCharacterSetInvalidateBitmap (set);
   uset_complement (set->_uset);
 }
 
 void
 CFCharacterSetUnion (CFMutableCharacterSetRef set, CFCharacterSetRef otherSet)
 {
+  CFCharacterSetInvalidateBitmap (set);
   uset_addAll (set->_uset, otherSet->_uset);
 }
 
@@ -108,6 +108,7 @@ struct __CFDateFormatter
 };
 
 static CFTypeID _kCFDateFormatterTypeID = 0;
+static CFIndex _kCFDateFormatterInitialized = 0;
 
 static const CFRuntimeClass CFDateFormatterClass =
 {
@@ -122,7 +123,7 @@ static const CFRuntimeClass CFDateFormatterClass =
   NULL
 };
 
-void CFDateFormatterInitialize (void)
+static void CFDateFormatterInitialize (void)
 {
   _kCFDateFormatterTypeID = _CFRuntimeRegisterClass(&CFDateFormatterClass);
 }
@@ -500,7 +501,7 @@ CFDateFormatterCreate (CFAllocatorRef alloc, CFLocaleRef locale,
   struct __CFDateFormatter *new;
   
   new = (struct __CFDateFormatter*)_CFRuntimeCreateInstance (alloc,
-    _kCFDateFormatterTypeID, CFDATEFORMATTER_SIZE, 0);
+    CFDateFormatterGetTypeID (), CFDATEFORMATTER_SIZE, 0);
   if (new)
     {
       CFIndex formatLength;
@@ -715,6 +716,7 @@ CFDateFormatterGetTimeStyle (CFDateFormatterRef fmt)
 CFTypeID
 CFDateFormatterGetTypeID (void)
 {
+  GSOnce (&_kCFDateFormatterInitialized, CFDateFormatterInitialize);
   return _kCFDateFormatterTypeID;
 }
 
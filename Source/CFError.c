@@ -62,6 +62,7 @@ struct __CFError
 };
 
 static CFTypeID _kCFErrorTypeID = 0;
+static CFIndex _kCFErrorInitialized = 0;
 
 static void
 CFErrorFinalize (CFTypeRef cf)
@@ -102,7 +103,7 @@ static const CFRuntimeClass CFErrorClass =
   NULL
 };
 
-void CFErrorInitialize (void)
+static void CFErrorInitialize (void)
 {
   _kCFErrorTypeID = _CFRuntimeRegisterClass (&CFErrorClass);
 }
@@ -117,7 +118,7 @@ CFErrorCreate (CFAllocatorRef allocator, CFStringRef domain,
     return NULL;
   
   new = (struct __CFError*)_CFRuntimeCreateInstance (allocator,
-    _kCFErrorTypeID,
+    CFErrorGetTypeID (),
     sizeof(struct __CFError) - sizeof(CFRuntimeBase),
     0);
   
@@ -208,6 +209,7 @@ CFErrorGetDomain (CFErrorRef err)
 CFTypeID
 CFErrorGetTypeID (void)
 {
+  GSOnce (&_kCFErrorInitialized, CFErrorInitialize);
   return _kCFErrorTypeID;
 }
 
@@ -108,6 +108,7 @@ struct __CFLocale
 
 static GSMutex _kCFLocaleLock;
 static CFTypeID _kCFLocaleTypeID = 0;
+static CFIndex _kCFLocaleInitialized = 0;
 static CFLocaleRef _kCFLocaleCurrent = NULL;
 static CFLocaleRef _kCFLocaleSystem = NULL;
 static CFArrayRef _kCFLocaleAvailableLocaleIdentifiers = NULL;
@@ -151,7 +152,7 @@ static const CFRuntimeClass CFLocaleClass =
   NULL
 };
 
-void CFLocaleInitialize (void)
+static void CFLocaleInitialize (void)
 {
   _kCFLocaleTypeID = _CFRuntimeRegisterClass(&CFLocaleClass);
   GSMutexInitialize (&_kCFLocaleLock);
@@ -473,6 +474,7 @@ CFLocaleCopyCurrent (void)
 {
   CFLocaleRef result;
   
+  GSOnce (&_kCFLocaleInitialized, CFLocaleInitialize);
   GSMutexLock (&_kCFLocaleLock);
   if (_kCFLocaleCurrent)
     {
@@ -520,6 +522,7 @@ CFLocaleRef
 CFLocaleGetSystem (void)
 {
   CFLocaleRef result;
+  GSOnce (&_kCFLocaleInitialized, CFLocaleInitialize);
   GSMutexLock (&_kCFLocaleLock);
   if (_kCFLocaleSystem)
     {
@@ -542,6 +545,7 @@ CFLocaleCopyAvailableLocaleIdentifiers (void)
   int32_t idx;
   CFMutableArrayRef mArray;
   
+  GSOnce (&_kCFLocaleInitialized, CFLocaleInitialize);
   GSMutexLock (&_kCFLocaleLock);
   if (_kCFLocaleAvailableLocaleIdentifiers)
     {
@@ -598,6 +602,7 @@ CFLocaleCopyISOCountryCodes (void)
 {
   const char *const *cCodes;
   
+  GSOnce (&_kCFLocaleInitialized, CFLocaleInitialize);
   GSMutexLock (&_kCFLocaleLock);
   if (_kCFLocaleISOCountryCodes)
     {
@@ -617,6 +622,7 @@ CFLocaleCopyISOLanguageCodes (void)
 {
   const char *const *cCodes;
   
+  GSOnce (&_kCFLocaleInitialized, CFLocaleInitialize);
   GSMutexLock (&_kCFLocaleLock);
   if (_kCFLocaleISOLanguageCodes)
     {
@@ -1016,6 +1022,7 @@ CFLocaleCreateLocaleIdentifierFromComponents (CFAllocatorRef allocator,
 CFTypeID
 CFLocaleGetTypeID (void)
 {
+  GSOnce (&_kCFLocaleInitialized, CFLocaleInitialize);
   return _kCFLocaleTypeID;
 }
 
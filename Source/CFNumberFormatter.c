@@ -125,6 +125,7 @@ struct __CFNumberFormatter
 };
 
 static CFTypeID _kCFNumberFormatterTypeID;
+static CFIndex _kCFNumberFormatterInitialized = 0;
 
 static CFTypeRef CFNumberFormatterCopy (CFAllocatorRef alloc, CFTypeRef cf)
 {
@@ -171,7 +172,7 @@ static const CFRuntimeClass CFNumberFormatterClass =
   NULL
 };
 
-void CFNumberFormatterInitialize (void)
+static void CFNumberFormatterInitialize (void)
 {
   _kCFNumberFormatterTypeID = _CFRuntimeRegisterClass(&CFNumberFormatterClass);
 }
@@ -800,6 +801,7 @@ CFNumberFormatterGetStyle (CFNumberFormatterRef fmt)
 CFTypeID
 CFNumberFormatterGetTypeID (void)
 {
+  GSOnce (&_kCFNumberFormatterInitialized, CFNumberFormatterInitialize);
   return _kCFNumberFormatterTypeID;
 }
 
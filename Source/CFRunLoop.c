@@ -54,6 +54,7 @@ static CFTypeID _kCFRunLoopTypeID = 0;
 static CFTypeID _kCFRunLoopSourceTypeID = 0;
 static CFTypeID _kCFRunLoopObserverTypeID = 0;
 static CFTypeID _kCFRunLoopTimerTypeID = 0;
+static CFIndex _kCFRunLoopInitialized = 0;
 
 static CFRunLoopRef static_mainLoop = NULL;
 static pthread_key_t static_loopKey;
@@ -252,7 +253,7 @@ static CFRuntimeClass CFRunLoopTimerClass =
 #define CFRUNLOOP_SIZE \
   sizeof(struct __CFRunLoop) - sizeof(CFRuntimeBase)
 
-void
+static void
 CFRunLoopInitialize (void)
 {
   _kCFRunLoopTypeID = _CFRuntimeRegisterClass (&CFRunLoopClass);
@@ -264,24 +265,28 @@ CFRunLoopInitialize (void)
 CFTypeID
 CFRunLoopGetTypeID (void)
 {
+  GSOnce (&_kCFRunLoopInitialized, CFRunLoopInitialize);
   return _kCFRunLoopTypeID;
 }
 
 CFTypeID
 CFRunLoopSourceGetTypeID (void)
 {
+  GSOnce (&_kCFRunLoopInitialized, CFRunLoopInitialize);
   return _kCFRunLoopSourceTypeID;
 }
 
 CFTypeID
 CFRunLoopObserverGetTypeID (void)
 {
+  GSOnce (&_kCFRunLoopInitialized, CFRunLoopInitialize);
   return _kCFRunLoopObserverTypeID;
 }
 
 CFTypeID
 CFRunLoopTimerGetTypeID (void)
 {
+  GSOnce (&_kCFRunLoopInitialized, CFRunLoopInitialize);
   return _kCFRunLoopTimerTypeID;
 }
 
@@ -390,7 +395,7 @@ CFRunLoopCreate (void)
   CFRunLoopRef rl;
 
   rl = (CFRunLoopRef)_CFRuntimeCreateInstance (kCFAllocatorDefault,
-                                               _kCFRunLoopTypeID,
+                                               CFRunLoopGetTypeID (),
                                                CFRUNLOOP_SIZE,
                                                0);
   rl->_commonModes = CFSetCreateMutable(kCFAllocatorDefault,
@@ -1448,7 +1453,7 @@ CFRunLoopSourceCreate (CFAllocatorRef  alloc, CFIndex order,
   CFRunLoopSourceRef new;
   
   new = (CFRunLoopSourceRef)_CFRuntimeCreateInstance (alloc,
-                                                      _kCFRunLoopSourceTypeID,
+                                                      CFRunLoopSourceGetTypeID (),
                                                       CFRUNLOOPSOURCE_SIZE,
                                                       0);
   if (new)
@@ -1558,7 +1563,7 @@ CFRunLoopObserverCreate (CFAllocatorRef  alloc, CFOptionFlags activities,
   CFRunLoopObserverRef new;
   
   new = (CFRunLoopObserverRef)_CFRuntimeCreateInstance (alloc,
-                                                        _kCFRunLoopObserverTypeID,
+                                                        CFRunLoopObserverGetTypeID (),
                                                         CFRUNLOOPOBSERVER_SIZE,
                                                         0);
   if (new)
@@ -1680,7 +1685,7 @@ CFRunLoopTimerCreate (CFAllocatorRef  alloc, CFAbsoluteTime fireDate,
   CFRunLoopTimerRef new;
   
   new = (CFRunLoopTimerRef)_CFRuntimeCreateInstance (alloc,
-                                                     _kCFRunLoopTimerTypeID,
+                                                     CFRunLoopTimerGetTypeID (),
                                                      CFRUNLOOPTIMER_SIZE,
                                                      0);
   if (new)
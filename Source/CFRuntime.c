@@ -25,15 +25,24 @@
 */
 
 #include "CoreFoundation/CFRuntime.h"
+#include "CoreFoundation/CFArray.h"
+#include "CoreFoundation/CFData.h"
+#include "CoreFoundation/CFDictionary.h"
+#include "CoreFoundation/CFNumber.h"
+#include "CoreFoundation/CFSet.h"
 #include "CoreFoundation/CFString.h"
 
 #include "GSPrivate.h"
 #include "GSObjCRuntime.h"
 
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#if !defined(_WIN32)
+#include <sched.h>
+#endif
 
 #if HAVE_OBJC_RUNTIME_H
 #include <objc/runtime.h>
@@ -45,10 +54,14 @@ Boolean kCFUseCollectableAllocator = false;
 Boolean (*__CFObjCIsCollectable) (void *) = NULL;
 
 /* CFRuntimeClass Table */
-CFRuntimeClass **__CFRuntimeClassTable = NULL;
+#define GS_RUNTIME_CLASS_TABLE_SIZE 1024
+/* The table lives in BSS, so only the pages that are actually used are
+   ever touched. */
+static CFRuntimeClass *_kCFRuntimeClassTable[GS_RUNTIME_CLASS_TABLE_SIZE];
+CFRuntimeClass **__CFRuntimeClassTable = _kCFRuntimeClassTable;
 void **__CFRuntimeObjCClassTable = NULL;
 UInt32 __CFRuntimeClassTableCount = 0;
-UInt32 __CFRuntimeClassTableSize = 1024;        /* Initial size */
+UInt32 __CFRuntimeClassTableSize = GS_RUNTIME_CLASS_TABLE_SIZE;
 
 static GSMutex _kCFRuntimeTableLock;
 
@@ -144,6 +157,300 @@ _CFRuntimeUnregisterClassWithTypeID (CFTypeID typeID)
 
 
 
+/******************************/
+/* Instance statistics.
+ *
+ * Every thread counts into its own shard, so the hot paths never write
+ * to a cache line shared with another thread.  Shards are linked into a
+ * global list and summed when the statistics are read; when a thread
+ * exits its counts are folded into _kCFRuntimeStatsRetired.  A shard's
+ * counters are indexed by type ID and allocated in pages of
+ * GS_RUNTIME_STATS_PAGE_SIZE types, since most programs use only a few
+ * dozen types.  When counting is off, each hook costs one predictable
+ * branch on _kCFRuntimeStatsEnabled.
+ *
+ * Only the owning thread writes a shard's counters, but readers sum them
+ * from other threads, so both sides use relaxed atomic loads and stores.
+ * These compile to plain moves on common processors.
+ */
+enum
+{
+  GSRuntimeStatAllocations,
+  GSRuntimeStatDeallocations,
+  GSRuntimeStatBytes,
+  GSRuntimeStatRetains,
+  GSRuntimeStatReleases,
+  GSRuntimeStatCount
+};
+
+#define GS_RUNTIME_STATS_PAGE_SIZE 64
+#define GS_RUNTIME_STATS_PAGES \
+  (GS_RUNTIME_CLASS_TABLE_SIZE / GS_RUNTIME_STATS_PAGE_SIZE)
+
+typedef CFIndex
+GSRuntimeStatsPage[GS_RUNTIME_STATS_PAGE_SIZE][GSRuntimeStatCount];
+
+typedef struct GSRuntimeStatsShard GSRuntimeStatsShard;
+struct GSRuntimeStatsShard
+{
+  GSRuntimeStatsShard *next;
+  GSRuntimeStatsPage *pages[GS_RUNTIME_STATS_PAGES];
+};
+
+static CFIndex _kCFRuntimeStatsEnabled = false;
+static GSThreadKey _kCFRuntimeStatsKey;
+static GSMutex _kCFRuntimeStatsLock;
+static GSRuntimeStatsShard *_kCFRuntimeStatsShards = NULL;
+static GSRuntimeStatsShard _kCFRuntimeStatsRetired;
+
+#define GS_RUNTIME_STATS_ENABLED() \
+  GS_UNLIKELY (GSAtomicLoadRelaxedCFIndex (&_kCFRuntimeStatsEnabled))
+
+#define GS_RUNTIME_STATS_ADD(typeID, counter, value) do { \
+  if (GS_RUNTIME_STATS_ENABLED ()) \
+    GSRuntimeStatsAdd (typeID, counter, value); \
+} while (0)
+
+static void
+GSRuntimeStatsAdd (CFTypeID typeID, int counter, CFIndex value)
+{
+  GSRuntimeStatsShard *shard;
+  GSRuntimeStatsPage *page;
+  CFIndex *count;
+  CFIndex idx;
+
+  if (typeID >= GS_RUNTIME_CLASS_TABLE_SIZE)
+    return;
+
+  shard = GSThreadKeyGetValue (_kCFRuntimeStatsKey);
+  if (shard == NULL)
+    {
+      shard = calloc (1, sizeof (GSRuntimeStatsShard));
+      if (shard == NULL)
+        return;
+      GSThreadKeySetValue (_kCFRuntimeStatsKey, shard);
+      GSMutexLock (&_kCFRuntimeStatsLock);
+      shard->next = _kCFRuntimeStatsShards;
+      _kCFRuntimeStatsShards = shard;
+      GSMutexUnlock (&_kCFRuntimeStatsLock);
+    }
+
+  idx = typeID / GS_RUNTIME_STATS_PAGE_SIZE;
+  page = shard->pages[idx];
+  if (page == NULL)
+    {
+      page = calloc (1, sizeof (GSRuntimeStatsPage));
+      if (page == NULL)
+        return;
+      /* Readers walk the pages with the lock held. */
+      GSMutexLock (&_kCFRuntimeStatsLock);
+      shard->pages[idx] = page;
+      GSMutexUnlock (&_kCFRuntimeStatsLock);
+    }
+
+  count = &(*page)[typeID % GS_RUNTIME_STATS_PAGE_SIZE][counter];
+  GSAtomicStoreRelaxedCFIndex (count,
+                               GSAtomicLoadRelaxedCFIndex (count) + value);
+}
+
+/* Adds the counts in src to dst.  Must be called with the lock held. */
+static void
+GSRuntimeStatsShardMerge (GSRuntimeStatsShard *dst, GSRuntimeStatsShard *src)
+{
+  CFIndex idx;
+  CFIndex type;
+  CFIndex counter;
+
+  for (idx = 0; idx < GS_RUNTIME_STATS_PAGES; ++idx)
+    {
+      if (src->pages[idx] == NULL)
+        continue;
+      if (dst->pages[idx] == NULL)
+        {
+          dst->pages[idx] = calloc (1, sizeof (GSRuntimeStatsPage));
+          if (dst->pages[idx] == NULL)
+            continue;
+        }
+      for (type = 0; type < GS_RUNTIME_STATS_PAGE_SIZE; ++type)
+        for (counter = 0; counter < GSRuntimeStatCount; ++counter)
+          (*dst->pages[idx])[type][counter] +=
+            GSAtomicLoadRelaxedCFIndex (&(*src->pages[idx])[type][counter]);
+    }
+}
+
+static void
+GSRuntimeStatsShardFreePages (GSRuntimeStatsShard *shard)
+{
+  CFIndex idx;
+
+  for (idx = 0; idx < GS_RUNTIME_STATS_PAGES; ++idx)
+    free (shard->pages[idx]);
+}
+
+static void
+GSRuntimeStatsShardDestroy (GSRuntimeStatsShard *shard)
+{
+  GSRuntimeStatsShard **link;
+
+  GSMutexLock (&_kCFRuntimeStatsLock);
+  for (link = &_kCFRuntimeStatsShards; *link != NULL; link = &(*link)->next)
+    {
+      if (*link == shard)
+        {
+          *link = shard->next;
+          break;
+        }
+    }
+  GSRuntimeStatsShardMerge (&_kCFRuntimeStatsRetired, shard);
+  GSMutexUnlock (&_kCFRuntimeStatsLock);
+
+  GSRuntimeStatsShardFreePages (shard);
+  free (shard);
+}
+
+/* Sums all shards into total, which must be zeroed. */
+static void
+GSRuntimeStatsCollect (GSRuntimeStatsShard *total)
+{
+  GSRuntimeStatsShard *shard;
+
+  GSMutexLock (&_kCFRuntimeStatsLock);
+  GSRuntimeStatsShardMerge (total, &_kCFRuntimeStatsRetired);
+  for (shard = _kCFRuntimeStatsShards; shard != NULL; shard = shard->next)
+    GSRuntimeStatsShardMerge (total, shard);
+  GSMutexUnlock (&_kCFRuntimeStatsLock);
+}
+
+static CFIndex *
+GSRuntimeStatsShardGetCounts (GSRuntimeStatsShard *shard, CFTypeID typeID)
+{
+  GSRuntimeStatsPage *page;
+  CFIndex *counts;
+  CFIndex counter;
+
+  page = shard->pages[typeID / GS_RUNTIME_STATS_PAGE_SIZE];
+  if (page == NULL)
+    return NULL;
+  counts = (*page)[typeID % GS_RUNTIME_STATS_PAGE_SIZE];
+  for (counter = 0; counter < GSRuntimeStatCount; ++counter)
+    {
+      if (counts[counter] != 0)
+        return counts;
+    }
+  return NULL;
+}
+
+static void
+GSRuntimeStatsDump (void)
+{
+  GSRuntimeStatsShard total;
+  CFRuntimeClass *cls;
+  CFIndex *counts;
+  CFTypeID typeID;
+
+  memset (&total, 0, sizeof (total));
+  GSRuntimeStatsCollect (&total);
+
+  fprintf (stderr, "%-28s %10s %12s %14s %12s %12s\n", "Type", "Live",
+           "Allocations", "Bytes", "Retains", "Releases");
+  for (typeID = 1; typeID < __CFRuntimeClassTableCount; ++typeID)
+    {
+      cls = __CFRuntimeClassTable[typeID];
+      counts = GSRuntimeStatsShardGetCounts (&total, typeID);
+      if (cls == NULL || counts == NULL)
+        continue;
+      fprintf (stderr, "%-28s %10ld %12ld %14ld %12ld %12ld\n",
+               cls->className,
+               (long) (counts[GSRuntimeStatAllocations]
+                       - counts[GSRuntimeStatDeallocations]),
+               (long) counts[GSRuntimeStatAllocations],
+               (long) counts[GSRuntimeStatBytes],
+               (long) counts[GSRuntimeStatRetains],
+               (long) counts[GSRuntimeStatReleases]);
+    }
+  GSRuntimeStatsShardFreePages (&total);
+}
+
+void
+_CFRuntimeSetInstanceStatisticsEnabled (Boolean enabled)
+{
+  GSAtomicStoreRelaxedCFIndex (&_kCFRuntimeStatsEnabled, enabled);
+}
+
+Boolean
+_CFRuntimeGetInstanceStatisticsEnabled (void)
+{
+  return GSAtomicLoadRelaxedCFIndex (&_kCFRuntimeStatsEnabled) ? true : false;
+}
+
+CFDictionaryRef
+_CFRuntimeCopyInstanceStatistics (void)
+{
+  static const char *names[] =
+    { "LiveInstances", "Allocations", "Bytes", "Retains", "Releases" };
+  GSRuntimeStatsShard total;
+  CFMutableDictionaryRef result;
+  CFDictionaryRef entry;
+  CFStringRef keys[5];
+  CFNumberRef values[5];
+  CFStringRef className;
+  CFRuntimeClass *cls;
+  CFIndex *counts;
+  CFIndex live;
+  CFTypeID typeID;
+  CFIndex i;
+
+  /* Take the snapshot before creating any objects, so that building the
+     result does not show up in it. */
+  memset (&total, 0, sizeof (total));
+  GSRuntimeStatsCollect (&total);
+
+  result = CFDictionaryCreateMutable (NULL, 0, &kCFTypeDictionaryKeyCallBacks,
+                                      &kCFTypeDictionaryValueCallBacks);
+  for (i = 0; i < 5; ++i)
+    keys[i] = CFStringCreateWithCString (NULL, names[i],
+                                         kCFStringEncodingASCII);
+
+  for (typeID = 1; typeID < __CFRuntimeClassTableCount; ++typeID)
+    {
+      cls = __CFRuntimeClassTable[typeID];
+      counts = GSRuntimeStatsShardGetCounts (&total, typeID);
+      if (cls == NULL || counts == NULL)
+        continue;
+
+      live = counts[GSRuntimeStatAllocations]
+        - counts[GSRuntimeStatDeallocations];
+      values[0] = CFNumberCreate (NULL, kCFNumberCFIndexType, &live);
+      values[1] = CFNumberCreate (NULL, kCFNumberCFIndexType,
+                                  &counts[GSRuntimeStatAllocations]);
+      values[2] = CFNumberCreate (NULL, kCFNumberCFIndexType,
+                                  &counts[GSRuntimeStatBytes]);
+      values[3] = CFNumberCreate (NULL, kCFNumberCFIndexType,
+                                  &counts[GSRuntimeStatRetains]);
+      values[4] = CFNumberCreate (NULL, kCFNumberCFIndexType,
+                                  &counts[GSRuntimeStatReleases]);
+      entry = CFDictionaryCreate (NULL, (const void **) keys,
+                                  (const void **) values, 5,
+                                  &kCFTypeDictionaryKeyCallBacks,
+                                  &kCFTypeDictionaryValueCallBacks);
+      className = CFStringCreateWithCString (NULL, cls->className,
+                                             kCFStringEncodingASCII);
+      CFDictionarySetValue (result, className, entry);
+
+      CFRelease (className);
+      CFRelease (entry);
+      for (i = 0; i < 5; ++i)
+        CFRelease (values[i]);
+    }
+
+  for (i = 0; i < 5; ++i)
+    CFRelease (keys[i]);
+  GSRuntimeStatsShardFreePages (&total);
+
+  return result;
+}
+
+
 CFTypeRef
 _CFRuntimeCreateInstance (CFAllocatorRef allocator, CFTypeID typeID,
                           CFIndex extraBytes, unsigned char *category)
@@ -171,6 +478,12 @@ _CFRuntimeCreateInstance (CFAllocatorRef allocator, CFTypeID typeID,
         __CFRuntimeObjCClassTable ? __CFRuntimeObjCClassTable[typeID] : NULL;
       new->_typeID = typeID;
 
+      if (GS_RUNTIME_STATS_ENABLED ())
+        {
+          GSRuntimeStatsAdd (typeID, GSRuntimeStatAllocations, 1);
+          GSRuntimeStatsAdd (typeID, GSRuntimeStatBytes, instSize);
+        }
+
       cls = __CFRuntimeClassTable[typeID];
       if (NULL != cls->init)
         {
@@ -344,6 +657,95 @@ CFMakeCollectable (CFTypeRef cf)
   return cf;
 }
 
+/* Every mutable property list type (CFArray, CFData, CFString and the
+ * GSHashTable based CFDictionary and CFSet) keeps its mutable flag in the
+ * lowest bit of _flags.info.
+ */
+enum
+{
+  _kCFRuntimeInfoIsMutable = (1 << 0)
+};
+
+static void CFMakeImmortalApplier (const void *value, void *context);
+
+static void
+CFMakeImmortalDictionaryApplier (const void *key, const void *value,
+                                 void *context)
+{
+  CFMakeImmortalApplier (key, context);
+  CFMakeImmortalApplier (value, context);
+}
+
+static void
+CFMakeImmortalApplier (const void *value, void *context)
+{
+  CFRuntimeBase *obj = (CFRuntimeBase *) value;
+  CFTypeID typeID;
+
+  if (obj == NULL)
+    return;
+#if defined (OBJC_SMALL_OBJECT_MASK)
+  if (((uintptr_t) obj & OBJC_SMALL_OBJECT_MASK) != 0)
+    return;
+#endif
+  typeID = CFGetTypeID (obj);
+  if (CF_IS_OBJC (typeID, obj))
+    return;
+
+  /* Objects that are already read-only have been visited before (or are
+     static), so this also takes care of cycles in the graph. */
+  if (obj->_flags.ro)
+    return;
+
+  if (typeID == CFStringGetTypeID ())
+    {
+      /* Strings cache their hash lazily, do it now so that the object is
+         never written to again.  A string kept in a rope could not be
+         read once it is no longer mutable. */
+      GSStringFlatten ((CFStringRef) obj);
+      CFHash (obj);
+      obj->_flags.info &= ~_kCFRuntimeInfoIsMutable;
+      obj->_flags.ro = 1;
+    }
+  else if (typeID == CFDataGetTypeID ())
+    {
+      obj->_flags.info &= ~_kCFRuntimeInfoIsMutable;
+      obj->_flags.ro = 1;
+    }
+  else if (typeID == CFArrayGetTypeID ())
+    {
+      obj->_flags.info &= ~_kCFRuntimeInfoIsMutable;
+      obj->_flags.ro = 1;
+      CFArrayApplyFunction ((CFArrayRef) obj,
+                            CFRangeMake (0, CFArrayGetCount ((CFArrayRef) obj)),
+                            CFMakeImmortalApplier, context);
+    }
+  else if (typeID == CFDictionaryGetTypeID ())
+    {
+      obj->_flags.info &= ~_kCFRuntimeInfoIsMutable;
+      obj->_flags.ro = 1;
+      CFDictionaryApplyFunction ((CFDictionaryRef) obj,
+                                 CFMakeImmortalDictionaryApplier, context);
+    }
+  else if (typeID == CFSetGetTypeID ())
+    {
+      obj->_flags.info &= ~_kCFRuntimeInfoIsMutable;
+      obj->_flags.ro = 1;
+      CFSetApplyFunction ((CFSetRef) obj, CFMakeImmortalApplier, context);
+    }
+  else
+    {
+      obj->_flags.ro = 1;
+    }
+}
+
+CFTypeRef
+CFMakeImmortal (CFTypeRef cf)
+{
+  CFMakeImmortalApplier (cf, NULL);
+  return cf;
+}
+
 void
 CFRelease (CFTypeRef cf)
 {
@@ -355,16 +757,46 @@ CFRelease (CFTypeRef cf)
 
       if (!((CFRuntimeBase *) cf)->_flags.ro)
         {
-          CFIndex result = GSAtomicDecrementCFIndex (&(((obj) cf)[-1].retained));
+          CFTypeID typeID;
+          CFIndex result;
+
+          typeID = ((CFRuntimeBase *) cf)->_typeID;
+          result = GSAtomicDecrementCFIndex (&(((obj) cf)[-1].retained));
           if (result < 0)
             {
               assert (result == -1);
               GSRuntimeDeallocateInstance (cf);
             }
+          GS_RUNTIME_STATS_ADD (typeID, GSRuntimeStatReleases, 1);
         }
     }
 }
 
+/* Retains cf unless its last reference is already gone, for tables that
+   keep objects without retaining them and drop them on finalization. */
+Boolean
+GSRuntimeRetainIfAlive (CFTypeRef cf)
+{
+  CFIndex *retained;
+  CFIndex count;
+
+  if (((CFRuntimeBase *) cf)->_flags.ro)
+    return true;
+
+  retained = &(((obj) cf)[-1].retained);
+  do
+    {
+      count = GSAtomicLoadCFIndex (retained);
+      if (count < 0)
+        return false;
+    }
+  while (GSAtomicCompareAndSwapCFIndex (retained, count, count + 1) != count);
+  GS_RUNTIME_STATS_ADD (((CFRuntimeBase *) cf)->_typeID,
+                        GSRuntimeStatRetains, 1);
+
+  return true;
+}
+
 CFTypeRef
 CFRetain (CFTypeRef cf)
 {
@@ -378,17 +810,299 @@ CFRetain (CFTypeRef cf)
         {
           CFIndex result = GSAtomicIncrementCFIndex (&(((obj) cf)[-1].retained));
           assert (result < INT_MAX);
+          GS_RUNTIME_STATS_ADD (((CFRuntimeBase *) cf)->_typeID,
+                                GSRuntimeStatRetains, 1);
         }
     }
   return cf;
 }
 
+
+
+/******************************/
+/* C autorelease pools.
+ *
+ * Each thread has a stack of autoreleased objects, stored in page sized
+ * chunks.  A pool is a NULL marker on that stack; the token handed out by
+ * CFAutoreleasePoolPush() is the address of its marker.  Popping a pool
+ * releases everything above its marker, newest first.  Consecutive
+ * entries for the same object are coalesced into a single atomic update
+ * of the retain count, and the memory of objects that die during a pop is
+ * returned to their allocators in batches, grouped by allocator.
+ *
+ * Up to GS_AUTORELEASE_SPARE_SIZE emptied chunks are kept for reuse.  A
+ * page sized malloc() makes glibc merge its free lists of small blocks,
+ * so freeing and reallocating chunks on every pop slowed down the
+ * allocations of the objects being autoreleased.
+ */
+#define GS_AUTORELEASE_CHUNK_SIZE \
+  ((4096 - 2 * sizeof (void *)) / sizeof (void *))
+#define GS_AUTORELEASE_DEAD_SIZE 64
+#define GS_AUTORELEASE_SPARE_SIZE 16
+
+typedef struct GSAutoreleaseChunk GSAutoreleaseChunk;
+struct GSAutoreleaseChunk
+{
+  GSAutoreleaseChunk *prev;
+  const void **top;
+  const void *objects[GS_AUTORELEASE_CHUNK_SIZE];
+};
+
+typedef struct
+{
+  GSAutoreleaseChunk *chunk;
+  GSAutoreleaseChunk *spare;
+  CFIndex spares;
+  CFIndex depth;
+} GSAutoreleaseStack;
+
+typedef struct
+{
+  CFIndex count;
+  struct
+  {
+    CFAllocatorRef allocator;
+    void *memory;
+  } objects[GS_AUTORELEASE_DEAD_SIZE];
+} GSAutoreleaseDeadList;
+
+static GSThreadKey _kCFAutoreleaseStackKey;
+
+static void GSAutoreleaseStackDestroy (GSAutoreleaseStack *stack);
+
+static GSAutoreleaseStack *
+GSAutoreleaseStackGet (Boolean create)
+{
+  GSAutoreleaseStack *stack;
+
+  stack = GSThreadKeyGetValue (_kCFAutoreleaseStackKey);
+  if (stack == NULL && create)
+    {
+      stack = calloc (1, sizeof (GSAutoreleaseStack));
+      if (stack == NULL)
+        return NULL;
+      GSThreadKeySetValue (_kCFAutoreleaseStackKey, stack);
+    }
+
+  return stack;
+}
+
+static const void **
+GSAutoreleaseStackAppend (GSAutoreleaseStack *stack, const void *value)
+{
+  GSAutoreleaseChunk *chunk;
+
+  chunk = stack->chunk;
+  if (chunk == NULL || chunk->top == chunk->objects + GS_AUTORELEASE_CHUNK_SIZE)
+    {
+      if (stack->spare != NULL)
+        {
+          chunk = stack->spare;
+          stack->spare = chunk->prev;
+          stack->spares--;
+        }
+      else
+        {
+          chunk = malloc (sizeof (GSAutoreleaseChunk));
+          if (chunk == NULL)
+            return NULL;
+        }
+      chunk->prev = stack->chunk;
+      chunk->top = chunk->objects;
+      stack->chunk = chunk;
+    }
+  *chunk->top = value;
+
+  return chunk->top++;
+}
+
+static void
+GSAutoreleaseDeadListFlush (GSAutoreleaseDeadList *dead)
+{
+  CFAllocatorRef allocator;
+  CFIndex i;
+  CFIndex j;
+
+  for (i = 0; i < dead->count; ++i)
+    {
+      allocator = dead->objects[i].allocator;
+      if (dead->objects[i].memory == NULL)
+        continue;
+      for (j = i; j < dead->count; ++j)
+        {
+          if (dead->objects[j].allocator == allocator
+              && dead->objects[j].memory != NULL)
+            {
+              CFAllocatorDeallocate (allocator, dead->objects[j].memory);
+              dead->objects[j].memory = NULL;
+            }
+        }
+    }
+  dead->count = 0;
+}
+
+static void
+GSAutoreleaseRelease (CFTypeRef cf, CFIndex count, GSAutoreleaseDeadList *dead)
+{
+  CFRuntimeClass *cls;
+  CFIndex result;
+
+#if defined (OBJC_SMALL_OBJECT_MASK)
+  if (((uintptr_t) cf & OBJC_SMALL_OBJECT_MASK) != 0)
+    return;
+#endif
+  if (CF_IS_OBJC (CFGetTypeID (cf), cf))
+    {
+      while (count-- > 0)
+        CFRelease (cf);
+      return;
+    }
+  if (((CFRuntimeBase *) cf)->_flags.ro)
+    return;
+
+  GS_RUNTIME_STATS_ADD (((CFRuntimeBase *) cf)->_typeID,
+                        GSRuntimeStatReleases, count);
+  result = GSAtomicAddCFIndex (&(((obj) cf)[-1].retained), -count);
+  if (result < 0)
+    {
+      assert (result == -1);
+      GS_RUNTIME_STATS_ADD (((CFRuntimeBase *) cf)->_typeID,
+                            GSRuntimeStatDeallocations, 1);
+      cls = __CFRuntimeClassTable[CFGetTypeID (cf)];
+      if (cls->finalize)
+        cls->finalize (cf);
+
+      if (dead->count == GS_AUTORELEASE_DEAD_SIZE)
+        GSAutoreleaseDeadListFlush (dead);
+      dead->objects[dead->count].allocator = ((obj) cf)[-1].allocator;
+      dead->objects[dead->count].memory = (void *) &((obj) cf)[-1];
+      dead->count++;
+    }
+}
+
+static void
+GSAutoreleaseStackPop (GSAutoreleaseStack *stack, const void **pool)
+{
+  GSAutoreleaseDeadList dead;
+  GSAutoreleaseChunk *chunk;
+  const void **slot;
+  const void *value;
+  CFIndex count;
+
+  dead.count = 0;
+  /* Finalizers may autorelease more objects, so the top of the stack is
+     looked up again on every iteration. */
+  while ((chunk = stack->chunk) != NULL)
+    {
+      if (chunk->top == chunk->objects)
+        {
+          stack->chunk = chunk->prev;
+          if (stack->spares < GS_AUTORELEASE_SPARE_SIZE)
+            {
+              chunk->prev = stack->spare;
+              stack->spare = chunk;
+              stack->spares++;
+            }
+          else
+            free (chunk);
+          continue;
+        }
+
+      slot = --chunk->top;
+      value = *slot;
+      if (value == NULL)
+        {
+          stack->depth--;
+          if (slot == pool)
+            break;
+          continue;
+        }
+
+      count = 1;
+      while (chunk->top > chunk->objects && chunk->top[-1] == value)
+        {
+          chunk->top--;
+          count++;
+        }
+      GSAutoreleaseRelease (value, count, &dead);
+    }
+  GSAutoreleaseDeadListFlush (&dead);
+}
+
+static void
+GSAutoreleaseStackDestroy (GSAutoreleaseStack *stack)
+{
+  GSAutoreleaseChunk *chunk;
+
+  /* Pools left in place when the thread exits are popped here. */
+  GSThreadKeySetValue (_kCFAutoreleaseStackKey, stack);
+  GSAutoreleaseStackPop (stack, NULL);
+  GSThreadKeySetValue (_kCFAutoreleaseStackKey, NULL);
+
+  while ((chunk = stack->chunk) != NULL)
+    {
+      stack->chunk = chunk->prev;
+      free (chunk);
+    }
+  while ((chunk = stack->spare) != NULL)
+    {
+      stack->spare = chunk->prev;
+      free (chunk);
+    }
+  free (stack);
+}
+
+static Boolean
+GSAutoreleasePoolAddObject (CFTypeRef cf)
+{
+  GSAutoreleaseStack *stack;
+
+  stack = GSAutoreleaseStackGet (false);
+  if (stack == NULL || stack->depth == 0)
+    return false;
+
+  return GSAutoreleaseStackAppend (stack, cf) != NULL;
+}
+
+void *
+CFAutoreleasePoolPush (void)
+{
+  GSAutoreleaseStack *stack;
+  const void **pool;
+
+  stack = GSAutoreleaseStackGet (true);
+  if (stack == NULL)
+    return NULL;
+  pool = GSAutoreleaseStackAppend (stack, NULL);
+  if (pool == NULL)
+    return NULL;
+  stack->depth++;
+
+  return (void *) pool;
+}
+
+void
+CFAutoreleasePoolPop (void *pool)
+{
+  GSAutoreleaseStack *stack;
+
+  if (pool == NULL)
+    return;
+  stack = GSAutoreleaseStackGet (false);
+  if (stack == NULL || stack->depth == 0)
+    return;
+
+  GSAutoreleaseStackPop (stack, (const void **) pool);
+}
+
 CFTypeRef
 CFAutorelease (CFTypeRef cf)
 {
 #if __has_feature(objc_arc)
   return objc_autoreleaseReturnValue(cf);
 #else
+  if (GSAutoreleasePoolAddObject (cf))
+    return cf;
   CF_OBJC_CALLV(CFTypeRef, cf, cf, "autorelease");
   return cf;
 #endif
@@ -397,6 +1111,8 @@ CFAutorelease (CFTypeRef cf)
 void *
 _CFBridgingRelease (CFTypeRef cf)
 {
+  if (GSAutoreleasePoolAddObject (cf))
+    return (void *)cf;
   CF_OBJC_CALLV(CFTypeRef, cf, cf, "autorelease");
   return (void *)cf;
 }
@@ -427,6 +1143,8 @@ GSRuntimeDeallocateInstance (CFTypeRef cf)
 {
   CFRuntimeClass *cls;
   cls = __CFRuntimeClassTable[CFGetTypeID (cf)];
+  GS_RUNTIME_STATS_ADD (((CFRuntimeBase *) cf)->_typeID,
+                        GSRuntimeStatDeallocations, 1);
 
   if (cls->finalize)
     cls->finalize (cf);
@@ -457,89 +1175,103 @@ GSRuntimeInitializeConstants (void)
     }
 }
 
+void
+GSOnceRun (CFIndex *guard, void (*function) (void))
+{
+  /* While the function runs, the guard holds the running thread with the
+   * low bit set, so it is never 0 or 2.
+   */
+  CFIndex owner = GSThreadSelf () | 1;
+  CFIndex state;
+
+  state = GSAtomicCompareAndSwapCFIndex (guard, 0, owner);
+  if (state == 0)
+    {
+      function ();
+      GSAtomicCompareAndSwapCFIndex (guard, owner, 2);
+    }
+  else if (state != owner)
+    {
+      while (GSAtomicLoadCFIndex (guard) != 2)
+        {
+#if defined(_WIN32)
+          SwitchToThread ();
+#else
+          sched_yield ();
+#endif
+        }
+    }
+}
+
 GS_PRIVATE void CFAllocatorInitialize (void);
 GS_PRIVATE void CFArrayInitialize (void);
-GS_PRIVATE void CFAttributedStringInitialize (void);
-GS_PRIVATE void CFBagInitialize (void);
-GS_PRIVATE void CFBinaryHeapInitialize (void);
-GS_PRIVATE void CFBitVectorInitialize (void);
 GS_PRIVATE void CFBooleanInitialize (void);
-GS_PRIVATE void CFCalendarInitialize (void);
-GS_PRIVATE void CFCharacterSetInitialize (void);
 GS_PRIVATE void CFDataInitialize (void);
 GS_PRIVATE void CFBundleInitialize (void);
 GS_PRIVATE void CFDateInitialize (void);
-GS_PRIVATE void CFDateFormatterInitialize (void);
 GS_PRIVATE void CFDictionaryInitialize (void);
-GS_PRIVATE void CFErrorInitialize (void);
-GS_PRIVATE void CFLocaleInitialize (void);
 GS_PRIVATE void CFNullInitialize (void);
 GS_PRIVATE void CFNumberInitialize (void);
-GS_PRIVATE void CFNumberFormatterInitialize (void);
-GS_PRIVATE void CFRunLoopInitialize (void);
 GS_PRIVATE void CFSetInitialize (void);
-GS_PRIVATE void CFStreamInitialize (void);
 GS_PRIVATE void CFStringInitialize (void);
 GS_PRIVATE void CFConstantStringInitialize (void);
 GS_PRIVATE void CFStringEncodingInitialize (void);
-GS_PRIVATE void CFTimeZoneInitialize (void);
-GS_PRIVATE void CFTreeInitialize (void);
-GS_PRIVATE void CFURLInitialize (void);
-GS_PRIVATE void CFUUIDInitialize (void);
-GS_PRIVATE void CFXMLNodeInitialize (void);
 
 #if !defined(_MSC_VER)
 void CFInitialize (void) __attribute__ ((constructor));
 #endif
 
-static CFIndex CFInitialized = 0;
-void
-CFInitialize (void)
+static void
+GSRuntimeStatsInitialize (void)
 {
-  /* Only initialize once. */
-  if (GSAtomicCompareAndSwapCFIndex (&CFInitialized, 0, 1) == 1)
+  const char *env;
+
+  env = getenv ("CFInstanceStatistics");
+  if (env == NULL || *env == '\0' || strcmp (env, "NO") == 0
+      || strcmp (env, "0") == 0)
     return;
 
-  /* Initialize CFRuntimeClassTable */
-  __CFRuntimeClassTable = (CFRuntimeClass **) calloc (__CFRuntimeClassTableSize,
-                                                      sizeof (CFRuntimeClass
-                                                              *));
+  GSAtomicStoreRelaxedCFIndex (&_kCFRuntimeStatsEnabled, true);
+  atexit (GSRuntimeStatsDump);
+}
 
+/* Only the core types, the ones that have constant instances or are used
+ * by nearly every program, are registered here.  Every other type
+ * registers itself the first time its CF...GetTypeID() function is called,
+ * which also happens before any instance is created.
+ */
+static void
+CFInitializeOnce (void)
+{
   GSMutexInitialize (&_kCFRuntimeTableLock);
+  GSThreadKeyCreate (&_kCFAutoreleaseStackKey, GSAutoreleaseStackDestroy);
+  GSMutexInitialize (&_kCFRuntimeStatsLock);
+  GSThreadKeyCreate (&_kCFRuntimeStatsKey, GSRuntimeStatsShardDestroy);
+  GSRuntimeStatsInitialize ();
 
   /* CFNotATypeClass should be at index = 0 */
   _CFRuntimeRegisterClass (&CFNotATypeClass);
 
   CFAllocatorInitialize ();
   CFArrayInitialize ();
-  CFAttributedStringInitialize ();
-  CFBagInitialize ();
-  CFBinaryHeapInitialize ();
-  CFBitVectorInitialize ();
   CFBooleanInitialize ();
-  CFCalendarInitialize ();
-  CFCharacterSetInitialize ();
   CFDataInitialize ();
   CFBundleInitialize ();
   CFDateInitialize ();
-  CFDateFormatterInitialize ();
   CFDictionaryInitialize ();
-  CFErrorInitialize ();
-  CFLocaleInitialize ();
   CFNullInitialize ();
   CFNumberInitialize ();
-  CFNumberFormatterInitialize ();
   CFSetInitialize ();
-  CFStreamInitialize ();
   CFStringInitialize ();
   CFConstantStringInitialize (); /* must be after CFStringIntialize () */
   CFStringEncodingInitialize ();
-  CFTimeZoneInitialize ();
-  CFTreeInitialize ();
-  CFURLInitialize ();
-  CFUUIDInitialize ();
-  CFXMLNodeInitialize ();
-  CFRunLoopInitialize ();
+}
+
+static CFIndex CFInitialized = 0;
+void
+CFInitialize (void)
+{
+  GSOnce (&CFInitialized, CFInitializeOnce);
 }
 
 #if defined(_MSC_VER)
@@ -61,6 +61,7 @@ CONST_STRING_DECL(kCFStreamPropertyFileCurrentOffset,
 
 static CFTypeID _kCFWriteStreamTypeID = 0;
 static CFTypeID _kCFReadStreamTypeID = 0;
+static CFIndex _kCFStreamInitialized = 0;
 
 static void
 CFWriteStreamFDFinalize(CFWriteStreamRef s);
@@ -286,7 +287,7 @@ static CFRuntimeClass CFReadStreamClass =
   NULL
 };
 
-void
+static void
 CFStreamInitialize (void)
 {
   _kCFWriteStreamTypeID = _CFRuntimeRegisterClass (&CFWriteStreamClass);
@@ -296,12 +297,14 @@ CFStreamInitialize (void)
 CFTypeID
 CFWriteStreamGetTypeID (void)
 {
+  GSOnce (&_kCFStreamInitialized, CFStreamInitialize);
   return _kCFWriteStreamTypeID;
 }
 
 CFTypeID
 CFReadStreamGetTypeID (void)
 {
+  GSOnce (&_kCFStreamInitialized, CFStreamInitialize);
   return _kCFReadStreamTypeID;
 }
 
@@ -462,7 +465,7 @@ CFWriteStreamCreateWithAllocatedBuffers (CFAllocatorRef alloc,
 {
   CFWriteStreamRef new;
 
-  new = (CFWriteStreamRef)_CFRuntimeCreateInstance (alloc, _kCFWriteStreamTypeID,
+  new = (CFWriteStreamRef)_CFRuntimeCreateInstance (alloc, CFWriteStreamGetTypeID (),
                                                    CFWRITESTREAMBUFFER_SIZE, 0);
   GSMemoryCopy(&new->impl, &CFWriteStreamBufferImpl, sizeof(CFWriteStreamBufferImpl));
 
@@ -481,7 +484,7 @@ CFWriteStreamCreateWithBuffer (CFAllocatorRef alloc, UInt8 *buffer,
   if (buffer == NULL && bufferCapacity > 0)
     return NULL;
 
-  new = (CFWriteStreamRef)_CFRuntimeCreateInstance (alloc, _kCFWriteStreamTypeID,
+  new = (CFWriteStreamRef)_CFRuntimeCreateInstance (alloc, CFWriteStreamGetTypeID (),
                                                    CFWRITESTREAMBUFFER_SIZE, 0);
   sbuf = ((struct CFWriteStreamBuffer *)new);
   GSMemoryCopy(&new->impl, &CFWriteStreamBufferImpl, sizeof(CFWriteStreamBufferImpl));
@@ -511,7 +514,7 @@ CFWriteStreamCreateWithFile (CFAllocatorRef alloc, CFURLRef fileURL)
     }
   CFRelease(scheme);
 
-  new = (CFWriteStreamRef)_CFRuntimeCreateInstance (alloc, _kCFWriteStreamTypeID,
+  new = (CFWriteStreamRef)_CFRuntimeCreateInstance (alloc, CFWriteStreamGetTypeID (),
                                                    CFWRITESTREAMFD_SIZE, 0);
 
   sfd = ((struct CFWriteStreamFD *)new);
@@ -890,7 +893,7 @@ CFReadStreamCreateWithBytesNoCopy (CFAllocatorRef alloc, const UInt8 *bytes,
   if (bytes == NULL && length > 0)
     return NULL;
 
-  new = (CFReadStreamRef)_CFRuntimeCreateInstance (alloc, _kCFReadStreamTypeID,
+  new = (CFReadStreamRef)_CFRuntimeCreateInstance (alloc, CFReadStreamGetTypeID (),
                                                    CFREADSTREAMBUFFER_SIZE, 0);
 
   GSMemoryCopy(&new->impl, &CFReadStreamBufferImpl, sizeof(CFReadStreamBufferImpl));
@@ -921,7 +924,7 @@ CFReadStreamCreateWithFile (CFAllocatorRef alloc, CFURLRef fileURL)
     }
   CFRelease(scheme);
 
-  new = (CFReadStreamRef)_CFRuntimeCreateInstance (alloc, _kCFReadStreamTypeID,
+  new = (CFReadStreamRef)_CFRuntimeCreateInstance (alloc, CFReadStreamGetTypeID (),
                                                    CFREADSTREAMFD_SIZE, 0);
   GSMemoryCopy(&new->impl, &CFReadStreamFDImpl, sizeof(CFReadStreamFDImpl));
   sfd = (struct CFReadStreamFD*) new;
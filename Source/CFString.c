@@ -29,7 +29,7 @@
 #include "CoreFoundation/CFArray.h"
 #include "CoreFoundation/CFData.h"
 #include "CoreFoundation/CFDictionary.h"
-#include "CoreFoundation/CFNumberFormatter.h"
+#include "CoreFoundation/CFNumber.h"
 #include "CoreFoundation/CFString.h"
 #include "CoreFoundation/CFStringEncodingExt.h"
 #include "CoreFoundation/GSCharacter.h"
@@ -38,15 +38,28 @@
 #include "GSPrivate.h"
 #include "GSObjCRuntime.h"
 #include "GSMemory.h"
+#include "GSRope.h"
+#include "GSDtoa.h"
 
 #include <assert.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#if HAVE_UNICODE_UCHAR_H
+#include <unicode/uchar.h>
+#endif
+#if HAVE_UNICODE_ULOC_H
+#include <unicode/uloc.h>
+#endif
 #if HAVE_UNICODE_UNORM_H
 #include <unicode/unorm.h>
 #endif
+#if HAVE_UNICODE_UNORM2_H
+#include <unicode/unorm2.h>
+#endif
 #if HAVE_UNICODE_USTRING_H
 #include <unicode/ustring.h>
 #endif
@@ -74,13 +87,18 @@ CONST_STRING_DECL (kCFStringTransformLatinGreek, "Latin-Greek");
 CONST_STRING_DECL (kCFStringTransformToXMLHex, "Any-Hex/XML");
 CONST_STRING_DECL (kCFStringTransformToUnicodeName, "Any-Name");
 CONST_STRING_DECL (kCFStringTransformStripDiacritics,
-                   "NFD; [:nonspacing marks:]Remove; NFC");
+                   "NFD; [:nonspacing mark:]Remove; NFC");
 
-/* CFString has two possible internal encodings:
+/* CFString has three possible internal encodings:
      * UTF-16 (preferable)
      * ASCII
-   If the encoding is not one of the two listed above, it will be converted
-   to UTF-16 any character is not ASCII.
+     * ISO-8859-1
+     * UTF-8
+   Text in an 8-bit encoding is stored with one byte per character if every
+   character is in the ISO-8859-1 range, and as UTF-16 otherwise.  Strings
+   stored as ISO-8859-1 have the _kCFStringIsLatin1 flag set, so that they
+   are never mistaken for ASCII.  Well formed UTF-8 that is neither ASCII
+   nor ISO-8859-1 is kept as it is, see struct __CFUTF8String.
 */
 
 struct __CFString
@@ -92,6 +110,51 @@ struct __CFString
   CFAllocatorRef _deallocator;
 };
 
+/* Strings stored as UTF-8 have two more fields: the length of the
+   contents in bytes, and breadcrumbs that map every
+   CFSTRING_UTF8_STRIDE'th UTF-16 index to a byte offset.  The breadcrumbs
+   are built the first time a character is looked up by index, after
+   which reaching any index takes at most CFSTRING_UTF8_STRIDE steps.
+   _count is in UTF-16 code units, as for every other string.
+ */
+typedef struct
+{
+  CFIndex index;                /* UTF-16 index of a character */
+  CFIndex offset;               /* and its offset in bytes */
+} CFStringBreadcrumb;
+
+struct __CFUTF8String
+{
+  CFRuntimeBase _parent;
+  void *_contents;
+  CFIndex _count;
+  CFHashCode _hash;
+  CFAllocatorRef _deallocator;
+  CFIndex _byteCount;
+  CFStringBreadcrumb *_breadcrumbs;
+};
+
+/* A substring view shares the characters of an immutable string, its
+   owner, instead of copying them.  _contents points into the owner's
+   contents, the owner is retained, and the encoding flags are the same as
+   the owner's.  The owner is never a view itself.
+ */
+struct __CFStringView
+{
+  CFRuntimeBase _parent;
+  void *_contents;
+  CFIndex _count;
+  CFHashCode _hash;
+  CFAllocatorRef _deallocator;
+  CFStringRef _owner;
+};
+
+/* Mutable strings keep their characters in one UTF-16 buffer until they
+   grow past CFSTRING_ROPE_THRESHOLD characters.  Editing a large string
+   then moves it to a rope (see GSRope.h), and _contents is NULL for as
+   long as _rope is set.  CFStringGetCharactersPtr() and the functions
+   that hand the buffer to ICU move the characters back into one buffer.
+ */
 struct __CFMutableString
 {
   CFRuntimeBase _parent;
@@ -100,8 +163,17 @@ struct __CFMutableString
   CFHashCode _hash;
   CFAllocatorRef _allocator;
   CFIndex _capacity;
+  GSRopeRef _rope;
 };
 
+#define CFSTRING_ROPE_THRESHOLD (32 * 1024)
+
+/* Substrings shorter than CFSTRING_VIEW_MIN_LENGTH are copied rather than
+   made into views.  CFStringCreateCopy() gives a view its own characters
+   if its owner is more than CFSTRING_VIEW_RATIO times as long. */
+#define CFSTRING_VIEW_MIN_LENGTH 32
+#define CFSTRING_VIEW_RATIO 4
+
 static CFTypeID _kCFStringTypeID;
 
 /* These are some masks to access the data in CFRuntimeBase's _flags.info
@@ -111,8 +183,11 @@ enum
   _kCFStringIsMutable = (1 << 0),
   _kCFStringIsInline = (1 << 1),
   _kCFStringIsUnicode = (1 << 2),
-  _kCFStringHasLengthByte = (1 << 3),   /* This is used for Pascal strings */
-  _kCFStringHasNullByte = (1 << 4)
+  _kCFStringIsInterned = (1 << 3),
+  _kCFStringHasNullByte = (1 << 4),
+  _kCFStringIsLatin1 = (1 << 5),
+  _kCFStringIsUTF8 = (1 << 6),
+  _kCFStringIsView = (1 << 7)
 };
 
 // TODO: dispatch to ObjC in all of these methods OR check its use
@@ -146,6 +221,47 @@ CFStringHasNullByte (CFStringRef str)
     _flags.info & _kCFStringHasNullByte ? true : false;
 }
 
+CF_INLINE Boolean
+CFStringIsLatin1 (CFStringRef str)
+{
+  return
+    ((CFRuntimeBase *) str)->_flags.info & _kCFStringIsLatin1 ? true : false;
+}
+
+CF_INLINE Boolean
+CFStringIsUTF8 (CFStringRef str)
+{
+  return
+    ((CFRuntimeBase *) str)->_flags.info & _kCFStringIsUTF8 ? true : false;
+}
+
+CF_INLINE Boolean
+CFStringIsInterned (CFStringRef str)
+{
+  return
+    ((CFRuntimeBase *) str)->_flags.info & _kCFStringIsInterned ? true : false;
+}
+
+CF_INLINE void
+CFStringSetInterned (CFStringRef str)
+{
+  ((CFRuntimeBase *) str)->_flags.info |= _kCFStringIsInterned;
+}
+
+CF_INLINE Boolean
+CFStringIsView (CFStringRef str)
+{
+  return
+    ((CFRuntimeBase *) str)->_flags.info & _kCFStringIsView ? true : false;
+}
+
+CF_INLINE GSRopeRef
+CFStringGetRope (CFStringRef str)
+{
+  return CFStringIsMutable (str)
+    ? ((struct __CFMutableString *) str)->_rope : NULL;
+}
+
 CF_INLINE void
 CFStringSetMutable (CFStringRef str)
 {
@@ -170,23 +286,87 @@ CFStringSetNullByte (CFStringRef str)
   ((CFRuntimeBase *) str)->_flags.info |= _kCFStringHasNullByte;
 }
 
+CF_INLINE void
+CFStringSetLatin1 (CFStringRef str)
+{
+  ((CFRuntimeBase *) str)->_flags.info |= _kCFStringIsLatin1;
+}
+
+CF_INLINE void
+CFStringSetUTF8 (CFStringRef str)
+{
+  ((CFRuntimeBase *) str)->_flags.info |= _kCFStringIsUTF8;
+}
+
+
+
+static void
+CFStringInternRemove (CFStringRef str);
+
+static void
+CFStringLineIndexRemove (CFStringRef str);
 
+static Boolean
+CFStringLineIndexIsCached (CFStringRef str);
 
 static void
 CFStringFinalize (CFTypeRef cf)
 {
   CFStringRef str = (CFStringRef) cf;
 
-  if (!CFStringIsInline (str))
+  if (CFStringIsInterned (str))
+    CFStringInternRemove (str);
+  if (CFStringLineIndexIsCached (str))
+    CFStringLineIndexRemove (str);
+  if (CFStringIsUTF8 (str))
+    free (((struct __CFUTF8String *) str)->_breadcrumbs);
+  if (CFStringIsView (str))
+    CFRelease (((struct __CFStringView *) str)->_owner);
+  else if (CFStringGetRope (str))
+    GSRopeDestroy (CFStringGetRope (str));
+  else if (!CFStringIsInline (str))
     CFAllocatorDeallocate (str->_deallocator, str->_contents);
 }
 
 static Boolean
 CFStringEqual (CFTypeRef cf1, CFTypeRef cf2)
 {
+  /* There is only one interned string for any contents, and CFEqual()
+     has already checked whether these are the same object. */
+  if (CFStringIsInterned (cf1) && CFStringIsInterned (cf2))
+    return false;
   return CFStringCompare (cf1, cf2, 0) == 0 ? true : false;
 }
 
+/* Gives the same result as GSHashBytes() on the UTF-16 form of the
+   characters, without having to widen them first. */
+static CFHashCode
+CFStringHash8Bit (const UInt8 *bytes, CFIndex length)
+{
+  CFHashCode ret = 0;
+  CFIndex idx;
+
+  if (length <= 0)
+    return 0x0ffffffe;
+
+  for (idx = 0 ; idx < length ; ++idx)
+    {
+#if __BIG_ENDIAN__
+      ret = (ret << 5) + ret;
+      ret = (ret << 5) + ret + (char) bytes[idx];
+#else
+      ret = (ret << 5) + ret + (char) bytes[idx];
+      ret = (ret << 5) + ret;
+#endif
+    }
+
+  ret &= 0x0fffffff;
+  if (ret == 0)
+    ret = 0x0fffffff;
+
+  return ret;
+}
+
 static CFHashCode
 CFStringHash (CFTypeRef cf)
 {
@@ -202,13 +382,23 @@ CFStringHash (CFTypeRef cf)
     {
       if (str->_hash == 0)
         {
-          if (CFStringIsUnicode (str))
+          if (CFStringGetRope (str))
+            {
+              /* Hashed below. */
+            }
+          else if (CFStringIsUnicode (str))
             {
               len = CFStringGetLength (str) * sizeof (UniChar);
               ((struct __CFString *) str)->_hash =
                 GSHashBytes (str->_contents, len);
               return str->_hash;
             }
+          else if (!CFStringIsUTF8 (str))
+            {
+              ((struct __CFString *) str)->_hash =
+                CFStringHash8Bit (str->_contents, str->_count);
+              return str->_hash;
+            }
         }
       else
         return str->_hash;
@@ -245,45 +435,153 @@ static const CFRuntimeClass CFStringClass = {
   NULL
 };
 
-static GSMutex static_strings_lock;
-static CFMutableDictionaryRef static_strings;
-/*
- * Hack to allocated CFStrings uniquely without compiler support.
+/* Interned strings are kept in a hash table that does not retain them.
+ * The table is split in CFSTRING_INTERN_SHARDS shards, each with its own
+ * lock, picked by the low bits of the hash.  A string removes itself from
+ * its shard when it is finalized.  Until it has done so, a lookup may find
+ * a string whose last reference is already gone; such a string cannot be
+ * retained any more and is skipped.  Only strings flagged as interned are
+ * ever removed, so constant strings that end up in the table stay there.
+ */
+#define CFSTRING_INTERN_SHARDS 16
+#define CFSTRING_INTERN_INITIAL_SIZE 64
+
+typedef struct
+{
+  GSMutex lock;
+  CFIndex size;                 /* Always a power of 2, or 0 */
+  CFIndex count;
+  CFStringRef *slots;
+} CFStringInternShard;
+
+static CFStringInternShard _kCFStringInternTable[CFSTRING_INTERN_SHARDS];
+static CFIndex _kCFStringInternLookups = 0;
+static CFIndex _kCFStringInternHits = 0;
+static CFIndex _kCFStringInternBytesSaved = 0;
+
+/* Constant strings created at runtime are kept in an open addressing table
+ * keyed by the address of the C string.  Lookups do not take a lock: a
+ * table is only ever published after it is completely filled in, slots
+ * are written once with a fully initialized string, and tables replaced
+ * while growing are never freed, so a reader can keep using a table it
+ * has already loaded.  Insertions are serialized by static_strings_lock.
+ * String headers are carved out of larger blocks to avoid an allocation
+ * per literal.
  */
+#define STATIC_STRINGS_INITIAL_SIZE 256
+#define STATIC_STRINGS_BLOCK_SIZE 64
+
+struct static_strings_table
+{
+  CFIndex size;                 /* Always a power of 2 */
+  CFIndex count;
+  struct __CFString *volatile slots[1];
+};
+
+static GSMutex static_strings_lock;
+static struct static_strings_table *volatile static_strings = NULL;
+static struct __CFString *static_strings_block = NULL;
+static CFIndex static_strings_block_used = STATIC_STRINGS_BLOCK_SIZE;
+
+static struct static_strings_table *
+static_strings_table_create (CFIndex size)
+{
+  struct static_strings_table *table;
+
+  table = CFAllocatorAllocate (kCFAllocatorSystemDefault,
+                               sizeof (struct static_strings_table)
+                               + (size - 1) * sizeof (struct __CFString *), 0);
+  assert (table);
+  memset (table, 0, sizeof (struct static_strings_table)
+          + (size - 1) * sizeof (struct __CFString *));
+  table->size = size;
+
+  return table;
+}
+
+static CFStringRef
+static_strings_table_lookup (struct static_strings_table *table,
+                             const char *str, CFIndex *index)
+{
+  struct __CFString *entry;
+  CFIndex mask;
+  CFIndex idx;
+
+  mask = table->size - 1;
+  idx = GSHashPointer (str) & mask;
+  while ((entry = table->slots[idx]) != NULL)
+    {
+      if (entry->_contents == str)
+        return entry;
+      idx = (idx + 1) & mask;
+    }
+  if (index)
+    *index = idx;
+
+  return NULL;
+}
+
+static void
+static_strings_table_grow (void)
+{
+  struct static_strings_table *old;
+  struct static_strings_table *new;
+  struct __CFString *entry;
+  CFIndex idx;
+  CFIndex newIdx;
+
+  old = static_strings;
+  new = static_strings_table_create (old->size * 2);
+  for (idx = 0; idx < old->size; ++idx)
+    {
+      entry = old->slots[idx];
+      if (entry != NULL)
+        {
+          static_strings_table_lookup (new, entry->_contents, &newIdx);
+          new->slots[newIdx] = entry;
+          new->count++;
+        }
+    }
+  /* The old table is intentionally leaked; readers may still be using it. */
+  GSMemoryBarrier ();
+  static_strings = new;
+}
+
 CFStringRef
 __CFStringMakeConstantString (const char *str)
 {
+  struct static_strings_table *table;
+  struct __CFString *new_const_str;
   CFStringRef old;
+  CFIndex idx;
 
-  if (static_strings == NULL)
+  table = static_strings;
+  if (table != NULL)
     {
-      /* The 170 capacity is really arbitrary.  I just wanted to make the
-       * number large enough so that the hash table size comes out to 257,
-       * a table large enough to fit most needs before needing to expand.
-       */
-      GSMutexLock (&static_strings_lock);
-      if (static_strings == NULL)
-        static_strings = CFDictionaryCreateMutable (NULL, 170, NULL, NULL);
-      GSMutexUnlock (&static_strings_lock);
+      old = static_strings_table_lookup (table, str, NULL);
+      /* Return the existing string pointer if we have one. */
+      if (old != NULL)
+        return old;
     }
 
-  old = (CFStringRef) CFDictionaryGetValue (static_strings, str);
-
-  /* Return the existing string pointer if we have one. */
-  if (NULL != old)
-    return old;
-
+  /* This may run from another library's constructor, before ours. */
+  CFInitialize ();
   GSMutexLock (&static_strings_lock);
+  if (static_strings == NULL)
+    static_strings = static_strings_table_create (STATIC_STRINGS_INITIAL_SIZE);
   /* Check again in case another thread added this string to the table while
    * we were waiting on the mutex. */
-  old = (CFStringRef) CFDictionaryGetValue (static_strings, str);
+  old = static_strings_table_lookup (static_strings, str, &idx);
   if (NULL == old)
     {
-      struct __CFString *new_const_str;
-
-      new_const_str =
-        CFAllocatorAllocate (NULL, sizeof (struct __CFString), 0);
-      assert (new_const_str);
+      if (static_strings_block_used == STATIC_STRINGS_BLOCK_SIZE)
+        {
+          static_strings_block = CFAllocatorAllocate (NULL,
+            STATIC_STRINGS_BLOCK_SIZE * sizeof (struct __CFString), 0);
+          assert (static_strings_block);
+          static_strings_block_used = 0;
+        }
+      new_const_str = &static_strings_block[static_strings_block_used++];
 
       /* Using _CFRuntimeInitStaticInstance() guarantees that any CFRetain or
        * CFRelease calls on object will be a no-op.
@@ -294,8 +592,13 @@ __CFStringMakeConstantString (const char *str)
       new_const_str->_hash = 0;
       new_const_str->_deallocator = NULL;
 
-      CFDictionaryAddValue (static_strings, str,
-                            (const void *) new_const_str);
+      /* The string must be completely initialized before it is visible. */
+      GSMemoryBarrier ();
+      static_strings->slots[idx] = new_const_str;
+      static_strings->count++;
+      /* Keep the load factor under 50%. */
+      if (static_strings->count * 2 > static_strings->size)
+        static_strings_table_grow ();
       old = new_const_str;
     }
   GSMutexUnlock (&static_strings_lock);
@@ -303,11 +606,47 @@ __CFStringMakeConstantString (const char *str)
   return old;
 }
 
+CFStringRef
+__CFStringInitializeConstantString (struct __CFConstantStringLiteral *str)
+{
+  CFRuntimeBase *base = (CFRuntimeBase *) str;
+
+  /* Several threads may get here at the same time for the same literal,
+   * which is harmless because they all store the same values.  The type
+   * ID is stored last since CFSTR() uses it to know that the string is
+   * ready, so it must not be published before CFString is registered.
+   */
+  CFInitialize ();
+  assert (_kCFStringTypeID != 0);
+  base->_isa = __CFISAForTypeID (_kCFStringTypeID);
+  GSMemoryBarrier ();
+  base->_typeID = _kCFStringTypeID;
+
+  return (CFStringRef) str;
+}
+
+static GSThreadKey _kCFStringFormatCacheKey;
+static GSMutex _kCFStringLineIndexLock;
+#if !UCONFIG_NO_TRANSLITERATION
+static GSMutex _kCFStringTransformPoolLock;
+#endif
+static void
+CFStringFormatCacheDestroy (void *data);
+
 void
 CFStringInitialize (void)
 {
+  CFIndex idx;
+
   _kCFStringTypeID = _CFRuntimeRegisterClass (&CFStringClass);
   GSMutexInitialize (&static_strings_lock);
+  for (idx = 0; idx < CFSTRING_INTERN_SHARDS; ++idx)
+    GSMutexInitialize (&_kCFStringInternTable[idx].lock);
+  GSThreadKeyCreate (&_kCFStringFormatCacheKey, CFStringFormatCacheDestroy);
+  GSMutexInitialize (&_kCFStringLineIndexLock);
+#if !UCONFIG_NO_TRANSLITERATION
+  GSMutexInitialize (&_kCFStringTransformPoolLock);
+#endif
 }
 
 
@@ -365,149 +704,578 @@ CFStringGetTypeID (void)
 #define CFSTRING_SIZE \
   sizeof(struct __CFString) - sizeof(struct __CFRuntimeBase)
 
-static CFStringRef
-CFStringCreateImmutable (CFAllocatorRef alloc, const UInt8 * bytes,
-                         CFIndex numBytes, CFStringEncoding encoding,
-                         Boolean isExtRep, CFAllocatorRef contentsDealloc,
-                         Boolean copy)
+/* True for the encodings whose code units are wider than one byte. */
+CF_INLINE Boolean
+CFStringEncodingIsWide (CFStringEncoding enc)
 {
-  struct __CFString *new;
-  UniChar b[BUFFER_SIZE];
-  UniChar *buffer;
-  UniChar *bufferStart;
-  CFIndex need;
-  CFIndex extra;
-
-  buffer = b;
-  bufferStart = b;
-
-  /* Check if we can store this string as ASCII */
-  if (__CFStringEncodingIsSupersetOfASCII (encoding))
-    {
-      const UInt8 *s;
-      const UInt8 *limit;
+  return enc == kCFStringEncodingUTF16 || enc == kCFStringEncodingUTF16BE
+    || enc == kCFStringEncodingUTF16LE || enc == kCFStringEncodingUTF32
+    || enc == kCFStringEncodingUTF32BE || enc == kCFStringEncodingUTF32LE;
+}
 
-      s = bytes;
-      limit = s + numBytes;
-      while (s < limit)
-        {
-          if (*s++ > 0x7F)
-            break;
-        }
-      if (s >= limit)
-        encoding = kCFStringEncodingASCII;
-    }
+/* ASCII runs shorter than this are counted without calling
+   GSASCIILength(), which costs more than it saves on them. */
+#define CFSTRING_ASCII_INLINE_RUN 16
 
-  if (encoding == kCFStringEncodingASCII)
-    {
-      need = numBytes;
-      extra = numBytes + 1;
-    }
-  else
-    {
-      const UInt8 *src;
+/* Returns true if the bytes are well formed UTF-8 without a byte order
+   mark.  In that case length is set to the number of UTF-16 code units
+   needed, and latin1 to whether every character is at or below U+00FF.
+   If dest is not NULL it must hold numBytes bytes, and the text is also
+   converted to ISO-8859-1 there for as long as latin1 holds, so that short
+   strings are only read once.
+ */
+static Boolean
+CFStringUTF8Scan (const UInt8 *bytes, CFIndex numBytes, CFIndex *length,
+                  Boolean *latin1, UInt8 *dest)
+{
+  const UInt8 *s;
+  const UInt8 *limit;
+  CFIndex count;
+  CFIndex run;
+  Boolean narrow;
+  UInt8 c;
+
+  s = bytes;
+  limit = bytes + numBytes;
+  if (numBytes >= 3 && s[0] == 0xEF && s[1] == 0xBB && s[2] == 0xBF)
+    return false;
 
-      src = bytes;
-      /* We'll include a loss character for this conversion in case
-         there is an error in the input stream. We dont' want to fail
-         just because someone included an invalid code point/unit.
-         The loss character will be the Unicode replacement character U+FFFD.
-       */
-      need = GSUnicodeFromEncoding (&buffer, buffer + BUFFER_SIZE, encoding,
-                                    &src, src + numBytes, 0xFFFD);
-      if (need < 0)             /* There is something seriously wrong! */
-        return NULL;
-      extra = (need + 1) * sizeof (UniChar);
-    }
-  if (!copy)
+  count = 0;
+  narrow = true;
+  while (s < limit)
     {
-      if (encoding == kCFStringEncodingUTF16)
+      c = *s;
+      if (c < 0x80)
         {
-          UniChar c;
-
-          c = *((const UniChar *) bytes);
-          if (c == kGSUTF16CharacterSwappedByteOrderMark)
-            copy = true;
+          run = 1;
+          while (run < CFSTRING_ASCII_INLINE_RUN && s + run < limit
+                 && s[run] < 0x80)
+            run++;
+          if (run == CFSTRING_ASCII_INLINE_RUN)
+            run = GSASCIILength (s, limit - s);
+          if (dest)
+            GSMemoryCopy (dest + count, s, run);
+          s += run;
+          count += run;
         }
-      else if (encoding != kCFStringEncodingASCII)
+      else if (c < 0xC2)
         {
-          copy = true;
+          return false;
         }
-#if __BIG_ENDIAN__
-      else if (encoding == kCFStringEncodingUTF16LE)
+      else if (c < 0xE0)
         {
-          copy = true;
+          if (limit - s < 2 || (s[1] & 0xC0) != 0x80)
+            return false;
+          if (c > 0xC3)
+            {
+              narrow = false;
+              dest = NULL;
+            }
+          if (dest)
+            dest[count] = ((c & 0x1F) << 6) | (s[1] & 0x3F);
+          s += 2;
+          count += 1;
         }
-#else
-      else if (encoding == kCFStringEncodingUTF16BE)
+      else if (c < 0xF0)
         {
-          copy = true;
+          if (limit - s < 3 || (s[1] & 0xC0) != 0x80
+              || (s[2] & 0xC0) != 0x80
+              || (c == 0xE0 && s[1] < 0xA0)     /* overlong */
+              || (c == 0xED && s[1] > 0x9F))    /* surrogate */
+            return false;
+          narrow = false;
+          dest = NULL;
+          s += 3;
+          count += 1;
         }
-#endif
-    }
-
-  new = (struct __CFString *) _CFRuntimeCreateInstance (alloc,
-                                                        _kCFStringTypeID,
-                                                        CFSTRING_SIZE +
-                                                        extra, NULL);
-  if (new)
-    {
-      if (contentsDealloc == NULL)
-        contentsDealloc = CFAllocatorGetDefault ();
-      new->_deallocator = CFRetain (contentsDealloc);
-
-      if (copy)
+      else if (c < 0xF5)
         {
-          new->_contents = &(new[1]);
-
-          if (encoding == kCFStringEncodingASCII)
-            {
-              GSMemoryCopy (new->_contents, bytes, numBytes);
-            }
-          else if (extra <= BUFFER_SIZE)
-            {
-              GSMemoryCopy (new->_contents, bufferStart,
-                            need * sizeof (UniChar));
-              CFStringSetUnicode (new);
-            }
-          else
-            {
-              UniChar *contents;
-
-              contents = new->_contents;
-              GSUnicodeFromEncoding (&contents, contents + need, encoding,
-                                     &bytes, bytes + numBytes, 0xFFFD);
-              CFStringSetUnicode (new);
-            }
-
-          new->_count = need;
-          CFStringSetInline (new);
-          CFStringHasNullByte (new);
+          if (limit - s < 4 || (s[1] & 0xC0) != 0x80
+              || (s[2] & 0xC0) != 0x80 || (s[3] & 0xC0) != 0x80
+              || (c == 0xF0 && s[1] < 0x90)     /* overlong */
+              || (c == 0xF4 && s[1] > 0x8F))    /* above U+10FFFF */
+            return false;
+          narrow = false;
+          dest = NULL;
+          s += 4;
+          count += 2;
         }
       else
         {
-          new->_contents = (void *) bytes;
-          new->_count = encoding == kCFStringEncodingASCII
-            ? numBytes : numBytes / sizeof (UniChar);
-          if (encoding != kCFStringEncodingASCII)
-            CFStringSetUnicode (new);
+          return false;
         }
     }
 
-  return (CFStringRef) new;
+  *length = count;
+  *latin1 = narrow;
+  return true;
 }
 
-CFStringRef
-CFStringCreateWithBytes (CFAllocatorRef alloc, const UInt8 * bytes,
-                         CFIndex numBytes, CFStringEncoding encoding,
-                         Boolean isExternalRepresentation)
+#define CFSTRING_UTF8_SIZE \
+  sizeof(struct __CFUTF8String) - sizeof(struct __CFRuntimeBase)
+#define CFSTRING_UTF8_STRIDE 64
+#define CFSTRING_UTF8_HIGH_BITS ((UInt64) 0x8080808080808080ULL)
+
+/* The functions below expect well formed UTF-8, which is all that is
+   ever stored. */
+CF_INLINE CFIndex
+CFStringUTF8SequenceLength (UInt8 lead)
 {
-  return CFStringCreateImmutable (alloc, bytes, numBytes, encoding,
-                                  isExternalRepresentation, NULL, true);
+  if (lead < 0x80)
+    return 1;
+  if (lead < 0xE0)
+    return 2;
+  if (lead < 0xF0)
+    return 3;
+  return 4;
 }
 
-CFStringRef
-CFStringCreateWithBytesNoCopy (CFAllocatorRef alloc, const UInt8 * bytes,
+CF_INLINE UTF32Char
+CFStringUTF8Decode (const UInt8 *s)
+{
+  switch (CFStringUTF8SequenceLength (*s))
+    {
+      case 1:
+        return s[0];
+      case 2:
+        return ((s[0] & 0x1F) << 6) | (s[1] & 0x3F);
+      case 3:
+        return ((s[0] & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+      default:
+        return ((s[0] & 0x07) << 18) | ((s[1] & 0x3F) << 12)
+          | ((s[2] & 0x3F) << 6) | (s[3] & 0x3F);
+    }
+}
+
+static CFStringBreadcrumb *
+CFStringUTF8GetBreadcrumbs (struct __CFUTF8String *str)
+{
+  CFStringBreadcrumb *crumbs;
+  CFStringBreadcrumb *current;
+  const UInt8 *start;
+  const UInt8 *s;
+  CFIndex count;
+  CFIndex units;
+  CFIndex pos;
+  CFIndex idx;
+
+  crumbs = str->_breadcrumbs;
+  if (crumbs != NULL || str->_count <= CFSTRING_UTF8_STRIDE)
+    return crumbs;
+
+  count = (str->_count + CFSTRING_UTF8_STRIDE - 1) / CFSTRING_UTF8_STRIDE;
+  crumbs = malloc (count * sizeof (CFStringBreadcrumb));
+  if (crumbs == NULL)
+    return NULL;
+
+  start = str->_contents;
+  s = start;
+  pos = 0;
+  idx = 0;
+  while (idx < count)
+    {
+      units = *s >= 0xF0 ? 2 : 1;
+      if (pos + units > idx * CFSTRING_UTF8_STRIDE)
+        {
+          crumbs[idx].index = pos;
+          crumbs[idx].offset = s - start;
+          idx++;
+        }
+      pos += units;
+      s += CFStringUTF8SequenceLength (*s);
+    }
+
+  /* Another thread may have got there first. */
+  current = GSAtomicCompareAndSwapPointer (&str->_breadcrumbs, NULL, crumbs);
+  if (current != NULL)
+    {
+      free (crumbs);
+      crumbs = current;
+    }
+
+  return crumbs;
+}
+
+/* Returns the start of the character holding UTF-16 index idx, which must
+   be less than the length of the string, and sets start to the UTF-16
+   index of that character.  The two only differ if idx is the second
+   half of a surrogate pair. */
+static const UInt8 *
+CFStringUTF8Seek (struct __CFUTF8String *str, CFIndex idx, CFIndex *start)
+{
+  CFStringBreadcrumb *crumbs;
+  const UInt8 *s;
+  const UInt8 *limit;
+  UInt64 w;
+  UInt64 trail;
+  UInt64 four;
+  CFIndex units;
+  CFIndex pos;
+
+  s = str->_contents;
+  limit = s + str->_byteCount;
+  pos = 0;
+  crumbs = CFStringUTF8GetBreadcrumbs (str);
+  if (crumbs != NULL)
+    {
+      crumbs += idx / CFSTRING_UTF8_STRIDE;
+      s += crumbs->offset;
+      pos = crumbs->index;
+    }
+
+  /* Skip eight bytes at a time while every character starting in them
+     ends before idx.  They hold one UTF-16 code unit per byte that is not
+     a trail byte, and one more per four byte sequence.  Each mask has at
+     most the top bit of every byte set, so the multiplication adds them
+     up in the top byte. */
+  while (limit - s >= 8)
+    {
+      memcpy (&w, s, 8);
+      trail = w & ~(w << 1) & CFSTRING_UTF8_HIGH_BITS;
+      four = w & (w << 1) & (w << 2) & (w << 3) & CFSTRING_UTF8_HIGH_BITS;
+      units = 8 - (CFIndex) (((trail >> 7) * 0x0101010101010101ULL) >> 56)
+        + (CFIndex) (((four >> 7) * 0x0101010101010101ULL) >> 56);
+      if (pos + units > idx)
+        break;
+      pos += units;
+      s += 8;
+    }
+  /* The last character skipped may end past those eight bytes. */
+  while ((*s & 0xC0) == 0x80)
+    s++;
+
+  for (;;)
+    {
+      units = *s >= 0xF0 ? 2 : 1;
+      if (pos + units > idx)
+        break;
+      pos += units;
+      s += CFStringUTF8SequenceLength (*s);
+    }
+
+  *start = pos;
+  return s;
+}
+
+static void
+CFStringUTF8GetCharacters (struct __CFUTF8String *str, CFRange range,
+                           UniChar *buffer)
+{
+  const UInt8 *s;
+  UniChar *limit;
+  UTF32Char c;
+  CFIndex pos;
+  CFIndex run;
+
+  if (range.length <= 0)
+    return;
+
+  s = CFStringUTF8Seek (str, range.location, &pos);
+  limit = buffer + range.length;
+  while (buffer < limit)
+    {
+      if (*s < 0x80 && pos >= range.location)
+        {
+          run = 0;
+          while (run < CFSTRING_ASCII_INLINE_RUN && buffer + run < limit
+                 && s[run] < 0x80)
+            {
+              buffer[run] = s[run];
+              run++;
+            }
+          if (run == CFSTRING_ASCII_INLINE_RUN)
+            run += GSASCIIWiden (buffer + run, s + run,
+                                 limit - buffer - run);
+          buffer += run;
+          s += run;
+          pos += run;
+          if (buffer == limit)
+            break;
+        }
+      c = CFStringUTF8Decode (s);
+      s += CFStringUTF8SequenceLength (*s);
+      if (c > 0xFFFF)
+        {
+          /* The range may start in the middle of this pair. */
+          if (pos >= range.location)
+            *buffer++ = U16_LEAD (c);
+          if (buffer < limit)
+            *buffer++ = U16_TRAIL (c);
+          pos += 2;
+        }
+      else
+        {
+          *buffer++ = c;
+          pos += 1;
+        }
+    }
+}
+
+/* Finds the bytes holding a range of UTF-16 code units.  Returns false if
+   either end of the range falls between the two halves of a surrogate
+   pair. */
+static Boolean
+CFStringUTF8GetByteRange (struct __CFUTF8String *str, CFRange range,
+                          CFRange *bytes)
+{
+  const UInt8 *contents;
+  const UInt8 *s;
+  CFIndex end;
+  CFIndex pos;
+
+  contents = str->_contents;
+  if (range.location == 0)
+    {
+      bytes->location = 0;
+    }
+  else if (range.location == str->_count)
+    {
+      bytes->location = str->_byteCount;
+    }
+  else
+    {
+      s = CFStringUTF8Seek (str, range.location, &pos);
+      if (pos != range.location)
+        return false;
+      bytes->location = s - contents;
+    }
+
+  end = range.location + range.length;
+  if (end == str->_count)
+    {
+      bytes->length = str->_byteCount - bytes->location;
+    }
+  else if (range.length == 0)
+    {
+      bytes->length = 0;
+    }
+  else
+    {
+      s = CFStringUTF8Seek (str, end, &pos);
+      if (pos != end)
+        return false;
+      bytes->length = (s - contents) - bytes->location;
+    }
+
+  return true;
+}
+
+static CFStringRef
+CFStringCreateImmutable (CFAllocatorRef alloc, const UInt8 * bytes,
+                         CFIndex numBytes, CFStringEncoding encoding,
+                         Boolean isExtRep, CFAllocatorRef contentsDealloc,
+                         Boolean copy)
+{
+  struct __CFString *new;
+  UniChar b[BUFFER_SIZE];
+  UInt8 narrow[BUFFER_SIZE];
+  UniChar *buffer;
+  UniChar *bufferStart;
+  CFIndex need;
+  CFIndex extra;
+  Boolean latin1;
+  Boolean narrowed;
+  Boolean utf8;
+
+  buffer = b;
+  bufferStart = b;
+  latin1 = false;
+  narrowed = false;
+  utf8 = false;
+
+  /* Check if we can store this string as ASCII */
+  if (__CFStringEncodingIsSupersetOfASCII (encoding))
+    {
+      if (GSASCIILength (bytes, numBytes) == numBytes)
+        encoding = kCFStringEncodingASCII;
+    }
+
+  if (encoding == kCFStringEncodingASCII
+      || encoding == kCFStringEncodingISOLatin1)
+    {
+      need = numBytes;
+      extra = numBytes + 1;
+      latin1 = encoding == kCFStringEncodingISOLatin1;
+    }
+  else if (encoding == kCFStringEncodingUTF8
+           && CFStringUTF8Scan (bytes, numBytes, &need, &latin1,
+                                numBytes <= BUFFER_SIZE ? narrow : NULL))
+    {
+      if (latin1)
+        {
+          extra = need + 1;
+          narrowed = numBytes <= BUFFER_SIZE;
+        }
+      else
+        {
+          extra = numBytes + 1;
+          utf8 = true;
+        }
+    }
+  else
+    {
+      const UInt8 *src;
+
+      src = bytes;
+      /* We'll include a loss character for this conversion in case
+         there is an error in the input stream. We dont' want to fail
+         just because someone included an invalid code point/unit.
+         The loss character will be the Unicode replacement character U+FFFD.
+       */
+      need = GSUnicodeFromEncoding (&buffer, buffer + BUFFER_SIZE, encoding,
+                                    &src, src + numBytes, 0xFFFD);
+      if (need < 0)             /* There is something seriously wrong! */
+        return NULL;
+      extra = (need + 1) * sizeof (UniChar);
+
+      /* Other 8-bit encodings are only checked when the whole string
+         fit in the buffer. */
+      if (need <= BUFFER_SIZE && !CFStringEncodingIsWide (encoding)
+          && GSLatin1Narrow (narrow, bufferStart, need) == need)
+        {
+          extra = need + 1;
+          latin1 = true;
+          narrowed = true;
+        }
+    }
+  if (!copy)
+    {
+      if (encoding == kCFStringEncodingUTF16)
+        {
+          UniChar c;
+
+          c = *((const UniChar *) bytes);
+          if (c == kGSUTF16CharacterSwappedByteOrderMark)
+            copy = true;
+        }
+      else if (encoding != kCFStringEncodingASCII
+               && encoding != kCFStringEncodingISOLatin1 && !utf8)
+        {
+          copy = true;
+        }
+#if __BIG_ENDIAN__
+      else if (encoding == kCFStringEncodingUTF16LE)
+        {
+          copy = true;
+        }
+#else
+      else if (encoding == kCFStringEncodingUTF16BE)
+        {
+          copy = true;
+        }
+#endif
+    }
+
+  new = (struct __CFString *) _CFRuntimeCreateInstance (alloc,
+                                                        _kCFStringTypeID,
+                                                        (utf8 ?
+                                                         CFSTRING_UTF8_SIZE :
+                                                         CFSTRING_SIZE) +
+                                                        extra, NULL);
+  if (new)
+    {
+      if (contentsDealloc == NULL)
+        contentsDealloc = CFAllocatorGetDefault ();
+      new->_deallocator = CFRetain (contentsDealloc);
+
+      if (copy)
+        {
+          if (utf8)
+            new->_contents = &(((struct __CFUTF8String *) new)[1]);
+          else
+            new->_contents = &(new[1]);
+
+          if (encoding == kCFStringEncodingASCII
+              || encoding == kCFStringEncodingISOLatin1 || utf8)
+            {
+              GSMemoryCopy (new->_contents, bytes, numBytes);
+            }
+          else if (latin1 && !narrowed && encoding == kCFStringEncodingUTF8)
+            {
+              UInt8 *contents;
+              const UInt8 *limit;
+
+              contents = new->_contents;
+              limit = bytes + numBytes;
+              while (bytes < limit)
+                {
+                  if (*bytes < 0x80)
+                    {
+                      *contents++ = *bytes++;
+                    }
+                  else
+                    {
+                      *contents++ = ((bytes[0] & 0x1F) << 6)
+                        | (bytes[1] & 0x3F);
+                      bytes += 2;
+                    }
+                }
+            }
+          else if (latin1)
+            {
+              GSMemoryCopy (new->_contents, narrow, need);
+            }
+          else if (extra <= BUFFER_SIZE)
+            {
+              GSMemoryCopy (new->_contents, bufferStart,
+                            need * sizeof (UniChar));
+              CFStringSetUnicode (new);
+            }
+          else
+            {
+              UniChar *contents;
+
+              contents = new->_contents;
+              GSUnicodeFromEncoding (&contents, contents + need, encoding,
+                                     &bytes, bytes + numBytes, 0xFFFD);
+              CFStringSetUnicode (new);
+            }
+
+          new->_count = need;
+          CFStringSetInline (new);
+          CFStringSetNullByte (new);
+        }
+      else
+        {
+          new->_contents = (void *) bytes;
+          if (encoding == kCFStringEncodingASCII
+              || encoding == kCFStringEncodingISOLatin1)
+            {
+              new->_count = numBytes;
+            }
+          else if (utf8)
+            {
+              new->_count = need;
+            }
+          else
+            {
+              new->_count = numBytes / sizeof (UniChar);
+              CFStringSetUnicode (new);
+            }
+        }
+      if (latin1)
+        CFStringSetLatin1 (new);
+      if (utf8)
+        {
+          ((struct __CFUTF8String *) new)->_byteCount = numBytes;
+          CFStringSetUTF8 (new);
+        }
+    }
+
+  return (CFStringRef) new;
+}
+
+CFStringRef
+CFStringCreateWithBytes (CFAllocatorRef alloc, const UInt8 * bytes,
+                         CFIndex numBytes, CFStringEncoding encoding,
+                         Boolean isExternalRepresentation)
+{
+  return CFStringCreateImmutable (alloc, bytes, numBytes, encoding,
+                                  isExternalRepresentation, NULL, true);
+}
+
+CFStringRef
+CFStringCreateWithBytesNoCopy (CFAllocatorRef alloc, const UInt8 * bytes,
                                CFIndex numBytes, CFStringEncoding encoding,
                                Boolean isExternalRepresentation,
                                CFAllocatorRef contentsDeallocator)
@@ -517,10 +1285,11 @@ CFStringCreateWithBytesNoCopy (CFAllocatorRef alloc, const UInt8 * bytes,
                                   contentsDeallocator, false);
 }
 
-CFStringRef
-CFStringCreateCopy (CFAllocatorRef alloc, CFStringRef str)
+/* Always creates a new string with its own copy of the characters. */
+static CFStringRef
+CFStringCreateCopyOfContents (CFAllocatorRef alloc, CFStringRef str)
 {
-  if (CF_IS_OBJC (_kCFStringTypeID, str))
+  if (CF_IS_OBJC (_kCFStringTypeID, str) || CFStringGetRope (str))
     {
       CFIndex length = CFStringGetLength (str);
       UniChar *buf =
@@ -534,609 +1303,2061 @@ CFStringCreateCopy (CFAllocatorRef alloc, CFStringRef str)
   CFStringRef new;
   CFStringEncoding enc;
 
-  if (alloc == NULL)
-    alloc = CFAllocatorGetDefault ();
-
-  if (CFGetAllocator (str) == alloc && !CFStringIsMutable (str))
-    return CFRetain (str);
-
-  length =
-    CFStringIsUnicode (str) ? str->_count * sizeof (UniChar) : str->_count;
-  enc =
-    CFStringIsUnicode (str) ? kCFStringEncodingUTF16 : kCFStringEncodingASCII;
+  if (CFStringIsUnicode (str))
+    {
+      length = str->_count * sizeof (UniChar);
+      enc = kCFStringEncodingUTF16;
+    }
+  else if (CFStringIsUTF8 (str))
+    {
+      length = ((struct __CFUTF8String *) str)->_byteCount;
+      enc = kCFStringEncodingUTF8;
+    }
+  else
+    {
+      length = str->_count;
+      enc = CFStringIsLatin1 (str)
+        ? kCFStringEncodingISOLatin1 : kCFStringEncodingASCII;
+    }
   new = CFStringCreateWithBytes (alloc, str->_contents, length, enc, false);
 
   return new;
 }
 
 CFStringRef
-CFStringCreateWithFileSystemRepresentation (CFAllocatorRef alloc,
-                                            const char *buffer)
+CFStringCreateCopy (CFAllocatorRef alloc, CFStringRef str)
 {
-  /* FIXME: Need to make sure the system encoding will work here. */
-  return CFStringCreateWithCString (alloc, buffer,
-                                    CFStringGetSystemEncoding ());
+  if (!CF_IS_OBJC (_kCFStringTypeID, str))
+    {
+      if (alloc == NULL)
+        alloc = CFAllocatorGetDefault ();
+
+      /* A copy of a view much shorter than its owner gets its own
+         characters, so that keeping it around does not keep the owner
+         alive too. */
+      if (CFGetAllocator (str) == alloc && !CFStringIsMutable (str)
+          && (!CFStringIsView (str) || str->_count * CFSTRING_VIEW_RATIO
+              >= ((struct __CFStringView *) str)->_owner->_count))
+        return CFRetain (str);
+    }
+
+  return CFStringCreateCopyOfContents (alloc, str);
 }
 
-CFStringRef
-CFStringCreateFromExternalRepresentation (CFAllocatorRef alloc,
-                                          CFDataRef data,
-                                          CFStringEncoding encoding)
+CF_INLINE CFStringInternShard *
+CFStringInternGetShard (CFHashCode hash)
 {
-  const UInt8 *bytes = CFDataGetBytePtr (data);
-  CFIndex numBytes = CFDataGetLength (data);
-  return CFStringCreateWithBytes (alloc, bytes, numBytes, encoding, true);
+  return &_kCFStringInternTable[hash % CFSTRING_INTERN_SHARDS];
 }
 
-CFStringRef
-CFStringCreateWithCharacters (CFAllocatorRef alloc, const UniChar * chars,
-                              CFIndex numChars)
-{
-  return CFStringCreateWithBytes (alloc, (const UInt8 *) chars,
-                                  numChars * sizeof (UniChar),
-                                  kCFStringEncodingUnicode, false);
+CF_INLINE CFIndex
+CFStringInternGetSlot (CFStringInternShard *shard, CFHashCode hash)
+{
+  return (hash / CFSTRING_INTERN_SHARDS) & (shard->size - 1);
+}
+
+static void
+CFStringInternInsert (CFStringInternShard *shard, CFStringRef str)
+{
+  CFIndex idx;
+
+  idx = CFStringInternGetSlot (shard, str->_hash);
+  while (shard->slots[idx] != NULL)
+    idx = (idx + 1) & (shard->size - 1);
+  shard->slots[idx] = str;
+  shard->count += 1;
+}
+
+static void
+CFStringInternGrow (CFStringInternShard *shard)
+{
+  CFStringRef *old;
+  CFIndex oldSize;
+  CFIndex idx;
+
+  old = shard->slots;
+  oldSize = shard->size;
+  shard->size = oldSize ? oldSize * 2 : CFSTRING_INTERN_INITIAL_SIZE;
+  shard->slots = CFAllocatorAllocate (kCFAllocatorSystemDefault,
+                                      shard->size * sizeof (CFStringRef), 0);
+  memset (shard->slots, 0, shard->size * sizeof (CFStringRef));
+  shard->count = 0;
+  for (idx = 0; idx < oldSize; ++idx)
+    {
+      if (old[idx] != NULL)
+        CFStringInternInsert (shard, old[idx]);
+    }
+  if (old != NULL)
+    CFAllocatorDeallocate (kCFAllocatorSystemDefault, old);
+}
+
+/* Called by CFStringFinalize() for strings flagged as interned. */
+static void
+CFStringInternRemove (CFStringRef str)
+{
+  CFStringInternShard *shard;
+  CFStringRef moved;
+  CFIndex mask;
+  CFIndex hole;
+  CFIndex idx;
+  CFIndex home;
+
+  shard = CFStringInternGetShard (str->_hash);
+  GSMutexLock (&shard->lock);
+
+  mask = shard->size - 1;
+  hole = CFStringInternGetSlot (shard, str->_hash);
+  while (shard->slots[hole] != str)
+    {
+      if (shard->slots[hole] == NULL)
+        {
+          GSMutexUnlock (&shard->lock);
+          return;
+        }
+      hole = (hole + 1) & mask;
+    }
+
+  /* Move later entries of the same cluster back into the hole, so that
+     no lookup stops short of them. */
+  idx = hole;
+  for (idx = (idx + 1) & mask; shard->slots[idx] != NULL;
+       idx = (idx + 1) & mask)
+    {
+      moved = shard->slots[idx];
+      home = CFStringInternGetSlot (shard, moved->_hash);
+      if (((idx - home) & mask) >= ((idx - hole) & mask))
+        {
+          shard->slots[hole] = moved;
+          hole = idx;
+        }
+    }
+  shard->slots[hole] = NULL;
+  shard->count -= 1;
+
+  GSMutexUnlock (&shard->lock);
+}
+
+CF_INLINE CFIndex
+CFStringGetStorageSize (CFStringRef str)
+{
+  if (CFStringIsUnicode (str))
+    return CFStringGetLength (str) * sizeof (UniChar);
+  if (CFStringIsUTF8 (str))
+    return ((struct __CFUTF8String *) str)->_byteCount;
+  return str->_count;
+}
+
+CFStringRef
+CFStringCreateInterned (CFAllocatorRef alloc, CFStringRef str)
+{
+  CFStringInternShard *shard;
+  CFStringRef found;
+  CFStringRef candidate;
+  CFHashCode hash;
+  CFIndex idx;
+  Boolean hit;
+
+  if (CF_IS_OBJC (_kCFStringTypeID, str))
+    {
+      CFStringRef copy;
+
+      /* The hash of an Objective-C string may not match ours. */
+      copy = CFStringCreateCopyOfContents (alloc, str);
+      found = CFStringCreateInterned (alloc, copy);
+      CFRelease (copy);
+
+      return found;
+    }
+
+  if (CFStringIsInterned (str))
+    {
+      GSAtomicIncrementCFIndex (&_kCFStringInternLookups);
+      GSAtomicIncrementCFIndex (&_kCFStringInternHits);
+      return CFRetain (str);
+    }
+
+  hash = CFHash (str);
+  shard = CFStringInternGetShard (hash);
+  found = NULL;
+  hit = false;
+
+  GSMutexLock (&shard->lock);
+  if (shard->size > 0)
+    {
+      idx = CFStringInternGetSlot (shard, hash);
+      while ((candidate = shard->slots[idx]) != NULL)
+        {
+          if (candidate->_hash == hash && CFEqual (candidate, str)
+              && GSRuntimeRetainIfAlive (candidate))
+            {
+              found = candidate;
+              hit = true;
+              break;
+            }
+          idx = (idx + 1) & (shard->size - 1);
+        }
+    }
+
+  if (found == NULL)
+    {
+      /* Immutable strings that own their characters are used as they are,
+         anything else is copied first. */
+      if (CFStringIsMutable (str) || CFStringIsView (str))
+        found = CFStringCreateCopyOfContents (alloc, str);
+      else
+        found = CFRetain (str);
+      CFHash (found);
+
+      if (!((CFRuntimeBase *) found)->_flags.ro)
+        CFStringSetInterned (found);
+      if ((shard->count + 1) * 4 > shard->size * 3)
+        CFStringInternGrow (shard);
+      CFStringInternInsert (shard, found);
+    }
+  GSMutexUnlock (&shard->lock);
+
+  GSAtomicIncrementCFIndex (&_kCFStringInternLookups);
+  if (hit)
+    {
+      GSAtomicIncrementCFIndex (&_kCFStringInternHits);
+      GSAtomicAddCFIndex (&_kCFStringInternBytesSaved,
+                          CFStringGetStorageSize (str));
+    }
+
+  return found;
+}
+
+CFDictionaryRef
+_CFStringCopyInternStatistics (void)
+{
+  static const char *names[] = { "Lookups", "Hits", "Entries", "BytesSaved" };
+  CFStringRef keys[4];
+  CFNumberRef values[4];
+  CFDictionaryRef result;
+  CFIndex counts[4];
+  CFIndex idx;
+
+  counts[0] = GSAtomicLoadCFIndex (&_kCFStringInternLookups);
+  counts[1] = GSAtomicLoadCFIndex (&_kCFStringInternHits);
+  counts[2] = 0;
+  for (idx = 0; idx < CFSTRING_INTERN_SHARDS; ++idx)
+    {
+      GSMutexLock (&_kCFStringInternTable[idx].lock);
+      counts[2] += _kCFStringInternTable[idx].count;
+      GSMutexUnlock (&_kCFStringInternTable[idx].lock);
+    }
+  counts[3] = GSAtomicLoadCFIndex (&_kCFStringInternBytesSaved);
+
+  for (idx = 0; idx < 4; ++idx)
+    {
+      keys[idx] = CFStringCreateWithCString (NULL, names[idx],
+                                             kCFStringEncodingASCII);
+      values[idx] = CFNumberCreate (NULL, kCFNumberCFIndexType, &counts[idx]);
+    }
+  result = CFDictionaryCreate (NULL, (const void **) keys,
+                               (const void **) values, 4,
+                               &kCFTypeDictionaryKeyCallBacks,
+                               &kCFTypeDictionaryValueCallBacks);
+  for (idx = 0; idx < 4; ++idx)
+    {
+      CFRelease (keys[idx]);
+      CFRelease (values[idx]);
+    }
+
+  return result;
+}
+
+CFStringRef
+CFStringCreateWithFileSystemRepresentation (CFAllocatorRef alloc,
+                                            const char *buffer)
+{
+  /* FIXME: Need to make sure the system encoding will work here. */
+  return CFStringCreateWithCString (alloc, buffer,
+                                    CFStringGetSystemEncoding ());
+}
+
+CFStringRef
+CFStringCreateFromExternalRepresentation (CFAllocatorRef alloc,
+                                          CFDataRef data,
+                                          CFStringEncoding encoding)
+{
+  const UInt8 *bytes = CFDataGetBytePtr (data);
+  CFIndex numBytes = CFDataGetLength (data);
+  return CFStringCreateWithBytes (alloc, bytes, numBytes, encoding, true);
+}
+
+CFStringRef
+CFStringCreateWithCharacters (CFAllocatorRef alloc, const UniChar * chars,
+                              CFIndex numChars)
+{
+  return CFStringCreateWithBytes (alloc, (const UInt8 *) chars,
+                                  numChars * sizeof (UniChar),
+                                  kCFStringEncodingUnicode, false);
+}
+
+CFStringRef
+CFStringCreateWithCharactersNoCopy (CFAllocatorRef alloc,
+                                    const UniChar * chars, CFIndex numChars,
+                                    CFAllocatorRef contentsDeallocator)
+{
+  return CFStringCreateWithBytesNoCopy (alloc, (const UInt8 *) chars,
+                                        numChars * sizeof (UniChar),
+                                        kCFStringEncodingUnicode, false,
+                                        contentsDeallocator);
+}
+
+CFStringRef
+CFStringCreateWithCString (CFAllocatorRef alloc, const char *cStr,
+                           CFStringEncoding encoding)
+{
+  CFIndex len = strlen (cStr);
+  return CFStringCreateWithBytes (alloc, (const UInt8 *) cStr, len, encoding,
+                                  false);
+}
+
+CFStringRef
+CFStringCreateWithCStringNoCopy (CFAllocatorRef alloc, const char *cStr,
+                                 CFStringEncoding encoding,
+                                 CFAllocatorRef contentsDeallocator)
+{
+  CFIndex len = strlen (cStr);
+  return CFStringCreateWithBytesNoCopy (alloc, (const UInt8 *) cStr, len,
+                                        encoding, false, contentsDeallocator);
+}
+
+/* Compiled formats are kept in a small per-thread cache keyed on the
+   address of the format string.  Only constant strings, such as CFSTR()
+   literals and strings passed to CFMakeImmortal(), are cached.  They are
+   never freed, so the cache needs no reference to them and an address
+   cannot be reused for other contents.  An entry is taken out of the
+   cache while it is in use, because formatting a %@ argument may format
+   other strings on the same thread.
+ */
+#define CFSTRING_FORMAT_CACHE_SIZE 256
+
+typedef struct
+{
+  CFStringRef format;
+  GSFormatRef compiled;
+} CFStringFormatCacheEntry;
+
+static void
+CFStringFormatCacheDestroy (void *data)
+{
+  CFStringFormatCacheEntry *cache;
+  CFIndex idx;
+
+  cache = data;
+  for (idx = 0; idx < CFSTRING_FORMAT_CACHE_SIZE; ++idx)
+    {
+      if (cache[idx].format != NULL)
+        GSFormatDestroy (cache[idx].compiled);
+    }
+  free (cache);
+}
+
+static CFStringFormatCacheEntry *
+CFStringFormatCacheGetEntry (CFStringRef format, Boolean create)
+{
+  CFStringFormatCacheEntry *cache;
+
+  if (CF_IS_OBJC (_kCFStringTypeID, format) || CFStringIsMutable (format)
+      || !((CFRuntimeBase *) format)->_flags.ro)
+    return NULL;
+
+  cache = GSThreadKeyGetValue (_kCFStringFormatCacheKey);
+  if (cache == NULL)
+    {
+      if (!create)
+        return NULL;
+      cache = calloc (CFSTRING_FORMAT_CACHE_SIZE,
+                      sizeof (CFStringFormatCacheEntry));
+      if (cache == NULL)
+        return NULL;
+      GSThreadKeySetValue (_kCFStringFormatCacheKey, cache);
+    }
+
+  return &cache[GSHashPointer (format) & (CFSTRING_FORMAT_CACHE_SIZE - 1)];
+}
+
+static GSFormatRef
+CFStringFormatCompile (CFStringRef format)
+{
+  CFStringFormatCacheEntry *entry;
+  GSFormatRef compiled;
+  UniChar buffer[BUFFER_SIZE];
+  const UniChar *chars;
+  UniChar *tmp;
+  CFIndex length;
+
+  entry = CFStringFormatCacheGetEntry (format, false);
+  if (entry != NULL && entry->format == format)
+    {
+      compiled = entry->compiled;
+      entry->format = NULL;
+      entry->compiled = NULL;
+      return compiled;
+    }
+
+  tmp = NULL;
+  length = CFStringGetLength (format);
+  chars = CFStringGetCharactersPtr (format);
+  if (chars == NULL)
+    {
+      if (length > BUFFER_SIZE)
+        {
+          tmp = CFAllocatorAllocate (kCFAllocatorSystemDefault,
+                                     length * sizeof (UniChar), 0);
+          if (tmp == NULL)
+            return NULL;
+          chars = tmp;
+        }
+      else
+        {
+          chars = buffer;
+        }
+      CFStringGetCharacters (format, CFRangeMake (0, length),
+                             (UniChar *) chars);
+    }
+  compiled = GSFormatCompile (chars, length);
+  if (tmp != NULL)
+    CFAllocatorDeallocate (kCFAllocatorSystemDefault, tmp);
+
+  return compiled;
+}
+
+static void
+CFStringFormatRelease (CFStringRef format, GSFormatRef compiled)
+{
+  CFStringFormatCacheEntry *entry;
+
+  entry = CFStringFormatCacheGetEntry (format, true);
+  if (entry == NULL)
+    {
+      GSFormatDestroy (compiled);
+      return;
+    }
+
+  if (entry->format != NULL)
+    GSFormatDestroy (entry->compiled);
+  entry->format = format;
+  entry->compiled = compiled;
+}
+
+CFStringRef
+CFStringCreateWithFormat (CFAllocatorRef alloc, CFDictionaryRef formatOptions,
+                          CFStringRef format, ...)
+{
+  CFStringRef result;
+  va_list args;
+
+  va_start (args, format);
+  result =
+    CFStringCreateWithFormatAndArguments (alloc, formatOptions, format, args);
+  va_end (args);
+
+  return result;
+}
+
+CFStringRef
+CFStringCreateWithFormatAndArguments (CFAllocatorRef alloc,
+                                      CFDictionaryRef formatOptions,
+                                      CFStringRef format, va_list arguments)
+{
+  CFIndex str_len;
+  UniChar buf[BUFFER_SIZE];
+  UniChar *str;
+  GSFormatRef fmt;
+  CFStringRef fmted_str;
+
+  fmt = CFStringFormatCompile (format);
+  if (fmt == NULL)
+    return NULL;
+  str_len = GSFormatWriteWithArguments (fmt, buf, BUFFER_SIZE, &str,
+                                        formatOptions, arguments);
+  CFStringFormatRelease (format, fmt);
+  if (str_len < 0)
+    return NULL;
+
+  fmted_str = CFStringCreateWithCharacters (alloc, (const UniChar *) str,
+                                            str_len);
+  if (str != buf)
+    CFAllocatorDeallocate (kCFAllocatorSystemDefault, str);
+
+  return fmted_str;
+}
+
+#define CFSTRING_VIEW_SIZE \
+  sizeof(struct __CFStringView) - sizeof(struct __CFRuntimeBase)
+
+static CFStringRef
+CFStringCreateView (CFAllocatorRef alloc, CFStringRef str, CFRange range)
+{
+  struct __CFStringView *new;
+  CFStringRef owner;
+  CFIndex width;
+
+  owner = CFStringIsView (str) ? ((struct __CFStringView *) str)->_owner : str;
+  new = (struct __CFStringView *) _CFRuntimeCreateInstance (alloc,
+                                                            _kCFStringTypeID,
+                                                            CFSTRING_VIEW_SIZE,
+                                                            NULL);
+  if (new)
+    {
+      width = CFStringIsUnicode (str) ? sizeof (UniChar) : 1;
+      new->_contents = (UInt8 *) str->_contents + range.location * width;
+      new->_count = range.length;
+      new->_owner = CFRetain (owner);
+      ((CFRuntimeBase *) new)->_flags.info = _kCFStringIsView
+        | (((CFRuntimeBase *) str)->_flags.info
+           & (_kCFStringIsUnicode | _kCFStringIsLatin1));
+    }
+
+  return (CFStringRef) new;
+}
+
+CFStringRef
+CFStringCreateWithSubstring (CFAllocatorRef alloc, CFStringRef str,
+                             CFRange range)
+{
+  void *contents;
+  CFIndex len;
+  CFStringEncoding enc;
+
+  /* Substrings of immutable strings share their characters, unless they
+     are so short that copying them is cheaper. */
+  if (range.length >= CFSTRING_VIEW_MIN_LENGTH
+      && !CF_IS_OBJC (_kCFStringTypeID, str)
+      && !CFStringIsMutable (str) && !CFStringIsUTF8 (str))
+    return CFStringCreateView (alloc, str, range);
+
+  if (CFStringGetRope (str))
+    {
+      CFStringRef new;
+      UniChar *chars;
+
+      chars = CFAllocatorAllocate (kCFAllocatorSystemDefault,
+                                   range.length * sizeof (UniChar), 0);
+      GSRopeGetCharacters (CFStringGetRope (str), range, chars);
+      new = CFStringCreateWithCharacters (alloc, chars, range.length);
+      CFAllocatorDeallocate (kCFAllocatorSystemDefault, chars);
+
+      return new;
+    }
+  else if (CFStringIsUnicode (str))
+    {
+      enc = kCFStringEncodingUnicode;
+      len = range.length * sizeof (UniChar);
+      contents = ((UniChar *) str->_contents) + range.location;
+    }
+  else if (CFStringIsUTF8 (str))
+    {
+      CFRange bytes;
+
+      if (!CFStringUTF8GetByteRange ((struct __CFUTF8String *) str, range,
+                                     &bytes))
+        {
+          CFStringRef new;
+          UniChar *chars;
+
+          chars = CFAllocatorAllocate (kCFAllocatorSystemDefault,
+                                       range.length * sizeof (UniChar), 0);
+          CFStringUTF8GetCharacters ((struct __CFUTF8String *) str, range,
+                                     chars);
+          new = CFStringCreateWithCharacters (alloc, chars, range.length);
+          CFAllocatorDeallocate (kCFAllocatorSystemDefault, chars);
+
+          return new;
+        }
+      enc = kCFStringEncodingUTF8;
+      len = bytes.length;
+      contents = ((char *) str->_contents) + bytes.location;
+    }
+  else
+    {
+      enc = CFStringIsLatin1 (str)
+        ? kCFStringEncodingISOLatin1 : kCFStringEncodingASCII;
+      len = range.length;
+      contents = ((char *) str->_contents) + range.location;
+    }
+
+  return CFStringCreateWithBytes (alloc, (const UInt8 *) contents, len, enc,
+                                  false);
+}
+
+/* Copies the characters of str to the contents of new, a string being
+   built by CFStringCreateByCombiningStrings(), at offset.  Returns the
+   offset after them. */
+static CFIndex
+CFStringCombineCopy (struct __CFString *new, CFIndex offset, CFStringRef str)
+{
+  CFIndex length;
+
+  length = CFStringGetLength (str);
+  if (CFStringIsUnicode (new))
+    CFStringGetCharacters (str, CFRangeMake (0, length),
+                           (UniChar *) new->_contents + offset);
+  else
+    GSMemoryCopy ((UInt8 *) new->_contents + offset, str->_contents, length);
+
+  return offset + length;
+}
+
+/* An 8-bit string that is neither ASCII nor ISO-8859-1 is UTF-8 holding
+   characters above U+00FF, so only a string in 16-bit storage or one
+   that is UTF-8 needs a 16-bit result. */
+CF_INLINE Boolean
+CFStringCombineNeedsUnicode (CFStringRef str)
+{
+  return CF_IS_OBJC (_kCFStringTypeID, str) || CFStringIsUnicode (str)
+    || CFStringIsUTF8 (str);
+}
+
+CFStringRef
+CFStringCreateByCombiningStrings (CFAllocatorRef alloc, CFArrayRef theArray,
+                                  CFStringRef separatorString)
+{
+  struct __CFString *new;
+  CFStringRef str;
+  CFIndex count;
+  CFIndex length;
+  CFIndex idx;
+  Boolean wide;
+  Boolean latin1;
+
+  /* Measure the result first, so that it can be allocated once with its
+     characters inline and in the narrowest storage that holds them. */
+  count = CFArrayGetCount (theArray);
+  length = 0;
+  wide = false;
+  latin1 = false;
+  if (count > 1)
+    {
+      length = CFStringGetLength (separatorString) * (count - 1);
+      wide = CFStringCombineNeedsUnicode (separatorString);
+      latin1 = !wide && CFStringIsLatin1 (separatorString);
+    }
+  for (idx = 0; idx < count; ++idx)
+    {
+      str = CFArrayGetValueAtIndex (theArray, idx);
+      length += CFStringGetLength (str);
+      if (!wide)
+        {
+          wide = CFStringCombineNeedsUnicode (str);
+          latin1 = latin1 || CFStringIsLatin1 (str);
+        }
+    }
+
+  new = (struct __CFString *) _CFRuntimeCreateInstance (alloc,
+                                                        _kCFStringTypeID,
+                                                        CFSTRING_SIZE
+                                                        + (length + 1)
+                                                        * (wide ?
+                                                           sizeof (UniChar)
+                                                           : 1), NULL);
+  if (new == NULL)
+    return NULL;
+
+  new->_deallocator = CFRetain (CFAllocatorGetDefault ());
+  new->_contents = &(new[1]);
+  new->_count = length;
+  CFStringSetInline (new);
+  if (wide)
+    CFStringSetUnicode (new);
+  else if (latin1)
+    CFStringSetLatin1 (new);
+
+  length = 0;
+  for (idx = 0; idx < count; ++idx)
+    {
+      if (idx > 0)
+        length = CFStringCombineCopy (new, length, separatorString);
+      length = CFStringCombineCopy (new, length,
+                                    CFArrayGetValueAtIndex (theArray, idx));
+    }
+
+  return (CFStringRef) new;
+}
+
+CFDataRef
+CFStringCreateExternalRepresentation (CFAllocatorRef alloc,
+                                      CFStringRef str,
+                                      CFStringEncoding encoding,
+                                      UInt8 lossByte)
+{
+  UInt8 *buffer;
+  CFRange range;
+  CFIndex converted;
+  CFIndex strLen;
+  CFIndex len;
+  CFIndex usedLen = 0;
+
+  strLen = CFStringGetLength (str);
+  range = CFRangeMake (0, strLen);
+  converted = CFStringGetBytes (str, range, encoding, lossByte, true, NULL, 0, &len);
+  if (converted == 0)
+    return NULL;
+  len += 1;             /* include space for a NULL byte. */
+
+  buffer = CFAllocatorAllocate (alloc, len, 0);
+
+  converted = CFStringGetBytes (str, range, encoding, lossByte,
+                                true, buffer, len, &usedLen);
+
+  if (converted == 0)
+    {
+      CFAllocatorDeallocate (alloc, buffer);
+      return NULL;
+    }
+
+  return CFDataCreateWithBytesNoCopy (alloc, buffer, usedLen, alloc);
+}
+
+static void
+CFStringFlatten (CFMutableStringRef str);
+
+const UniChar *
+CFStringGetCharactersPtr (CFStringRef str)
+{
+  if (!CF_IS_OBJC (_kCFStringTypeID, str) && CFStringIsUnicode (str))
+    {
+      if (CFStringGetRope (str))
+        CFStringFlatten ((CFMutableStringRef) str);
+      return str->_contents;
+    }
+
+  return NULL;
+}
+
+const UniChar *
+__CFStringGetContiguousCharactersPtr (CFStringRef str)
+{
+  if (!CF_IS_OBJC (_kCFStringTypeID, str) && CFStringIsUnicode (str)
+      && !CFStringGetRope (str))
+    return str->_contents;
+
+  return NULL;
+}
+
+const char *
+__CFStringGetContiguousLatin1Ptr (CFStringRef str)
+{
+  if (!CF_IS_OBJC (_kCFStringTypeID, str) && !CFStringIsUnicode (str)
+      && !CFStringIsUTF8 (str))
+    return str->_contents;
+
+  return NULL;
+}
+
+const char *
+CFStringGetCStringPtr (CFStringRef str, CFStringEncoding enc)
+{
+  CF_OBJC_FUNCDISPATCHV (_kCFStringTypeID, const char *, str,
+                         "cStringUsingEncoding:",
+                         CFStringConvertEncodingToNSStringEncoding (enc));
+
+  /* Views are not followed by a null byte. */
+  if (CFStringIsUnicode (str) || CFStringIsView (str))
+    return NULL;
+  if (CFStringIsUTF8 (str))
+    return enc == kCFStringEncodingUTF8 ? str->_contents : NULL;
+  if (CFStringIsLatin1 (str))
+    return enc == kCFStringEncodingISOLatin1 ? str->_contents : NULL;
+
+  return __CFStringEncodingIsSupersetOfASCII (enc) ? str->_contents : NULL;
+}
+
+CFIndex
+CFStringGetBytes (CFStringRef str, CFRange range, CFStringEncoding enc,
+                  UInt8 lossByte, Boolean isExtRep, UInt8 * buffer,
+                  CFIndex maxBufLen, CFIndex * usedBufLen)
+{
+  UInt8 *bufferStart;
+  const UniChar *sUnicode;
+  CFRange byteRange;
+  CFIndex converted;
+
+  if (CF_IS_OBJC (_kCFStringTypeID, str))
+    {
+      /* Boolean b; */
+      uintptr_t opts = 0;
+
+      if (lossByte != 0)
+        opts |= 1;              /* NSStringEncodingConversionAllowLossy */
+      if (isExtRep != 0)
+        opts |= 2;              /*NSStringEncodingConversionExternalRepresentation */
+
+      // FIXME: Base's NSString doesn't implement getBytes:... yet!
+      *usedBufLen = 0;
+      return 0;
+
+      /*
+         CF_OBJC_CALLV (Boolean, b, str,
+         "getBytes:maxLength:usedLength:encoding:options:range:remainingRange:",
+         buffer, maxBufLen, usedBufLen,
+         CFStringConvertEncodingToNSStringEncoding (enc), opts,
+         range, NULL);
+
+         return b ? *usedBufLen : 0;
+       */
+    }
+
+  bufferStart = buffer;
+  sUnicode = __CFStringGetContiguousCharactersPtr (str);
+
+  if (sUnicode)
+    {
+      const UniChar *sUnicodeStart;
+      const UniChar *sLimit;
+
+      sUnicodeStart = sUnicode + range.location;
+      sUnicode = sUnicodeStart;
+      sLimit = sUnicodeStart + range.length;
+      /* It is safe to discard the return value in this case. */
+      GSUnicodeToEncoding (&buffer, buffer + maxBufLen, enc, &sUnicode,
+                           sLimit, lossByte, isExtRep);
+      converted = sUnicode - sUnicodeStart;
+    }
+  else if (CFStringIsUTF8 (str) && enc == kCFStringEncodingUTF8
+           && !isExtRep
+           && CFStringUTF8GetByteRange ((struct __CFUTF8String *) str,
+                                        range, &byteRange)
+           && (buffer == NULL || byteRange.length <= maxBufLen))
+    {
+      /* The contents are already UTF-8. */
+      if (buffer != NULL)
+        GSMemoryCopy (buffer, (const UInt8 *) str->_contents
+                      + byteRange.location, byteRange.length);
+      buffer += byteRange.length;
+      converted = range.length;
+    }
+  else if (!CFStringIsUnicode (str) && !CFStringIsUTF8 (str)
+           && (enc == kCFStringEncodingISOLatin1
+               || (!CFStringIsLatin1 (str)
+                   && __CFStringEncodingIsSupersetOfASCII (enc))))
+    {
+      const UInt8 *sBytes;
+
+      /* The contents are already in the requested encoding. */
+      sBytes = (const UInt8 *) str->_contents + range.location;
+      converted = range.length;
+      if (buffer != NULL)
+        {
+          if (converted > maxBufLen)
+            converted = maxBufLen;
+          GSMemoryCopy (buffer, sBytes, converted);
+        }
+      buffer += converted;
+    }
+  else if (enc == kCFStringEncodingUnicode)
+    {
+      range.length =
+        range.length >
+        (maxBufLen / sizeof (UniChar)) ? maxBufLen /
+        sizeof (UniChar) : range.length;
+      CFStringGetCharacters (str, range, (UniChar *) buffer);
+      buffer += range.length * sizeof (UniChar);
+      converted = range.length;
+    }
+  else
+    {
+      UniChar b[BUFFER_SIZE];
+      const UInt8 *bufferLimit;
+      CFIndex chunk;
+
+      /* Convert the contents to UTF-16 a buffer at a time. */
+      bufferLimit = buffer != NULL ? buffer + maxBufLen : NULL;
+      converted = 0;
+      while (converted < range.length)
+        {
+          chunk = range.length - converted;
+          if (chunk > BUFFER_SIZE)
+            chunk = BUFFER_SIZE;
+          CFStringGetCharacters (str,
+                                 CFRangeMake (range.location + converted,
+                                              chunk), b);
+          /* Never split a surrogate pair between two buffers. */
+          if (chunk < range.length - converted
+              && U16_IS_SURROGATE_LEAD (b[chunk - 1]))
+            chunk--;
+
+          sUnicode = b;
+          GSUnicodeToEncoding (&buffer, bufferLimit, enc, &sUnicode,
+                               b + chunk, lossByte,
+                               isExtRep && converted == 0);
+          converted += sUnicode - b;
+          if (sUnicode < b + chunk)
+            break;
+        }
+    }
+  if (usedBufLen)
+    *usedBufLen = buffer - bufferStart;
+
+  return converted;             /* FIXME */
+}
+
+void
+CFStringGetCharacters (CFStringRef str, CFRange range, UniChar * buffer)
+{
+  CF_OBJC_FUNCDISPATCHV (_kCFStringTypeID, void, str,
+                         "getCharacters:range:", buffer, range);
+
+  if (CFStringGetRope (str))
+    {
+      GSRopeGetCharacters (CFStringGetRope (str), range, buffer);
+    }
+  else if (CFStringIsUnicode (str))
+    {
+      memcpy (buffer, ((UniChar *) str->_contents) + range.location,
+              range.length * sizeof (UniChar));
+    }
+  else if (CFStringIsUTF8 (str))
+    {
+      CFStringUTF8GetCharacters ((struct __CFUTF8String *) str, range,
+                                 buffer);
+    }
+  else
+    {
+      GSLatin1Widen (buffer, (const UInt8 *) str->_contents + range.location,
+                     range.length);
+    }
+}
+
+Boolean
+CFStringGetCString (CFStringRef str, char *buffer, CFIndex bufferSize,
+                    CFStringEncoding encoding)
+{
+  CFIndex len = CFStringGetLength (str);
+  CFIndex used;
+
+  CF_OBJC_FUNCDISPATCHV (_kCFStringTypeID, Boolean, str,
+                         "getCString:maxLength:encoding:", buffer, bufferSize,
+                         CFStringConvertEncodingToNSStringEncoding
+                         (encoding));
+
+  if (CFStringGetBytes (str, CFRangeMake (0, len), encoding, 0, false,
+                        (UInt8 *) buffer, bufferSize, &used) == len
+      && used <= len)
+    {
+      buffer[used] = '\0';
+      return true;
+    }
+
+  return false;
+}
+
+Boolean
+CFStringGetFileSystemRepresentation (CFStringRef string, char *buffer,
+                                     CFIndex maxBufLen)
+{
+  /* FIXME */
+  return CFStringGetCString (string, buffer, maxBufLen,
+                             CFStringGetSystemEncoding ());
+}
+
+
+UniChar
+CFStringGetCharacterAtIndex (CFStringRef str, CFIndex idx)
+{
+  CF_OBJC_FUNCDISPATCHV (_kCFStringTypeID, UniChar, str,
+                         "characterAtIndex:", idx);
+  if (CFStringIsUTF8 (str))
+    {
+      UniChar c;
+
+      CFStringUTF8GetCharacters ((struct __CFUTF8String *) str,
+                                 CFRangeMake (idx, 1), &c);
+      return c;
+    }
+  if (CFStringGetRope (str))
+    return GSRopeGetCharacterAtIndex (CFStringGetRope (str), idx);
+  return CFStringIsUnicode (str) ? ((UniChar *) str->_contents)[idx] :
+    ((UInt8 *) str->_contents)[idx];
+}
+
+CFIndex
+CFStringGetLength (CFStringRef str)
+{
+  CF_OBJC_FUNCDISPATCHV (_kCFStringTypeID, CFIndex, str, "length");
+  return str->_count;
+}
+
+CFRange
+CFStringGetRangeOfComposedCharactersAtIndex (CFStringRef str,
+                                             CFIndex theIndex)
+{
+  CF_OBJC_FUNCDISPATCHV (_kCFStringTypeID, CFRange, str,
+                         "rangeOfComposedCharacterSequenceAtIndex:",
+                         theIndex);
+
+  if (CFStringIsUnicode (str) || CFStringIsUTF8 (str))
+    {
+      CFIndex len = 1;
+      UniChar c = CFStringGetCharacterAtIndex (str, theIndex);
+      if (U16_IS_SURROGATE (c))
+        {
+          len = 2;
+          if (U16_IS_SURROGATE_TRAIL (c))
+            theIndex -= 1;
+        }
+
+      return CFRangeMake (theIndex, len);
+    }
+
+  return CFRangeMake (theIndex, 1);
+}
+
+UTF32Char
+CFStringGetLongCharacterForSurrogatePair (UniChar surrogateHigh,
+                                          UniChar surrogateLow)
+{
+  return (UTF32Char) U16_GET_SUPPLEMENTARY (surrogateHigh, surrogateLow);
+}
+
+Boolean
+CFStringGetSurrogatePairForLongCharacter (UTF32Char character,
+                                          UniChar * surrogates)
+{
+  if (character > 0x10000)
+    return false;
+
+  surrogates[0] = U16_LEAD (character);
+  surrogates[1] = U16_TRAIL (character);
+
+  return true;
+}
+
+Boolean
+CFStringIsSurrogateHighCharacter (UniChar character)
+{
+  return (Boolean) U16_IS_LEAD (character);
+}
+
+Boolean
+CFStringIsSurrogateLowCharacter (UniChar character)
+{
+  return (Boolean) U16_IS_TRAIL (character);
+}
+
+/* Numbers are read in place from strings with 8-bit or UTF-16 contents.
+   Other strings are copied, first only enough for most numbers and then
+   all of the range if the number might continue past that. */
+#define CFSTRING_SCAN_BUFFER_SIZE 64
+
+static CFRange
+CFStringScanNumber (CFStringRef str, CFRange range, SInt64 *intValue,
+                    double *doubleValue, Boolean *overflow)
+{
+  UniChar buffer[CFSTRING_SCAN_BUFFER_SIZE];
+  const UInt8 *bytes;
+  const UniChar *chars;
+  UniChar *allocated;
+  CFIndex length;
+  CFIndex skip;
+  CFIndex len;
+  Boolean over;
+
+  bytes = NULL;
+  chars = NULL;
+  allocated = NULL;
+  length = range.length;
+  if (!CF_IS_OBJC (_kCFStringTypeID, str) && !CFStringIsUTF8 (str)
+      && CFStringGetRope (str) == NULL)
+    {
+      if (CFStringIsUnicode (str))
+        chars = (const UniChar *) str->_contents + range.location;
+      else
+        bytes = (const UInt8 *) str->_contents + range.location;
+    }
+  else
+    {
+      length = GS_MIN (range.length, CFSTRING_SCAN_BUFFER_SIZE);
+      CFStringGetCharacters (str, CFRangeMake (range.location, length),
+                             buffer);
+      chars = buffer;
+    }
+
+  for (;;)
+    {
+      for (skip = 0; skip < length; ++skip)
+        {
+          UniChar c = bytes != NULL ? bytes[skip] : chars[skip];
+
+          if (c != ' ' && (c < '\t' || c > '\r'))
+            break;
+        }
+      if (intValue != NULL)
+        len = GSStrtoll (bytes != NULL ? bytes + skip : NULL,
+                         chars != NULL ? chars + skip : NULL,
+                         length - skip, intValue, &over);
+      else
+        len = GSStrtod (bytes != NULL ? bytes + skip : NULL,
+                        chars != NULL ? chars + skip : NULL,
+                        length - skip, doubleValue, &over);
+
+      if (chars != buffer || skip + len < length || length == range.length)
+        break;
+      allocated = CFAllocatorAllocate (kCFAllocatorSystemDefault,
+                                       range.length * sizeof (UniChar), 0);
+      CFStringGetCharacters (str, range, allocated);
+      chars = allocated;
+      length = range.length;
+    }
+
+  if (allocated != NULL)
+    CFAllocatorDeallocate (kCFAllocatorSystemDefault, allocated);
+  if (overflow)
+    *overflow = len > 0 && over;
+
+  return len > 0 ? CFRangeMake (range.location + skip, len)
+    : CFRangeMake (range.location, 0);
+}
+
+CFRange
+CFStringScanIntValue (CFStringRef str, CFRange range, SInt64 *value,
+                      Boolean *overflow)
+{
+  return CFStringScanNumber (str, range, value, NULL, overflow);
+}
+
+CFRange
+CFStringScanDoubleValue (CFStringRef str, CFRange range, double *value,
+                         Boolean *overflow)
+{
+  return CFStringScanNumber (str, range, NULL, value, overflow);
+}
+
+double
+CFStringGetDoubleValue (CFStringRef str)
+{
+  double d;
+  CFRange r;
+
+  r = CFStringScanNumber (str, CFRangeMake (0, CFStringGetLength (str)),
+                          NULL, &d, NULL);
+  return r.length > 0 ? d : 0.0;
+}
+
+SInt32
+CFStringGetIntValue (CFStringRef str)
+{
+  SInt64 i;
+  CFRange r;
+
+  r = CFStringScanNumber (str, CFRangeMake (0, CFStringGetLength (str)),
+                          &i, NULL, NULL);
+  if (r.length == 0)
+    return 0;
+  if (i > INT_MAX)
+    return INT_MAX;
+  if (i < INT_MIN)
+    return INT_MIN;
+  return (SInt32) i;
+}
+
+
+
+/* CFMutableString functions start here. 
+   
+   All mutable string instances are Unicode.  This makes it
+   easier to use the ICU functions. */
+
+/* This function is used to grow the size of a CFMutableString buffer.
+   The string's buffer will grow to (newCapacity * sizeof(UniChar)).
+   On return, oldContentBuffer will point to the old data.  If this value
+   is not provided, the old content buffer is freed and data will be lost. */
+static Boolean
+CFStringCheckCapacityAndGrow (CFMutableStringRef str, CFIndex newCapacity,
+                              void **oldContentBuffer)
+{
+  void *currentContents;
+  void *newContents;
+  struct __CFMutableString *mStr = (struct __CFMutableString *) str;
+
+  if (mStr->_capacity >= newCapacity)
+    {
+      if (oldContentBuffer)
+        *oldContentBuffer = str->_contents;
+      return true;
+    }
+
+  currentContents = mStr->_contents;
+
+  newContents = CFAllocatorAllocate (mStr->_allocator,
+                                     (newCapacity * sizeof (UniChar)), 0);
+  if (newContents == NULL)
+    return false;
+  mStr->_contents = newContents;
+  mStr->_capacity = newCapacity;
+
+  if (oldContentBuffer)
+    *oldContentBuffer = currentContents;
+  else
+    CFAllocatorDeallocate (mStr->_allocator, currentContents);
+
+  return true;
 }
 
-CFStringRef
-CFStringCreateWithCharactersNoCopy (CFAllocatorRef alloc,
-                                    const UniChar * chars, CFIndex numChars,
-                                    CFAllocatorRef contentsDeallocator)
-{
-  return CFStringCreateWithBytesNoCopy (alloc, (const UInt8 *) chars,
-                                        numChars * sizeof (UniChar),
-                                        kCFStringEncodingUnicode, false,
-                                        contentsDeallocator);
-}
+#define DEFAULT_STRING_CAPACITY 16
 
-CFStringRef
-CFStringCreateWithCString (CFAllocatorRef alloc, const char *cStr,
-                           CFStringEncoding encoding)
+/* Moves the characters of a string kept in a rope back into one
+   buffer. */
+static void
+CFStringFlatten (CFMutableStringRef str)
 {
-  CFIndex len = strlen (cStr);
-  return CFStringCreateWithBytes (alloc, (const UInt8 *) cStr, len, encoding,
-                                  false);
+  struct __CFMutableString *mStr = (struct __CFMutableString *) str;
+  UniChar *contents;
+  CFIndex length;
+  CFIndex capacity;
+
+  length = GSRopeGetLength (mStr->_rope);
+  capacity = length < DEFAULT_STRING_CAPACITY
+    ? DEFAULT_STRING_CAPACITY : length;
+  contents = CFAllocatorAllocate (mStr->_allocator,
+                                  capacity * sizeof (UniChar), 0);
+  if (contents == NULL)
+    return;
+  GSRopeGetCharacters (mStr->_rope, CFRangeMake (0, length), contents);
+  GSRopeDestroy (mStr->_rope);
+  mStr->_rope = NULL;
+  mStr->_contents = contents;
+  mStr->_capacity = capacity;
 }
 
-CFStringRef
-CFStringCreateWithCStringNoCopy (CFAllocatorRef alloc, const char *cStr,
-                                 CFStringEncoding encoding,
-                                 CFAllocatorRef contentsDeallocator)
+void
+GSStringFlatten (CFStringRef str)
 {
-  CFIndex len = strlen (cStr);
-  return CFStringCreateWithBytesNoCopy (alloc, (const UInt8 *) cStr, len,
-                                        encoding, false, contentsDeallocator);
+  if (CFStringGetRope (str))
+    CFStringFlatten ((CFMutableStringRef) str);
 }
 
-CFStringRef
-CFStringCreateWithFormat (CFAllocatorRef alloc, CFDictionaryRef formatOptions,
-                          CFStringRef format, ...)
+/* Returns true if replacing range with length characters should be done
+   on a rope, moving the string to one if needed.  Large strings go to a
+   rope on the first edit that would otherwise move characters around,
+   which excludes edits at the end of a buffer with room to spare. */
+static Boolean
+CFStringUseRope (CFMutableStringRef str, CFRange range, CFIndex length)
 {
-  CFStringRef result;
-  va_list args;
+  struct __CFMutableString *mStr = (struct __CFMutableString *) str;
+  CFIndex newLength;
+  GSRopeRef rope;
 
-  va_start (args, format);
-  result =
-    CFStringCreateWithFormatAndArguments (alloc, formatOptions, format, args);
-  va_end (args);
+  if (mStr->_rope != NULL)
+    return true;
 
-  return result;
+  newLength = mStr->_count - range.length + length;
+  if (newLength < CFSTRING_ROPE_THRESHOLD
+      || (range.location + range.length == mStr->_count
+          && newLength <= mStr->_capacity))
+    return false;
+
+  rope = GSRopeCreate (mStr->_allocator, mStr->_contents, mStr->_count);
+  if (rope == NULL)
+    return false;
+  CFAllocatorDeallocate (mStr->_allocator, mStr->_contents);
+  mStr->_contents = NULL;
+  mStr->_capacity = 0;
+  mStr->_rope = rope;
+
+  return true;
 }
 
-CFStringRef
-CFStringCreateWithFormatAndArguments (CFAllocatorRef alloc,
-                                      CFDictionaryRef formatOptions,
-                                      CFStringRef format, va_list arguments)
+static void
+CFStringRopeReplace (CFMutableStringRef str, CFRange range,
+                     const UniChar * chars, CFIndex length)
 {
-  Boolean free_fmt_str = false;
-  CFIndex str_len;
-  CFIndex fmt_str_len;
-  UniChar buf[BUFFER_SIZE];
-  UniChar *str = buf;
-  const UniChar *fmt_str;
-  CFStringRef fmted_str;
+  struct __CFMutableString *mStr = (struct __CFMutableString *) str;
 
-  fmt_str_len = CFStringGetLength (format);
-  fmt_str = CFStringGetCharactersPtr (format);
-  if (fmt_str == 0)
-    {
-      CFRange range;
+  GSRopeReplace (mStr->_rope, range, chars, length);
+  mStr->_count = GSRopeGetLength (mStr->_rope);
+  mStr->_hash = 0;
 
-      free_fmt_str = true;
-      fmt_str = CFAllocatorAllocate (kCFAllocatorSystemDefault,
-                                     fmt_str_len * sizeof (UniChar), 0);
-      range = CFRangeMake (0, fmt_str_len);
-      CFStringGetCharacters (format, range, (UniChar *) fmt_str);
-    }
-  str_len = GSUnicodeFormatWithArguments (str, BUFFER_SIZE, formatOptions,
-                                          fmt_str, fmt_str_len, arguments);
-  if (str_len > BUFFER_SIZE)
-    {
-      /* The buffer was not long enough for the formatted string, so we will
-       * need to allocate a longer buffer and try again.
-       */
-      str = CFAllocatorAllocate (kCFAllocatorSystemDefault,
-                                 str_len * sizeof (UniChar), 0);
-      str_len = GSUnicodeFormatWithArguments (str, str_len, formatOptions,
-                                              fmt_str, fmt_str_len,
-                                              arguments);
+  /* Go back to a single buffer once the string is small again. */
+  if (mStr->_count < CFSTRING_ROPE_THRESHOLD / 2)
+    CFStringFlatten (str);
+}
 
-    }
-  if (str_len < 0)
-    return NULL;
+#define CFSTRING_INIT_MUTABLE(str) do \
+{ \
+  ((CFRuntimeBase *)str)->_flags.info = 0xFF \
+    & (_kCFStringIsMutable | _kCFStringIsUnicode | _kCFStringHasNullByte); \
+} while(0)
 
-  fmted_str = CFStringCreateWithCharacters (alloc, (const UniChar *) str,
-                                            str_len);
-  if (free_fmt_str)
-    CFAllocatorDeallocate (kCFAllocatorSystemDefault, (void *) fmt_str);
-  if (str != buf)
-    CFAllocatorDeallocate (kCFAllocatorSystemDefault, str);
+CFMutableStringRef
+CFStringCreateMutable (CFAllocatorRef alloc, CFIndex maxLength)
+{
+  struct __CFMutableString *new;
 
-  return fmted_str;
-}
+  new = (struct __CFMutableString *) _CFRuntimeCreateInstance (alloc,
+                                                               _kCFStringTypeID,
+                                                               sizeof (struct
+                                                                       __CFMutableString)
+                                                               -
+                                                               sizeof
+                                                               (CFRuntimeBase),
+                                                               NULL);
 
-CFStringRef
-CFStringCreateWithSubstring (CFAllocatorRef alloc, CFStringRef str,
-                             CFRange range)
-{
-  void *contents;
-  CFIndex len;
-  CFStringEncoding enc;
+  new->_capacity =
+    maxLength < DEFAULT_STRING_CAPACITY ? DEFAULT_STRING_CAPACITY : maxLength;
+  new->_allocator = alloc ? alloc : CFAllocatorGetDefault ();
+  new->_contents = CFAllocatorAllocate (new->_allocator,
+                                        new->_capacity * sizeof (UniChar), 0);
 
-  if (CFStringIsUnicode (str))
-    {
-      enc = kCFStringEncodingUnicode;
-      len = range.length * sizeof (UniChar);
-      contents = ((UniChar *) str->_contents) + range.location;
-    }
-  else
-    {
-      enc = kCFStringEncodingASCII;
-      len = range.length;
-      contents = ((char *) str->_contents) + range.location;
-    }
+  CFSTRING_INIT_MUTABLE (new);
 
-  return CFStringCreateWithBytes (alloc, (const UInt8 *) contents, len, enc,
-                                  false);
+  return (CFMutableStringRef) new;
 }
 
-CFDataRef
-CFStringCreateExternalRepresentation (CFAllocatorRef alloc,
-                                      CFStringRef str,
-                                      CFStringEncoding encoding,
-                                      UInt8 lossByte)
+CFMutableStringRef
+CFStringCreateMutableCopy (CFAllocatorRef alloc, CFIndex maxLength,
+                           CFStringRef str)
 {
-  UInt8 *buffer;
-  CFRange range;
-  CFIndex converted;
-  CFIndex strLen;
-  CFIndex len;
-  CFIndex usedLen = 0;
-
-  strLen = CFStringGetLength (str);
-  range = CFRangeMake (0, strLen);
-  converted = CFStringGetBytes (str, range, encoding, lossByte, true, NULL, 0, &len);
-  if (converted == 0)
-    return NULL;
-  len += 1;             /* include space for a NULL byte. */
+  CFMutableStringRef new;
+  CFIndex textLen;
+  CFIndex capacity;
 
-  buffer = CFAllocatorAllocate (alloc, len, 0);
+  textLen = CFStringGetLength (str);
+  capacity = textLen;
+  if (maxLength > capacity)
+    capacity = maxLength;
+  new = (CFMutableStringRef) CFStringCreateMutable (alloc, capacity);
 
-  converted = CFStringGetBytes (str, range, encoding, lossByte,
-                                true, buffer, len, &usedLen);
+  CFStringGetCharacters (str, CFRangeMake (0, textLen),
+                         (UniChar *) new->_contents);
+  new->_count = textLen;
 
-  if (converted == 0)
-    {
-      CFAllocatorDeallocate (alloc, buffer);
-      return NULL;
-    }
+  CFSTRING_INIT_MUTABLE (new);
 
-  return CFDataCreateWithBytesNoCopy (alloc, buffer, usedLen, alloc);
+  return new;
 }
 
-const UniChar *
-CFStringGetCharactersPtr (CFStringRef str)
+CFMutableStringRef
+CFStringCreateMutableWithExternalCharactersNoCopy (CFAllocatorRef alloc,
+                                                   UniChar * chars,
+                                                   CFIndex numChars,
+                                                   CFIndex capacity,
+                                                   CFAllocatorRef
+                                                   externalCharactersAllocator)
 {
-  if (!CF_IS_OBJC (_kCFStringTypeID, str) && CFStringIsUnicode (str))
-    return str->_contents;
-
-  return NULL;
+  return NULL;                  /* FIXME */
 }
 
-const char *
-CFStringGetCStringPtr (CFStringRef str, CFStringEncoding enc)
+void
+CFStringSetExternalCharactersNoCopy (CFMutableStringRef str, UniChar * chars,
+                                     CFIndex length, CFIndex capacity)
 {
-  CF_OBJC_FUNCDISPATCHV (_kCFStringTypeID, const char *, str,
-                         "cStringUsingEncoding:",
-                         CFStringConvertEncodingToNSStringEncoding (enc));
+  return;                       /* FIXME */
+}
+
+/* Options CFStringFindAndReplace () handles with its own matcher.  The
+   others are left to CFStringFindWithOptions (). */
+#define CFSTRING_LITERAL_FIND_OPTIONS \
+  (kCFCompareBackwards | kCFCompareAnchored | kCFCompareCaseInsensitive)
 
-  return (!CFStringIsUnicode (str)
-          && __CFStringEncodingIsSupersetOfASCII (enc)) ? str->
-    _contents : NULL;
+CF_INLINE UniChar
+CFStringFoldCase (UniChar c)
+{
+  if (c < 0x80)
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+  return (UniChar) u_foldCase (c, U_FOLD_CASE_DEFAULT);
 }
 
-CFIndex
-CFStringGetBytes (CFStringRef str, CFRange range, CFStringEncoding enc,
-                  UInt8 lossByte, Boolean isExtRep, UInt8 * buffer,
-                  CFIndex maxBufLen, CFIndex * usedBufLen)
+/* Finds the non-overlapping matches of find in text with a Horspool search,
+   going from the end if backwards is set.  Case insensitive matching uses
+   simple case folding of each UTF-16 unit, so a match always has the length
+   of find, which must already be folded.  The matches are appended to
+   *matches in the order they are found.  Returns the number of matches. */
+static CFIndex
+CFStringFindLiteralMatches (const UniChar *text, CFIndex textLength,
+                            const UniChar *find, CFIndex findLength,
+                            CFOptionFlags options, CFIndex **matches,
+                            CFIndex *capacity)
 {
-  UInt8 *bufferStart;
-  const UniChar *sUnicode;
-  CFIndex converted;
+  CFIndex shift[256];
+  CFIndex count;
+  CFIndex pos;
+  CFIndex idx;
+  Boolean backwards = (options & kCFCompareBackwards) != 0;
+  Boolean anchored = (options & kCFCompareAnchored) != 0;
+  Boolean fold = (options & kCFCompareCaseInsensitive) != 0;
 
-  if (CF_IS_OBJC (_kCFStringTypeID, str))
+  if (findLength > textLength)
+    return 0;
+
+  /* The shift lines up the character at the end of the window (the start
+     when going backwards) with its nearest other occurrence in find. */
+  for (idx = 0; idx < 256; ++idx)
+    shift[idx] = findLength;
+  if (backwards)
     {
-      /* Boolean b; */
-      uintptr_t opts = 0;
+      for (idx = findLength - 1; idx > 0; --idx)
+        shift[find[idx] & 0xFF] = idx;
+    }
+  else
+    {
+      for (idx = 0; idx < findLength - 1; ++idx)
+        shift[find[idx] & 0xFF] = findLength - 1 - idx;
+    }
 
-      if (lossByte != 0)
-        opts |= 1;              /* NSStringEncodingConversionAllowLossy */
-      if (isExtRep != 0)
-        opts |= 2;              /*NSStringEncodingConversionExternalRepresentation */
+  count = 0;
+  pos = backwards ? textLength - findLength : 0;
+  while (pos >= 0 && pos <= textLength - findLength)
+    {
+      UniChar c;
+      CFIndex test;
+      Boolean found;
+
+      test = backwards ? pos : pos + findLength - 1;
+      c = fold ? CFStringFoldCase (text[test]) : text[test];
+      found = false;
+      if (c == find[test - pos])
+        {
+          found = true;
+          for (idx = 0; idx < findLength && found; ++idx)
+            {
+              UniChar t = fold ? CFStringFoldCase (text[pos + idx])
+                : text[pos + idx];
 
-      // FIXME: Base's NSString doesn't implement getBytes:... yet!
-      *usedBufLen = 0;
-      return 0;
+              found = t == find[idx];
+            }
+        }
 
-      /*
-         CF_OBJC_CALLV (Boolean, b, str,
-         "getBytes:maxLength:usedLength:encoding:options:range:remainingRange:",
-         buffer, maxBufLen, usedBufLen,
-         CFStringConvertEncodingToNSStringEncoding (enc), opts,
-         range, NULL);
+      if (found)
+        {
+          if (count == *capacity)
+            {
+              *capacity = *capacity * 2 + 16;
+              *matches = CFAllocatorReallocate (kCFAllocatorSystemDefault,
+                                                *matches,
+                                                *capacity * sizeof (CFIndex),
+                                                0);
+            }
+          (*matches)[count++] = pos;
+        }
+      if (anchored)
+        break;
+      if (found)
+        pos += backwards ? -findLength : findLength;
+      else
+        pos += backwards ? -shift[c & 0xFF] : shift[c & 0xFF];
+    }
 
-         return b ? *usedBufLen : 0;
-       */
+  return count;
+}
+
+CFIndex
+CFStringFindAndReplace (CFMutableStringRef str, CFStringRef stringToFind,
+                        CFStringRef replacementString, CFRange rangeToSearch,
+                        CFOptionFlags compareOptions)
+{
+  CF_OBJC_FUNCDISPATCHV (_kCFStringTypeID, CFIndex, str,
+                         "replaceOccurrencesOfString:withString:options:range:",
+                         stringToFind, replacementString, compareOptions,
+                         rangeToSearch);
+
+  const UniChar *text;
+  UniChar *textCopy;
+  UniChar *find;
+  UniChar *replacement;
+  UniChar *result;
+  UniChar *cur;
+  CFIndex *matches;
+  CFIndex *lengths;
+  CFIndex capacity;
+  CFIndex findLength;
+  CFIndex repLength;
+  CFIndex resultLength;
+  CFIndex count;
+  CFIndex last;
+  CFIndex idx;
+  CFStringRef segment;
+
+  findLength = CFStringGetLength (stringToFind);
+  if (findLength == 0 || rangeToSearch.length < findLength)
+    return 0;
+  repLength = CFStringGetLength (replacementString);
+
+  /* Everything is copied out first, as either string may be str. */
+  find = CFAllocatorAllocate (kCFAllocatorSystemDefault,
+                              (findLength + repLength) * sizeof (UniChar), 0);
+  replacement = find + findLength;
+  CFStringGetCharacters (stringToFind, CFRangeMake (0, findLength), find);
+  CFStringGetCharacters (replacementString, CFRangeMake (0, repLength),
+                         replacement);
+
+  text = __CFStringGetContiguousCharactersPtr (str);
+  textCopy = NULL;
+  if (text != NULL)
+    {
+      text += rangeToSearch.location;
+    }
+  else
+    {
+      textCopy = CFAllocatorAllocate (kCFAllocatorSystemDefault,
+                                      rangeToSearch.length * sizeof (UniChar),
+                                      0);
+      CFStringGetCharacters (str, rangeToSearch, textCopy);
+      text = textCopy;
     }
 
-  bufferStart = buffer;
-  sUnicode = CFStringGetCharactersPtr (str);
-
-  if (sUnicode)
+  /* Find all matches first.  Their locations are relative to the search
+     range, and lengths is only needed if they can differ from findLength. */
+  matches = NULL;
+  lengths = NULL;
+  capacity = 0;
+  if ((compareOptions & ~CFSTRING_LITERAL_FIND_OPTIONS) == 0)
     {
-      const UniChar *sUnicodeStart;
-      const UniChar *sLimit;
-
-      sUnicodeStart = sUnicode + range.location;
-      sUnicode = sUnicodeStart;
-      sLimit = sUnicodeStart + range.length;
-      /* It is safe to discard the return value in this case. */
-      GSUnicodeToEncoding (&buffer, buffer + maxBufLen, enc, &sUnicode,
-                           sLimit, lossByte, isExtRep);
-      converted = sUnicode - sUnicodeStart;
+      if (compareOptions & kCFCompareCaseInsensitive)
+        for (idx = 0; idx < findLength; ++idx)
+          find[idx] = CFStringFoldCase (find[idx]);
+      count = CFStringFindLiteralMatches (text, rangeToSearch.length, find,
+                                          findLength, compareOptions,
+                                          &matches, &capacity);
     }
-  else if (__CFStringEncodingIsSupersetOfASCII (enc))
+  else
     {
-      const char *sCString;
+      CFRange search = rangeToSearch;
+      CFRange found;
+      CFIndex end = rangeToSearch.location + rangeToSearch.length;
+
+      count = 0;
+      while (search.length > 0
+             && CFStringFindWithOptions (str, stringToFind, search,
+                                         compareOptions, &found)
+             && found.length > 0)
+        {
+          if ((compareOptions & kCFCompareAnchored)
+              && ((compareOptions & kCFCompareBackwards)
+                  ? found.location + found.length != end
+                  : found.location != search.location))
+            break;
+          if (count == capacity)
+            {
+              capacity = capacity * 2 + 16;
+              matches = CFAllocatorReallocate (kCFAllocatorSystemDefault,
+                                               matches,
+                                               capacity * sizeof (CFIndex), 0);
+              lengths = CFAllocatorReallocate (kCFAllocatorSystemDefault,
+                                               lengths,
+                                               capacity * sizeof (CFIndex), 0);
+            }
+          matches[count] = found.location - rangeToSearch.location;
+          lengths[count] = found.length;
+          ++count;
+          if (compareOptions & kCFCompareAnchored)
+            break;
+          if (compareOptions & kCFCompareBackwards)
+            {
+              search.length = found.location - search.location;
+            }
+          else
+            {
+              search.location = found.location + found.length;
+              search.length = end - search.location;
+            }
+        }
+    }
 
-      sCString = CFStringGetCStringPtr (str, kCFStringEncodingASCII);
-      if (sCString)
+  if (count > 0)
+    {
+      /* Put the matches in order, then build the new contents of the
+         range in one buffer and replace the range with it. */
+      if (compareOptions & kCFCompareBackwards)
         {
-          sCString += range.location;
-          converted = range.length > maxBufLen ? maxBufLen : range.length;
-          GSMemoryCopy (buffer, sCString, converted);
-          buffer += converted;
+          for (idx = 0; idx < count / 2; ++idx)
+            {
+              CFIndex tmp = matches[idx];
+
+              matches[idx] = matches[count - 1 - idx];
+              matches[count - 1 - idx] = tmp;
+              if (lengths != NULL)
+                {
+                  tmp = lengths[idx];
+                  lengths[idx] = lengths[count - 1 - idx];
+                  lengths[count - 1 - idx] = tmp;
+                }
+            }
         }
-      else
+
+      resultLength = rangeToSearch.length + count * repLength;
+      for (idx = 0; idx < count; ++idx)
+        resultLength -= lengths != NULL ? lengths[idx] : findLength;
+      /* One extra character so that an empty result is not a zero sized
+         allocation. */
+      result = CFAllocatorAllocate (kCFAllocatorSystemDefault,
+                                    (resultLength + 1) * sizeof (UniChar), 0);
+
+      cur = result;
+      last = 0;
+      for (idx = 0; idx < count; ++idx)
         {
-          converted = 0;
+          memcpy (cur, text + last, (matches[idx] - last) * sizeof (UniChar));
+          cur += matches[idx] - last;
+          memcpy (cur, replacement, repLength * sizeof (UniChar));
+          cur += repLength;
+          last = matches[idx] + (lengths != NULL ? lengths[idx] : findLength);
         }
+      memcpy (cur, text + last,
+              (rangeToSearch.length - last) * sizeof (UniChar));
+
+      segment = CFStringCreateWithCharactersNoCopy (kCFAllocatorSystemDefault,
+                                                    result, resultLength,
+                                                    kCFAllocatorSystemDefault);
+      CFStringReplace (str, rangeToSearch, segment);
+      CFRelease (segment);
     }
-  else if (enc == kCFStringEncodingUnicode)
-    {
-      range.length =
-        range.length >
-        (maxBufLen / sizeof (UniChar)) ? maxBufLen /
-        sizeof (UniChar) : range.length;
-      CFStringGetCharacters (str, range, (UniChar *) buffer);
-      buffer += range.length * sizeof (UniChar);
-      converted = range.length;
-    }
-  if (usedBufLen)
-    *usedBufLen = buffer - bufferStart;
 
-  return converted;             /* FIXME */
+  if (matches != NULL)
+    CFAllocatorDeallocate (kCFAllocatorSystemDefault, matches);
+  if (lengths != NULL)
+    CFAllocatorDeallocate (kCFAllocatorSystemDefault, lengths);
+  if (textCopy != NULL)
+    CFAllocatorDeallocate (kCFAllocatorSystemDefault, textCopy);
+  CFAllocatorDeallocate (kCFAllocatorSystemDefault, find);
+
+  return count;
 }
 
-void
-CFStringGetCharacters (CFStringRef str, CFRange range, UniChar * buffer)
+Boolean
+CFStringFindCharacterFromSet (CFStringRef str, CFCharacterSetRef theSet,
+                              CFRange rangeToSearch,
+                              CFStringCompareFlags searchOptions,
+                              CFRange *result)
 {
-  CF_OBJC_FUNCDISPATCHV (_kCFStringTypeID, void, str,
-                         "getCharacters:range:", buffer, range);
+  const UInt8 *bytes;
+  const UniChar *chars;
+  UniChar *allocated;
+  Boolean backwards;
+  CFIndex offset;
+  CFIndex length;
+  CFIndex found;
+  CFIndex len;
 
-  if (CFStringIsUnicode (str))
+  bytes = NULL;
+  chars = NULL;
+  allocated = NULL;
+  if (!CF_IS_OBJC (_kCFStringTypeID, str) && !CFStringIsUTF8 (str)
+      && CFStringGetRope (str) == NULL)
     {
-      memcpy (buffer, ((UniChar *) str->_contents) + range.location,
-              range.length * sizeof (UniChar));
+      if (CFStringIsUnicode (str))
+        chars = (const UniChar *) str->_contents + rangeToSearch.location;
+      else
+        bytes = (const UInt8 *) str->_contents + rangeToSearch.location;
     }
   else
     {
-      UInt8 *c;
-      UInt8 *stop;
-
-      c = str->_contents + range.location;
-      stop = c + range.length;
-      while (c < stop)
-        *buffer++ = *c++;
+      allocated = CFAllocatorAllocate (kCFAllocatorSystemDefault,
+                                       rangeToSearch.length * sizeof (UniChar),
+                                       0);
+      CFStringGetCharacters (str, rangeToSearch, allocated);
+      chars = allocated;
     }
-}
-
-Boolean
-CFStringGetCString (CFStringRef str, char *buffer, CFIndex bufferSize,
-                    CFStringEncoding encoding)
-{
-  CFIndex len = CFStringGetLength (str);
-  CFIndex used;
-
-  CF_OBJC_FUNCDISPATCHV (_kCFStringTypeID, Boolean, str,
-                         "getCString:maxLength:encoding:", buffer, bufferSize,
-                         CFStringConvertEncodingToNSStringEncoding
-                         (encoding));
 
-  if (CFStringGetBytes (str, CFRangeMake (0, len), encoding, 0, false,
-                        (UInt8 *) buffer, bufferSize, &used) == len
-      && used <= len)
+  /* An anchored search only looks at the character at the start, or at the
+     end if searching backwards, which may be a surrogate pair. */
+  backwards = searchOptions & kCFCompareBackwards ? true : false;
+  offset = 0;
+  length = rangeToSearch.length;
+  if (searchOptions & kCFCompareAnchored)
     {
-      buffer[used] = '\0';
-      return true;
+      length = GS_MIN (length, 2);
+      if (backwards)
+        offset = rangeToSearch.length - length;
     }
 
-  return false;
-}
-
-Boolean
-CFStringGetFileSystemRepresentation (CFStringRef string, char *buffer,
-                                     CFIndex maxBufLen)
-{
-  /* FIXME */
-  return CFStringGetCString (string, buffer, maxBufLen,
-                             CFStringGetSystemEncoding ());
-}
+  len = 1;
+  if (bytes != NULL)
+    found = GSCharacterSetFindLatin1 (theSet, bytes + offset, length,
+                                      backwards);
+  else
+    found = GSCharacterSetFindCharacters (theSet, chars + offset, length,
+                                          backwards, &len);
+  if (found != kCFNotFound && (searchOptions & kCFCompareAnchored)
+      && (backwards ? found + len != length : found != 0))
+    found = kCFNotFound;
 
+  if (allocated != NULL)
+    CFAllocatorDeallocate (kCFAllocatorSystemDefault, allocated);
 
-UniChar
-CFStringGetCharacterAtIndex (CFStringRef str, CFIndex idx)
-{
-  CF_OBJC_FUNCDISPATCHV (_kCFStringTypeID, UniChar, str,
-                         "characterAtIndex:", idx);
-  return CFStringIsUnicode (str) ? ((UniChar *) str->_contents)[idx] :
-    ((UInt8 *) str->_contents)[idx];
+  if (found == kCFNotFound)
+    return false;
+  if (result != NULL)
+    *result = CFRangeMake (rangeToSearch.location + offset + found, len);
+  return true;
 }
 
-CFIndex
-CFStringGetLength (CFStringRef str)
+/* Finds the first line ending in range, or the last one if backwards is
+   true.  Paragraphs do not end at U+0085 or U+2028, which end lines.
+   Strings in UTF-16 or 8-bit storage are searched where they are; others
+   are copied a piece at a time. */
+static CFIndex
+CFStringFindNewline (CFStringRef str, CFRange range, Boolean paragraph,
+                     Boolean backwards)
 {
-  CF_OBJC_FUNCDISPATCHV (_kCFStringTypeID, CFIndex, str, "length");
-  return str->_count;
-}
+  UniChar buffer[BUFFER_SIZE];
+  const UInt8 *bytes;
+  const UniChar *chars;
+  CFIndex start;
+  CFIndex end;
+  CFIndex found;
+  CFIndex offset;
+  CFIndex n;
+  UniChar c;
 
-CFRange
-CFStringGetRangeOfComposedCharactersAtIndex (CFStringRef str,
-                                             CFIndex theIndex)
-{
-  CF_OBJC_FUNCDISPATCHV (_kCFStringTypeID, CFRange, str,
-                         "rangeOfComposedCharacterSequenceAtIndex:",
-                         theIndex);
+  bytes = NULL;
+  chars = NULL;
+  if (!CF_IS_OBJC (_kCFStringTypeID, str) && !CFStringIsUTF8 (str)
+      && CFStringGetRope (str) == NULL)
+    {
+      if (CFStringIsUnicode (str))
+        chars = str->_contents;
+      else
+        bytes = str->_contents;
+    }
 
-  if (CFStringIsUnicode (str))
+  start = range.location;
+  end = range.location + range.length;
+  while (start < end)
     {
-      CFIndex len = 1;
-      UniChar *characters = ((UniChar *) str->_contents) + theIndex;
-      if (U16_IS_SURROGATE (*characters))
+      if (bytes != NULL)
         {
-          len = 2;
-          if (U16_IS_SURROGATE_TRAIL (*characters))
-            theIndex -= 1;
+          found = GSNewlineFind (bytes + start, end - start, backwards);
+          if (found == kCFNotFound)
+            return kCFNotFound;
+          found += start;
+          c = bytes[found];
+        }
+      else if (chars != NULL)
+        {
+          found = GSNewlineFind16 (chars + start, end - start, backwards);
+          if (found == kCFNotFound)
+            return kCFNotFound;
+          found += start;
+          c = chars[found];
+        }
+      else
+        {
+          n = GS_MIN (end - start, BUFFER_SIZE);
+          offset = backwards ? end - n : start;
+          CFStringGetCharacters (str, CFRangeMake (offset, n), buffer);
+          found = GSNewlineFind16 (buffer, n, backwards);
+          if (found == kCFNotFound)
+            {
+              if (backwards)
+                end = offset;
+              else
+                start = offset + n;
+              continue;
+            }
+          c = buffer[found];
+          found += offset;
         }
 
-      return CFRangeMake (theIndex, len);
+      if (!paragraph || (c != 0x85 && c != 0x2028))
+        return found;
+      if (backwards)
+        end = found;
+      else
+        start = found + 1;
     }
 
-  return CFRangeMake (theIndex, 1);
+  return kCFNotFound;
 }
 
-UTF32Char
-CFStringGetLongCharacterForSurrogatePair (UniChar surrogateHigh,
-                                          UniChar surrogateLow)
+/* Returns the index after the line ending at idx, which is two characters
+   long for CR LF. */
+CF_INLINE CFIndex
+CFStringNewlineEnd (CFStringRef str, CFIndex idx, CFIndex length)
 {
-  return (UTF32Char) U16_GET_SUPPLEMENTARY (surrogateHigh, surrogateLow);
+  if (idx + 1 < length && CFStringGetCharacterAtIndex (str, idx) == '\r'
+      && CFStringGetCharacterAtIndex (str, idx + 1) == '\n')
+    return idx + 2;
+
+  return idx + 1;
 }
 
-Boolean
-CFStringGetSurrogatePairForLongCharacter (UTF32Char character,
-                                          UniChar * surrogates)
+static void
+CFStringGetBounds (CFStringRef str, CFRange range, Boolean paragraph,
+                   CFIndex * beginIndex, CFIndex * endIndex,
+                   CFIndex * contentsEndIndex)
 {
-  if (character > 0x10000)
-    return false;
+  CFIndex length;
+  CFIndex idx;
+  CFIndex found;
+  CFIndex end;
+  CFIndex contentsEnd;
 
-  surrogates[0] = U16_LEAD (character);
-  surrogates[1] = U16_TRAIL (character);
+  length = CFStringGetLength (str);
+  if (beginIndex != NULL)
+    {
+      /* A location between CR and LF belongs to the line they end. */
+      idx = range.location;
+      if (idx > 0 && idx < length
+          && CFStringGetCharacterAtIndex (str, idx) == '\n'
+          && CFStringGetCharacterAtIndex (str, idx - 1) == '\r')
+        idx -= 1;
+      found = CFStringFindNewline (str, CFRangeMake (0, idx), paragraph,
+                                   true);
+      *beginIndex = found == kCFNotFound ? 0 : found + 1;
+    }
 
-  return true;
+  if (endIndex != NULL || contentsEndIndex != NULL)
+    {
+      /* The line ends after the one holding the last character of range. */
+      idx = range.location + range.length;
+      if (range.length > 0)
+        idx -= 1;
+      found = CFStringFindNewline (str, CFRangeMake (idx, length - idx),
+                                   paragraph, false);
+      if (found == kCFNotFound)
+        {
+          end = length;
+          contentsEnd = length;
+        }
+      else
+        {
+          end = CFStringNewlineEnd (str, found, length);
+          contentsEnd = found;
+          if (found == idx && found > 0
+              && CFStringGetCharacterAtIndex (str, found) == '\n'
+              && CFStringGetCharacterAtIndex (str, found - 1) == '\r')
+            contentsEnd -= 1;
+        }
+      if (endIndex != NULL)
+        *endIndex = end;
+      if (contentsEndIndex != NULL)
+        *contentsEndIndex = contentsEnd;
+    }
 }
 
-Boolean
-CFStringIsSurrogateHighCharacter (UniChar character)
+void
+CFStringGetLineBounds (CFStringRef str, CFRange range,
+                       CFIndex * lineBeginIndex, CFIndex * lineEndIndex,
+                       CFIndex * contentsEndIndex)
 {
-  return (Boolean) U16_IS_LEAD (character);
+  CFStringGetBounds (str, range, false, lineBeginIndex, lineEndIndex,
+                     contentsEndIndex);
 }
 
-Boolean
-CFStringIsSurrogateLowCharacter (UniChar character)
+void
+CFStringGetParagraphBounds (CFStringRef str, CFRange range,
+                            CFIndex * parBeginIndex, CFIndex * parEndIndex,
+                            CFIndex * contentsEndIndex)
 {
-  return (Boolean) U16_IS_TRAIL (character);
+  CFStringGetBounds (str, range, true, parBeginIndex, parEndIndex,
+                     contentsEndIndex);
 }
 
-double
-CFStringGetDoubleValue (CFStringRef str)
+/* The indices where lines start are kept for a few large immutable
+   strings, so that finding a line by number, or the line holding a
+   character, is a binary search.  Other strings are scanned each time.
+   An index is made the first time a string is asked about and is dropped
+   when the string is deallocated or a newer index takes its place.
+   _kCFStringLineIndexCount counts the entries in use, so that strings
+   are finalized without taking the lock while the cache is empty. */
+#define CFSTRING_LINE_INDEX_MIN_LENGTH 4096
+#define CFSTRING_LINE_INDEX_CACHE_SIZE 8
+
+typedef struct
 {
-  double d;
-  Boolean success;
-  CFNumberFormatterRef fmt;
-
-  fmt = CFNumberFormatterCreate (NULL, NULL, kCFNumberFormatterDecimalStyle);
-  if (fmt == NULL)
-    return 0.0;
+  CFStringRef str;
+  CFIndex count;
+  CFIndex *starts;
+} CFStringLineIndex;
 
-  success = CFNumberFormatterGetValueFromString (fmt, str, NULL,
-                                                 kCFNumberDoubleType,
-                                                 (void *) &d);
+static CFStringLineIndex
+  _kCFStringLineIndexCache[CFSTRING_LINE_INDEX_CACHE_SIZE];
+static CFIndex _kCFStringLineIndexNext = 0;
+static CFIndex _kCFStringLineIndexCount = 0;
 
-  CFRelease (fmt);
-  return success ? d : 0.0;
+static Boolean
+CFStringLineIndexIsCached (CFStringRef str)
+{
+  return !CFStringIsMutable (str)
+    && str->_count >= CFSTRING_LINE_INDEX_MIN_LENGTH;
 }
 
-SInt32
-CFStringGetIntValue (CFStringRef str)
+/* Must be called with _kCFStringLineIndexLock held. */
+static CFStringLineIndex *
+CFStringLineIndexFind (CFStringRef str)
 {
-  SInt32 i;
-  Boolean success;
-  CFNumberFormatterRef fmt;
-
-  fmt = CFNumberFormatterCreate (NULL, NULL, kCFNumberFormatterNoStyle);
-  if (fmt == NULL)
-    return 0;
+  CFIndex idx;
 
-  success = CFNumberFormatterGetValueFromString (fmt, str, NULL,
-                                                 kCFNumberSInt32Type,
-                                                 (void *) &i);
+  for (idx = 0; idx < CFSTRING_LINE_INDEX_CACHE_SIZE; ++idx)
+    if (_kCFStringLineIndexCache[idx].str == str)
+      return &_kCFStringLineIndexCache[idx];
 
-  CFRelease (fmt);
-  return success ? i : 0;
+  return NULL;
 }
 
-
-
-/* CFMutableString functions start here. 
-   
-   All mutable string instances are Unicode.  This makes it
-   easier to use the ICU functions. */
-
-/* This function is used to grow the size of a CFMutableString buffer.
-   The string's buffer will grow to (newCapacity * sizeof(UniChar)).
-   On return, oldContentBuffer will point to the old data.  If this value
-   is not provided, the old content buffer is freed and data will be lost. */
-static Boolean
-CFStringCheckCapacityAndGrow (CFMutableStringRef str, CFIndex newCapacity,
-                              void **oldContentBuffer)
+static void
+CFStringLineIndexRemove (CFStringRef str)
 {
-  void *currentContents;
-  void *newContents;
-  struct __CFMutableString *mStr = (struct __CFMutableString *) str;
+  CFStringLineIndex *entry;
 
-  if (mStr->_capacity >= newCapacity)
+  /* An index for str was added before its last release, so it cannot be
+     missed here. */
+  if (GSAtomicLoadCFIndex (&_kCFStringLineIndexCount) == 0)
+    return;
+
+  GSMutexLock (&_kCFStringLineIndexLock);
+  entry = CFStringLineIndexFind (str);
+  if (entry != NULL)
     {
-      if (oldContentBuffer)
-        *oldContentBuffer = str->_contents;
-      return true;
+      CFAllocatorDeallocate (kCFAllocatorSystemDefault, entry->starts);
+      entry->str = NULL;
+      entry->count = 0;
+      entry->starts = NULL;
+      GSAtomicDecrementCFIndex (&_kCFStringLineIndexCount);
     }
+  GSMutexUnlock (&_kCFStringLineIndexLock);
+}
 
-  currentContents = mStr->_contents;
-
-  newContents = CFAllocatorAllocate (mStr->_allocator,
-                                     (newCapacity * sizeof (UniChar)), 0);
-  if (newContents == NULL)
-    return false;
-  mStr->_contents = newContents;
-  mStr->_capacity = newCapacity;
+static CFIndex *
+CFStringLineIndexBuild (CFStringRef str, CFIndex * count)
+{
+  CFIndex *starts;
+  CFIndex capacity;
+  CFIndex length;
+  CFIndex found;
+  CFIndex next;
+
+  length = CFStringGetLength (str);
+  capacity = 64;
+  starts = CFAllocatorAllocate (kCFAllocatorSystemDefault,
+                                capacity * sizeof (CFIndex), 0);
+  *count = 0;
+  next = 0;
+  while (next < length)
+    {
+      if (*count == capacity)
+        {
+          capacity *= 2;
+          starts = CFAllocatorReallocate (kCFAllocatorSystemDefault, starts,
+                                          capacity * sizeof (CFIndex), 0);
+        }
+      starts[(*count)++] = next;
 
-  if (oldContentBuffer)
-    *oldContentBuffer = currentContents;
-  else
-    CFAllocatorDeallocate (mStr->_allocator, currentContents);
+      found = CFStringFindNewline (str, CFRangeMake (next, length - next),
+                                   false, false);
+      if (found == kCFNotFound)
+        break;
+      next = CFStringNewlineEnd (str, found, length);
+    }
 
-  return true;
+  return starts;
 }
 
-#define DEFAULT_STRING_CAPACITY 16
-
-#define CFSTRING_INIT_MUTABLE(str) do \
-{ \
-  ((CFRuntimeBase *)str)->_flags.info = 0xFF \
-    & (_kCFStringIsMutable | _kCFStringIsUnicode | _kCFStringHasNullByte); \
-} while(0)
-
-CFMutableStringRef
-CFStringCreateMutable (CFAllocatorRef alloc, CFIndex maxLength)
+enum
 {
-  struct __CFMutableString *new;
+  CFStringLineCount,
+  CFStringLineAtIndex,
+  CFStringLineStart
+};
 
-  new = (struct __CFMutableString *) _CFRuntimeCreateInstance (alloc,
-                                                               _kCFStringTypeID,
-                                                               sizeof (struct
-                                                                       __CFMutableString)
-                                                               -
-                                                               sizeof
-                                                               (CFRuntimeBase),
-                                                               NULL);
+static CFIndex
+CFStringLineIndexQuery (const CFIndex *starts, CFIndex count, int query,
+                        CFIndex value)
+{
+  CFIndex min;
+  CFIndex max;
+  CFIndex mid;
 
-  new->_capacity =
-    maxLength < DEFAULT_STRING_CAPACITY ? DEFAULT_STRING_CAPACITY : maxLength;
-  new->_allocator = alloc ? alloc : CFAllocatorGetDefault ();
-  new->_contents = CFAllocatorAllocate (new->_allocator,
-                                        new->_capacity * sizeof (UniChar), 0);
+  switch (query)
+    {
+    case CFStringLineCount:
+      return count;
+    case CFStringLineStart:
+      return value >= 0 && value < count ? starts[value] : kCFNotFound;
+    }
 
-  CFSTRING_INIT_MUTABLE (new);
+  /* Find the last line that starts at or before value. */
+  min = 0;
+  max = count;
+  while (max - min > 1)
+    {
+      mid = (min + max) / 2;
+      if (starts[mid] <= value)
+        min = mid;
+      else
+        max = mid;
+    }
 
-  return (CFMutableStringRef) new;
+  return min;
 }
 
-CFMutableStringRef
-CFStringCreateMutableCopy (CFAllocatorRef alloc, CFIndex maxLength,
-                           CFStringRef str)
+static CFIndex
+CFStringLineQuery (CFStringRef str, int query, CFIndex value)
 {
-  CFMutableStringRef new;
-  CFStringInlineBuffer buffer;
-  UniChar *contents;
-  CFIndex textLen;
-  CFIndex capacity;
-  CFIndex idx;
+  CFStringLineIndex *entry;
+  CFIndex *starts;
+  CFIndex count;
+  CFIndex ret;
+  Boolean cached;
+
+  if (query == CFStringLineAtIndex
+      && (value < 0 || value >= CFStringGetLength (str)))
+    return kCFNotFound;
+
+  cached = !CF_IS_OBJC (_kCFStringTypeID, str)
+    && CFStringLineIndexIsCached (str);
+  if (cached)
+    {
+      GSMutexLock (&_kCFStringLineIndexLock);
+      entry = CFStringLineIndexFind (str);
+      if (entry != NULL)
+        {
+          ret = CFStringLineIndexQuery (entry->starts, entry->count, query,
+                                        value);
+          GSMutexUnlock (&_kCFStringLineIndexLock);
+          return ret;
+        }
+      GSMutexUnlock (&_kCFStringLineIndexLock);
+    }
 
-  textLen = CFStringGetLength (str);
-  capacity = textLen;
-  if (maxLength > capacity)
-    capacity = maxLength;
-  new = (CFMutableStringRef) CFStringCreateMutable (alloc, capacity);
+  starts = CFStringLineIndexBuild (str, &count);
+  ret = CFStringLineIndexQuery (starts, count, query, value);
 
-  /* An inline buffer is going to work well here... */
-  CFStringInitInlineBuffer (str, &buffer, CFRangeMake (0, textLen));
-  contents = (UniChar *) new->_contents;
-  idx = 0;
-  while (idx < textLen)
+  if (cached)
     {
-      UniChar c = CFStringGetCharacterFromInlineBuffer (&buffer, idx++);
-      *(contents++) = c;
+      GSMutexLock (&_kCFStringLineIndexLock);
+      if (CFStringLineIndexFind (str) == NULL)
+        {
+          entry = &_kCFStringLineIndexCache[_kCFStringLineIndexNext];
+          _kCFStringLineIndexNext = (_kCFStringLineIndexNext + 1)
+            % CFSTRING_LINE_INDEX_CACHE_SIZE;
+          if (entry->str == NULL)
+            GSAtomicIncrementCFIndex (&_kCFStringLineIndexCount);
+          CFAllocatorDeallocate (kCFAllocatorSystemDefault, entry->starts);
+          entry->str = str;
+          entry->count = count;
+          entry->starts = starts;
+          starts = NULL;
+        }
+      GSMutexUnlock (&_kCFStringLineIndexLock);
     }
-  new->_count = textLen;
+  if (starts != NULL)
+    CFAllocatorDeallocate (kCFAllocatorSystemDefault, starts);
 
-  CFSTRING_INIT_MUTABLE (new);
-
-  return new;
+  return ret;
 }
 
-CFMutableStringRef
-CFStringCreateMutableWithExternalCharactersNoCopy (CFAllocatorRef alloc,
-                                                   UniChar * chars,
-                                                   CFIndex numChars,
-                                                   CFIndex capacity,
-                                                   CFAllocatorRef
-                                                   externalCharactersAllocator)
+CFIndex
+_CFStringGetLineCount (CFStringRef str)
 {
-  return NULL;                  /* FIXME */
+  return CFStringLineQuery (str, CFStringLineCount, 0);
 }
 
-void
-CFStringSetExternalCharactersNoCopy (CFMutableStringRef str, UniChar * chars,
-                                     CFIndex length, CFIndex capacity)
+CFIndex
+_CFStringGetLineAtIndex (CFStringRef str, CFIndex idx)
 {
-  return;                       /* FIXME */
+  return CFStringLineQuery (str, CFStringLineAtIndex, idx);
 }
 
 CFIndex
-CFStringFindAndReplace (CFMutableStringRef str, CFStringRef stringToFind,
-                        CFStringRef replacementString, CFRange rangeToSearch,
-                        CFOptionFlags compareOptions)
+_CFStringGetLineStartIndex (CFStringRef str, CFIndex line)
 {
-  return 0;                     /* FIXME */
+  return CFStringLineQuery (str, CFStringLineStart, line);
 }
 
 void
@@ -1169,6 +3390,12 @@ CFStringAppendCharacters (CFMutableStringRef str,
 
   length = str->_count;
 
+  if (CFStringUseRope (str, CFRangeMake (length, 0), numChars))
+    {
+      CFStringRopeReplace (str, CFRangeMake (length, 0), chars, numChars);
+      return;
+    }
+
   if (CFStringCheckCapacityAndGrow (str, (length + numChars), &contents)
       && contents != str->_contents)
     {
@@ -1179,6 +3406,7 @@ CFStringAppendCharacters (CFMutableStringRef str,
   memcpy ((UniChar *) str->_contents + length, chars,
           numChars * sizeof (UniChar));
   str->_count = length + numChars;
+  str->_hash = 0;
 }
 
 void
@@ -1246,46 +3474,23 @@ CFStringAppendFormatAndArguments (CFMutableStringRef str,
                                   CFDictionaryRef options, CFStringRef format,
                                   va_list args)
 {
-  Boolean free_fmt_str = false;
   CFIndex str_len;
-  CFIndex fmt_str_len;
   UniChar buf[BUFFER_SIZE];
-  UniChar *fmted_str = buf;
-  const UniChar *fmt_str;
-
-  fmt_str_len = CFStringGetLength (format);
-  fmt_str = CFStringGetCharactersPtr (format);
-  if (fmt_str == 0)
-    {
-      CFRange range;
-
-      free_fmt_str = true;
-      fmt_str = CFAllocatorAllocate (kCFAllocatorSystemDefault,
-                                     fmt_str_len * sizeof (UniChar), 0);
-      range = CFRangeMake (0, fmt_str_len);
-      CFStringGetCharacters (format, range, (UniChar *) fmt_str);
-    }
-  str_len = GSUnicodeFormatWithArguments (fmted_str, BUFFER_SIZE, options,
-                                          fmt_str, fmt_str_len, args);
-  if (str_len > BUFFER_SIZE)
-    {
-      /* The buffer was not long enough for the formatted string, so we will
-       * need to allocate a longer buffer and try again.
-       */
-      fmted_str = CFAllocatorAllocate (kCFAllocatorSystemDefault,
-                                       str_len * sizeof (UniChar), 0);
-      str_len = GSUnicodeFormatWithArguments (fmted_str, str_len, options,
-                                              fmt_str, fmt_str_len, args);
+  UniChar *fmted_str;
+  GSFormatRef fmt;
 
-    }
+  fmt = CFStringFormatCompile (format);
+  if (fmt == NULL)
+    return;
+  str_len = GSFormatWriteWithArguments (fmt, buf, BUFFER_SIZE, &fmted_str,
+                                        options, args);
+  CFStringFormatRelease (format, fmt);
   if (str_len < 0)
     return;
 
   CFStringAppendCharacters (str, (const UniChar *) fmted_str, str_len);
-  if (free_fmt_str)
-    CFAllocatorDeallocate (kCFAllocatorSystemDefault, (void *) fmt_str);
   if (fmted_str != buf)
-    CFAllocatorDeallocate (kCFAllocatorSystemDefault, str);
+    CFAllocatorDeallocate (kCFAllocatorSystemDefault, fmted_str);
 }
 
 void
@@ -1318,6 +3523,9 @@ CFStringPad (CFMutableStringRef str, CFStringRef padString,
       return;
     }
 
+  if (CFStringGetRope (str))
+    CFStringFlatten (str);
+
   if (padString == NULL && length < CFStringGetLength (str))    /* truncating */
     {
       ((UniChar *) str->_contents)[length] = 0x0000;
@@ -1379,6 +3587,24 @@ CFStringReplace (CFMutableStringRef str, CFRange range,
   textLength = CFStringGetLength (str);
   repLength = CFStringGetLength (replacement);
 
+  if (CFStringUseRope (str, range, repLength))
+    {
+      UniChar b[BUFFER_SIZE];
+      UniChar *chars;
+
+      /* The replacement may be str itself, so copy it out first. */
+      chars = b;
+      if (repLength > BUFFER_SIZE)
+        chars = CFAllocatorAllocate (kCFAllocatorSystemDefault,
+                                     repLength * sizeof (UniChar), 0);
+      CFStringGetCharacters (replacement, CFRangeMake (0, repLength), chars);
+      CFStringRopeReplace (str, range, chars, repLength);
+      if (chars != b)
+        CFAllocatorDeallocate (kCFAllocatorSystemDefault, chars);
+
+      return;
+    }
+
   if (repLength != range.length)
     {
       UniChar *moveFrom;
@@ -1430,6 +3656,14 @@ CFStringReplaceAll (CFMutableStringRef theString, CFStringRef replacement)
   CFIndex idx;
   UniChar *contents;
 
+  if (CFStringGetRope (theString))
+    {
+      CFStringReplace (theString,
+                       CFRangeMake (0, CFStringGetLength (theString)),
+                       replacement);
+      return;
+    }
+
   /* This function is very similar to CFStringReplace() but takes a few
      shortcuts and should be a little fast if all you need to do is replace
      the whole string. */
@@ -1453,12 +3687,89 @@ CFStringReplaceAll (CFMutableStringRef theString, CFStringRef replacement)
 void
 CFStringTrim (CFMutableStringRef str, CFStringRef trimString)
 {
-  CFStringFindAndReplace (str, trimString, NULL,
-                          CFRangeMake (0, CFStringGetLength (str)),
-                          kCFCompareAnchored);
-  CFStringFindAndReplace (str, trimString, NULL,
-                          CFRangeMake (0, CFStringGetLength (str)),
-                          kCFCompareBackwards | kCFCompareAnchored);
+  UniChar buffer[BUFFER_SIZE];
+  const UniChar *trim;
+  UniChar *allocated;
+  UniChar *contents;
+  CFRange found;
+  CFIndex trimLength;
+  CFIndex length;
+  CFIndex start;
+  CFIndex end;
+
+  trimLength = CFStringGetLength (trimString);
+  if (trimLength == 0)
+    return;
+
+  if (CF_IS_OBJC (_kCFStringTypeID, str))
+    {
+      length = CFStringGetLength (str);
+      start = 0;
+      while (start < length
+             && CFStringFindWithOptions (str, trimString,
+                                         CFRangeMake (start, length - start),
+                                         kCFCompareAnchored, &found))
+        start = found.location + found.length;
+      end = length;
+      while (end > start
+             && CFStringFindWithOptions (str, trimString,
+                                         CFRangeMake (start, end - start),
+                                         kCFCompareAnchored
+                                         | kCFCompareBackwards, &found))
+        end = found.location;
+      CFStringDelete (str, CFRangeMake (end, length - end));
+      CFStringDelete (str, CFRangeMake (0, start));
+      return;
+    }
+
+  if (CFStringGetRope (str))
+    CFStringFlatten (str);
+
+  allocated = NULL;
+  trim = __CFStringGetContiguousCharactersPtr (trimString);
+  if (trim == NULL)
+    {
+      if (trimLength > BUFFER_SIZE)
+        {
+          allocated = CFAllocatorAllocate (kCFAllocatorSystemDefault,
+                                           trimLength * sizeof (UniChar), 0);
+          trim = allocated;
+        }
+      else
+        {
+          trim = buffer;
+        }
+      CFStringGetCharacters (trimString, CFRangeMake (0, trimLength),
+                             (UniChar *) trim);
+    }
+
+  /* Every repetition of trimString is removed from both ends. */
+  contents = (UniChar *) str->_contents;
+  length = CFStringGetLength (str);
+  start = 0;
+  while (length - start >= trimLength
+         && memcmp (contents + start, trim, trimLength * sizeof (UniChar)) == 0)
+    start += trimLength;
+  end = length;
+  while (end - start >= trimLength
+         && memcmp (contents + end - trimLength, trim,
+                    trimLength * sizeof (UniChar)) == 0)
+    end -= trimLength;
+
+  if (allocated != NULL)
+    CFAllocatorDeallocate (kCFAllocatorSystemDefault, allocated);
+
+  if (start > 0)
+    memmove (contents, contents + start, (end - start) * sizeof (UniChar));
+  str->_count = end - start;
+  str->_hash = 0;
+}
+
+CF_INLINE Boolean
+CFStringIsTrimmedWhitespace (UniChar c)
+{
+  /* Letters, digits and punctuation from ASCII are never white space. */
+  return (c <= 0x20 || c >= 0x85) && GSCharacterIsWhitespace (c);
 }
 
 void
@@ -1466,41 +3777,26 @@ CFStringTrimWhitespace (CFMutableStringRef str)
 {
   CF_OBJC_FUNCDISPATCHV (_kCFStringTypeID, void, str, "_cfTrimWhitespace");
 
-  CFStringInlineBuffer buffer;
   CFIndex start;
   CFIndex end;
-  CFIndex textLength;
-  CFIndex newLength;
-  CFIndex idx;
-  UniChar c;
   UniChar *contents;
-  UniChar *contentsStart;
-
-  /* I assume that the resulting string will be shorter than the original
-     so no bounds checking is done. */
-  textLength = CFStringGetLength (str);
-  CFStringInitInlineBuffer (str, &buffer, CFRangeMake (0, textLength));
 
-  idx = 0;
-  c = CFStringGetCharacterFromInlineBuffer (&buffer, idx++);
-  while (GSCharacterIsWhitespace (c) && idx < textLength)
-    c = CFStringGetCharacterFromInlineBuffer (&buffer, idx++);
-  start = idx - 1;
-  end = start;
-  while (idx < textLength)
-    {
-      c = CFStringGetCharacterFromInlineBuffer (&buffer, idx++);
-      /* reset the end point */
-      if (!GSCharacterIsWhitespace (c))
-        end = idx;
-    }
+  if (CFStringGetRope (str))
+    CFStringFlatten (str);
 
-  newLength = end - start;
+  /* Only the white space at either end is looked at, not the characters
+     in between. */
   contents = (UniChar *) str->_contents;
-  contentsStart = (UniChar *) (contents + start);
-  memmove (contents, contentsStart, newLength * sizeof (UniChar));
-
-  str->_count = newLength;
+  end = CFStringGetLength (str);
+  start = 0;
+  while (start < end && CFStringIsTrimmedWhitespace (contents[start]))
+    start++;
+  while (end > start && CFStringIsTrimmedWhitespace (contents[end - 1]))
+    end--;
+
+  if (start > 0)
+    memmove (contents, contents + start, (end - start) * sizeof (UniChar));
+  str->_count = end - start;
   str->_hash = 0;
 }
 
@@ -1512,15 +3808,74 @@ enum
   _kCFStringFold
 };
 
+/* Returns true if the case mappings of the language of localeID differ
+   from the root rules for ASCII letters.  The Turkish and Azeri dotted and
+   dotless i are the main case, Lithuanian keeps the dot above i in some
+   mappings, and Dutch title case capitalizes "ij" as one letter. */
+static Boolean
+CFStringCaseMapIsLocalized (const char *localeID, CFIndex op)
+{
+  char lang[ULOC_LANG_CAPACITY];
+  UErrorCode err = U_ZERO_ERROR;
+
+  uloc_getLanguage (localeID, lang, ULOC_LANG_CAPACITY, &err);
+  if (U_FAILURE (err))
+    return true;
+
+  return strcmp (lang, "tr") == 0 || strcmp (lang, "az") == 0
+    || strcmp (lang, "lt") == 0
+    || (op == _kCFStringCapitalize && strcmp (lang, "nl") == 0);
+}
+
+/* Title case for ASCII text in place.  Words are taken to be runs of
+   letters, which is what ICU's word break rules give unless the text has
+   digits or the punctuation that can join letters into one word, so
+   those, and any character outside ASCII, return false and leave the
+   text unchanged. */
+static Boolean
+CFStringCapitalizeASCII (UniChar *contents, CFIndex length)
+{
+  CFIndex idx;
+  Boolean inWord;
+  UniChar c;
+
+  for (idx = 0; idx < length; ++idx)
+    {
+      c = contents[idx];
+      if (c >= 0x80 || (c >= '0' && c <= '9') || c == '\'' || c == '.'
+          || c == ':' || c == ',' || c == ';' || c == '_' || c == '@')
+        return false;
+    }
+
+  inWord = false;
+  for (idx = 0; idx < length; ++idx)
+    {
+      c = contents[idx] | 0x20;
+      if (c >= 'a' && c <= 'z')
+        {
+          contents[idx] = inWord ? c : c - 0x20;
+          inWord = true;
+        }
+      else
+        {
+          inWord = false;
+        }
+    }
+
+  return true;
+}
+
 static void
 CFStringCaseMap (CFMutableStringRef str, CFLocaleRef locale,
                  CFOptionFlags flags, CFIndex op)
 {
 #if HAVE_UNICODE_USTRING_H
-  char *localeID = NULL;        /* FIXME */
+  char buffer[ULOC_FULLNAME_CAPACITY];
+  const char *localeID;
   const UniChar *oldContents;
   CFIndex oldContentsLength;
   CFIndex newLength;
+  Boolean done;
   int32_t optFlags;
   UErrorCode err = U_ZERO_ERROR;
   struct __CFMutableString *mStr = (struct __CFMutableString *) str;
@@ -1528,11 +3883,54 @@ CFStringCaseMap (CFMutableStringRef str, CFLocaleRef locale,
   oldContents = CFStringGetCharactersPtr (str);
   oldContentsLength = CFStringGetLength (str);
 
+  /* A NULL locale asks for the root mappings, not those of the default
+     locale. */
+  localeID = NULL;
+  if (locale != NULL)
+    localeID = CFLocaleGetCStringIdentifier (locale, buffer,
+                                             ULOC_FULLNAME_CAPACITY);
+  if (localeID == NULL)
+    localeID = "";
+
+  /* Most strings are ISO-8859-1 and can be mapped without ICU, unless the
+     language has its own rules.  Case folding does not use the locale. */
+  if (op == _kCFStringFold || !CFStringCaseMapIsLocalized (localeID, op))
+    {
+      UniChar *contents = mStr->_contents;
+
+      switch (op)
+        {
+        case _kCFStringCapitalize:
+          done = CFStringCapitalizeASCII (contents, oldContentsLength);
+          break;
+        case _kCFStringLowercase:
+          done = GSLatin1Lowercase (contents, oldContentsLength, false)
+            == oldContentsLength;
+          break;
+        case _kCFStringUppercase:
+          done = GSLatin1Uppercase (contents, oldContentsLength)
+            == oldContentsLength;
+          break;
+        case _kCFStringFold:
+          done = GSLatin1Lowercase (contents, oldContentsLength, true)
+            == oldContentsLength;
+          break;
+        default:
+          return;
+        }
+      if (done)
+        {
+          mStr->_hash = 0;
+          return;
+        }
+    }
+
   /* Loops a maximum of 2 times, and should never loop more than that.  If
      it does have to go through the loop a 3rd time something is wrong
      and this whole thing will blow up. */
   do
     {
+      err = U_ZERO_ERROR;
       switch (op)
         {
         case _kCFStringCapitalize:
@@ -1659,15 +4057,129 @@ CFToICUNormalization (CFStringNormalizationForm form)
     }
 }
 
+#if HAVE_UNICODE_UNORM2_H
+static const UNormalizer2 *_kCFStringNormalizers[4];
+
+/* The normalizers belong to ICU and are shared, so each is looked up once
+   and never closed. */
+static const UNormalizer2 *
+CFStringGetNormalizer (CFStringNormalizationForm form)
+{
+  const UNormalizer2 *norm2;
+  UErrorCode err = U_ZERO_ERROR;
+
+  if (form < kCFStringNormalizationFormD
+      || form > kCFStringNormalizationFormKC)
+    return NULL;
+
+  norm2 = _kCFStringNormalizers[form];
+  if (norm2 == NULL)
+    {
+      norm2 = unorm2_getInstance (NULL,
+                                  form == kCFStringNormalizationFormKD
+                                  || form == kCFStringNormalizationFormKC
+                                  ? "nfkc" : "nfc",
+                                  form == kCFStringNormalizationFormC
+                                  || form == kCFStringNormalizationFormKC
+                                  ? UNORM2_COMPOSE : UNORM2_DECOMPOSE, &err);
+      if (U_FAILURE (err))
+        return NULL;
+      _kCFStringNormalizers[form] = norm2;
+    }
+
+  return norm2;
+}
+#endif
+
 void
 CFStringNormalize (CFMutableStringRef str, CFStringNormalizationForm theForm)
 {
-#if !UCONFIG_NO_NORMALIZATION
-  /* FIXME: The unorm API has been officially deprecated on ICU 4.8, however,
-     the new unorm2 API was only introduced on ICU 4.4.  The current plan is
-     to provide compatibility down to ICU 4.0, so unorm is used here.  In
-     the future, when we no longer support building with older versions of
-     the library this code can be updated for the new API. */
+#if HAVE_UNICODE_UNORM2_H
+  UniChar buffer[BUFFER_SIZE];
+  const UNormalizer2 *norm2;
+  struct __CFMutableString *mStr;
+  UniChar *contents;
+  UniChar *result;
+  CFIndex length;
+  CFIndex start;
+  CFIndex resultLength;
+  UErrorCode err = U_ZERO_ERROR;
+
+  norm2 = CFStringGetNormalizer (theForm);
+  if (norm2 == NULL)
+    return;
+
+  if (CF_IS_OBJC (_kCFStringTypeID, str))
+    {
+      CFMutableStringRef copy;
+
+      copy = CFStringCreateMutableCopy (kCFAllocatorDefault, 0, str);
+      CFStringNormalize (copy, theForm);
+      CF_OBJC_VOIDCALLV (str, "setString:", copy);
+      CFRelease (copy);
+      return;
+    }
+
+  contents = (UniChar *) CFStringGetCharactersPtr (str);
+  length = CFStringGetLength (str);
+
+  /* ASCII is normalized in every form, and ISO-8859-1 is in NFC.  None of
+     these characters combine with the ones before them, so the quick check
+     starts at the last of them, and only what follows the normalized span
+     it finds is passed to the normalizer. */
+  start = 0;
+  for (;;)
+    {
+      start += GSASCIILength16 (contents + start, length - start);
+      if (start < length && contents[start] <= 0xFF
+          && theForm == kCFStringNormalizationFormC)
+        start++;
+      else
+        break;
+    }
+  if (start == length)
+    return;
+  if (start > 0)
+    start--;
+  start += unorm2_spanQuickCheckYes (norm2, contents + start, length - start,
+                                     &err);
+  if (U_FAILURE (err) || start == length)
+    return;
+
+  result = buffer;
+  resultLength = unorm2_normalize (norm2, contents + start, length - start,
+                                   result, BUFFER_SIZE, &err);
+  if (err == U_BUFFER_OVERFLOW_ERROR)
+    {
+      result = CFAllocatorAllocate (kCFAllocatorSystemDefault,
+                                    resultLength * sizeof (UniChar), 0);
+      err = U_ZERO_ERROR;
+      resultLength = unorm2_normalize (norm2, contents + start,
+                                       length - start, result, resultLength,
+                                       &err);
+    }
+
+  /* The string's own buffer is only replaced if the result does not fit. */
+  mStr = (struct __CFMutableString *) str;
+  if (U_SUCCESS (err)
+      && CFStringCheckCapacityAndGrow (str, start + resultLength,
+                                       (void **) &contents))
+    {
+      if (contents != mStr->_contents)
+        {
+          memcpy (mStr->_contents, contents, start * sizeof (UniChar));
+          CFAllocatorDeallocate (mStr->_allocator, contents);
+        }
+      memcpy ((UniChar *) mStr->_contents + start, result,
+              resultLength * sizeof (UniChar));
+      mStr->_count = start + resultLength;
+      mStr->_hash = 0;
+    }
+
+  if (result != buffer)
+    CFAllocatorDeallocate (kCFAllocatorSystemDefault, result);
+#elif !UCONFIG_NO_NORMALIZATION
+  /* ICU before 4.4 only has the unorm API, which was deprecated in 4.8. */
   UniChar *oldContents;
   CFIndex oldContentsLength;
   CFIndex newLength;
@@ -1731,33 +4243,149 @@ CFStringNormalize (CFMutableStringRef str, CFStringNormalizationForm theForm)
 #endif
 }
 
+#if !UCONFIG_NO_TRANSLITERATION
+/* Opening a transliterator parses its rules, which usually costs far more
+   than the transform itself, so transliterators are kept in a pool.  Each
+   (transform, direction) pair has a prototype that is only ever cloned and
+   a few idle instances.  An instance is checked out of the pool while it is
+   in use, so no two threads share one.  Entries are never removed.
+ */
+#define CFSTRING_TRANSFORM_POOL_SIZE 32
+#define CFSTRING_TRANSFORM_IDLE_SIZE 4
+#define UTRANS_LENGTH 128
+
+typedef struct
+{
+  CFStringRef transform;
+  UTransDirection dir;
+  UTransliterator *prototype;
+  CFIndex idleCount;
+  UTransliterator *idle[CFSTRING_TRANSFORM_IDLE_SIZE];
+} CFStringTransformPoolEntry;
+
+static CFStringTransformPoolEntry
+  _kCFStringTransformPool[CFSTRING_TRANSFORM_POOL_SIZE];
+static CFIndex _kCFStringTransformPoolCount = 0;
+
+/* Must be called with _kCFStringTransformPoolLock held. */
+static CFStringTransformPoolEntry *
+CFStringTransformPoolFind (CFStringRef transform, UTransDirection dir)
+{
+  CFStringTransformPoolEntry *entry;
+  CFIndex idx;
+
+  for (idx = 0; idx < _kCFStringTransformPoolCount; ++idx)
+    {
+      entry = &_kCFStringTransformPool[idx];
+      if (entry->dir == dir && (entry->transform == transform
+                                || CFEqual (entry->transform, transform)))
+        return entry;
+    }
+
+  return NULL;
+}
+
+static UTransliterator *
+CFStringTransformCheckOut (CFStringRef transform, UTransDirection dir,
+                           CFStringTransformPoolEntry ** entryPtr)
+{
+  CFStringTransformPoolEntry *entry;
+  UTransliterator *utrans;
+  UTransliterator *prototype;
+  UniChar transID[UTRANS_LENGTH];
+  CFIndex idLength;
+  UErrorCode err = U_ZERO_ERROR;
+
+  utrans = NULL;
+  prototype = NULL;
+  GSMutexLock (&_kCFStringTransformPoolLock);
+  entry = CFStringTransformPoolFind (transform, dir);
+  if (entry != NULL)
+    {
+      if (entry->idleCount > 0)
+        utrans = entry->idle[--entry->idleCount];
+      else
+        prototype = entry->prototype;
+    }
+  GSMutexUnlock (&_kCFStringTransformPoolLock);
+
+  if (entry == NULL)
+    {
+      idLength = CFStringGetLength (transform);
+      if (idLength > UTRANS_LENGTH)
+        idLength = UTRANS_LENGTH;
+      CFStringGetCharacters (transform, CFRangeMake (0, idLength), transID);
+      utrans = utrans_openU (transID, idLength, dir, NULL, 0, NULL, &err);
+      if (U_FAILURE (err))
+        return NULL;
+
+      /* Another thread may have added the same transform meanwhile. */
+      GSMutexLock (&_kCFStringTransformPoolLock);
+      entry = CFStringTransformPoolFind (transform, dir);
+      if (entry == NULL
+          && _kCFStringTransformPoolCount < CFSTRING_TRANSFORM_POOL_SIZE)
+        {
+          entry = &_kCFStringTransformPool[_kCFStringTransformPoolCount++];
+          entry->transform = CFStringCreateCopy (kCFAllocatorSystemDefault,
+                                                 transform);
+          entry->dir = dir;
+          entry->prototype = utrans;
+          entry->idleCount = 0;
+          prototype = utrans;
+          utrans = NULL;
+        }
+      GSMutexUnlock (&_kCFStringTransformPoolLock);
+    }
+
+  if (prototype != NULL)
+    {
+      utrans = utrans_clone (prototype, &err);
+      if (U_FAILURE (err))
+        return NULL;
+    }
+
+  *entryPtr = entry;
+  return utrans;
+}
+
+static void
+CFStringTransformCheckIn (CFStringTransformPoolEntry * entry,
+                          UTransliterator * utrans)
+{
+  if (entry != NULL)
+    {
+      GSMutexLock (&_kCFStringTransformPoolLock);
+      if (entry->idleCount < CFSTRING_TRANSFORM_IDLE_SIZE)
+        {
+          entry->idle[entry->idleCount++] = utrans;
+          utrans = NULL;
+        }
+      GSMutexUnlock (&_kCFStringTransformPoolLock);
+    }
+  if (utrans != NULL)
+    utrans_close (utrans);
+}
+#endif
+
 Boolean
 CFStringTransform (CFMutableStringRef str, CFRange * range,
                    CFStringRef transform, Boolean reverse)
 {
 #if !UCONFIG_NO_TRANSLITERATION
-#define UTRANS_LENGTH 128
   struct __CFMutableString *mStr;
-  UniChar transID[UTRANS_LENGTH];
-  CFIndex idLength;
-  CFIndex newLength;
-  CFIndex start;
-  CFIndex limit;
+  CFStringTransformPoolEntry *entry;
   UTransliterator *utrans;
-  UTransDirection dir;
+  int32_t textLength;
+  int32_t start;
+  int32_t limit;
   UErrorCode err = U_ZERO_ERROR;
 
-  dir = reverse ? UTRANS_REVERSE : UTRANS_FORWARD;
-
-  idLength = CFStringGetLength (transform);
-  if (idLength > UTRANS_LENGTH)
-    idLength = UTRANS_LENGTH;
-  CFStringGetCharacters (transform, CFRangeMake (0, idLength), transID);
-  utrans = utrans_openU (transID, idLength, dir, NULL, 0, NULL, &err);
-  if (U_FAILURE (err))
+  utrans = CFStringTransformCheckOut (transform,
+                                      reverse ? UTRANS_REVERSE
+                                      : UTRANS_FORWARD, &entry);
+  if (utrans == NULL)
     return false;
 
-  newLength = CFStringGetLength (str);
   if (range)
     {
       start = range->location;
@@ -1766,7 +4394,7 @@ CFStringTransform (CFMutableStringRef str, CFRange * range,
   else
     {
       start = 0;
-      limit = newLength;
+      limit = CFStringGetLength (str);
     }
 
   if (CF_IS_OBJC (_kCFStringTypeID, str))
@@ -1777,11 +4405,16 @@ CFStringTransform (CFMutableStringRef str, CFRange * range,
   else
     {
       mStr = (struct __CFMutableString *) str;
+      if (mStr->_rope != NULL)
+        CFStringFlatten (str);
     }
 
-  utrans_transUChars (utrans, mStr->_contents, (int32_t *) & mStr->_count,
-                      mStr->_capacity, start, (int32_t *) & limit, &err);
-  utrans_close (utrans);
+  textLength = mStr->_count;
+  utrans_transUChars (utrans, mStr->_contents, &textLength,
+                      mStr->_capacity, start, &limit, &err);
+  CFStringTransformCheckIn (entry, utrans);
+  mStr->_count = textLength;
+  mStr->_hash = 0;
 
   if (((CFMutableStringRef) mStr) != str)       /* ObjC case */
     {
@@ -1793,7 +4426,7 @@ CFStringTransform (CFMutableStringRef str, CFRange * range,
     return false;
 
   if (range)
-    range->length = limit;
+    range->length = limit - start;
 
   return true;
 #else
@@ -28,7 +28,10 @@
 #include "CoreFoundation/CFByteOrder.h"
 #include "CoreFoundation/CFString.h"
 #include "CoreFoundation/CFStringEncodingExt.h"
+#include "CoreFoundation/GSCharacter.h"
+#include "CoreFoundation/GSUnicode.h"
 #include "GSPrivate.h"
+#include "GSMemory.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -37,15 +40,21 @@
 #if HAVE_UNICODE_UCNV_H
 #include <unicode/ucnv.h>
 #endif
+#include <unicode/uset.h>
 
 static GSMutex _kCFStringEncodingLock;
 static CFStringEncoding *_kCFStringEncodingList = NULL;
 static CFStringEncoding _kCFStringSystemEncoding = kCFStringEncodingInvalidId;
+static GSThreadKey _kCFStringConverterPoolKey;
+
+static void
+GSConverterPoolDestroy (void *data);
 
 void
 CFStringEncodingInitialize (void)
 {
   GSMutexInitialize (&_kCFStringEncodingLock);
+  GSThreadKeyCreate (&_kCFStringConverterPoolKey, GSConverterPoolDestroy);
 }
 
 typedef struct
@@ -251,39 +260,427 @@ CFStringICUConverterName (CFStringEncoding encoding)
   return name;
 }
 
+/* Opening a converter loads and checks its tables, so each thread keeps
+   the last few converters it used open.  A converter is taken out of the
+   pool while it is in use and reset when it goes back.  Converters always
+   stop on invalid input and the functions below substitute the loss
+   character themselves, so a converter only depends on the encoding.
+ */
+#define CFSTRING_CONVERTER_POOL_SIZE 4
+
+typedef struct
+{
+  CFStringEncoding encoding[CFSTRING_CONVERTER_POOL_SIZE];
+  UConverter *cnv[CFSTRING_CONVERTER_POOL_SIZE];
+  CFIndex next;
+} GSConverterPool;
+
+static void
+GSConverterPoolDestroy (void *data)
+{
+  GSConverterPool *pool;
+  CFIndex idx;
+
+  pool = data;
+  for (idx = 0; idx < CFSTRING_CONVERTER_POOL_SIZE; ++idx)
+    {
+      if (pool->cnv[idx] != NULL)
+        ucnv_close (pool->cnv[idx]);
+    }
+  free (pool);
+}
+
 static UConverter *
-GSStringOpenConverter (CFStringEncoding encoding, char lossByte)
+GSStringOpenConverter (CFStringEncoding encoding)
 {
+  GSConverterPool *pool;
   const char *converterName;
   UConverter *cnv;
+  CFIndex idx;
   UErrorCode err = U_ZERO_ERROR;
 
+  pool = GSThreadKeyGetValue (_kCFStringConverterPoolKey);
+  if (pool != NULL)
+    {
+      for (idx = 0; idx < CFSTRING_CONVERTER_POOL_SIZE; ++idx)
+        {
+          if (pool->cnv[idx] != NULL && pool->encoding[idx] == encoding)
+            {
+              cnv = pool->cnv[idx];
+              pool->cnv[idx] = NULL;
+              return cnv;
+            }
+        }
+    }
+
   converterName = CFStringICUConverterName (encoding);
+  if (converterName == NULL || *converterName == '\0')
+    return NULL;
 
   cnv = ucnv_open (converterName, &err);
   if (U_FAILURE (err))
-    cnv = NULL;
+    return NULL;
+
+  ucnv_setToUCallBack (cnv, UCNV_TO_U_CALLBACK_STOP, NULL, NULL, NULL, &err);
+  ucnv_setFromUCallBack (cnv, UCNV_FROM_U_CALLBACK_STOP, NULL, NULL, NULL,
+                         &err);
+
+  return cnv;
+}
+
+static void
+GSStringCloseConverter (CFStringEncoding encoding, UConverter * cnv)
+{
+  GSConverterPool *pool;
+  CFIndex idx;
+
+  if (cnv == NULL)
+    return;
 
-  if (lossByte)
+  pool = GSThreadKeyGetValue (_kCFStringConverterPoolKey);
+  if (pool == NULL)
     {
-      /* FIXME: for some reason this is returning U_ILLEGAL_ARGUMENTS_ERROR */
-      ucnv_setSubstChars (cnv, &lossByte, 1, &err);
+      pool = calloc (1, sizeof (GSConverterPool));
+      if (pool == NULL)
+        {
+          ucnv_close (cnv);
+          return;
+        }
+      GSThreadKeySetValue (_kCFStringConverterPoolKey, pool);
     }
-  else
+
+  ucnv_reset (cnv);
+  for (idx = 0; idx < CFSTRING_CONVERTER_POOL_SIZE; ++idx)
+    {
+      if (pool->cnv[idx] == NULL)
+        break;
+    }
+  if (idx == CFSTRING_CONVERTER_POOL_SIZE)
     {
-      ucnv_setToUCallBack (cnv, UCNV_TO_U_CALLBACK_STOP, NULL, NULL, NULL,
-                           &err);
-      ucnv_setFromUCallBack (cnv, UCNV_FROM_U_CALLBACK_STOP, NULL, NULL, NULL,
-                             &err);
+      idx = pool->next;
+      pool->next = (idx + 1) % CFSTRING_CONVERTER_POOL_SIZE;
+      ucnv_close (pool->cnv[idx]);
     }
+  pool->encoding[idx] = encoding;
+  pool->cnv[idx] = cnv;
+}
 
-  return cnv;
+/* Single-byte code pages are converted with tables built from the ICU
+   converter the first time they are used, so ICU is only called for
+   bytes and characters the tables do not map.  toUnicode holds 0xFFFF
+   for unmapped bytes.  fromUnicode is indexed by the high byte of a
+   character; each page holds the byte plus one, or 0 if unmapped.
+ */
+typedef struct
+{
+  UniChar toUnicode[256];
+  UInt16 *fromUnicode[256];
+} GSSingleByteTable;
+
+static GSSingleByteTable _kCFStringNoSingleByteTable;
+static GSSingleByteTable *_kCFStringSingleByteTables
+  [sizeof (str_encoding_table) / sizeof (_str_encoding)];
+
+static void
+GSSingleByteTableDestroy (GSSingleByteTable * table)
+{
+  CFIndex idx;
+
+  for (idx = 0; idx < 256; ++idx)
+    free (table->fromUnicode[idx]);
+  free (table);
+}
+
+static GSSingleByteTable *
+GSSingleByteTableCreate (UConverter * cnv)
+{
+  GSSingleByteTable *table;
+  USet *set;
+  UChar32 start;
+  UChar32 end;
+  UChar32 c;
+  int32_t count;
+  int32_t item;
+  UniChar u[2];
+  UniChar *t;
+  const UniChar *us;
+  char b[4];
+  char *bt;
+  const char *bs;
+  UErrorCode err = U_ZERO_ERROR;
+
+  if (ucnv_getType (cnv) != UCNV_SBCS)
+    return NULL;
+  table = calloc (1, sizeof (GSSingleByteTable));
+  if (table == NULL)
+    return NULL;
+
+  for (c = 0; c < 256; ++c)
+    {
+      b[0] = c;
+      bs = b;
+      t = u;
+      ucnv_reset (cnv);
+      ucnv_toUnicode (cnv, &t, u + 2, &bs, b + 1, NULL, true, &err);
+      table->toUnicode[c] = U_SUCCESS (err) && t - u == 1 ? u[0] : 0xFFFF;
+      err = U_ZERO_ERROR;
+    }
+
+  set = uset_openEmpty ();
+  ucnv_getUnicodeSet (cnv, set, UCNV_ROUNDTRIP_AND_FALLBACK_SET, &err);
+  count = U_SUCCESS (err) ? uset_getItemCount (set) : 0;
+  for (item = 0; item < count; ++item)
+    {
+      if (uset_getItem (set, item, &start, &end, NULL, 0, &err) != 0)
+        continue;               /* A string, not a range. */
+      for (c = start; c <= end && c < 0xFFFF; ++c)
+        {
+          if (U16_IS_SURROGATE (c))
+            continue;
+          u[0] = c;
+          us = u;
+          bt = b;
+          ucnv_reset (cnv);
+          ucnv_fromUnicode (cnv, &bt, b + 4, &us, u + 1, NULL, true, &err);
+          if (U_SUCCESS (err) && bt - b == 1)
+            {
+              if (table->fromUnicode[c >> 8] == NULL)
+                table->fromUnicode[c >> 8] = calloc (256, sizeof (UInt16));
+              if (table->fromUnicode[c >> 8] == NULL)
+                {
+                  uset_close (set);
+                  GSSingleByteTableDestroy (table);
+                  return NULL;
+                }
+              table->fromUnicode[c >> 8][c & 0xFF] = (UInt8) b[0] + 1;
+            }
+          err = U_ZERO_ERROR;
+        }
+    }
+  uset_close (set);
+  ucnv_reset (cnv);
+
+  return table;
+}
+
+static const GSSingleByteTable *
+GSStringGetSingleByteTable (CFStringEncoding encoding)
+{
+  GSSingleByteTable *table;
+  UConverter *cnv;
+  CFIndex idx;
+
+  idx = CFStringEncodingTableIndex (encoding);
+  if (idx == str_encoding_table_size)
+    return NULL;
+
+  table = _kCFStringSingleByteTables[idx];
+  if (table == NULL)
+    {
+      cnv = GSStringOpenConverter (encoding);
+      if (cnv == NULL)
+        return NULL;
+      table = GSSingleByteTableCreate (cnv);
+      GSStringCloseConverter (encoding, cnv);
+      if (table == NULL)
+        table = &_kCFStringNoSingleByteTable;
+      if (GSAtomicCompareAndSwapPointer (&_kCFStringSingleByteTables[idx],
+                                         NULL, table) != NULL)
+        {
+          if (table != &_kCFStringNoSingleByteTable)
+            GSSingleByteTableDestroy (table);
+          table = _kCFStringSingleByteTables[idx];
+        }
+    }
+
+  return table == &_kCFStringNoSingleByteTable ? NULL : table;
+}
+
+#define CONVERTER_BUFFER_SIZE 512
+
+CFIndex
+GSStringEncodingToUnicode (UniChar * d, CFIndex room,
+                           CFStringEncoding encoding, const UInt8 ** s,
+                           const UInt8 * sLimit, UniChar loss)
+{
+  const GSSingleByteTable *table;
+  UConverter *cnv;
+  UniChar buffer[CONVERTER_BUFFER_SIZE];
+  UniChar *t;
+  const char *src;
+  char invalid[32];
+  int8_t invalidLength;
+  CFIndex count;
+  CFIndex n;
+  UniChar c;
+  UErrorCode err;
+
+  count = 0;
+  table = GSStringGetSingleByteTable (encoding);
+  if (table != NULL)
+    {
+      while (*s < sLimit)
+        {
+          c = table->toUnicode[**s];
+          if (c == 0xFFFF)
+            break;
+          if (count < room)
+            d[count] = c;
+          ++count;
+          ++*s;
+        }
+      if (*s == sLimit)
+        return count;
+    }
+
+  cnv = GSStringOpenConverter (encoding);
+  if (cnv == NULL)
+    return count;
+
+  src = (const char *) *s;
+  while (src < (const char *) sLimit)
+    {
+      t = buffer;
+      err = U_ZERO_ERROR;
+      ucnv_toUnicode (cnv, &t, buffer + CONVERTER_BUFFER_SIZE, &src,
+                      (const char *) sLimit, NULL, true, &err);
+      n = t - buffer;
+      if (count < room)
+        GSMemoryCopy (d + count, buffer,
+                      (n < room - count ? n : room - count)
+                      * sizeof (UniChar));
+      count += n;
+
+      if (err == U_BUFFER_OVERFLOW_ERROR || U_SUCCESS (err))
+        continue;
+      if (loss == 0)
+        {
+          invalidLength = sizeof (invalid);
+          err = U_ZERO_ERROR;
+          ucnv_getInvalidChars (cnv, invalid, &invalidLength, &err);
+          src -= invalidLength;
+          break;
+        }
+      if (count < room)
+        d[count] = loss;
+      ++count;
+    }
+  *s = (const UInt8 *) src;
+  GSStringCloseConverter (encoding, cnv);
+
+  return count;
 }
 
-CF_INLINE void
-GSStringCloseConverter (UConverter * cnv)
+CFIndex
+GSStringEncodingFromUnicode (UInt8 * d, CFIndex room,
+                             CFStringEncoding encoding, const UniChar ** s,
+                             const UniChar * sLimit, char loss)
 {
-  ucnv_close (cnv);
+  const GSSingleByteTable *table;
+  const UInt16 *page;
+  UConverter *cnv;
+  char buffer[CONVERTER_BUFFER_SIZE];
+  int32_t offsets[CONVERTER_BUFFER_SIZE];
+  char *t;
+  const UniChar *src;
+  const UniChar *chunkLimit;
+  const UniChar *lossSrc;
+  UniChar invalid[2];
+  int8_t invalidLength;
+  CFIndex count;
+  CFIndex chunk;
+  CFIndex n;
+  UniChar c;
+  UErrorCode err;
+
+  count = 0;
+  table = GSStringGetSingleByteTable (encoding);
+  if (table != NULL)
+    {
+      while (*s < sLimit && (d == NULL || count < room))
+        {
+          c = **s;
+          page = table->fromUnicode[c >> 8];
+          if (page == NULL || page[c & 0xFF] == 0)
+            break;
+          if (d != NULL)
+            d[count] = page[c & 0xFF] - 1;
+          ++count;
+          ++*s;
+        }
+      if (*s == sLimit || (d != NULL && count == room))
+        return count;
+    }
+
+  cnv = GSStringOpenConverter (encoding);
+  if (cnv == NULL)
+    return count;
+
+  /* Convert small enough pieces that the output always fits in buffer,
+     and use the offsets to only write out whole characters. */
+  chunk = (CONVERTER_BUFFER_SIZE - 16) / ucnv_getMaxCharSize (cnv);
+  while (*s < sLimit && (d == NULL || count < room))
+    {
+      chunkLimit = sLimit - *s > chunk ? *s + chunk : sLimit;
+      if (chunkLimit < sLimit && U16_IS_LEAD (chunkLimit[-1]))
+        --chunkLimit;
+      src = *s;
+      t = buffer;
+      err = U_ZERO_ERROR;
+      ucnv_fromUnicode (cnv, &t, buffer + CONVERTER_BUFFER_SIZE, &src,
+                        chunkLimit, offsets, chunkLimit == sLimit, &err);
+      n = t - buffer;
+      if (err == U_INVALID_CHAR_FOUND || err == U_ILLEGAL_CHAR_FOUND
+          || err == U_TRUNCATED_CHAR_FOUND)
+        {
+          invalidLength = 2;
+          err = U_ZERO_ERROR;
+          ucnv_getInvalidUChars (cnv, invalid, &invalidLength, &err);
+          if (loss != 0)
+            {
+              /* Convert the loss character too, in case the converter
+                 has to change state first. */
+              c = (UInt8) loss;
+              lossSrc = &c;
+              ucnv_fromUnicode (cnv, &t, buffer + CONVERTER_BUFFER_SIZE,
+                                &lossSrc, &c + 1, NULL, false, &err);
+              if (U_FAILURE (err))
+                *t++ = loss;
+              while (n < t - buffer)
+                offsets[n++] = src - invalidLength - *s;
+            }
+          else
+            {
+              src -= invalidLength;
+            }
+        }
+      else if (U_FAILURE (err))
+        {
+          break;
+        }
+
+      if (d != NULL && n > room - count)
+        {
+          n = room - count;
+          while (n > 0 && offsets[n] >= 0 && offsets[n] == offsets[n - 1])
+            --n;
+          if (offsets[n] >= 0)
+            src = *s + offsets[n];
+          GSMemoryCopy (d + count, buffer, n);
+          count += n;
+          *s = src;
+          break;
+        }
+      if (d != NULL)
+        GSMemoryCopy (d + count, buffer, n);
+      count += n;
+      *s = src;
+      if (loss == 0 && src < chunkLimit)
+        break;
+    }
+  GSStringCloseConverter (encoding, cnv);
+
+  return count;
 }
 
 static CFStringEncoding
@@ -589,9 +986,11 @@ CFStringGetMaximumSizeForEncoding (CFIndex length, CFStringEncoding encoding)
       charSize = sizeof (UniChar);
       break;
     default:
-      cnv = GSStringOpenConverter (encoding, 0);
+      cnv = GSStringOpenConverter (encoding);
+      if (cnv == NULL)
+        return 0;
       charSize = ucnv_getMaxCharSize (cnv);
-      GSStringCloseConverter (cnv);
+      GSStringCloseConverter (encoding, cnv);
     }
 
   return charSize * length;
@@ -654,14 +1053,48 @@ CFStringIsEncodingAvailable (CFStringEncoding encoding)
 CFStringEncoding
 CFStringGetFastestEncoding (CFStringRef str)
 {
-  const UniChar *s = CFStringGetCharactersPtr (str);
-  return s ? kCFStringEncodingUTF16 : kCFStringEncodingASCII;
+  if (__CFStringGetContiguousCharactersPtr (str))
+    return kCFStringEncodingUTF16;
+  if (CFStringGetCStringPtr (str, kCFStringEncodingASCII))
+    return kCFStringEncodingASCII;
+  if (CFStringGetCStringPtr (str, kCFStringEncodingISOLatin1))
+    return kCFStringEncodingISOLatin1;
+  if (CFStringGetCStringPtr (str, kCFStringEncodingUTF8))
+    return kCFStringEncodingUTF8;
+  return kCFStringEncodingUTF16;
 }
 
 CFStringEncoding
 CFStringGetSmallestEncoding (CFStringRef str)
 {
-  return kCFStringEncodingInvalidId;
+  UniChar chars[256];
+  UInt8 bytes[256];
+  CFStringEncoding enc;
+  CFIndex length;
+  CFIndex idx;
+  CFIndex n;
+
+  if (CFStringGetCStringPtr (str, kCFStringEncodingASCII))
+    return kCFStringEncodingASCII;
+
+  /* Look at the characters a buffer at a time, moving from ASCII to
+     ISO-8859-1 to UTF-16 as wider characters turn up. */
+  enc = kCFStringEncodingASCII;
+  length = CFStringGetLength (str);
+  for (idx = 0; idx < length; idx += n)
+    {
+      n = length - idx;
+      if (n > 256)
+        n = 256;
+      CFStringGetCharacters (str, CFRangeMake (idx, n), chars);
+      if (enc == kCFStringEncodingASCII && GSASCIILength16 (chars, n) < n)
+        enc = kCFStringEncodingISOLatin1;
+      if (enc == kCFStringEncodingISOLatin1
+          && GSLatin1Narrow (bytes, chars, n) < n)
+        return kCFStringEncodingUnicode;
+    }
+
+  return enc;
 }
 
 CFIndex
@@ -678,3 +1111,449 @@ CFStringGetNameOfEncoding (CFStringEncoding encoding)
 {
   return NULL;
 }
+
+
+
+/* Encodings that GSUnicodeFromEncoding() converts without keeping any
+   state are decoded a complete sequence at a time, and the bytes of a
+   sequence that is cut off are kept in pending until the next call.
+   Other encodings are decoded by an ICU converter owned by the decoder,
+   which keeps partial sequences and shift states itself.
+ */
+struct GSUnicodeDecoder
+{
+  CFStringEncoding encoding;
+  UniChar loss;
+  Boolean started;
+  Boolean lossPending;
+  CFIndex pendingLength;
+  UInt8 pending[8];
+  UConverter *cnv;
+};
+
+GSUnicodeDecoderRef
+GSUnicodeDecoderCreate (CFStringEncoding enc, UniChar loss)
+{
+  GSUnicodeDecoderRef decoder;
+
+  decoder = calloc (1, sizeof (struct GSUnicodeDecoder));
+  if (decoder == NULL)
+    return NULL;
+  decoder->encoding = enc;
+  decoder->loss = loss;
+
+  switch (enc)
+    {
+    case kCFStringEncodingUTF8:
+    case kCFStringEncodingUTF16:
+    case kCFStringEncodingUTF16BE:
+    case kCFStringEncodingUTF16LE:
+    case kCFStringEncodingUTF32:
+    case kCFStringEncodingUTF32BE:
+    case kCFStringEncodingUTF32LE:
+    case kCFStringEncodingASCII:
+    case kCFStringEncodingISOLatin1:
+      break;
+    default:
+      if (GSStringGetSingleByteTable (enc) == NULL)
+        {
+          decoder->cnv = GSStringOpenConverter (enc);
+          if (decoder->cnv == NULL)
+            {
+              free (decoder);
+              return NULL;
+            }
+        }
+    }
+
+  return decoder;
+}
+
+void
+GSUnicodeDecoderDestroy (GSUnicodeDecoderRef decoder)
+{
+  if (decoder->cnv != NULL)
+    GSStringCloseConverter (decoder->encoding, decoder->cnv);
+  free (decoder);
+}
+
+void
+GSUnicodeDecoderReset (GSUnicodeDecoderRef decoder)
+{
+  decoder->started = false;
+  decoder->lossPending = false;
+  decoder->pendingLength = 0;
+  if (decoder->cnv != NULL)
+    ucnv_reset (decoder->cnv);
+}
+
+/* The length of the longest prefix of s that does not end in the middle
+   of a sequence. */
+static CFIndex
+GSUnicodeDecoderCompleteLength (GSUnicodeDecoderRef decoder,
+                                const UInt8 * s, CFIndex n)
+{
+  CFIndex idx;
+  CFIndex length;
+  UTF16Char c;
+
+  switch (decoder->encoding)
+    {
+    case kCFStringEncodingUTF8:
+      for (idx = n - 1; idx >= 0 && idx >= n - 3; --idx)
+        {
+          if ((s[idx] & 0xC0) != 0x80)
+            {
+              if (s[idx] < 0xC0)
+                length = 1;
+              else if (s[idx] < 0xE0)
+                length = 2;
+              else if (s[idx] < 0xF0)
+                length = 3;
+              else if (s[idx] < 0xF8)
+                length = 4;
+              else
+                length = 1;
+              return idx + length > n ? idx : n;
+            }
+        }
+      return n;
+    case kCFStringEncodingUTF16BE:
+    case kCFStringEncodingUTF16LE:
+      n &= ~(CFIndex) 1;
+      if (n == 0)
+        return 0;
+      if (decoder->encoding == kCFStringEncodingUTF16BE)
+        c = (s[n - 2] << 8) | s[n - 1];
+      else
+        c = (s[n - 1] << 8) | s[n - 2];
+      return GSCharacterIsLeadSurrogate (c) ? n - 2 : n;
+    case kCFStringEncodingUTF32BE:
+    case kCFStringEncodingUTF32LE:
+      return n & ~(CFIndex) 3;
+    default:
+      return n;
+    }
+}
+
+/* Convert n bytes that hold only complete sequences. */
+static CFIndex
+GSUnicodeDecoderConvert (GSUnicodeDecoderRef decoder, UniChar * d,
+                         UniChar * dLimit, const UInt8 ** s, CFIndex n)
+{
+  const UInt8 *sLimit;
+  UniChar *dStart;
+  CFIndex count;
+
+  /* GSUnicodeFromEncoding() drops a UTF-8 byte order mark at the start of
+     the text, which is only right at the start of the input. */
+  dStart = d;
+  sLimit = *s + n;
+  if (decoder->started && decoder->encoding == kCFStringEncodingUTF8)
+    {
+      while (sLimit - *s >= 3 && (*s)[0] == 0xEF && (*s)[1] == 0xBB
+             && (*s)[2] == 0xBF && d < dLimit)
+        {
+          *d++ = kGSUTF16CharacterByteOrderMark;
+          *s += 3;
+        }
+    }
+  if (n > 0)
+    decoder->started = true;
+
+  count = GSUnicodeFromEncoding (&d, dLimit, decoder->encoding, s, sLimit,
+                                 decoder->loss);
+  if (count < 0)
+    return -1;
+
+  return d - dStart;
+}
+
+/* The number of bytes the first sequence in s needs. */
+static CFIndex
+GSUnicodeDecoderSequenceLength (GSUnicodeDecoderRef decoder,
+                                const UInt8 * s, CFIndex n)
+{
+  CFIndex length;
+  CFIndex idx;
+  UTF16Char c;
+
+  switch (decoder->encoding)
+    {
+    case kCFStringEncodingUTF8:
+      if (s[0] >= 0xC0 && s[0] < 0xE0)
+        length = 2;
+      else if (s[0] >= 0xE0 && s[0] < 0xF0)
+        length = 3;
+      else if (s[0] >= 0xF0 && s[0] < 0xF8)
+        length = 4;
+      else
+        length = 1;
+      /* A lead byte without enough continuation bytes is invalid on its
+         own, and the bytes after it start the next sequence. */
+      for (idx = 1; idx < length && idx < n; ++idx)
+        {
+          if ((s[idx] & 0xC0) != 0x80)
+            return 1;
+        }
+      return length;
+    case kCFStringEncodingUTF16BE:
+    case kCFStringEncodingUTF16LE:
+      if (n < 2)
+        return 2;
+      if (decoder->encoding == kCFStringEncodingUTF16BE)
+        c = (s[0] << 8) | s[1];
+      else
+        c = (s[1] << 8) | s[0];
+      return GSCharacterIsLeadSurrogate (c) ? 4 : 2;
+    case kCFStringEncodingUTF32BE:
+    case kCFStringEncodingUTF32LE:
+      return 4;
+    default:
+      return 1;
+    }
+}
+
+/* Decode the first sequence of pending followed by s through a small
+   buffer, so that nothing is consumed unless its output fits.  A sequence
+   that is still cut off is moved to pending. */
+static CFIndex
+GSUnicodeDecoderConvertOne (GSUnicodeDecoderRef decoder, UniChar * d,
+                            CFIndex dLength, const UInt8 ** s,
+                            const UInt8 * sLimit, Boolean flush)
+{
+  UInt8 bytes[16];
+  UniChar chars[8];
+  const UInt8 *src;
+  CFIndex available;
+  CFIndex length;
+  CFIndex used;
+  CFIndex n;
+
+  available = sLimit - *s;
+  if (available > 8)
+    available = 8;
+  memcpy (bytes, decoder->pending, decoder->pendingLength);
+  memcpy (bytes + decoder->pendingLength, *s, available);
+  n = decoder->pendingLength + available;
+
+  length = GSUnicodeDecoderSequenceLength (decoder, bytes, n);
+  if (length > n)
+    {
+      if (!flush)
+        {
+          memcpy (decoder->pending, bytes, n);
+          decoder->pendingLength = n;
+          *s += available;
+          return 0;
+        }
+      length = n;
+    }
+
+  src = bytes;
+  n = GSUnicodeDecoderConvert (decoder, chars, chars + 8, &src, length);
+  if (n < 0)
+    return -1;
+  if (n > dLength)
+    return 0;
+  memcpy (d, chars, n * sizeof (UniChar));
+
+  used = src - bytes;
+  if (used >= decoder->pendingLength)
+    {
+      *s += used - decoder->pendingLength;
+      decoder->pendingLength = 0;
+    }
+  else
+    {
+      decoder->pendingLength -= used;
+      memmove (decoder->pending, decoder->pending + used,
+               decoder->pendingLength);
+    }
+
+  return n;
+}
+
+static CFIndex
+GSUnicodeDecoderDecodeICU (GSUnicodeDecoderRef decoder, UniChar * d,
+                           CFIndex dLength, const UInt8 ** s,
+                           const UInt8 * sLimit, Boolean flush)
+{
+  UniChar *t;
+  UniChar *tLimit;
+  const char *src;
+  UErrorCode err;
+
+  t = d;
+  tLimit = d + dLength;
+  src = (const char *) *s;
+  do
+    {
+      if (decoder->lossPending)
+        {
+          if (t == tLimit)
+            break;
+          *t++ = decoder->loss;
+          decoder->lossPending = false;
+        }
+      err = U_ZERO_ERROR;
+      ucnv_toUnicode (decoder->cnv, &t, tLimit, &src, (const char *) sLimit,
+                      NULL, flush, &err);
+      if (err == U_INVALID_CHAR_FOUND || err == U_ILLEGAL_CHAR_FOUND
+          || err == U_TRUNCATED_CHAR_FOUND)
+        {
+          if (decoder->loss == 0)
+            {
+              *s = (const UInt8 *) src;
+              return -1;
+            }
+          decoder->lossPending = true;
+          err = U_ZERO_ERROR;
+        }
+    }
+  while (decoder->lossPending || (U_SUCCESS (err)
+                                  && src < (const char *) sLimit));
+  *s = (const UInt8 *) src;
+
+  return t - d;
+}
+
+CFIndex
+GSUnicodeDecoderDecode (GSUnicodeDecoderRef decoder, UniChar * d,
+                        CFIndex dLength, const UInt8 ** s,
+                        const UInt8 * const sLimit, Boolean flush)
+{
+  UniChar *dStart;
+  UniChar *dLimit;
+  const UInt8 *s0;
+  CFIndex pendingLength;
+  CFIndex available;
+  CFIndex length;
+  CFIndex n;
+  UTF32Char c;
+
+  if (decoder->cnv != NULL)
+    return GSUnicodeDecoderDecodeICU (decoder, d, dLength, s, sLimit, flush);
+
+  /* Look for a byte order mark and settle on the byte order. */
+  if (!decoder->started && (decoder->encoding == kCFStringEncodingUTF16
+                            || decoder->encoding == kCFStringEncodingUTF32))
+    {
+      length = decoder->encoding == kCFStringEncodingUTF16 ? 2 : 4;
+      while (decoder->pendingLength < length && *s < sLimit)
+        decoder->pending[decoder->pendingLength++] = *(*s)++;
+      if (decoder->pendingLength < length && !flush)
+        return 0;
+
+      if (decoder->encoding == kCFStringEncodingUTF16)
+        {
+          c = decoder->pendingLength == 2
+            ? (decoder->pending[0] << 8) | decoder->pending[1] : 0;
+          if (c == 0xFEFF)
+            decoder->encoding = kCFStringEncodingUTF16BE;
+          else if (c == 0xFFFE)
+            decoder->encoding = kCFStringEncodingUTF16LE;
+          else
+            decoder->encoding = CFByteOrderGetCurrent () == CFByteOrderBigEndian
+              ? kCFStringEncodingUTF16BE : kCFStringEncodingUTF16LE;
+        }
+      else
+        {
+          c = decoder->pendingLength == 4
+            ? ((UTF32Char) decoder->pending[0] << 24)
+            | (decoder->pending[1] << 16) | (decoder->pending[2] << 8)
+            | decoder->pending[3] : 0;
+          if (c == 0xFEFF)
+            decoder->encoding = kCFStringEncodingUTF32BE;
+          else if (c == 0xFFFE0000)
+            decoder->encoding = kCFStringEncodingUTF32LE;
+          else
+            decoder->encoding = CFByteOrderGetCurrent () == CFByteOrderBigEndian
+              ? kCFStringEncodingUTF32BE : kCFStringEncodingUTF32LE;
+        }
+      if (c == 0xFEFF || c == 0xFFFE || c == 0xFFFE0000)
+        decoder->pendingLength = 0;
+      decoder->started = true;
+    }
+
+  dStart = d;
+  dLimit = d + dLength;
+  while (decoder->pendingLength > 0)
+    {
+      pendingLength = decoder->pendingLength;
+      s0 = *s;
+      n = GSUnicodeDecoderConvertOne (decoder, d, dLimit - d, s, sLimit,
+                                      flush);
+      if (n < 0)
+        return -1;
+      d += n;
+      if (n == 0 && *s == s0 && decoder->pendingLength == pendingLength)
+        return d - dStart;
+    }
+
+  while (*s < sLimit && d < dLimit)
+    {
+      /* No encoding handled here gives more than one character for each
+         byte, or for each two bytes of UTF-16 and UTF-32. */
+      available = sLimit - *s;
+      if (decoder->encoding != kCFStringEncodingUTF8
+          && !(decoder->encoding == kCFStringEncodingASCII
+               || decoder->encoding == kCFStringEncodingISOLatin1
+               || GSStringGetSingleByteTable (decoder->encoding) != NULL))
+        {
+          if (available > (dLimit - d) * 2)
+            available = (dLimit - d) * 2;
+        }
+      else if (available > dLimit - d)
+        {
+          available = dLimit - d;
+        }
+
+      length = GSUnicodeDecoderCompleteLength (decoder, *s, available);
+      if (length == 0)
+        {
+          /* The next sequence is cut off, or does not fit. */
+          s0 = *s;
+          n = GSUnicodeDecoderConvertOne (decoder, d, dLimit - d, s, sLimit,
+                                          flush);
+          if (n < 0)
+            return -1;
+          if (n == 0 && *s == s0)
+            break;
+          d += n;
+          continue;
+        }
+
+      n = GSUnicodeDecoderConvert (decoder, d, dLimit, s, length);
+      if (n < 0)
+        return -1;
+      d += n;
+    }
+
+  return d - dStart;
+}
+
+Boolean
+GSUnicodeDecoderAppend (GSUnicodeDecoderRef decoder,
+                        CFMutableStringRef str, const UInt8 * bytes,
+                        CFIndex length, Boolean flush)
+{
+  UniChar buffer[CONVERTER_BUFFER_SIZE];
+  const UInt8 *s;
+  const UInt8 *sLimit;
+  CFIndex n;
+
+  s = bytes;
+  sLimit = bytes + length;
+  do
+    {
+      n = GSUnicodeDecoderDecode (decoder, buffer, CONVERTER_BUFFER_SIZE,
+                                  &s, sLimit, flush);
+      if (n < 0)
+        return false;
+      CFStringAppendCharacters (str, buffer, n);
+    }
+  while (s < sLimit || n == CONVERTER_BUFFER_SIZE);
+
+  return true;
+}
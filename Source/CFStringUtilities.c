@@ -232,44 +232,6 @@ CFStringCompareWithOptionsAndLocale (CFStringRef str1,
   return ret;
 }
 
-Boolean
-CFStringFindCharacterFromSet (CFStringRef str, CFCharacterSetRef theSet,
-  CFRange rangeToSearch, CFStringCompareFlags searchOptions, CFRange *result)
-{
-  /* FIXME: Not really sure how to get this done. Input is welcome. */
-  return false;
-}
-
-CFStringRef
-CFStringCreateByCombiningStrings (CFAllocatorRef alloc, CFArrayRef theArray,
-  CFStringRef separatorString)
-{
-  CFIndex idx;
-  CFIndex count;
-  CFMutableStringRef string;
-  CFStringRef currentString;
-  CFStringRef ret;
-  
-  count = CFArrayGetCount (theArray) - 1;
-  if (count == 0)
-    return NULL;
-  
-  string = CFStringCreateMutable (NULL, 0);
-  idx = 0;
-  while (idx < count)
-    {
-      currentString = (CFStringRef)CFArrayGetValueAtIndex (theArray, idx++);
-      CFStringAppend (string, currentString);
-      CFStringAppend (string, separatorString);
-    }
-  currentString = CFArrayGetValueAtIndex (theArray, idx);
-  CFStringAppend (string, currentString);
-  
-  ret = CFStringCreateCopy (alloc, string);
-  CFRelease (string);
-  return ret;
-}
-
 CFArrayRef
 CFStringCreateArrayBySeparatingStrings (CFAllocatorRef alloc,
   CFStringRef str, CFStringRef separator)
@@ -310,31 +272,70 @@ CFStringCreateArrayBySeparatingStrings (CFAllocatorRef alloc,
   return ret;
 }
 
-CFArrayRef
-CFStringCreateArrayWithFindResults (CFAllocatorRef alloc,
-  CFStringRef str, CFStringRef stringToFind, CFRange rangeToSearch,
-  CFStringCompareFlags compOpt)
+/* The values of the array returned by CFStringCreateArrayWithFindResults()
+   are pointers to CFRange structures, each one owned by the array. */
+static void
+CFStringRangeReleaseCallback (CFAllocatorRef allocator, const void *value)
 {
-  return NULL; /* FIXME */
+  CFAllocatorDeallocate (allocator, (void *) value);
 }
 
-/* These next two functions should be very similar.  According to Apple's
-   documentation the only different between the two is that ...ParagraphBounds
-   does not stop at Unicode NextLine or LineSeparactor characters.
-   
-   They can probably be implemented using ICU's break iterator.
-*/
-void
-CFStringGetLineBounds (CFStringRef str, CFRange range,
-  CFIndex *lineBeginIndex, CFIndex *lineEndIndex, CFIndex *contentsEndIndex)
+static Boolean
+CFStringRangeEqualCallback (const void *value1, const void *value2)
 {
-  return;
+  const CFRange *r1 = value1;
+  const CFRange *r2 = value2;
+
+  return r1->location == r2->location && r1->length == r2->length;
 }
 
-void
-CFStringGetParagraphBounds (CFStringRef string, CFRange range,
-  CFIndex *parBeginIndex, CFIndex *parEndIndex, CFIndex *contentsEndIndex)
+static const CFArrayCallBacks _kCFStringRangeArrayCallBacks = {
+  .version = 0,
+  .retain = NULL,
+  .release = CFStringRangeReleaseCallback,
+  .copyDescription = NULL,
+  .equal = CFStringRangeEqualCallback
+};
+
+CFArrayRef
+CFStringCreateArrayWithFindResults (CFAllocatorRef alloc,
+  CFStringRef str, CFStringRef stringToFind, CFRange rangeToSearch,
+  CFStringCompareFlags compOpt)
 {
-  return;
+  CFIndex end;
+  CFRange found;
+  CFRange *value;
+  CFMutableArrayRef array;
+  
+  array = CFArrayCreateMutable (alloc, 0, &_kCFStringRangeArrayCallBacks);
+  
+  end = rangeToSearch.location + rangeToSearch.length;
+  while (rangeToSearch.length > 0
+         && CFStringFindWithOptions (str, stringToFind, rangeToSearch,
+                                     compOpt, &found)
+         && found.length > 0)
+  {
+    value = CFAllocatorAllocate (alloc, sizeof (CFRange), 0);
+    *value = found;
+    CFArrayAppendValue (array, value);
+    
+    if (compOpt & kCFCompareBackwards)
+      {
+        rangeToSearch.length = found.location - rangeToSearch.location;
+      }
+    else
+      {
+        rangeToSearch.location = found.location + found.length;
+        rangeToSearch.length = end - rangeToSearch.location;
+      }
+  }
+  
+  if (CFArrayGetCount (array) == 0)
+    {
+      CFRelease (array);
+      return NULL;
+    }
+  
+  return array;
 }
 
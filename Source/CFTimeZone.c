@@ -71,6 +71,7 @@ struct __CFTimeZone
 };
 
 static CFTypeID _kCFTimeZoneTypeID = 0;
+static CFIndex _kCFTimeZoneInitialized = 0;
 
 static GSMutex _kCFTimeZoneCacheLock;
 static CFMutableDictionaryRef _kCFTimeZoneCache = NULL;
@@ -106,7 +107,7 @@ static CFRuntimeClass CFTimeZoneClass =
   NULL
 };
 
-void CFTimeZoneInitialize (void)
+static void CFTimeZoneInitialize (void)
 {
   _kCFTimeZoneTypeID = _CFRuntimeRegisterClass (&CFTimeZoneClass);
   GSMutexInitialize (&_kCFTimeZoneCacheLock);
@@ -117,6 +118,7 @@ void CFTimeZoneInitialize (void)
 CFTypeID
 CFTimeZoneGetTypeID (void)
 {
+  GSOnce (&_kCFTimeZoneInitialized, CFTimeZoneInitialize);
   return _kCFTimeZoneTypeID;
 }
 
@@ -135,6 +137,7 @@ CFTimeZoneCreate (CFAllocatorRef alloc, CFStringRef name, CFDataRef data)
   struct __CFTimeZone *new;
   CFTimeZoneRef old;
   
+  GSOnce (&_kCFTimeZoneInitialized, CFTimeZoneInitialize);
   if (_kCFTimeZoneCache == NULL)
     {
       GSMutexLock(&_kCFTimeZoneCacheLock);
@@ -173,7 +176,7 @@ CFTimeZoneCreate (CFAllocatorRef alloc, CFStringRef name, CFDataRef data)
     return NULL;
   
   new = (struct __CFTimeZone*)_CFRuntimeCreateInstance (alloc,
-    _kCFTimeZoneTypeID, CFTIMEZONE_SIZE, 0);
+    CFTimeZoneGetTypeID (), CFTIMEZONE_SIZE, 0);
   if (new)
     {
       CFIndex idx;
@@ -27,12 +27,14 @@
 #include "CoreFoundation/CFRuntime.h"
 #include "CoreFoundation/CFString.h"
 #include "CoreFoundation/CFTree.h"
+#include "GSPrivate.h"
 
 #include <string.h>
 
 
 
 static CFTypeID _kCFTreeTypeID = 0;
+static CFIndex _kCFTreeInitialized = 0;
 
 struct __CFTree
 {
@@ -89,7 +91,7 @@ static CFRuntimeClass CFTreeClass =
   NULL
 };
 
-void CFTreeInitialize (void)
+static void CFTreeInitialize (void)
 {
   _kCFTreeTypeID = _CFRuntimeRegisterClass (&CFTreeClass);
 }
@@ -99,6 +101,7 @@ void CFTreeInitialize (void)
 CFTypeID
 CFTreeGetTypeID (void)
 {
+  GSOnce (&_kCFTreeInitialized, CFTreeInitialize);
   return _kCFTreeTypeID;
 }
 
@@ -109,7 +112,7 @@ CFTreeCreate (CFAllocatorRef allocator, const CFTreeContext *context)
 {
   CFTreeRef new;
   
-  new = (CFTreeRef)_CFRuntimeCreateInstance (allocator, _kCFTreeTypeID,
+  new = (CFTreeRef)_CFRuntimeCreateInstance (allocator, CFTreeGetTypeID (),
     CFTREE_SIZE, 0);
   if (new)
     {
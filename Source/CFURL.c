@@ -66,6 +66,7 @@
   || c == '(' || c == '*' || c == '+' || c == ',' || c == ';' || c == '=')
 
 static CFTypeID _kCFURLTypeID = 0;
+static CFIndex _kCFURLInitialized = 0;
 
 struct __CFURL
 {
@@ -171,7 +172,7 @@ static const CFRuntimeClass CFURLClass =
   NULL
 };
 
-void CFURLInitialize (void)
+static void CFURLInitialize (void)
 {
   _kCFURLTypeID = _CFRuntimeRegisterClass (&CFURLClass);
 }
@@ -181,6 +182,7 @@ void CFURLInitialize (void)
 CFTypeID
 CFURLGetTypeID (void)
 {
+  GSOnce (&_kCFURLInitialized, CFURLInitialize);
   return _kCFURLTypeID;
 }
 
@@ -408,7 +410,7 @@ CFURLCreate_internal (CFAllocatorRef alloc, CFStringRef string,
   if (!CFURLStringParse (string, ranges))
     return NULL;
   
-  new = (struct __CFURL*)_CFRuntimeCreateInstance (alloc, _kCFURLTypeID,
+  new = (struct __CFURL*)_CFRuntimeCreateInstance (alloc, CFURLGetTypeID (),
     CFURL_SIZE, 0);
   if (new)
     {
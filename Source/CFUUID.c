@@ -112,6 +112,7 @@ static void CFsrandomdev(void)
 #endif
 
 static CFTypeID _kCFUUIDTypeID = 0;
+static CFIndex _kCFUUIDInitialized = 0;
 static GSMutex _kCFUUIDLock;
 static CFMutableSetRef _kCFUUIDConstants = NULL;
 
@@ -187,7 +188,7 @@ const CFRuntimeClass CFUUIDClass =
   NULL  /* copyDebugDesc */
 };
 
-void CFUUIDInitialize (void)
+static void CFUUIDInitialize (void)
 {
   INITRANDOM();
   _kCFUUIDTypeID = _CFRuntimeRegisterClass (&CFUUIDClass);
@@ -241,7 +242,7 @@ CFUUIDCreateFromUUIDBytes (CFAllocatorRef alloc, CFUUIDBytes bytes)
 {
   struct __CFUUID *new;
   
-  new = (struct __CFUUID *)_CFRuntimeCreateInstance (alloc, _kCFUUIDTypeID,
+  new = (struct __CFUUID *)_CFRuntimeCreateInstance (alloc, CFUUIDGetTypeID (),
     sizeof(struct __CFUUID) - sizeof(CFRuntimeBase), NULL);
   if (new)
     new->_bytes = bytes;
@@ -319,6 +320,7 @@ CFUUIDGetConstantUUIDWithBytes (CFAllocatorRef alloc, UInt8 byte0, UInt8 byte1,
   uuidBytes.byte14 = byte14;
   uuidBytes.byte15 = byte15;
   
+  GSOnce (&_kCFUUIDInitialized, CFUUIDInitialize);
   GSMutexLock (&_kCFUUIDLock);
   if (_kCFUUIDConstants == NULL)
     _kCFUUIDConstants = CFSetCreateMutable (NULL, 0, &cb);
@@ -344,6 +346,7 @@ CFUUIDGetUUIDBytes (CFUUIDRef uuid)
 CFTypeID
 CFUUIDGetTypeID (void)
 {
+  GSOnce (&_kCFUUIDInitialized, CFUUIDInitialize);
   return _kCFUUIDTypeID;
 }
 
@@ -29,6 +29,7 @@
 #include "CoreFoundation/CFString.h"
 #include "CoreFoundation/CFURL.h"
 #include "CoreFoundation/CFXMLNode.h"
+#include "GSPrivate.h"
 
 #include <stdlib.h>
 
@@ -42,6 +43,7 @@ struct __CFXMLNode
 };
 
 static CFTypeID _kCFXMLNodeTypeID = 0;
+static CFIndex _kCFXMLNodeInitialized = 0;
 
 static void
 CFXMLNodeFinalize (CFTypeRef cf)
@@ -241,7 +243,7 @@ static const CFRuntimeClass CFXMLNodeClass =
   NULL
 };
 
-void CFXMLNodeInitialize (void)
+static void CFXMLNodeInitialize (void)
 {
   _kCFXMLNodeTypeID = _CFRuntimeRegisterClass (&CFXMLNodeClass);
 }
@@ -360,6 +362,7 @@ CFXMLNodeCopyAdditionalInfo (CFAllocatorRef alloc, void *info,
 CFTypeID
 CFXMLNodeGetTypeID (void)
 {
+  GSOnce (&_kCFXMLNodeInitialized, CFXMLNodeInitialize);
   return _kCFXMLNodeTypeID;
 }
 
@@ -405,7 +408,7 @@ CFXMLNodeCreate (CFAllocatorRef alloc, CFXMLNodeTypeCode xmlType,
         additionalInfoSize = 0;
     }
   
-  new = (struct __CFXMLNode*)_CFRuntimeCreateInstance (alloc, _kCFXMLNodeTypeID,
+  new = (struct __CFXMLNode*)_CFRuntimeCreateInstance (alloc, CFXMLNodeGetTypeID (),
     CFXMLNODE_SIZE + additionalInfoSize, 0);
   if (new)
     {
@@ -0,0 +1,80 @@
+/* GSDtoa.h
+
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This file is part of GNUstep CoreBase library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; see the file COPYING.LIB.
+   If not, see <http://www.gnu.org/licenses/> or write to the
+   Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#ifndef __GSDTOA_H__
+#define __GSDTOA_H__
+
+#include "config.h"
+
+#include "CoreFoundation/CFBase.h"
+#include "GSPrivate.h"
+
+/* Conversion of doubles to decimal digits for the string formatting code.
+ * These functions take a finite, non-negative value and write ASCII digits
+ * without a decimal point.  They return the number of digits written, and
+ * set *exponent to the decimal exponent of the first digit, so "123" with
+ * an exponent of 0 is 1.23.  Zero gives no digits.
+ */
+
+/* "00" "01" ... "99", for converting two digits at a time. */
+GS_PRIVATE extern const char GSDigitPairs[200];
+
+/* The shortest digits that convert back to the same value, using Ryu.
+   digits must have room for 17 characters. */
+GS_PRIVATE int
+GSDtoaShortest (double value, char *digits, int *exponent);
+
+/* The value correctly rounded to count significant digits, where count is
+   at least 1.  digits must have room for count characters. */
+GS_PRIVATE int
+GSDtoaPrecision (double value, int count, char *digits, int *exponent);
+
+/* The value correctly rounded to fraction digits after the decimal point.
+   digits must have room for GS_DTOA_FIXED_SIZE(fraction) characters. */
+#define GS_DTOA_FIXED_SIZE(fraction) (310 + (fraction))
+
+GS_PRIVATE int
+GSDtoaFixed (double value, int fraction, char *digits, int *exponent);
+
+/* Parsing of numbers at the start of text, in the manner of C++'s
+ * from_chars(): there is no locale, and no white space is skipped.  The
+ * text is read from bytes if it is not NULL, otherwise from chars.  The
+ * functions return the number of characters that make up the number, or
+ * 0 if there is none.
+ */
+
+/* An optional sign followed by decimal digits.  If the number does not fit
+   in an SInt64, *overflow is set and *value is the nearest limit. */
+GS_PRIVATE CFIndex
+GSStrtoll (const UInt8 *bytes, const UniChar *chars, CFIndex length,
+           SInt64 *value, Boolean *overflow);
+
+/* An optional sign followed by decimal digits with an optional '.' and
+   exponent, or by "inf", "infinity" or "nan" in any case.  The result is
+   correctly rounded.  *overflow is set if a finite number is too large
+   and *value is infinity. */
+GS_PRIVATE CFIndex
+GSStrtod (const UInt8 *bytes, const UniChar *chars, CFIndex length,
+          double *value, Boolean *overflow);
+
+#endif /* __GSDTOA_H__ */
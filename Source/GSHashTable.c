@@ -232,7 +232,7 @@ static CFIndex _kGSHashTableSizesCount =
 
 /* Calculted 80% of values above. */
 static CFIndex _kGSHashTableFilled[] = {
-  5, 10, 23, 47, 101, 205, 416, 839, 2099, 3360,
+  5, 10, 23, 47, 101, 205, 416, 839, 1679, 3360,
   6735, 13474, 26962, 53927, 107869, 215746, 431511,
   863029, 1726069, 3452146, 6904309, 13808624, 27617271,
   55234551, 110469125, 220938258, 441876536, 883753098
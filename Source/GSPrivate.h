@@ -58,25 +58,47 @@
 #define GSMutexUnlock(x) LeaveCriticalSection(x)
 #define GSMutexDestroy(x) DeleteCriticalSection(x)
 
+#define GSThreadKey DWORD
+#define GSThreadKeyCreate(x, destructor) \
+  (*(x) = FlsAlloc((PFLS_CALLBACK_FUNCTION)(destructor)))
+#define GSThreadKeyGetValue(x) FlsGetValue(x)
+#define GSThreadKeySetValue(x, value) FlsSetValue(x, value)
+#define GSThreadSelf() ((CFIndex)GetCurrentThreadId())
+
 #if defined(_WIN64)
 #define GSAtomicIncrementCFIndex(ptr) \
   InterlockedIncrement64((LONGLONG volatile*)(ptr))
 #define GSAtomicDecrementCFIndex(ptr) \
   InterlockedDecrement64((LONGLONG volatile*)(ptr))
+#define GSAtomicAddCFIndex(ptr, value) \
+  (InterlockedExchangeAdd64((LONGLONG volatile*)(ptr), (value)) + (value))
 #define GSAtomicCompareAndSwapCFIndex(ptr, oldv, newv) \
   InterlockedCompareExchange64((LONGLONG volatile*)(ptr), (newv), (oldv))
+#define GSAtomicLoadCFIndex(ptr) \
+  InterlockedCompareExchange64((LONGLONG volatile*)(ptr), 0, 0)
+#define GSAtomicLoadRelaxedCFIndex(ptr) (*(LONGLONG volatile*)(ptr))
+#define GSAtomicStoreRelaxedCFIndex(ptr, value) \
+  (*(LONGLONG volatile*)(ptr) = (value))
 #else
 #define GSAtomicIncrementCFIndex(ptr) \
   InterlockedIncrement((LONG volatile*)(ptr))
 #define GSAtomicDecrementCFIndex(ptr) \
   InterlockedDecrement((LONG volatile*)(ptr))
+#define GSAtomicAddCFIndex(ptr, value) \
+  (InterlockedExchangeAdd((LONG volatile*)(ptr), (value)) + (value))
 #define GSAtomicCompareAndSwapCFIndex(ptr, oldv, newv) \
   InterlockedCompareExchange((LONG volatile*)(ptr), (newv), (oldv))
+#define GSAtomicLoadCFIndex(ptr) \
+  InterlockedCompareExchange((LONG volatile*)(ptr), 0, 0)
+#define GSAtomicLoadRelaxedCFIndex(ptr) (*(LONG volatile*)(ptr))
+#define GSAtomicStoreRelaxedCFIndex(ptr, value) \
+  (*(LONG volatile*)(ptr) = (value))
 #endif /* _WIN64 */
 
 
 #define GSAtomicCompareAndSwapPointer(ptr, oldv, newv) \
   InterlockedCompareExchangePointer((ptr), (newv), (oldv))
+#define GSMemoryBarrier() MemoryBarrier()
 
 #else /* _WIN32 */
 
@@ -88,15 +110,37 @@
 #define GSMutexUnlock(x) pthread_mutex_unlock(x)
 #define GSMutexDestroy(x) pthraed_mutex_destroy(x)
 
+#define GSThreadKey pthread_key_t
+#define GSThreadKeyCreate(x, destructor) \
+  pthread_key_create(x, (void (*)(void *))(destructor))
+#define GSThreadKeyGetValue(x) pthread_getspecific(x)
+#define GSThreadKeySetValue(x, value) pthread_setspecific(x, value)
+#define GSThreadSelf() ((CFIndex)pthread_self())
+
 #if defined(__llvm__) \
       || (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 1))
 
 #define GSAtomicIncrementCFIndex(ptr) __sync_add_and_fetch((long*)(ptr), 1)
 #define GSAtomicDecrementCFIndex(ptr) __sync_sub_and_fetch((long*)(ptr), 1)
+#define GSAtomicAddCFIndex(ptr, value) \
+  __sync_add_and_fetch((long*)(ptr), (long)(value))
 #define GSAtomicCompareAndSwapCFIndex(ptr, oldv, newv) \
   __sync_val_compare_and_swap((long*)(ptr), (long)(oldv), (long)(newv))
 #define GSAtomicCompareAndSwapPointer(ptr, oldv, newv) \
   __sync_val_compare_and_swap((void**)(ptr), (void*)(oldv), (void*)(newv))
+#define GSMemoryBarrier() __sync_synchronize()
+#if defined(__ATOMIC_ACQUIRE)
+#define GSAtomicLoadCFIndex(ptr) __atomic_load_n((long*)(ptr), __ATOMIC_ACQUIRE)
+#define GSAtomicLoadRelaxedCFIndex(ptr) \
+  __atomic_load_n((long*)(ptr), __ATOMIC_RELAXED)
+#define GSAtomicStoreRelaxedCFIndex(ptr, value) \
+  __atomic_store_n((long*)(ptr), (long)(value), __ATOMIC_RELAXED)
+#else
+#define GSAtomicLoadCFIndex(ptr) __sync_add_and_fetch((long*)(ptr), 0)
+#define GSAtomicLoadRelaxedCFIndex(ptr) (*(volatile long*)(ptr))
+#define GSAtomicStoreRelaxedCFIndex(ptr, value) \
+  (*(volatile long*)(ptr) = (long)(value))
+#endif
 
 #endif
 
@@ -104,6 +148,147 @@
 
 
 
+/* Hint for branches that are almost never taken, such as debugging and
+ * statistics hooks on hot paths.
+ */
+#if defined(__GNUC__) || defined(__llvm__)
+#define GS_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#else
+#define GS_UNLIKELY(x) (x)
+#endif
+
+/* One time initialization that does not take a lock once it has run.
+ * The guard must be a static CFIndex initialized to zero.  Callers that
+ * arrive while the function is running on another thread wait for it to
+ * finish.  A call made by the function itself, for example through a
+ * type getter that the initializer uses, returns at once.
+ */
+GS_PRIVATE void
+GSOnceRun (CFIndex *guard, void (*function) (void));
+
+CF_INLINE void
+GSOnce (CFIndex *guard, void (*function) (void))
+{
+  if (GSAtomicLoadCFIndex (guard) != 2)
+    GSOnceRun (guard, function);
+}
+
+/* Registers the core types, from CFRuntime.c.  This normally runs as a
+ * constructor, but code that can be reached from other constructors calls
+ * it first.
+ */
+void
+CFInitialize (void);
+
+/* Moves a mutable string kept in a rope back into one buffer, from
+ * CFString.c.  CFMakeImmortal() calls this before it clears the mutable
+ * flag, since only mutable strings are looked up in their rope.
+ */
+GS_PRIVATE void
+GSStringFlatten (CFStringRef str);
+
+/* Whether the processor and operating system support AVX2, from
+ * GSUnicode.c.  This executes CPUID, so callers keep the answer.
+ */
+GS_PRIVATE Boolean
+GSCPUHasAVX2 (void);
+
+/* Vectorized helpers for ASCII and ISO-8859-1 text, from GSUnicode.c.
+ * The ASCII functions stop at the first character above U+007F, or after
+ * n characters, and return the number of characters processed.
+ * GSLatin1Widen() converts all n bytes; GSLatin1Narrow() stops at the
+ * first character above U+00FF.
+ */
+GS_PRIVATE CFIndex
+GSASCIILength (const UInt8 *s, CFIndex n);
+
+GS_PRIVATE CFIndex
+GSASCIIWiden (UniChar *d, const UInt8 *s, CFIndex n);
+
+GS_PRIVATE CFIndex
+GSASCIILength16 (const UniChar *s, CFIndex n);
+
+GS_PRIVATE CFIndex
+GSASCIINarrow (UInt8 *d, const UniChar *s, CFIndex n);
+
+GS_PRIVATE void
+GSLatin1Widen (UniChar *d, const UInt8 *s, CFIndex n);
+
+GS_PRIVATE CFIndex
+GSLatin1Narrow (UInt8 *d, const UniChar *s, CFIndex n);
+
+/* Case mapping of ISO-8859-1 text in place, from GSUnicode.c.  These stop
+ * at the first character that needs the full Unicode rules and return the
+ * number of characters mapped.  If fold is true, GSLatin1Lowercase() folds
+ * case instead.
+ */
+GS_PRIVATE CFIndex
+GSLatin1Lowercase (UniChar *s, CFIndex n, Boolean fold);
+
+GS_PRIVATE CFIndex
+GSLatin1Uppercase (UniChar *s, CFIndex n);
+
+/* Line ending searches, from GSUnicode.c.  These return the index of the
+ * first LF, CR or U+0085 in s, or of the last one if backwards is true, or
+ * kCFNotFound.  GSNewlineFind16() also finds U+2028 and U+2029.
+ */
+GS_PRIVATE CFIndex
+GSNewlineFind (const UInt8 *s, CFIndex n, Boolean backwards);
+
+GS_PRIVATE CFIndex
+GSNewlineFind16 (const UniChar *s, CFIndex n, Boolean backwards);
+
+/* Character set searches, from CFCharacterSet.c.  These return the index
+ * of the first member of set in s, or of the last one if backwards is
+ * true, or kCFNotFound.  GSCharacterSetFindCharacters() also returns the
+ * number of UTF-16 code units in the member, 1 or 2, in *length.
+ */
+GS_PRIVATE CFIndex
+GSCharacterSetFindLatin1 (CFCharacterSetRef set, const UInt8 *s, CFIndex n,
+                          Boolean backwards);
+
+GS_PRIVATE CFIndex
+GSCharacterSetFindCharacters (CFCharacterSetRef set, const UniChar *s,
+                              CFIndex n, Boolean backwards, CFIndex *length);
+
+/* Conversion between UTF-16 and the encodings ICU provides, from
+ * CFStringEncoding.c, for GSUnicodeFromEncoding() and GSUnicodeToEncoding().
+ * Both advance *s past the input that was converted and return the number
+ * of code units the output takes.  GSStringEncodingToUnicode() converts all
+ * of the input, writing out at most room characters; it stops at invalid
+ * input only if loss is 0.  GSStringEncodingFromUnicode() stops when room
+ * bytes are written, unless d is NULL, or at the first character that
+ * cannot be converted if loss is 0.
+ */
+GS_PRIVATE CFIndex
+GSStringEncodingToUnicode (UniChar *d, CFIndex room,
+                           CFStringEncoding encoding, const UInt8 **s,
+                           const UInt8 *sLimit, UniChar loss);
+
+GS_PRIVATE CFIndex
+GSStringEncodingFromUnicode (UInt8 *d, CFIndex room,
+                             CFStringEncoding encoding, const UniChar **s,
+                             const UniChar *sLimit, char loss);
+
+/* Compiled printf-style formats, from GSUnicode.c.  GSFormatCompile()
+ * returns NULL if the format is malformed.  GSFormatWriteWithArguments()
+ * formats into buffer and returns the length of the output, or -1 on
+ * error.  If the output does not fit and result is not NULL, it is
+ * formatted again into memory from kCFAllocatorSystemDefault that is
+ * returned in *result; otherwise *result is set to buffer.
+ */
+typedef struct GSFormat *GSFormatRef;
+
+GS_PRIVATE GSFormatRef
+GSFormatCompile (const UniChar *format, CFIndex length);
+
+GS_PRIVATE void
+GSFormatDestroy (GSFormatRef fmt);
+
+GS_PRIVATE CFIndex
+GSFormatWriteWithArguments (GSFormatRef fmt, UniChar *buffer, CFIndex size,
+                            UniChar **result, CFTypeRef locale, va_list ap);
+
 CFIndex
 GSBSearch (const void *array, const void *key, CFRange range, CFIndex size,
   CFComparatorFunction comp, void *ctxt);
@@ -265,6 +450,9 @@ GSRuntimeConstantInit (CFTypeRef cf, CFTypeID typeID);
 void
 GSRuntimeDeallocateInstance (CFTypeRef cf);
 
+Boolean
+GSRuntimeRetainIfAlive (CFTypeRef cf);
+
 #define GS_MAX(a,b) (a > b ? a : b)
 #define GS_MIN(a,b) (a < b ? a : b)
 
@@ -0,0 +1,353 @@
+/* GSRope.c
+
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This file is part of GNUstep CoreBase library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; see the file COPYING.LIB.
+   If not, see <http://www.gnu.org/licenses/> or write to the
+   Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "GSRope.h"
+
+#include <string.h>
+
+/* The rope is a treap ordered by position: every node holds a chunk of up
+   to GS_ROPE_CHUNK_SIZE characters, the text is the in-order
+   concatenation of the chunks, and random priorities keep the tree
+   balanced.  New chunks are only filled to GS_ROPE_CHUNK_FILL so that
+   small edits can usually be done in place.
+ */
+#define GS_ROPE_CHUNK_SIZE 1024
+#define GS_ROPE_CHUNK_FILL 768
+
+typedef struct GSRopeNode GSRopeNode;
+struct GSRopeNode
+{
+  GSRopeNode *left;
+  GSRopeNode *right;
+  CFIndex length;               /* Characters in the whole subtree */
+  CFIndex count;                /* Characters in this node */
+  UInt32 priority;
+  UniChar chars[GS_ROPE_CHUNK_SIZE];
+};
+
+struct GSRope
+{
+  CFAllocatorRef allocator;
+  GSRopeNode *root;
+  UInt32 seed;
+};
+
+CF_INLINE CFIndex
+GSRopeNodeLength (GSRopeNode *node)
+{
+  return node ? node->length : 0;
+}
+
+CF_INLINE void
+GSRopeNodeUpdate (GSRopeNode *node)
+{
+  node->length = GSRopeNodeLength (node->left) + node->count
+    + GSRopeNodeLength (node->right);
+}
+
+static GSRopeNode *
+GSRopeNodeCreate (GSRopeRef rope, const UniChar *chars, CFIndex count)
+{
+  GSRopeNode *node;
+  UInt32 x;
+
+  node = CFAllocatorAllocate (rope->allocator, sizeof (GSRopeNode), 0);
+  if (node == NULL)
+    return NULL;
+
+  /* xorshift32 */
+  x = rope->seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  rope->seed = x;
+
+  node->left = NULL;
+  node->right = NULL;
+  node->length = count;
+  node->count = count;
+  node->priority = x;
+  memcpy (node->chars, chars, count * sizeof (UniChar));
+
+  return node;
+}
+
+static void
+GSRopeNodeDestroy (GSRopeRef rope, GSRopeNode *node)
+{
+  GSRopeNode *right;
+
+  while (node != NULL)
+    {
+      GSRopeNodeDestroy (rope, node->left);
+      right = node->right;
+      CFAllocatorDeallocate (rope->allocator, node);
+      node = right;
+    }
+}
+
+static GSRopeNode *
+GSRopeNodeMerge (GSRopeNode *a, GSRopeNode *b)
+{
+  if (a == NULL)
+    return b;
+  if (b == NULL)
+    return a;
+
+  if (a->priority > b->priority)
+    {
+      a->right = GSRopeNodeMerge (a->right, b);
+      GSRopeNodeUpdate (a);
+      return a;
+    }
+  b->left = GSRopeNodeMerge (a, b->left);
+  GSRopeNodeUpdate (b);
+  return b;
+}
+
+/* Splits the tree so that the first pos characters end up in *left and
+   the rest in *right.  A chunk straddling pos is cut in two. */
+static void
+GSRopeNodeSplit (GSRopeRef rope, GSRopeNode *node, CFIndex pos,
+                 GSRopeNode **left, GSRopeNode **right)
+{
+  GSRopeNode *tail;
+  CFIndex leftLength;
+  CFIndex offset;
+
+  if (node == NULL)
+    {
+      *left = NULL;
+      *right = NULL;
+      return;
+    }
+
+  leftLength = GSRopeNodeLength (node->left);
+  if (pos <= leftLength)
+    {
+      GSRopeNodeSplit (rope, node->left, pos, left, &node->left);
+      GSRopeNodeUpdate (node);
+      *right = node;
+    }
+  else if (pos >= leftLength + node->count)
+    {
+      GSRopeNodeSplit (rope, node->right, pos - leftLength - node->count,
+                       &node->right, right);
+      GSRopeNodeUpdate (node);
+      *left = node;
+    }
+  else
+    {
+      offset = pos - leftLength;
+      tail = GSRopeNodeCreate (rope, node->chars + offset,
+                               node->count - offset);
+      *right = GSRopeNodeMerge (tail, node->right);
+      node->count = offset;
+      node->right = NULL;
+      GSRopeNodeUpdate (node);
+      *left = node;
+    }
+}
+
+static GSRopeNode *
+GSRopeNodeBuild (GSRopeRef rope, const UniChar *chars, CFIndex length)
+{
+  GSRopeNode *root;
+  CFIndex count;
+
+  root = NULL;
+  while (length > 0)
+    {
+      count = length > GS_ROPE_CHUNK_FILL ? GS_ROPE_CHUNK_FILL : length;
+      root = GSRopeNodeMerge (root, GSRopeNodeCreate (rope, chars, count));
+      chars += count;
+      length -= count;
+    }
+
+  return root;
+}
+
+/* Replaces the range without changing the shape of the tree, if it lies
+   within one chunk and the result still fits in that chunk. */
+static Boolean
+GSRopeNodeReplaceInPlace (GSRopeNode *node, CFRange range,
+                          const UniChar *chars, CFIndex length)
+{
+  CFIndex leftLength;
+  CFIndex newCount;
+  Boolean done;
+
+  if (node == NULL)
+    return false;
+
+  leftLength = GSRopeNodeLength (node->left);
+  if (range.location >= leftLength
+      && range.location + range.length <= leftLength + node->count)
+    {
+      newCount = node->count - range.length + length;
+      if (newCount == 0 || newCount > GS_ROPE_CHUNK_SIZE)
+        return false;
+      range.location -= leftLength;
+      memmove (node->chars + range.location + length,
+               node->chars + range.location + range.length,
+               (node->count - range.location - range.length)
+               * sizeof (UniChar));
+      memcpy (node->chars + range.location, chars, length * sizeof (UniChar));
+      node->count = newCount;
+      done = true;
+    }
+  else if (range.location + range.length <= leftLength)
+    {
+      done = GSRopeNodeReplaceInPlace (node->left, range, chars, length);
+    }
+  else if (range.location >= leftLength + node->count)
+    {
+      range.location -= leftLength + node->count;
+      done = GSRopeNodeReplaceInPlace (node->right, range, chars, length);
+    }
+  else
+    {
+      done = false;
+    }
+
+  if (done)
+    node->length += length - range.length;
+  return done;
+}
+
+GSRopeRef
+GSRopeCreate (CFAllocatorRef alloc, const UniChar *chars, CFIndex length)
+{
+  GSRopeRef rope;
+
+  rope = CFAllocatorAllocate (alloc, sizeof (struct GSRope), 0);
+  if (rope == NULL)
+    return NULL;
+
+  rope->allocator = alloc;
+  rope->seed = 0x9E3779B9;
+  rope->root = GSRopeNodeBuild (rope, chars, length);
+
+  return rope;
+}
+
+void
+GSRopeDestroy (GSRopeRef rope)
+{
+  GSRopeNodeDestroy (rope, rope->root);
+  CFAllocatorDeallocate (rope->allocator, rope);
+}
+
+CFIndex
+GSRopeGetLength (GSRopeRef rope)
+{
+  return GSRopeNodeLength (rope->root);
+}
+
+UniChar
+GSRopeGetCharacterAtIndex (GSRopeRef rope, CFIndex idx)
+{
+  GSRopeNode *node;
+  CFIndex leftLength;
+
+  node = rope->root;
+  while (node != NULL)
+    {
+      leftLength = GSRopeNodeLength (node->left);
+      if (idx < leftLength)
+        {
+          node = node->left;
+        }
+      else if (idx < leftLength + node->count)
+        {
+          return node->chars[idx - leftLength];
+        }
+      else
+        {
+          idx -= leftLength + node->count;
+          node = node->right;
+        }
+    }
+
+  return 0;
+}
+
+static void
+GSRopeNodeGetCharacters (GSRopeNode *node, CFIndex location, CFIndex length,
+                         UniChar *buffer)
+{
+  CFIndex leftLength;
+  CFIndex n;
+
+  while (node != NULL && length > 0)
+    {
+      leftLength = GSRopeNodeLength (node->left);
+      if (location < leftLength)
+        {
+          n = leftLength - location;
+          if (n > length)
+            n = length;
+          GSRopeNodeGetCharacters (node->left, location, n, buffer);
+          buffer += n;
+          location += n;
+          length -= n;
+        }
+      location -= leftLength;
+      if (location < node->count && length > 0)
+        {
+          n = node->count - location;
+          if (n > length)
+            n = length;
+          memcpy (buffer, node->chars + location, n * sizeof (UniChar));
+          buffer += n;
+          location += n;
+          length -= n;
+        }
+      location -= node->count;
+      node = node->right;
+    }
+}
+
+void
+GSRopeGetCharacters (GSRopeRef rope, CFRange range, UniChar *buffer)
+{
+  GSRopeNodeGetCharacters (rope->root, range.location, range.length, buffer);
+}
+
+void
+GSRopeReplace (GSRopeRef rope, CFRange range, const UniChar *chars,
+               CFIndex length)
+{
+  GSRopeNode *head;
+  GSRopeNode *middle;
+  GSRopeNode *tail;
+
+  if (GSRopeNodeReplaceInPlace (rope->root, range, chars, length))
+    return;
+
+  GSRopeNodeSplit (rope, rope->root, range.location, &head, &tail);
+  GSRopeNodeSplit (rope, tail, range.length, &middle, &tail);
+  GSRopeNodeDestroy (rope, middle);
+  middle = GSRopeNodeBuild (rope, chars, length);
+  rope->root = GSRopeNodeMerge (GSRopeNodeMerge (head, middle), tail);
+}
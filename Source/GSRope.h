@@ -0,0 +1,58 @@
+/* GSRope.h
+
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This file is part of GNUstep CoreBase library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; see the file COPYING.LIB.
+   If not, see <http://www.gnu.org/licenses/> or write to the
+   Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#ifndef __GSROPE_H__
+#define __GSROPE_H__
+
+#include "config.h"
+
+#include "CoreFoundation/CFBase.h"
+#include "GSPrivate.h"
+
+/* A rope holds UTF-16 text in fixed size chunks kept in a balanced tree,
+   so that replacing any range costs O(log n) plus the length of the
+   replacement, instead of moving the whole tail of the text.  Mutable
+   strings switch to a rope once they get large, see CFString.c.
+ */
+typedef struct GSRope *GSRopeRef;
+
+GS_PRIVATE GSRopeRef
+GSRopeCreate (CFAllocatorRef alloc, const UniChar *chars, CFIndex length);
+
+GS_PRIVATE void
+GSRopeDestroy (GSRopeRef rope);
+
+GS_PRIVATE CFIndex
+GSRopeGetLength (GSRopeRef rope);
+
+GS_PRIVATE UniChar
+GSRopeGetCharacterAtIndex (GSRopeRef rope, CFIndex idx);
+
+GS_PRIVATE void
+GSRopeGetCharacters (GSRopeRef rope, CFRange range, UniChar *buffer);
+
+GS_PRIVATE void
+GSRopeReplace (GSRopeRef rope, CFRange range, const UniChar *chars,
+               CFIndex length);
+
+#endif /* __GSROPE_H__ */
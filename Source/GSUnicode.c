@@ -36,11 +36,1022 @@
 
 #include "GSPrivate.h"
 #include "GSMemory.h"
+#include "GSDtoa.h"
 
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include <unicode/ucnv.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) \
+  && (defined(__clang__) || __GNUC__ >= 5)
+#include <immintrin.h>
+#include <cpuid.h>
+#define GS_HAVE_AVX2_KERNELS 1
+#endif
+
 #define BUFFER_SIZE 512
 
+/* ASCII runs shorter than this are converted without the kernels below. */
+#define GS_ASCII_INLINE_RUN 16
+
+
+
+/* ASCII and ISO-8859-1 kernels.
+ *
+ * Most text is made of long runs of ASCII, so the UTF-8 converters hand
+ * those runs to the functions below and only decode the rest one code
+ * point at a time.  CFString uses the same functions to move between its
+ * 8-bit and UTF-16 forms.  Each operation has a portable version working
+ * on a machine word at a time, an SSE2 version and an AVX2 version.  The
+ * best one for the processor is picked the first time any of them is
+ * used.  The ASCII functions stop at the first character above U+007F,
+ * GSLatin1Narrow() at the first one above U+00FF, and all of them return
+ * the number of characters processed.
+ *
+ * The case mapping functions work in place on ISO-8859-1 text.  Within
+ * that range only the letters A-Z, U+00C0-U+00DE and their lowercase
+ * forms change, except for U+00D7 and U+00F7, and each maps to the
+ * character 0x20 away.  They stop at the characters whose mapping leaves
+ * the range or changes the length: U+00B5, U+00DF and U+00FF for
+ * uppercase, and U+00B5 and U+00DF for case folding.
+ *
+ * The newline functions find the first, or the last if backwards is true,
+ * of the characters that can end a line: LF, CR, U+0085, and in UTF-16
+ * also U+2028 and U+2029.  They return its index or kCFNotFound.
+ */
+typedef struct
+{
+  CFIndex (*length) (const UInt8 *s, CFIndex n);
+  CFIndex (*widen) (UniChar *d, const UInt8 *s, CFIndex n);
+  CFIndex (*length16) (const UniChar *s, CFIndex n);
+  CFIndex (*narrow) (UInt8 *d, const UniChar *s, CFIndex n);
+  void (*latin1Widen) (UniChar *d, const UInt8 *s, CFIndex n);
+  CFIndex (*latin1Narrow) (UInt8 *d, const UniChar *s, CFIndex n);
+  CFIndex (*latin1Lower) (UniChar *s, CFIndex n, Boolean fold);
+  CFIndex (*latin1Upper) (UniChar *s, CFIndex n);
+  CFIndex (*newline) (const UInt8 *s, CFIndex n, Boolean backwards);
+  CFIndex (*newline16) (const UniChar *s, CFIndex n, Boolean backwards);
+} GSASCIIKernels;
+
+#define GS_ASCII_MASK8 ((UInt64) 0x8080808080808080ULL)
+#define GS_ASCII_MASK16 ((UInt64) 0xFF80FF80FF80FF80ULL)
+#define GS_LATIN1_MASK16 ((UInt64) 0xFF00FF00FF00FF00ULL)
+
+/* Return true if the next GS_ASCII_INLINE_RUN characters are ASCII. */
+CF_INLINE Boolean
+GSASCIIRunIsLong (const UInt8 *s)
+{
+  UInt64 a;
+  UInt64 b;
+
+  memcpy (&a, s, 8);
+  memcpy (&b, s + 8, 8);
+
+  return ((a | b) & GS_ASCII_MASK8) == 0;
+}
+
+CF_INLINE Boolean
+GSASCIIRunIsLong16 (const UniChar *s)
+{
+  UInt64 a;
+  UInt64 b;
+  UInt64 c;
+  UInt64 d;
+
+  memcpy (&a, s, 8);
+  memcpy (&b, s + 4, 8);
+  memcpy (&c, s + 8, 8);
+  memcpy (&d, s + 12, 8);
+
+  return ((a | b | c | d) & GS_ASCII_MASK16) == 0;
+}
+
+#define GS_IS_NEWLINE(c) ((c) == '\n' || (c) == '\r' || (c) == 0x85 \
+                          || ((c) & 0xFFFE) == 0x2028)
+
+static CFIndex
+GSASCIILengthScalar (const UInt8 *s, CFIndex n)
+{
+  CFIndex i;
+  UInt64 w;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      memcpy (&w, s + i, 8);
+      if (w & GS_ASCII_MASK8)
+        break;
+    }
+  while (i < n && s[i] < 0x80)
+    i++;
+
+  return i;
+}
+
+static CFIndex
+GSASCIIWidenScalar (UniChar *d, const UInt8 *s, CFIndex n)
+{
+  CFIndex i;
+  CFIndex j;
+  UInt64 w;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      memcpy (&w, s + i, 8);
+      if (w & GS_ASCII_MASK8)
+        break;
+      for (j = i; j < i + 8; ++j)
+        d[j] = s[j];
+    }
+  while (i < n && s[i] < 0x80)
+    {
+      d[i] = s[i];
+      i++;
+    }
+
+  return i;
+}
+
+static CFIndex
+GSASCIILength16Scalar (const UniChar *s, CFIndex n)
+{
+  CFIndex i;
+  UInt64 w;
+
+  for (i = 0; i + 4 <= n; i += 4)
+    {
+      memcpy (&w, s + i, 8);
+      if (w & GS_ASCII_MASK16)
+        break;
+    }
+  while (i < n && s[i] < 0x80)
+    i++;
+
+  return i;
+}
+
+static CFIndex
+GSASCIINarrowScalar (UInt8 *d, const UniChar *s, CFIndex n)
+{
+  CFIndex i;
+  CFIndex j;
+  UInt64 w;
+
+  for (i = 0; i + 4 <= n; i += 4)
+    {
+      memcpy (&w, s + i, 8);
+      if (w & GS_ASCII_MASK16)
+        break;
+      for (j = i; j < i + 4; ++j)
+        d[j] = s[j];
+    }
+  while (i < n && s[i] < 0x80)
+    {
+      d[i] = s[i];
+      i++;
+    }
+
+  return i;
+}
+
+static void
+GSLatin1WidenScalar (UniChar *d, const UInt8 *s, CFIndex n)
+{
+  CFIndex i;
+
+  for (i = 0; i < n; ++i)
+    d[i] = s[i];
+}
+
+static CFIndex
+GSLatin1NarrowScalar (UInt8 *d, const UniChar *s, CFIndex n)
+{
+  CFIndex i;
+  CFIndex j;
+  UInt64 w;
+
+  for (i = 0; i + 4 <= n; i += 4)
+    {
+      memcpy (&w, s + i, 8);
+      if (w & GS_LATIN1_MASK16)
+        break;
+      for (j = i; j < i + 4; ++j)
+        d[j] = s[j];
+    }
+  while (i < n && s[i] <= 0xFF)
+    {
+      d[i] = s[i];
+      i++;
+    }
+
+  return i;
+}
+
+static CFIndex
+GSLatin1LowerScalar (UniChar *s, CFIndex n, Boolean fold)
+{
+  CFIndex i;
+  UniChar c;
+
+  for (i = 0; i < n; ++i)
+    {
+      c = s[i];
+      if (c > 0xFF || (fold && (c == 0xB5 || c == 0xDF)))
+        break;
+      if ((c >= 'A' && c <= 'Z') || (c >= 0xC0 && c <= 0xDE && c != 0xD7))
+        s[i] = c + 0x20;
+    }
+
+  return i;
+}
+
+static CFIndex
+GSLatin1UpperScalar (UniChar *s, CFIndex n)
+{
+  CFIndex i;
+  UniChar c;
+
+  for (i = 0; i < n; ++i)
+    {
+      c = s[i];
+      if (c > 0xFF || c == 0xB5 || c == 0xDF || c == 0xFF)
+        break;
+      if ((c >= 'a' && c <= 'z') || (c >= 0xE0 && c <= 0xFE && c != 0xF7))
+        s[i] = c - 0x20;
+    }
+
+  return i;
+}
+
+static CFIndex
+GSNewlineFindScalar (const UInt8 *s, CFIndex n, Boolean backwards)
+{
+  CFIndex i;
+
+  if (backwards)
+    {
+      for (i = n - 1; i >= 0; --i)
+        if (GS_IS_NEWLINE (s[i]))
+          return i;
+    }
+  else
+    {
+      for (i = 0; i < n; ++i)
+        if (GS_IS_NEWLINE (s[i]))
+          return i;
+    }
+
+  return kCFNotFound;
+}
+
+static CFIndex
+GSNewlineFind16Scalar (const UniChar *s, CFIndex n, Boolean backwards)
+{
+  CFIndex i;
+
+  if (backwards)
+    {
+      for (i = n - 1; i >= 0; --i)
+        if (GS_IS_NEWLINE (s[i]))
+          return i;
+    }
+  else
+    {
+      for (i = 0; i < n; ++i)
+        if (GS_IS_NEWLINE (s[i]))
+          return i;
+    }
+
+  return kCFNotFound;
+}
+
+#if defined(__SSE2__)
+static CFIndex
+GSASCIILengthSSE2 (const UInt8 *s, CFIndex n)
+{
+  CFIndex i;
+  __m128i v;
+
+  for (i = 0; i + 16 <= n; i += 16)
+    {
+      v = _mm_loadu_si128 ((const __m128i *) (s + i));
+      if (_mm_movemask_epi8 (v))
+        break;
+    }
+
+  return i + GSASCIILengthScalar (s + i, n - i);
+}
+
+static CFIndex
+GSASCIIWidenSSE2 (UniChar *d, const UInt8 *s, CFIndex n)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  CFIndex i;
+  __m128i v;
+
+  for (i = 0; i + 16 <= n; i += 16)
+    {
+      v = _mm_loadu_si128 ((const __m128i *) (s + i));
+      if (_mm_movemask_epi8 (v))
+        break;
+      _mm_storeu_si128 ((__m128i *) (d + i), _mm_unpacklo_epi8 (v, zero));
+      _mm_storeu_si128 ((__m128i *) (d + i + 8),
+                        _mm_unpackhi_epi8 (v, zero));
+    }
+
+  return i + GSASCIIWidenScalar (d + i, s + i, n - i);
+}
+
+static CFIndex
+GSASCIILength16SSE2 (const UniChar *s, CFIndex n)
+{
+  const __m128i mask = _mm_set1_epi16 ((short) 0xFF80);
+  const __m128i zero = _mm_setzero_si128 ();
+  CFIndex i;
+  __m128i v;
+
+  for (i = 0; i + 16 <= n; i += 16)
+    {
+      v = _mm_or_si128 (_mm_loadu_si128 ((const __m128i *) (s + i)),
+                        _mm_loadu_si128 ((const __m128i *) (s + i + 8)));
+      v = _mm_cmpeq_epi16 (_mm_and_si128 (v, mask), zero);
+      if (_mm_movemask_epi8 (v) != 0xFFFF)
+        break;
+    }
+
+  return i + GSASCIILength16Scalar (s + i, n - i);
+}
+
+static CFIndex
+GSASCIINarrowSSE2 (UInt8 *d, const UniChar *s, CFIndex n)
+{
+  const __m128i mask = _mm_set1_epi16 ((short) 0xFF80);
+  const __m128i zero = _mm_setzero_si128 ();
+  CFIndex i;
+  __m128i a;
+  __m128i b;
+  __m128i v;
+
+  for (i = 0; i + 16 <= n; i += 16)
+    {
+      a = _mm_loadu_si128 ((const __m128i *) (s + i));
+      b = _mm_loadu_si128 ((const __m128i *) (s + i + 8));
+      v = _mm_cmpeq_epi16 (_mm_and_si128 (_mm_or_si128 (a, b), mask), zero);
+      if (_mm_movemask_epi8 (v) != 0xFFFF)
+        break;
+      _mm_storeu_si128 ((__m128i *) (d + i), _mm_packus_epi16 (a, b));
+    }
+
+  return i + GSASCIINarrowScalar (d + i, s + i, n - i);
+}
+
+static void
+GSLatin1WidenSSE2 (UniChar *d, const UInt8 *s, CFIndex n)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  CFIndex i;
+  __m128i v;
+
+  for (i = 0; i + 16 <= n; i += 16)
+    {
+      v = _mm_loadu_si128 ((const __m128i *) (s + i));
+      _mm_storeu_si128 ((__m128i *) (d + i), _mm_unpacklo_epi8 (v, zero));
+      _mm_storeu_si128 ((__m128i *) (d + i + 8),
+                        _mm_unpackhi_epi8 (v, zero));
+    }
+  GSLatin1WidenScalar (d + i, s + i, n - i);
+}
+
+static CFIndex
+GSLatin1NarrowSSE2 (UInt8 *d, const UniChar *s, CFIndex n)
+{
+  const __m128i mask = _mm_set1_epi16 ((short) 0xFF00);
+  const __m128i zero = _mm_setzero_si128 ();
+  CFIndex i;
+  __m128i a;
+  __m128i b;
+  __m128i v;
+
+  for (i = 0; i + 16 <= n; i += 16)
+    {
+      a = _mm_loadu_si128 ((const __m128i *) (s + i));
+      b = _mm_loadu_si128 ((const __m128i *) (s + i + 8));
+      v = _mm_cmpeq_epi16 (_mm_and_si128 (_mm_or_si128 (a, b), mask), zero);
+      if (_mm_movemask_epi8 (v) != 0xFFFF)
+        break;
+      _mm_storeu_si128 ((__m128i *) (d + i), _mm_packus_epi16 (a, b));
+    }
+
+  return i + GSLatin1NarrowScalar (d + i, s + i, n - i);
+}
+
+/* A mask of the characters in [lo, hi], for values below 0x8000. */
+#define GS_SSE2_RANGE(v, lo, hi) \
+  _mm_and_si128 (_mm_cmpgt_epi16 ((v), _mm_set1_epi16 ((lo) - 1)), \
+                 _mm_cmplt_epi16 ((v), _mm_set1_epi16 ((hi) + 1)))
+
+static CFIndex
+GSLatin1LowerSSE2 (UniChar *s, CFIndex n, Boolean fold)
+{
+  const __m128i high = _mm_set1_epi16 ((short) 0xFF00);
+  const __m128i zero = _mm_setzero_si128 ();
+  CFIndex i;
+  __m128i v;
+  __m128i ok;
+  __m128i m;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      v = _mm_loadu_si128 ((const __m128i *) (s + i));
+      ok = _mm_cmpeq_epi16 (_mm_and_si128 (v, high), zero);
+      if (fold)
+        ok = _mm_andnot_si128
+          (_mm_or_si128 (_mm_cmpeq_epi16 (v, _mm_set1_epi16 (0xB5)),
+                         _mm_cmpeq_epi16 (v, _mm_set1_epi16 (0xDF))), ok);
+      if (_mm_movemask_epi8 (ok) != 0xFFFF)
+        break;
+      m = _mm_or_si128 (GS_SSE2_RANGE (v, 'A', 'Z'),
+                        _mm_andnot_si128
+                        (_mm_cmpeq_epi16 (v, _mm_set1_epi16 (0xD7)),
+                         GS_SSE2_RANGE (v, 0xC0, 0xDE)));
+      v = _mm_add_epi16 (v, _mm_and_si128 (m, _mm_set1_epi16 (0x20)));
+      _mm_storeu_si128 ((__m128i *) (s + i), v);
+    }
+
+  return i + GSLatin1LowerScalar (s + i, n - i, fold);
+}
+
+static CFIndex
+GSLatin1UpperSSE2 (UniChar *s, CFIndex n)
+{
+  const __m128i high = _mm_set1_epi16 ((short) 0xFF00);
+  const __m128i zero = _mm_setzero_si128 ();
+  CFIndex i;
+  __m128i v;
+  __m128i ok;
+  __m128i m;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      v = _mm_loadu_si128 ((const __m128i *) (s + i));
+      ok = _mm_cmpeq_epi16 (_mm_and_si128 (v, high), zero);
+      ok = _mm_andnot_si128
+        (_mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi16 (v, _mm_set1_epi16 (0xB5)),
+                                     _mm_cmpeq_epi16 (v, _mm_set1_epi16 (0xDF))),
+                       _mm_cmpeq_epi16 (v, _mm_set1_epi16 (0xFF))), ok);
+      if (_mm_movemask_epi8 (ok) != 0xFFFF)
+        break;
+      m = _mm_or_si128 (GS_SSE2_RANGE (v, 'a', 'z'),
+                        _mm_andnot_si128
+                        (_mm_cmpeq_epi16 (v, _mm_set1_epi16 (0xF7)),
+                         GS_SSE2_RANGE (v, 0xE0, 0xFE)));
+      v = _mm_sub_epi16 (v, _mm_and_si128 (m, _mm_set1_epi16 (0x20)));
+      _mm_storeu_si128 ((__m128i *) (s + i), v);
+    }
+
+  return i + GSLatin1UpperScalar (s + i, n - i);
+}
+/* A mask with two bits set for each line ending character in 8 UTF-16
+   code units. */
+#define GS_SSE2_NEWLINE16(v) \
+  _mm_movemask_epi8 (_mm_or_si128 \
+    (_mm_or_si128 (_mm_cmpeq_epi16 ((v), _mm_set1_epi16 ('\n')), \
+                   _mm_cmpeq_epi16 ((v), _mm_set1_epi16 ('\r'))), \
+     _mm_or_si128 (_mm_cmpeq_epi16 ((v), _mm_set1_epi16 (0x85)), \
+                   _mm_cmpeq_epi16 (_mm_and_si128 \
+                                    ((v), _mm_set1_epi16 ((short) 0xFFFE)), \
+                                    _mm_set1_epi16 (0x2028)))))
+
+static CFIndex
+GSNewlineFindSSE2 (const UInt8 *s, CFIndex n, Boolean backwards)
+{
+  const __m128i lf = _mm_set1_epi8 ('\n');
+  const __m128i cr = _mm_set1_epi8 ('\r');
+  const __m128i nel = _mm_set1_epi8 ((char) 0x85);
+  CFIndex i;
+  CFIndex r;
+  UInt32 m;
+  __m128i v;
+
+  if (backwards)
+    {
+      for (i = n; i >= 16; i -= 16)
+        {
+          v = _mm_loadu_si128 ((const __m128i *) (s + i - 16));
+          m = _mm_movemask_epi8 (_mm_or_si128 (_mm_or_si128
+                                               (_mm_cmpeq_epi8 (v, lf),
+                                                _mm_cmpeq_epi8 (v, cr)),
+                                               _mm_cmpeq_epi8 (v, nel)));
+          if (m)
+            return i - 16 + 31 - __builtin_clz (m);
+        }
+      return GSNewlineFindScalar (s, i, true);
+    }
+
+  for (i = 0; i + 16 <= n; i += 16)
+    {
+      v = _mm_loadu_si128 ((const __m128i *) (s + i));
+      m = _mm_movemask_epi8 (_mm_or_si128 (_mm_or_si128
+                                           (_mm_cmpeq_epi8 (v, lf),
+                                            _mm_cmpeq_epi8 (v, cr)),
+                                           _mm_cmpeq_epi8 (v, nel)));
+      if (m)
+        return i + __builtin_ctz (m);
+    }
+  r = GSNewlineFindScalar (s + i, n - i, false);
+
+  return r == kCFNotFound ? kCFNotFound : i + r;
+}
+
+static CFIndex
+GSNewlineFind16SSE2 (const UniChar *s, CFIndex n, Boolean backwards)
+{
+  CFIndex i;
+  CFIndex r;
+  UInt32 m;
+  __m128i v;
+
+  if (backwards)
+    {
+      for (i = n; i >= 8; i -= 8)
+        {
+          v = _mm_loadu_si128 ((const __m128i *) (s + i - 8));
+          m = GS_SSE2_NEWLINE16 (v);
+          if (m)
+            return i - 8 + (31 - __builtin_clz (m)) / 2;
+        }
+      return GSNewlineFind16Scalar (s, i, true);
+    }
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      v = _mm_loadu_si128 ((const __m128i *) (s + i));
+      m = GS_SSE2_NEWLINE16 (v);
+      if (m)
+        return i + __builtin_ctz (m) / 2;
+    }
+  r = GSNewlineFind16Scalar (s + i, n - i, false);
+
+  return r == kCFNotFound ? kCFNotFound : i + r;
+}
+#endif
+
+#if defined(GS_HAVE_AVX2_KERNELS)
+__attribute__ ((target ("avx2"))) static CFIndex
+GSASCIILengthAVX2 (const UInt8 *s, CFIndex n)
+{
+  CFIndex i;
+  __m256i v;
+
+  for (i = 0; i + 32 <= n; i += 32)
+    {
+      v = _mm256_loadu_si256 ((const __m256i *) (s + i));
+      if (_mm256_movemask_epi8 (v))
+        break;
+    }
+  /* One more step of 16 leaves less to the portable code. */
+  if (i + 16 <= n
+      && !_mm_movemask_epi8 (_mm_loadu_si128 ((const __m128i *) (s + i))))
+    i += 16;
+
+  return i + GSASCIILengthScalar (s + i, n - i);
+}
+
+__attribute__ ((target ("avx2"))) static CFIndex
+GSASCIIWidenAVX2 (UniChar *d, const UInt8 *s, CFIndex n)
+{
+  CFIndex i;
+  __m256i v;
+  __m128i w;
+
+  for (i = 0; i + 32 <= n; i += 32)
+    {
+      v = _mm256_loadu_si256 ((const __m256i *) (s + i));
+      if (_mm256_movemask_epi8 (v))
+        break;
+      _mm256_storeu_si256 ((__m256i *) (d + i),
+                           _mm256_cvtepu8_epi16 (_mm256_castsi256_si128 (v)));
+      _mm256_storeu_si256 ((__m256i *) (d + i + 16),
+                           _mm256_cvtepu8_epi16 (_mm256_extracti128_si256
+                                                 (v, 1)));
+    }
+  if (i + 16 <= n)
+    {
+      w = _mm_loadu_si128 ((const __m128i *) (s + i));
+      if (!_mm_movemask_epi8 (w))
+        {
+          _mm256_storeu_si256 ((__m256i *) (d + i), _mm256_cvtepu8_epi16 (w));
+          i += 16;
+        }
+    }
+
+  return i + GSASCIIWidenScalar (d + i, s + i, n - i);
+}
+
+__attribute__ ((target ("avx2"))) static CFIndex
+GSASCIILength16AVX2 (const UniChar *s, CFIndex n)
+{
+  const __m256i mask = _mm256_set1_epi16 ((short) 0xFF80);
+  CFIndex i;
+  __m256i v;
+
+  for (i = 0; i + 32 <= n; i += 32)
+    {
+      v = _mm256_or_si256 (_mm256_loadu_si256 ((const __m256i *) (s + i)),
+                           _mm256_loadu_si256 ((const __m256i *)
+                                               (s + i + 16)));
+      if (!_mm256_testz_si256 (v, mask))
+        break;
+    }
+  if (i + 16 <= n
+      && _mm256_testz_si256 (_mm256_loadu_si256 ((const __m256i *) (s + i)),
+                             mask))
+    i += 16;
+
+  return i + GSASCIILength16Scalar (s + i, n - i);
+}
+
+__attribute__ ((target ("avx2"))) static CFIndex
+GSASCIINarrowAVX2 (UInt8 *d, const UniChar *s, CFIndex n)
+{
+  const __m256i mask = _mm256_set1_epi16 ((short) 0xFF80);
+  CFIndex i;
+  __m256i a;
+  __m256i b;
+  __m256i v;
+
+  for (i = 0; i + 32 <= n; i += 32)
+    {
+      a = _mm256_loadu_si256 ((const __m256i *) (s + i));
+      b = _mm256_loadu_si256 ((const __m256i *) (s + i + 16));
+      if (!_mm256_testz_si256 (_mm256_or_si256 (a, b), mask))
+        break;
+      /* packus works within 128-bit lanes, so put the quarters back in
+         order afterwards. */
+      v = _mm256_permute4x64_epi64 (_mm256_packus_epi16 (a, b), 0xD8);
+      _mm256_storeu_si256 ((__m256i *) (d + i), v);
+    }
+  if (i + 16 <= n)
+    {
+      a = _mm256_loadu_si256 ((const __m256i *) (s + i));
+      if (_mm256_testz_si256 (a, mask))
+        {
+          _mm_storeu_si128 ((__m128i *) (d + i),
+                            _mm_packus_epi16 (_mm256_castsi256_si128 (a),
+                                              _mm256_extracti128_si256 (a, 1)));
+          i += 16;
+        }
+    }
+
+  return i + GSASCIINarrowScalar (d + i, s + i, n - i);
+}
+
+__attribute__ ((target ("avx2"))) static void
+GSLatin1WidenAVX2 (UniChar *d, const UInt8 *s, CFIndex n)
+{
+  CFIndex i;
+  __m128i v;
+
+  for (i = 0; i + 16 <= n; i += 16)
+    {
+      v = _mm_loadu_si128 ((const __m128i *) (s + i));
+      _mm256_storeu_si256 ((__m256i *) (d + i), _mm256_cvtepu8_epi16 (v));
+    }
+  GSLatin1WidenScalar (d + i, s + i, n - i);
+}
+
+__attribute__ ((target ("avx2"))) static CFIndex
+GSLatin1NarrowAVX2 (UInt8 *d, const UniChar *s, CFIndex n)
+{
+  const __m256i mask = _mm256_set1_epi16 ((short) 0xFF00);
+  CFIndex i;
+  __m256i a;
+  __m256i b;
+  __m256i v;
+
+  for (i = 0; i + 32 <= n; i += 32)
+    {
+      a = _mm256_loadu_si256 ((const __m256i *) (s + i));
+      b = _mm256_loadu_si256 ((const __m256i *) (s + i + 16));
+      if (!_mm256_testz_si256 (_mm256_or_si256 (a, b), mask))
+        break;
+      v = _mm256_permute4x64_epi64 (_mm256_packus_epi16 (a, b), 0xD8);
+      _mm256_storeu_si256 ((__m256i *) (d + i), v);
+    }
+  if (i + 16 <= n)
+    {
+      a = _mm256_loadu_si256 ((const __m256i *) (s + i));
+      if (_mm256_testz_si256 (a, mask))
+        {
+          _mm_storeu_si128 ((__m128i *) (d + i),
+                            _mm_packus_epi16 (_mm256_castsi256_si128 (a),
+                                              _mm256_extracti128_si256 (a, 1)));
+          i += 16;
+        }
+    }
+
+  return i + GSLatin1NarrowScalar (d + i, s + i, n - i);
+}
+
+#define GS_AVX2_RANGE(v, lo, hi) \
+  _mm256_and_si256 (_mm256_cmpgt_epi16 ((v), _mm256_set1_epi16 ((lo) - 1)), \
+                    _mm256_cmpgt_epi16 (_mm256_set1_epi16 ((hi) + 1), (v)))
+
+__attribute__ ((target ("avx2"))) static CFIndex
+GSLatin1LowerAVX2 (UniChar *s, CFIndex n, Boolean fold)
+{
+  const __m256i high = _mm256_set1_epi16 ((short) 0xFF00);
+  const __m256i zero = _mm256_setzero_si256 ();
+  CFIndex i;
+  __m256i v;
+  __m256i ok;
+  __m256i m;
+
+  for (i = 0; i + 16 <= n; i += 16)
+    {
+      v = _mm256_loadu_si256 ((const __m256i *) (s + i));
+      ok = _mm256_cmpeq_epi16 (_mm256_and_si256 (v, high), zero);
+      if (fold)
+        ok = _mm256_andnot_si256
+          (_mm256_or_si256 (_mm256_cmpeq_epi16 (v, _mm256_set1_epi16 (0xB5)),
+                            _mm256_cmpeq_epi16 (v, _mm256_set1_epi16 (0xDF))),
+           ok);
+      if ((UInt32) _mm256_movemask_epi8 (ok) != 0xFFFFFFFF)
+        break;
+      m = _mm256_or_si256 (GS_AVX2_RANGE (v, 'A', 'Z'),
+                           _mm256_andnot_si256
+                           (_mm256_cmpeq_epi16 (v, _mm256_set1_epi16 (0xD7)),
+                            GS_AVX2_RANGE (v, 0xC0, 0xDE)));
+      v = _mm256_add_epi16 (v, _mm256_and_si256 (m, _mm256_set1_epi16 (0x20)));
+      _mm256_storeu_si256 ((__m256i *) (s + i), v);
+    }
+
+  return i + GSLatin1LowerScalar (s + i, n - i, fold);
+}
+
+__attribute__ ((target ("avx2"))) static CFIndex
+GSLatin1UpperAVX2 (UniChar *s, CFIndex n)
+{
+  const __m256i high = _mm256_set1_epi16 ((short) 0xFF00);
+  const __m256i zero = _mm256_setzero_si256 ();
+  CFIndex i;
+  __m256i v;
+  __m256i ok;
+  __m256i m;
+
+  for (i = 0; i + 16 <= n; i += 16)
+    {
+      v = _mm256_loadu_si256 ((const __m256i *) (s + i));
+      ok = _mm256_cmpeq_epi16 (_mm256_and_si256 (v, high), zero);
+      ok = _mm256_andnot_si256
+        (_mm256_or_si256
+         (_mm256_or_si256 (_mm256_cmpeq_epi16 (v, _mm256_set1_epi16 (0xB5)),
+                           _mm256_cmpeq_epi16 (v, _mm256_set1_epi16 (0xDF))),
+          _mm256_cmpeq_epi16 (v, _mm256_set1_epi16 (0xFF))), ok);
+      if ((UInt32) _mm256_movemask_epi8 (ok) != 0xFFFFFFFF)
+        break;
+      m = _mm256_or_si256 (GS_AVX2_RANGE (v, 'a', 'z'),
+                           _mm256_andnot_si256
+                           (_mm256_cmpeq_epi16 (v, _mm256_set1_epi16 (0xF7)),
+                            GS_AVX2_RANGE (v, 0xE0, 0xFE)));
+      v = _mm256_sub_epi16 (v, _mm256_and_si256 (m, _mm256_set1_epi16 (0x20)));
+      _mm256_storeu_si256 ((__m256i *) (s + i), v);
+    }
+
+  return i + GSLatin1UpperScalar (s + i, n - i);
+}
+/* The AVX2 form of GS_SSE2_NEWLINE16, for 16 UTF-16 code units. */
+#define GS_AVX2_NEWLINE16(v) \
+  (UInt32) _mm256_movemask_epi8 (_mm256_or_si256 \
+    (_mm256_or_si256 (_mm256_cmpeq_epi16 ((v), _mm256_set1_epi16 ('\n')), \
+                      _mm256_cmpeq_epi16 ((v), _mm256_set1_epi16 ('\r'))), \
+     _mm256_or_si256 (_mm256_cmpeq_epi16 ((v), _mm256_set1_epi16 (0x85)), \
+                      _mm256_cmpeq_epi16 (_mm256_and_si256 \
+                                          ((v), _mm256_set1_epi16 \
+                                           ((short) 0xFFFE)), \
+                                          _mm256_set1_epi16 (0x2028)))))
+
+__attribute__ ((target ("avx2"))) static CFIndex
+GSNewlineFindAVX2 (const UInt8 *s, CFIndex n, Boolean backwards)
+{
+  const __m256i lf = _mm256_set1_epi8 ('\n');
+  const __m256i cr = _mm256_set1_epi8 ('\r');
+  const __m256i nel = _mm256_set1_epi8 ((char) 0x85);
+  CFIndex i;
+  CFIndex r;
+  UInt32 m;
+  __m256i v;
+
+  if (backwards)
+    {
+      for (i = n; i >= 32; i -= 32)
+        {
+          v = _mm256_loadu_si256 ((const __m256i *) (s + i - 32));
+          m = (UInt32) _mm256_movemask_epi8
+            (_mm256_or_si256 (_mm256_or_si256 (_mm256_cmpeq_epi8 (v, lf),
+                                               _mm256_cmpeq_epi8 (v, cr)),
+                              _mm256_cmpeq_epi8 (v, nel)));
+          if (m)
+            return i - 1 - __builtin_clz (m);
+        }
+      return GSNewlineFindScalar (s, i, true);
+    }
+
+  for (i = 0; i + 32 <= n; i += 32)
+    {
+      v = _mm256_loadu_si256 ((const __m256i *) (s + i));
+      m = (UInt32) _mm256_movemask_epi8
+        (_mm256_or_si256 (_mm256_or_si256 (_mm256_cmpeq_epi8 (v, lf),
+                                           _mm256_cmpeq_epi8 (v, cr)),
+                          _mm256_cmpeq_epi8 (v, nel)));
+      if (m)
+        return i + __builtin_ctz (m);
+    }
+  r = GSNewlineFindScalar (s + i, n - i, false);
+
+  return r == kCFNotFound ? kCFNotFound : i + r;
+}
+
+__attribute__ ((target ("avx2"))) static CFIndex
+GSNewlineFind16AVX2 (const UniChar *s, CFIndex n, Boolean backwards)
+{
+  CFIndex i;
+  CFIndex r;
+  UInt32 m;
+  __m256i v;
+
+  if (backwards)
+    {
+      for (i = n; i >= 16; i -= 16)
+        {
+          v = _mm256_loadu_si256 ((const __m256i *) (s + i - 16));
+          m = GS_AVX2_NEWLINE16 (v);
+          if (m)
+            return i - 16 + (31 - __builtin_clz (m)) / 2;
+        }
+      return GSNewlineFind16Scalar (s, i, true);
+    }
+
+  for (i = 0; i + 16 <= n; i += 16)
+    {
+      v = _mm256_loadu_si256 ((const __m256i *) (s + i));
+      m = GS_AVX2_NEWLINE16 (v);
+      if (m)
+        return i + __builtin_ctz (m) / 2;
+    }
+  r = GSNewlineFind16Scalar (s + i, n - i, false);
+
+  return r == kCFNotFound ? kCFNotFound : i + r;
+}
+#endif
+
+/* __builtin_cpu_supports() would link in libgcc's CPU probe, which runs
+ * at startup and executes about ten CPUID instructions.  Each one traps to
+ * the hypervisor in a virtual machine, so only the two leaves needed for
+ * AVX2 are read here, when the first kernel table is set up.
+ */
+Boolean
+GSCPUHasAVX2 (void)
+{
+#if defined(GS_HAVE_AVX2_KERNELS)
+  unsigned int a;
+  unsigned int b;
+  unsigned int c;
+  unsigned int d;
+
+#if defined(__i386__)
+  if (__get_cpuid_max (0, NULL) < 1)
+    return false;
+#endif
+  __cpuid (1, a, b, c, d);
+  if ((c & (bit_OSXSAVE | bit_AVX)) != (bit_OSXSAVE | bit_AVX))
+    return false;
+  /* The operating system must save the SSE and AVX registers. */
+  __asm__ ("xgetbv" : "=a" (a), "=d" (d) : "c" (0));
+  if ((a & 6) != 6)
+    return false;
+  __cpuid_count (7, 0, a, b, c, d);
+  return (b & bit_AVX2) != 0;
+#else
+  return false;
+#endif
+}
+
+static GSASCIIKernels _kGSASCIIKernels;
+static CFIndex _kGSASCIIKernelsInitialized = 0;
+
+static void
+GSASCIIKernelsInitialize (void)
+{
+  _kGSASCIIKernels.length = GSASCIILengthScalar;
+  _kGSASCIIKernels.widen = GSASCIIWidenScalar;
+  _kGSASCIIKernels.length16 = GSASCIILength16Scalar;
+  _kGSASCIIKernels.narrow = GSASCIINarrowScalar;
+  _kGSASCIIKernels.latin1Widen = GSLatin1WidenScalar;
+  _kGSASCIIKernels.latin1Narrow = GSLatin1NarrowScalar;
+  _kGSASCIIKernels.latin1Lower = GSLatin1LowerScalar;
+  _kGSASCIIKernels.latin1Upper = GSLatin1UpperScalar;
+  _kGSASCIIKernels.newline = GSNewlineFindScalar;
+  _kGSASCIIKernels.newline16 = GSNewlineFind16Scalar;
+#if defined(__SSE2__)
+  _kGSASCIIKernels.length = GSASCIILengthSSE2;
+  _kGSASCIIKernels.widen = GSASCIIWidenSSE2;
+  _kGSASCIIKernels.length16 = GSASCIILength16SSE2;
+  _kGSASCIIKernels.narrow = GSASCIINarrowSSE2;
+  _kGSASCIIKernels.latin1Widen = GSLatin1WidenSSE2;
+  _kGSASCIIKernels.latin1Narrow = GSLatin1NarrowSSE2;
+  _kGSASCIIKernels.latin1Lower = GSLatin1LowerSSE2;
+  _kGSASCIIKernels.latin1Upper = GSLatin1UpperSSE2;
+  _kGSASCIIKernels.newline = GSNewlineFindSSE2;
+  _kGSASCIIKernels.newline16 = GSNewlineFind16SSE2;
+#endif
+#if defined(GS_HAVE_AVX2_KERNELS)
+  if (GSCPUHasAVX2 ())
+    {
+      _kGSASCIIKernels.length = GSASCIILengthAVX2;
+      _kGSASCIIKernels.widen = GSASCIIWidenAVX2;
+      _kGSASCIIKernels.length16 = GSASCIILength16AVX2;
+      _kGSASCIIKernels.narrow = GSASCIINarrowAVX2;
+      _kGSASCIIKernels.latin1Widen = GSLatin1WidenAVX2;
+      _kGSASCIIKernels.latin1Narrow = GSLatin1NarrowAVX2;
+      _kGSASCIIKernels.latin1Lower = GSLatin1LowerAVX2;
+      _kGSASCIIKernels.latin1Upper = GSLatin1UpperAVX2;
+      _kGSASCIIKernels.newline = GSNewlineFindAVX2;
+      _kGSASCIIKernels.newline16 = GSNewlineFind16AVX2;
+    }
+#endif
+}
+
+CF_INLINE const GSASCIIKernels *
+GSASCIIKernelsGet (void)
+{
+  GSOnce (&_kGSASCIIKernelsInitialized, GSASCIIKernelsInitialize);
+  return &_kGSASCIIKernels;
+}
+
+CFIndex
+GSASCIILength (const UInt8 *s, CFIndex n)
+{
+  return GSASCIIKernelsGet ()->length (s, n);
+}
+
+CFIndex
+GSASCIIWiden (UniChar *d, const UInt8 *s, CFIndex n)
+{
+  return GSASCIIKernelsGet ()->widen (d, s, n);
+}
+
+CFIndex
+GSASCIILength16 (const UniChar *s, CFIndex n)
+{
+  return GSASCIIKernelsGet ()->length16 (s, n);
+}
+
+CFIndex
+GSASCIINarrow (UInt8 *d, const UniChar *s, CFIndex n)
+{
+  return GSASCIIKernelsGet ()->narrow (d, s, n);
+}
+
+void
+GSLatin1Widen (UniChar *d, const UInt8 *s, CFIndex n)
+{
+  GSASCIIKernelsGet ()->latin1Widen (d, s, n);
+}
+
+CFIndex
+GSLatin1Narrow (UInt8 *d, const UniChar *s, CFIndex n)
+{
+  return GSASCIIKernelsGet ()->latin1Narrow (d, s, n);
+}
+
+CFIndex
+GSLatin1Lowercase (UniChar *s, CFIndex n, Boolean fold)
+{
+  return GSASCIIKernelsGet ()->latin1Lower (s, n, fold);
+}
+
+CFIndex
+GSLatin1Uppercase (UniChar *s, CFIndex n)
+{
+  return GSASCIIKernelsGet ()->latin1Upper (s, n);
+}
+
+CFIndex
+GSNewlineFind (const UInt8 *s, CFIndex n, Boolean backwards)
+{
+  return GSASCIIKernelsGet ()->newline (s, n, backwards);
+}
+
+CFIndex
+GSNewlineFind16 (const UniChar *s, CFIndex n, Boolean backwards)
+{
+  return GSASCIIKernelsGet ()->newline16 (s, n, backwards);
+}
+
 static CFIndex
 GSUnicodeFromNonLossyASCII (const char *s, CFIndex slen, UniChar lossChar,
                             UniChar * d, CFIndex dlen, CFIndex * usedLen)
@@ -204,13 +1215,51 @@ GSUnicodeFromEncoding (UniChar ** d, const UniChar * const dLimit,
 
   if (enc == kCFStringEncodingUTF8)
     {
+      const UInt8 *sWorking;
       UTF32Char c;
       CFIndex add;
 
       GSUTF8CharacterSkipByteOrderMark (s, sLimit);
-      while (*s < sLimit)
+      sWorking = *s;
+      while (sWorking < sLimit)
         {
-          add = GSUTF8CharacterGet (*s, sLimit, &c);
+          if (*sWorking < 0x80)
+            {
+              const UInt8 *end;
+              CFIndex room;
+              CFIndex run;
+
+              /* Runs between other characters are usually short and
+                 are not worth a call to the kernels. */
+              run = sLimit - sWorking;
+              if (run > GS_ASCII_INLINE_RUN)
+                run = GS_ASCII_INLINE_RUN;
+              if (dLimit != NULL && dLimit - dWorking >= run
+                  && (run < GS_ASCII_INLINE_RUN
+                      || !GSASCIIRunIsLong (sWorking)))
+                {
+                  end = sWorking + run;
+                  while (sWorking < end && *sWorking < 0x80)
+                    *dWorking++ = *sWorking++;
+                  continue;
+                }
+
+              /* Widen as much of the ASCII run as fits, then only count
+                 the rest. */
+              room = (dLimit != NULL && dWorking < dLimit)
+                ? dLimit - dWorking : 0;
+              run = sLimit - sWorking;
+              if (run > room)
+                run = room;
+              run = run > 0 ? GSASCIIWiden (dWorking, sWorking, run) : 0;
+              if (run == 0)
+                run = GSASCIILength (sWorking, sLimit - sWorking);
+              sWorking += run;
+              dWorking += run;
+              continue;
+            }
+
+          add = GSUTF8CharacterGet (sWorking, sLimit, &c);
           /* RFC 3629 (https://tools.ietf.org/html/rfc3629) specifically
              prohibits encoding surrogates in UTF-8.
            */
@@ -222,9 +1271,10 @@ GSUnicodeFromEncoding (UniChar ** d, const UniChar * const dLimit,
                 break;
               add = 1;
             }
-          *s += add;
+          sWorking += add;
           dWorking += GSUTF16CharacterAppend (dWorking, dLimit, c);
         }
+      *s = sWorking;
     }
   else if (enc == kCFStringEncodingUTF16
            || enc == kCFStringEncodingUTF16BE
@@ -270,7 +1320,7 @@ GSUnicodeFromEncoding (UniChar ** d, const UniChar * const dLimit,
                 {
                   if (GSCharacterIsLeadSurrogate (c)
                       && sWorking < (const UTF16Char *) sLimit
-                      && GSCharacterIsTrailSurrogate (*sWorking))
+                      && GSCharacterIsTrailSurrogate (CFSwapInt16 (*sWorking)))
                     {
                       c =
                         (c << 10) + CFSwapInt16 (*sWorking++) -
@@ -346,9 +1396,12 @@ GSUnicodeFromEncoding (UniChar ** d, const UniChar * const dLimit,
             {
               c = CFSwapInt32 (*sWorking);
               if (GSCharacterIsSurrogate (c) || c > 0x10FFFF)
-                c = loss;
-              else
-                break;
+                {
+                  if (loss)
+                    c = loss;
+                  else
+                    break;
+                }
               ++sWorking;
               dWorking += GSUTF16CharacterAppend (dWorking, dLimit, c);
             }
@@ -358,10 +1411,13 @@ GSUnicodeFromEncoding (UniChar ** d, const UniChar * const dLimit,
           while (sWorking < (const UTF32Char *) sLimit)
             {
               c = *sWorking;
-              if ((GSCharacterIsSurrogate (c) || c > 0x10FFFF) && loss)
-                c = loss;
-              else
-                break;
+              if (GSCharacterIsSurrogate (c) || c > 0x10FFFF)
+                {
+                  if (loss)
+                    c = loss;
+                  else
+                    break;
+                }
               ++sWorking;
               dWorking += GSUTF16CharacterAppend (dWorking, dLimit, c);
             }
@@ -370,19 +1426,17 @@ GSUnicodeFromEncoding (UniChar ** d, const UniChar * const dLimit,
     }
   else if (enc == kCFStringEncodingASCII || enc == kCFStringEncodingISOLatin1)
     {
-      const UInt8 *sWorking;
-      UInt8 c;
-
-      sWorking = *s;
-
-      while (sWorking < sLimit)
-        {
-          c = *sWorking++;
-          if (dWorking < dLimit)
-            *dWorking = c;
-          ++dWorking;
-        }
-      *s = sWorking;
+      CFIndex count;
+      CFIndex room;
+
+      count = sLimit - *s;
+      room = (dLimit != NULL && dWorking < dLimit) ? dLimit - dWorking : 0;
+      if (room > count)
+        room = count;
+      if (room > 0)
+        GSLatin1Widen (dWorking, *s, room);
+      dWorking += count;
+      *s = sLimit;
     }
   else if (enc == kCFStringEncodingNonLossyASCII)
     {
@@ -390,7 +1444,11 @@ GSUnicodeFromEncoding (UniChar ** d, const UniChar * const dLimit,
     }
   else
     {
-      /* FIXME */
+      CFIndex room;
+
+      room = (dLimit != NULL && dWorking < dLimit) ? dLimit - dWorking : 0;
+      dWorking += GSStringEncodingToUnicode (dWorking, room, enc, s, sLimit,
+                                             loss);
     }
 
   *d = (dWorking > dLimit) ? (UniChar *) dLimit : dWorking;
@@ -413,14 +1471,74 @@ GSUnicodeToEncoding (UInt8 ** d, const UInt8 * const dLimit,
 
   if (enc == kCFStringEncodingUTF8)
     {
+      const UniChar *sWorking;
       UTF32Char c;
       CFIndex add;
 
       if (addBOM)
         dStop += GSUTF8CharacterAppendByteOrderMark (dStop, dLimit);
-      while (*s < sLimit && (dLimit == NULL || dStop < dLimit))
+      sWorking = *s;
+      /* No character takes more than four bytes, so only the last few
+         bytes of the buffer need a check that the next one fits. */
+      while (sWorking < sLimit && (dLimit == NULL || dLimit - dStop >= 4))
         {
-          add = GSUTF16CharacterGet (*s, sLimit, &c);
+          if (*sWorking < 0x80)
+            {
+              const UniChar *end;
+              CFIndex run;
+
+              run = sLimit - sWorking;
+              if (run > GS_ASCII_INLINE_RUN)
+                run = GS_ASCII_INLINE_RUN;
+              if (dLimit != NULL && dLimit - dStop >= run
+                  && (run < GS_ASCII_INLINE_RUN
+                      || !GSASCIIRunIsLong16 (sWorking)))
+                {
+                  end = sWorking + run;
+                  while (sWorking < end && *sWorking < 0x80)
+                    *dStop++ = *sWorking++;
+                  continue;
+                }
+
+              run = sLimit - sWorking;
+              if (dLimit == NULL)
+                {
+                  run = GSASCIILength16 (sWorking, run);
+                }
+              else
+                {
+                  if (run > dLimit - dStop)
+                    run = dLimit - dStop;
+                  run = GSASCIINarrow (dStop, sWorking, run);
+                }
+              sWorking += run;
+              dStop += run;
+              continue;
+            }
+
+          /* There is room for any character here, so the rest of the
+             Basic Multilingual Plane is written out directly. */
+          c = *sWorking;
+          if (dLimit != NULL && !GSCharacterIsSurrogate (c))
+            {
+              if (c < 0x800)
+                {
+                  dStop[0] = 0xC0 | (c >> 6);
+                  dStop[1] = 0x80 | (c & 0x3F);
+                  dStop += 2;
+                }
+              else
+                {
+                  dStop[0] = 0xE0 | (c >> 12);
+                  dStop[1] = 0x80 | ((c >> 6) & 0x3F);
+                  dStop[2] = 0x80 | (c & 0x3F);
+                  dStop += 3;
+                }
+              ++sWorking;
+              continue;
+            }
+
+          add = GSUTF16CharacterGet (sWorking, sLimit, &c);
           if (add == 0)
             {
               if (loss)
@@ -429,9 +1547,29 @@ GSUnicodeToEncoding (UInt8 ** d, const UInt8 * const dLimit,
                 break;
               add = 1;
             }
-          *s += add;
+          sWorking += add;
+          dStop += GSUTF8CharacterAppend (dStop, dLimit, c);
+        }
+      /* An invalid character that stopped the loop above stops this one
+         too. */
+      while (sWorking < sLimit && dLimit != NULL && dStop < dLimit)
+        {
+          add = GSUTF16CharacterGet (sWorking, sLimit, &c);
+          if (add == 0)
+            {
+              if (loss)
+                c = loss;
+              else
+                break;
+              add = 1;
+            }
+          /* Do not count a character that does not fit. */
+          if (dLimit - dStop < GSUTF8CharacterLength (c))
+            break;
+          sWorking += add;
           dStop += GSUTF8CharacterAppend (dStop, dLimit, c);
         }
+      *s = sWorking;
     }
   else if (enc == kCFStringEncodingUTF16
            || enc == kCFStringEncodingUTF16BE
@@ -444,37 +1582,44 @@ GSUnicodeToEncoding (UInt8 ** d, const UInt8 * const dLimit,
 
       dWorking = (UTF16Char *) dStart;
 
-      if (addBOM && dWorking < (UTF16Char *) dLimit)
+      if (addBOM)
         {
-          if (dLimit != NULL)
-            *dWorking = kGSUTF16CharacterByteOrderMark;
-          ++dWorking;
+          if (dLimit == NULL)
+            ++dWorking;
+          else if (dWorking < (UTF16Char *) dLimit)
+            *dWorking++ = kGSUTF16CharacterByteOrderMark;
         }
 
-      dLen = dLimit - (const UInt8*) dWorking;
-      sLen = sLimit - *s;
-      bytesToCopy = dLen > sLen ? sLen : dLen;
-      GSMemoryCopy (dWorking, *s, bytesToCopy);
+      /* Both lengths are in bytes.  Only whole code units are copied. */
+      sLen = (sLimit - *s) * sizeof (UniChar);
+      if (dLimit == NULL)
+        {
+          bytesToCopy = sLen;
+        }
+      else
+        {
+          dLen = dLimit - (const UInt8 *) dWorking;
+          bytesToCopy = dLen > sLen ? sLen : dLen & ~(CFIndex) 1;
+          GSMemoryCopy (dWorking, *s, bytesToCopy);
 
 #if __BIG_ENDIAN__
-      if (enc == kCFStringEncodingUTF32LE)
+          if (enc == kCFStringEncodingUTF16LE)
 #else
-      if (enc == kCFStringEncodingUTF32BE)
+          if (enc == kCFStringEncodingUTF16BE)
 #endif
-        {
-          dWorking = (UTF16Char *) dStart;
-          while (dWorking < (UTF16Char *) dLimit)
             {
-              *dWorking = CFSwapInt16 (*dWorking);
-              ++dWorking;
+              UTF16Char *dSwap;
+
+              dSwap = dWorking;
+              while (dSwap < dWorking + bytesToCopy / sizeof (UTF16Char))
+                {
+                  *dSwap = CFSwapInt16 (*dSwap);
+                  ++dSwap;
+                }
             }
-          dStop = (UInt8 *) dWorking;
-        }
-      else
-        {
-          dStop += bytesToCopy;
         }
 
+      dStop = (UInt8 *) dWorking + bytesToCopy;
       *s += bytesToCopy / sizeof (UniChar);
     }
   else if (enc == kCFStringEncodingUTF32
@@ -531,12 +1676,32 @@ GSUnicodeToEncoding (UInt8 ** d, const UInt8 * const dLimit,
       UInt8 *dWorking;
       const UniChar *sWorking;
       UniChar c;
+      CFIndex run;
 
       dWorking = dStart;
       sWorking = *s;
 
       while (sWorking < sLimit && (dLimit == NULL || dWorking < dLimit))
         {
+          /* Copy everything up to the next character that does not fit. */
+          run = sLimit - sWorking;
+          if (dLimit == NULL)
+            {
+              /* Every character takes one byte, lost or not. */
+              sWorking += run;
+              dWorking += run;
+            }
+          else
+            {
+              if (run > dLimit - dWorking)
+                run = dLimit - dWorking;
+              run = GSASCIINarrow (dWorking, sWorking, run);
+              sWorking += run;
+              dWorking += run;
+            }
+          if (sWorking == sLimit || (dLimit != NULL && dWorking == dLimit))
+            break;
+
           c = *sWorking++;
           if (c > 0x7F)
             c = loss;
@@ -552,12 +1717,32 @@ GSUnicodeToEncoding (UInt8 ** d, const UInt8 * const dLimit,
       UInt8 *dWorking;
       const UniChar *sWorking;
       UniChar c;
+      CFIndex run;
 
       dWorking = dStart;
       sWorking = *s;
 
       while (sWorking < sLimit && (dLimit == NULL || dWorking < dLimit))
         {
+          /* Copy everything up to the next character that does not fit. */
+          run = sLimit - sWorking;
+          if (dLimit == NULL)
+            {
+              /* Every character takes one byte, lost or not. */
+              sWorking += run;
+              dWorking += run;
+            }
+          else
+            {
+              if (run > dLimit - dWorking)
+                run = dLimit - dWorking;
+              run = GSLatin1Narrow (dWorking, sWorking, run);
+              sWorking += run;
+              dWorking += run;
+            }
+          if (sWorking == sLimit || (dLimit != NULL && dWorking == dLimit))
+            break;
+
           c = *sWorking++;
           if (c > 0xFF)
             c = loss;
@@ -573,7 +1758,10 @@ GSUnicodeToEncoding (UInt8 ** d, const UInt8 * const dLimit,
     }
   else
     {
-      /* FIXME */
+      dStop += GSStringEncodingFromUnicode (dLimit != NULL ? dStart : NULL,
+                                            dLimit != NULL
+                                            ? dLimit - dStart : 0, enc, s,
+                                            sLimit, loss);
     }
 
   *d = dStop;
@@ -662,265 +1850,6 @@ static const UInt8 fmt_table[] = {
   FMT_UNKNOWN, FMT_UNKNOWN, FMT_UNKNOWN, FMT_UNKNOWN
 };
 
-/* Step 0: At the beginning of the spec */
-#define STEP_0_JUMP do \
-{ \
-  type = (fmt < fmtlimit) ? *fmt++ : 0; \
-  switch ((type >= 0x20 && type <= 0x7A) ? fmt_table[type - 0x20] : 0) \
-    { \
-      case FMT_UNKNOWN:     goto handle_error; \
-      case FMT_SPACE:       goto flag_space_prefix; \
-      case FMT_HASH:        goto flag_alternate; \
-      case FMT_QUOTE:       goto flag_grouping; \
-      case FMT_PLUS:        goto flag_show_sign; \
-      case FMT_MINUS:       goto flag_left_align; \
-      case FMT_ZERO:        goto flag_pad_zeros; \
-      case FMT_NUMBER:      goto width_number; \
-      case FMT_POSITION:    goto get_position; \
-      case FMT_WIDTH_AST:   goto width_asterisk; \
-      case FMT_PRECISION:   goto precision; \
-      case FMT_MOD_SHORT:   goto mod_short; \
-      case FMT_MOD_LONG:    goto mod_long; \
-      case FMT_MOD_SIZE:    goto mod_size_t; \
-      case FMT_MOD_PTRDIFF: goto mod_ptrdiff_t; \
-      case FMT_MOD_INTMAX:  goto mod_intmax_t; \
-      case FMT_MOD_LDBL:    goto mod_ldbl; \
-      case FMT_PERCENT:     goto fmt_percent; \
-      case FMT_OBJECT:      goto fmt_object; \
-      case FMT_POINTER:     goto fmt_pointer; \
-      case FMT_INTEGER:     goto fmt_decimal; \
-      case FMT_OCTAL:       goto fmt_octal; \
-      case FMT_HEX:         goto fmt_hex; \
-      case FMT_UINTEGER:    goto fmt_unsigned_decimal; \
-      case FMT_GETCOUNT:    goto fmt_getcount; \
-      case FMT_DOUBLE:      goto fmt_double; \
-      case FMT_CHARACTER:   goto fmt_character; \
-      case FMT_STRING:      goto fmt_string; \
-    } \
-} while (0)
-
-/* Step 1: After reading flags and/or width */
-#define STEP_1_JUMP do \
-{ \
-  type = (fmt < fmtlimit) ? *fmt++ : 0; \
-  switch ((type >= 0x20 && type <= 0x7A) ? fmt_table[type - 0x20] : 0) \
-    { \
-      case FMT_UNKNOWN:     goto handle_error; \
-      case FMT_SPACE:       goto handle_error; \
-      case FMT_HASH:        goto handle_error; \
-      case FMT_QUOTE:       goto handle_error; \
-      case FMT_PLUS:        goto handle_error; \
-      case FMT_MINUS:       goto handle_error; \
-      case FMT_ZERO:        goto handle_error; \
-      case FMT_NUMBER:      goto handle_error; \
-      case FMT_POSITION:    goto get_position; \
-      case FMT_WIDTH_AST:   goto handle_error; \
-      case FMT_PRECISION:   goto precision; \
-      case FMT_MOD_SHORT:   goto mod_short; \
-      case FMT_MOD_LONG:    goto mod_long; \
-      case FMT_MOD_SIZE:    goto mod_size_t; \
-      case FMT_MOD_PTRDIFF: goto mod_ptrdiff_t; \
-      case FMT_MOD_INTMAX:  goto mod_intmax_t; \
-      case FMT_MOD_LDBL:    goto mod_ldbl; \
-      case FMT_PERCENT:     goto fmt_percent; \
-      case FMT_OBJECT:      goto fmt_object; \
-      case FMT_POINTER:     goto fmt_pointer; \
-      case FMT_INTEGER:     goto fmt_decimal; \
-      case FMT_OCTAL:       goto fmt_octal; \
-      case FMT_HEX:         goto fmt_hex; \
-      case FMT_UINTEGER:    goto fmt_unsigned_decimal; \
-      case FMT_GETCOUNT:    goto fmt_getcount; \
-      case FMT_DOUBLE:      goto fmt_double; \
-      case FMT_CHARACTER:   goto fmt_character; \
-      case FMT_STRING:      goto fmt_string; \
-    } \
-} while (0)
-
-/* Step 2: After processing precision */
-#define STEP_2_JUMP do \
-{ \
-  type = (fmt < fmtlimit) ? *fmt++ : 0; \
-  switch ((type >= 0x20 && type <= 0x7A) ? fmt_table[type - 0x20] : 0) \
-    { \
-      case FMT_UNKNOWN:     goto handle_error; \
-      case FMT_SPACE:       goto handle_error; \
-      case FMT_HASH:        goto handle_error; \
-      case FMT_QUOTE:       goto handle_error; \
-      case FMT_PLUS:        goto handle_error; \
-      case FMT_MINUS:       goto handle_error; \
-      case FMT_ZERO:        goto handle_error; \
-      case FMT_NUMBER:      goto handle_error; \
-      case FMT_POSITION:    goto handle_error; \
-      case FMT_WIDTH_AST:   goto handle_error; \
-      case FMT_PRECISION:   goto handle_error; \
-      case FMT_MOD_SHORT:   goto mod_short; \
-      case FMT_MOD_LONG:    goto mod_long; \
-      case FMT_MOD_SIZE:    goto mod_size_t; \
-      case FMT_MOD_PTRDIFF: goto mod_ptrdiff_t; \
-      case FMT_MOD_INTMAX:  goto mod_intmax_t; \
-      case FMT_MOD_LDBL:    goto mod_ldbl; \
-      case FMT_PERCENT:     goto fmt_percent; \
-      case FMT_OBJECT:      goto fmt_object; \
-      case FMT_POINTER:     goto fmt_pointer; \
-      case FMT_INTEGER:     goto fmt_decimal; \
-      case FMT_OCTAL:       goto fmt_octal; \
-      case FMT_HEX:         goto fmt_hex; \
-      case FMT_UINTEGER:    goto fmt_unsigned_decimal; \
-      case FMT_GETCOUNT:    goto fmt_getcount; \
-      case FMT_DOUBLE:      goto fmt_double; \
-      case FMT_CHARACTER:   goto fmt_character; \
-      case FMT_STRING:      goto fmt_string; \
-    } \
-} while (0)
-
-/* Step 3L: After reading length modifier 'l' */
-#define STEP_3L_JUMP do \
-{ \
-  type = (fmt < fmtlimit) ? *fmt++ : 0; \
-  switch ((type >= 0x20 && type <= 0x7A) ? fmt_table[type - 0x20] : 0) \
-    { \
-      case FMT_UNKNOWN:     goto handle_error; \
-      case FMT_SPACE:       goto handle_error; \
-      case FMT_HASH:        goto handle_error; \
-      case FMT_QUOTE:       goto handle_error; \
-      case FMT_PLUS:        goto handle_error; \
-      case FMT_MINUS:       goto handle_error; \
-      case FMT_ZERO:        goto handle_error; \
-      case FMT_NUMBER:      goto handle_error; \
-      case FMT_POSITION:    goto handle_error; \
-      case FMT_WIDTH_AST:   goto handle_error; \
-      case FMT_PRECISION:   goto handle_error; \
-      case FMT_MOD_SHORT:   goto handle_error; \
-      case FMT_MOD_LONG:    goto mod_longlong; \
-      case FMT_MOD_SIZE:    goto handle_error; \
-      case FMT_MOD_PTRDIFF: goto handle_error; \
-      case FMT_MOD_INTMAX:  goto handle_error; \
-      case FMT_MOD_LDBL:    goto handle_error; \
-      case FMT_PERCENT:     goto fmt_percent; \
-      case FMT_OBJECT:      goto fmt_object; \
-      case FMT_POINTER:     goto fmt_pointer; \
-      case FMT_INTEGER:     goto fmt_decimal; \
-      case FMT_OCTAL:       goto fmt_octal; \
-      case FMT_HEX:         goto fmt_hex; \
-      case FMT_UINTEGER:    goto fmt_unsigned_decimal; \
-      case FMT_GETCOUNT:    goto fmt_getcount; \
-      case FMT_DOUBLE:      goto handle_error; \
-      case FMT_CHARACTER:   goto fmt_character; \
-      case FMT_STRING:      goto fmt_string; \
-    } \
-} while (0)
-
-/* Step 3H: After reading length modifier 'h' */
-#define STEP_3H_JUMP do \
-{ \
-  type = (fmt < fmtlimit) ? *fmt++ : 0; \
-  switch ((type >= 0x20 && type <= 0x7A) ? fmt_table[type - 0x20] : 0) \
-    { \
-      case FMT_UNKNOWN:     goto handle_error; \
-      case FMT_SPACE:       goto handle_error; \
-      case FMT_HASH:        goto handle_error; \
-      case FMT_QUOTE:       goto handle_error; \
-      case FMT_PLUS:        goto handle_error; \
-      case FMT_MINUS:       goto handle_error; \
-      case FMT_ZERO:        goto handle_error; \
-      case FMT_NUMBER:      goto handle_error; \
-      case FMT_POSITION:    goto handle_error; \
-      case FMT_WIDTH_AST:   goto handle_error; \
-      case FMT_PRECISION:   goto handle_error; \
-      case FMT_MOD_SHORT:   goto mod_char; \
-      case FMT_MOD_LONG:    goto handle_error; \
-      case FMT_MOD_SIZE:    goto handle_error; \
-      case FMT_MOD_PTRDIFF: goto handle_error; \
-      case FMT_MOD_INTMAX:  goto handle_error; \
-      case FMT_MOD_LDBL:    goto handle_error; \
-      case FMT_PERCENT:     goto fmt_percent; \
-      case FMT_OBJECT:      goto fmt_object; \
-      case FMT_POINTER:     goto fmt_pointer; \
-      case FMT_INTEGER:     goto fmt_decimal; \
-      case FMT_OCTAL:       goto fmt_octal; \
-      case FMT_HEX:         goto fmt_hex; \
-      case FMT_UINTEGER:    goto fmt_unsigned_decimal; \
-      case FMT_GETCOUNT:    goto fmt_getcount; \
-      case FMT_DOUBLE:      goto handle_error; \
-      case FMT_CHARACTER:   goto fmt_character; \
-      case FMT_STRING:      goto fmt_string; \
-    } \
-} while (0)
-
-/* Step 4INT: After reading an integer conversion specifier */
-#define STEP_4INT_JUMP do \
-{ \
-  type = (fmt < fmtlimit) ? *fmt++ : 0; \
-  switch ((type >= 0x20 && type <= 0x7A) ? fmt_table[type - 0x20] : 0) \
-    { \
-      case FMT_UNKNOWN:     goto handle_error; \
-      case FMT_SPACE:       goto handle_error; \
-      case FMT_HASH:        goto handle_error; \
-      case FMT_QUOTE:       goto handle_error; \
-      case FMT_PLUS:        goto handle_error; \
-      case FMT_MINUS:       goto handle_error; \
-      case FMT_ZERO:        goto handle_error; \
-      case FMT_NUMBER:      goto handle_error; \
-      case FMT_POSITION:    goto handle_error; \
-      case FMT_WIDTH_AST:   goto handle_error; \
-      case FMT_PRECISION:   goto handle_error; \
-      case FMT_MOD_SHORT:   goto handle_error; \
-      case FMT_MOD_LONG:    goto handle_error; \
-      case FMT_MOD_SIZE:    goto handle_error; \
-      case FMT_MOD_PTRDIFF: goto handle_error; \
-      case FMT_MOD_INTMAX:  goto handle_error; \
-      case FMT_MOD_LDBL:    goto handle_error; \
-      case FMT_PERCENT:     goto fmt_percent; \
-      case FMT_OBJECT:      goto fmt_object; \
-      case FMT_POINTER:     goto fmt_pointer; \
-      case FMT_INTEGER:     goto fmt_decimal; \
-      case FMT_OCTAL:       goto fmt_octal; \
-      case FMT_HEX:         goto fmt_hex; \
-      case FMT_UINTEGER:    goto fmt_unsigned_decimal; \
-      case FMT_GETCOUNT:    goto fmt_getcount; \
-      case FMT_DOUBLE:      goto handle_error; \
-      case FMT_CHARACTER:   goto fmt_character; \
-      case FMT_STRING:      goto fmt_string; \
-    } \
-} while (0)
-
-/* Step 4DBL: after reading a long double conversion specifier */
-#define STEP_4DBL_JUMP do \
-{ \
-  type = (fmt < fmtlimit) ? *fmt++ : 0; \
-  switch ((type >= 0x20 && type <= 0x7A) ? fmt_table[type - 0x20] : 0) \
-    { \
-      case FMT_UNKNOWN:     goto handle_error; \
-      case FMT_SPACE:       goto handle_error; \
-      case FMT_HASH:        goto handle_error; \
-      case FMT_QUOTE:       goto handle_error; \
-      case FMT_PLUS:        goto handle_error; \
-      case FMT_MINUS:       goto handle_error; \
-      case FMT_ZERO:        goto handle_error; \
-      case FMT_NUMBER:      goto handle_error; \
-      case FMT_POSITION:    goto handle_error; \
-      case FMT_WIDTH_AST:   goto handle_error; \
-      case FMT_PRECISION:   goto handle_error; \
-      case FMT_MOD_SHORT:   goto handle_error; \
-      case FMT_MOD_LONG:    goto handle_error; \
-      case FMT_MOD_SIZE:    goto handle_error; \
-      case FMT_MOD_PTRDIFF: goto handle_error; \
-      case FMT_MOD_INTMAX:  goto handle_error; \
-      case FMT_MOD_LDBL:    goto handle_error; \
-      case FMT_PERCENT:     goto handle_error; \
-      case FMT_OBJECT:      goto handle_error; \
-      case FMT_POINTER:     goto handle_error; \
-      case FMT_INTEGER:     goto handle_error; \
-      case FMT_OCTAL:       goto handle_error; \
-      case FMT_HEX:         goto handle_error; \
-      case FMT_UINTEGER:    goto handle_error; \
-      case FMT_GETCOUNT:    goto handle_error; \
-      case FMT_DOUBLE:      goto fmt_long_double; \
-      case FMT_CHARACTER:   goto handle_error; \
-      case FMT_STRING:      goto handle_error; \
-    } \
-} while (0)
-
 CF_INLINE CFIndex
 _ustring_length (const UniChar * string, size_t maxlen)
 {
@@ -1147,25 +2076,6 @@ _ldbl_is_nan (long double d)
 #endif
 #endif
 
-/* format MUST already be pointing to a digit */
-static int
-_read_number (const UniChar ** __restrict__ format)
-{
-  int number;
-  const UniChar *start;
-
-  start = *format;
-  number = *(*format)++ - '0';
-  /* Don't read more than 3 characters (max value '999').  This is already
-   * an unrealistically high number for the types of numbers this function
-   * is used for.
-   */
-  while ((**format >= '0') && (**format <= '9') && (*format - start < 3))
-    number = (number * 10) + (*(*format++) - '0');
-
-  return number;
-}
-
 static const UniChar _lookup_upper[] =
   { '0', '1', '2', '3', '4', '5', '6', '7',
   '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'
@@ -1190,9 +2100,24 @@ _uint_to_string (unsigned long long int value, UniChar * bufend,
       while ((value >>= 3));
       break;
     case 10:
-      do
-        *--cur = lookup[value % base];
-      while ((value /= base));
+      /* Two digits per division. */
+      while (value >= 100)
+        {
+          const char *pair = GSDigitPairs + 2 * (value % 100);
+
+          value /= 100;
+          *--cur = pair[1];
+          *--cur = pair[0];
+        }
+      if (value >= 10)
+        {
+          *--cur = GSDigitPairs[2 * value + 1];
+          *--cur = GSDigitPairs[2 * value];
+        }
+      else
+        {
+          *--cur = lookup[value];
+        }
       break;
     case 16:
       do
@@ -1203,6 +2128,200 @@ _uint_to_string (unsigned long long int value, UniChar * bufend,
   return cur;
 }
 
+static Boolean
+_dbl_is_negative (double d)
+{
+  UInt64 bits;
+
+  memcpy (&bits, &d, sizeof (bits));
+  return (bits >> 63) != 0;
+}
+
+/* Precisions up to this use the stack buffers in GSFormatRender (). */
+#define DBL_STACK_PREC 160
+
+/* Room needed by _dbl_to_string () for a precision. */
+#define DBL_STRING_SIZE(prec) (GS_DTOA_FIXED_SIZE (prec) + 16)
+
+static CFIndex
+_dbl_to_hex_string (double value, Boolean uppercase, int prec,
+                    Boolean alternate, UniChar * out)
+{
+  const UniChar *lookup = uppercase ? _lookup_upper : _lookup_lower;
+  UniChar expbuf[8];
+  UniChar *expstr;
+  UniChar *cur;
+  UInt64 bits;
+  UInt64 frac;
+  int fracDigits;
+  int ndigits;
+  int exp2;
+  int lead;
+  int idx;
+
+  memcpy (&bits, &value, sizeof (bits));
+  frac = bits & ((1ULL << 52) - 1);
+  exp2 = (int) ((bits >> 52) & 0x7FF);
+  if (exp2 == 0)
+    {
+      lead = 0;
+      exp2 = frac == 0 ? 0 : -1022;
+    }
+  else
+    {
+      lead = 1;
+      exp2 -= 1023;
+    }
+
+  /* The fraction has 13 hexadecimal digits. */
+  fracDigits = 13;
+  if (prec < 0)
+    {
+      for (ndigits = 13; ndigits > 0; --ndigits)
+        if ((frac >> (4 * (13 - ndigits))) & 0xF)
+          break;
+    }
+  else
+    {
+      ndigits = prec;
+      if (prec < 13)
+        {
+          int shift = 4 * (13 - prec);
+          UInt64 full = ((UInt64) lead << 52) | frac;
+          UInt64 rem = full & ((1ULL << shift) - 1);
+          UInt64 half = 1ULL << (shift - 1);
+
+          /* Round half to even, which may carry into the leading digit. */
+          full >>= shift;
+          if (rem > half || (rem == half && (full & 1)))
+            ++full;
+          lead = (int) (full >> (4 * prec));
+          frac = full & ((1ULL << (4 * prec)) - 1);
+          fracDigits = prec;
+        }
+    }
+
+  cur = out;
+  *cur++ = '0';
+  *cur++ = uppercase ? 'X' : 'x';
+  *cur++ = lookup[lead];
+  if (ndigits > 0 || alternate)
+    *cur++ = '.';
+  for (idx = 0; idx < ndigits; ++idx)
+    *cur++ = idx < fracDigits
+      ? lookup[(frac >> (4 * (fracDigits - 1 - idx))) & 0xF] : '0';
+  *cur++ = uppercase ? 'P' : 'p';
+  *cur++ = exp2 < 0 ? '-' : '+';
+  expstr = _uint_to_string (exp2 < 0 ? -exp2 : exp2, expbuf + 8, 10, false);
+  while (expstr < expbuf + 8)
+    *cur++ = *expstr++;
+
+  return cur - out;
+}
+
+/* Formats a finite, non-negative value for the 'e', 'f', 'g' and 'a'
+ * conversions and their uppercase forms.  A negative precision is the
+ * default.  out must have room for DBL_STRING_SIZE(prec) characters and
+ * digits for GS_DTOA_FIXED_SIZE(prec).
+ */
+static CFIndex
+_dbl_to_string (double value, UniChar type, int prec, Boolean alternate,
+                char *digits, UniChar * out)
+{
+  UniChar *cur;
+  UniChar conv;
+  Boolean uppercase;
+  Boolean strip;
+  int ndigits;
+  int exp10;
+  int pos;
+
+  uppercase = (type & 0x20) == 0;
+  conv = type | 0x20;
+  if (conv == 'a')
+    return _dbl_to_hex_string (value, uppercase, prec, alternate, out);
+
+  if (prec < 0)
+    prec = 6;
+  strip = false;
+  if (conv == 'g')
+    {
+      /* Style 'e' is used if the exponent is less than -4 or not less
+         than the precision. */
+      if (prec == 0)
+        prec = 1;
+      ndigits = GSDtoaPrecision (value, prec, digits, &exp10);
+      strip = !alternate;
+      if (exp10 < prec && exp10 >= -4)
+        {
+          conv = 'f';
+          prec -= 1 + exp10;
+        }
+      else
+        {
+          conv = 'e';
+          prec -= 1;
+        }
+    }
+  else if (conv == 'e')
+    {
+      ndigits = GSDtoaPrecision (value, prec + 1, digits, &exp10);
+    }
+  else
+    {
+      ndigits = GSDtoaFixed (value, prec, digits, &exp10);
+    }
+
+  cur = out;
+  if (conv == 'e')
+    {
+      *cur++ = ndigits > 0 ? digits[0] : '0';
+      if (prec > 0 || alternate)
+        *cur++ = '.';
+      for (pos = 1; pos <= prec; ++pos)
+        *cur++ = pos < ndigits ? digits[pos] : '0';
+    }
+  else
+    {
+      /* digits[i] is the digit for 10^(exp10 - i). */
+      for (pos = exp10 > 0 ? exp10 : 0; pos >= -prec; --pos)
+        {
+          int idx = exp10 - pos;
+
+          *cur++ = idx >= 0 && idx < ndigits ? digits[idx] : '0';
+          if (pos == 0 && (prec > 0 || alternate))
+            *cur++ = '.';
+        }
+    }
+
+  if (strip && prec > 0)
+    {
+      while (cur[-1] == '0')
+        --cur;
+      if (cur[-1] == '.')
+        --cur;
+    }
+
+  if (conv == 'e')
+    {
+      if (ndigits == 0)
+        exp10 = 0;
+      *cur++ = uppercase ? 'E' : 'e';
+      *cur++ = exp10 < 0 ? '-' : '+';
+      if (exp10 < 0)
+        exp10 = -exp10;
+      if (exp10 >= 100)
+        {
+          *cur++ = '0' + exp10 / 100;
+          exp10 %= 100;
+        }
+      *cur++ = GSDigitPairs[2 * exp10];
+      *cur++ = GSDigitPairs[2 * exp10 + 1];
+    }
+
+  return cur - out;
+}
+
 static CFIndex
 _write_char (UniChar * obuf, UniChar * obuf_end, const UniChar c)
 {
@@ -1217,7 +2336,7 @@ _write (UniChar * obuf, UniChar * obuf_end, const UniChar * s, CFIndex len)
 {
   int remain = obuf_end - obuf;
   if (remain > 0)
-    GSMemoryCopy (obuf, s, remain < len ? remain : len * sizeof (UniChar));
+    GSMemoryCopy (obuf, s, (remain < len ? remain : len) * sizeof (UniChar));
   return len;
 }
 
@@ -1238,339 +2357,469 @@ _pad (UniChar * obuf, UniChar * obuf_end, const UniChar padchar, CFIndex len)
       else
         pad_string = _pad_zero;
       for (; len > PAD_SIZE; len -= PAD_SIZE)
-        written += _write (obuf, obuf_end, (UniChar *) pad_string, PAD_SIZE);
-      written += _write (obuf, obuf_end, (UniChar *) pad_string, len);
+        written += _write (obuf + written, obuf_end, (UniChar *) pad_string,
+                           PAD_SIZE);
+      written += _write (obuf + written, obuf_end, (UniChar *) pad_string,
+                         len);
     }
   return written;
 }
 
-CF_INLINE format_argument_t *
-GSUnicodeCreateArgumentList (const UniChar * __restrict__ format,
-                             CFIndex fmtlen, va_list ap)
+/* Compiled formats.  A format is parsed once into an array of specs, each
+ * holding the literal text that comes before a conversion and everything
+ * needed to perform the conversion.  The last spec only holds the text
+ * after the final conversion.  Arguments are numbered in the order they
+ * are read from the va_list, which is either the order of the conversions
+ * in the format or the order given by positional parameters.
+ */
+#define GS_FMT_SHOW_SPACE  0x01
+#define GS_FMT_ALTERNATE   0x02
+#define GS_FMT_SHOW_SIGN   0x04
+#define GS_FMT_LEFT_ALIGN  0x08
+#define GS_FMT_PAD_ZEROS   0x10
+
+enum
 {
-  int max;
-  int idx;
-  const UniChar *fmt;
-  const UniChar *fmtlimit;
-  format_argument_t *arglist;
-  UInt8 *lengthlist;
-  UInt8 *typelist;
-
-  max = 0;
-  fmt = format;
-  fmtlimit = fmt + fmtlen;
-  /* Find the maximum number of arguments. */
-
-  /* We'll first get to the first occurrence of '%' and make sure it includes
-   * a position field.
-   * POSIX.1-2008 allows the following pattern: '%n$[*m$][.*o$]<type>'
-   * http://pubs.opengroup.org/onlinepubs/9699919799/functions/printf.html
-   */
-  while (fmt < fmtlimit)
-    {
-      int pos;
-      Boolean doingposition;
+  GS_ARG_NONE = 0,
+  GS_ARG_INT,
+  GS_ARG_LONG,
+  GS_ARG_LONGLONG,
+  GS_ARG_DOUBLE,
+  GS_ARG_LONG_DOUBLE,
+  GS_ARG_POINTER
+};
 
-      doingposition = true;
-      while (fmt < fmtlimit && *fmt != '%')
-        fmt++;
-      if (!(fmt < fmtlimit))
-        break;
-      fmt++;
-      if (*fmt == '%')          /* Search again if we find a '%%' pattern. */
-        continue;
-      /* Must start with 1 - 9 or it is not a position argument */
-      if (!(*fmt >= '1' && *fmt <= '9'))
-        return NULL;
+typedef struct GSFormatSpec
+{
+  CFIndex literal;              /* Start of the preceding text */
+  CFIndex literalLength;
+  int width;                    /* 0 if not specified */
+  int prec;                     /* -1 if not specified */
+  int widthArg;                 /* Argument holding the width, or -1 */
+  int precArg;                  /* Argument holding the precision, or -1 */
+  int arg;                      /* Argument being converted, or -1 */
+  UInt8 conversion;             /* One of FMT_*, FMT_UNKNOWN for the end */
+  UInt8 length;                 /* One of FMT_MOD_* */
+  UInt8 flags;                  /* GS_FMT_* */
+  UniChar type;                 /* The conversion character */
+} GSFormatSpec;
+
+struct GSFormat
+{
+  CFIndex count;
+  CFIndex argCount;
+  UniChar *chars;
+  UInt8 *argTypes;
+  GSFormatSpec specs[1];
+};
 
-      /* Get the maximum position */
-      while (fmt < fmtlimit)
-        {
-          switch (*fmt)
-            {
-              /* Skip flags */
-            case ' ':
-            case '#':
-            case '\'':
-            case '+':
-            case '-':
-            case '0':
-              fmt++;
-              continue;
-            case '1':
-            case '2':
-            case '3':
-            case '4':
-            case '5':
-            case '6':
-            case '7':
-            case '8':
-            case '9':
-              if (doingposition == true)
-                {
-                  pos = _read_number (&fmt);
-                  /* If there isn't a '$' at this point, there is an error in
-                     the specification.  Return NULL and the error will be
-                     caught when doing the real parsing later.
-                   */
-                  if (*fmt != '$')
-                    return NULL;
-                  if (pos > max)
-                    max = pos;
-                  doingposition = false;        /* Position already done. */
-                }
-              fmt++;
-              continue;
-            case '.':
-              /* Precision is the last possibility for a position argument.
-                 If it is not '*' we can just move on.
-               */
-              if (*++fmt != '*')
-                break;
-            case '*':
-              fmt++;
-              doingposition = true;
-              continue;
-            default:
-              break;
-            }
-          break;
-        }
+#define GS_FORMAT_STACK_ARGUMENTS 16
+
+static int
+GSFormatReadNumber (const UniChar ** fmt, const UniChar * fmtlimit)
+{
+  const UniChar *f;
+  int number;
+
+  f = *fmt;
+  number = 0;
+  while (f < fmtlimit && *f >= '0' && *f <= '9')
+    {
+      if (number > (INT_MAX - 9) / 10)
+        return -1;
+      number = number * 10 + (*f++ - '0');
     }
-  if (max <= 0)
-    return NULL;
+  *fmt = f;
+
+  return number;
+}
+
+/* Reads the optional 'n$' following a '*'.  Returns n, 0 if there is no
+   position or -1 if it is malformed. */
+static int
+GSFormatReadPosition (const UniChar ** fmt, const UniChar * fmtlimit)
+{
+  int pos;
+
+  if (!(*fmt < fmtlimit && **fmt >= '1' && **fmt <= '9'))
+    return 0;
+  pos = GSFormatReadNumber (fmt, fmtlimit);
+  if (pos <= 0 || !(*fmt < fmtlimit) || **fmt != '$')
+    return -1;
+  (*fmt)++;
+
+  return pos;
+}
 
-  arglist =
-    (format_argument_t *) CFAllocatorAllocate (kCFAllocatorSystemDefault,
-                                               sizeof (format_argument_t) *
-                                               max, 0);
-  lengthlist =
-    (UInt8 *) CFAllocatorAllocate (kCFAllocatorSystemDefault,
-                                   sizeof (UInt8) * max, 0);
-  typelist =
-    (UInt8 *) CFAllocatorAllocate (kCFAllocatorSystemDefault,
-                                   sizeof (UInt8) * max, 0);
-  if (arglist == NULL || lengthlist == NULL || typelist == NULL)
-    {
-      if (arglist != NULL)
-        CFAllocatorDeallocate (kCFAllocatorSystemDefault, arglist);
-      if (lengthlist != NULL)
-        CFAllocatorDeallocate (kCFAllocatorSystemDefault, lengthlist);
-      if (typelist != NULL)
-        CFAllocatorDeallocate (kCFAllocatorSystemDefault, typelist);
-      return NULL;
-    }
-  GSMemoryZero (lengthlist, sizeof (UInt8) * max);
-  GSMemoryZero (typelist, sizeof (UInt8) * max);
-
-  /* Gather all the length and type. */
-  fmt = format;
+/* Assigns an argument of the given type to a conversion, width or
+   precision.  pos is the 1-based position, or 0 for the next argument.
+   A format must either use positions for all its arguments or for none
+   of them, and may not read the same argument with different types.
+ */
+static int
+GSFormatAddArgument (struct GSFormat *f, int *positional, int pos,
+                     UInt8 type, CFIndex maxArgs)
+{
+  int arg;
+
+  if (*positional < 0)
+    *positional = pos > 0;
+  else if (*positional != (pos > 0))
+    return -1;
+
+  arg = pos > 0 ? pos - 1 : f->argCount;
+  if (arg >= maxArgs)
+    return -1;
+  if (f->argTypes[arg] != GS_ARG_NONE && f->argTypes[arg] != type)
+    return -1;
+  f->argTypes[arg] = type;
+  if (arg >= f->argCount)
+    f->argCount = arg + 1;
+
+  return arg;
+}
+
+CF_INLINE UInt8
+GSFormatIntegerArgument (UInt8 length)
+{
+  switch (length)
+    {
+    case FMT_MOD_LONG:
+      return GS_ARG_LONG;
+    case FMT_MOD_LONGLONG:
+      return GS_ARG_LONGLONG;
+    case FMT_MOD_SIZE:
+      return sizeof (size_t) > sizeof (long) ? GS_ARG_LONGLONG : GS_ARG_LONG;
+    case FMT_MOD_PTRDIFF:
+      return sizeof (ptrdiff_t) > sizeof (long) ? GS_ARG_LONGLONG
+        : GS_ARG_LONG;
+    case FMT_MOD_INTMAX:
+      return sizeof (intmax_t) > sizeof (long) ? GS_ARG_LONGLONG
+        : GS_ARG_LONG;
+    default:
+      return GS_ARG_INT;
+    }
+}
+
+GSFormatRef
+GSFormatCompile (const UniChar * format, CFIndex length)
+{
+  struct GSFormat *f;
+  GSFormatSpec *spec;
+  const UniChar *fmt;
+  const UniChar *fmtlimit;
+  const UniChar *literal;
+  const UniChar *start;
+  CFIndex percents;
+  CFIndex maxArgs;
+  CFIndex idx;
+  int positional;
+
+  /* Every conversion reads at most three arguments. */
+  percents = 0;
+  for (idx = 0; idx < length; ++idx)
+    if (format[idx] == '%')
+      ++percents;
+  maxArgs = percents * 3;
+
+  f = CFAllocatorAllocate (kCFAllocatorSystemDefault,
+                           sizeof (struct GSFormat)
+                           + percents * sizeof (GSFormatSpec)
+                           + length * sizeof (UniChar) + maxArgs, 0);
+  if (f == NULL)
+    return NULL;
+  f->count = 0;
+  f->argCount = 0;
+  f->chars = (UniChar *) (f->specs + percents + 1);
+  f->argTypes = (UInt8 *) (f->chars + length);
+  GSMemoryCopy (f->chars, format, length * sizeof (UniChar));
+  GSMemoryZero (f->argTypes, maxArgs);
+
+  positional = -1;
+  fmt = f->chars;
+  fmtlimit = fmt + length;
   while (1)
     {
       int pos;
+      int n;
+      UInt8 argType;
 
+      spec = &f->specs[f->count++];
+      literal = fmt;
       while (fmt < fmtlimit && *fmt != '%')
         fmt++;
+      spec->literal = literal - f->chars;
+      spec->literalLength = fmt - literal;
+      spec->conversion = FMT_UNKNOWN;
       if (!(fmt < fmtlimit))
         break;
-      fmt++;
-      if (*fmt == '%')
-        {
-          fmt++;
-          continue;
-        }
+      fmt++;                    /* skip '%' */
 
-      /* Read position parameter
-       * The previous loop already established that the spec is well formed,
-       * so we do not need to check it again.
-       */
-      pos = _read_number (&fmt) - 1;
-      fmt++;                    /* Skip '$' */
+      spec->width = 0;
+      spec->prec = -1;
+      spec->widthArg = -1;
+      spec->precArg = -1;
+      spec->arg = -1;
+      spec->length = FMT_MOD_INT;
+      spec->flags = 0;
+      pos = 0;
 
-      /* Skip over any flags */
+      /* Flags, and the position which is a number followed by '$' */
       while (fmt < fmtlimit)
         {
           switch (*fmt)
             {
             case ' ':
+              spec->flags |= GS_FMT_SHOW_SPACE;
+              fmt++;
+              continue;
             case '#':
+              spec->flags |= GS_FMT_ALTERNATE;
+              fmt++;
+              continue;
             case '\'':
+              fmt++;
+              continue;
             case '+':
+              spec->flags |= GS_FMT_SHOW_SIGN;
+              fmt++;
+              continue;
             case '-':
+              spec->flags |= GS_FMT_LEFT_ALIGN;
+              fmt++;
+              continue;
             case '0':
+              spec->flags |= GS_FMT_PAD_ZEROS;
               fmt++;
               continue;
             default:
               break;
             }
+          if (pos == 0 && *fmt >= '1' && *fmt <= '9')
+            {
+              start = fmt;
+              n = GSFormatReadNumber (&fmt, fmtlimit);
+              if (fmt < fmtlimit && *fmt == '$')
+                {
+                  if (n <= 0)
+                    goto compile_error;
+                  pos = n;
+                  fmt++;
+                  continue;
+                }
+              fmt = start;      /* Not a position, so it is the width */
+            }
           break;
         }
 
       /* Width */
       if (fmt < fmtlimit && *fmt == '*')
         {
-          int width_pos;
-
-          width_pos = _read_number (&fmt) - 1;
-          if (*fmt == '$')
-            {
-              lengthlist[width_pos] = FMT_MOD_INT;
-              fmt++;
-            }
+          fmt++;
+          n = GSFormatReadPosition (&fmt, fmtlimit);
+          if (n < 0)
+            goto compile_error;
+          spec->widthArg = GSFormatAddArgument (f, &positional, n,
+                                                GS_ARG_INT, maxArgs);
+          if (spec->widthArg < 0)
+            goto compile_error;
         }
       else
         {
-          while (fmt < fmtlimit && (*fmt >= '0' && *fmt <= '9'))
-            fmt++;
+          spec->width = GSFormatReadNumber (&fmt, fmtlimit);
+          if (spec->width < 0)
+            goto compile_error;
         }
-      /* Precision */
+
+      /* Precision, '%.?' is treated as '%.0?' */
       if (fmt < fmtlimit && *fmt == '.')
         {
           fmt++;
-          if (fmt < fmtlimit && *fmt++ == '*')
+          if (fmt < fmtlimit && *fmt == '*')
             {
-              int prec_pos;
-
-              prec_pos = -1;
-              if (*fmt >= '1' && *fmt <= '9')
-                {
-                  prec_pos = _read_number (&fmt) - 1;
-                  if (*fmt == '$')
-                    {
-                      lengthlist[prec_pos] = FMT_MOD_INT;
-                      fmt++;
-                    }
-                }
+              fmt++;
+              n = GSFormatReadPosition (&fmt, fmtlimit);
+              if (n < 0)
+                goto compile_error;
+              spec->precArg = GSFormatAddArgument (f, &positional, n,
+                                                   GS_ARG_INT, maxArgs);
+              if (spec->precArg < 0)
+                goto compile_error;
             }
           else
             {
-              while (fmt < fmtlimit && (*fmt >= '0' && *fmt <= '9'))
-                fmt++;
+              spec->prec = GSFormatReadNumber (&fmt, fmtlimit);
+              if (spec->prec < 0)
+                goto compile_error;
             }
         }
-      if (!(fmt < fmtlimit))    /* Double check */
-        goto args_handle_error;
 
-      /* Length */
-      switch (*fmt++)
+      /* Length modifiers */
+      if (fmt < fmtlimit)
         {
-        case 'L':
-          lengthlist[pos] = FMT_MOD_LONG;
-          break;
-        case 'h':
-          if (*fmt == 'h')
+          switch (*fmt)
             {
+            case 'h':
               fmt++;
-              lengthlist[pos] = FMT_MOD_CHAR;
-            }
-          else
-            {
-              lengthlist[pos] = FMT_MOD_SHORT;
+              if (fmt < fmtlimit && *fmt == 'h')
+                {
+                  fmt++;
+                  spec->length = FMT_MOD_CHAR;
+                }
+              else
+                {
+                  spec->length = FMT_MOD_SHORT;
+                }
+              break;
+            case 'l':
+              fmt++;
+              if (fmt < fmtlimit && *fmt == 'l')
+                {
+                  fmt++;
+                  spec->length = FMT_MOD_LONGLONG;
+                }
+              else
+                {
+                  spec->length = FMT_MOD_LONG;
+                }
+              break;
+            case 'j':
+              fmt++;
+              spec->length = FMT_MOD_INTMAX;
+              break;
+            case 'z':
+              fmt++;
+              spec->length = FMT_MOD_SIZE;
+              break;
+            case 't':
+              fmt++;
+              spec->length = FMT_MOD_PTRDIFF;
+              break;
+            case 'L':
+              fmt++;
+              spec->length = FMT_MOD_LDBL;
+              break;
             }
+        }
+
+      /* Conversion specifier */
+      if (!(fmt < fmtlimit))
+        goto compile_error;
+      spec->type = *fmt++;
+      spec->conversion = (spec->type >= 0x20 && spec->type <= 0x7A)
+        ? fmt_table[spec->type - 0x20] : FMT_UNKNOWN;
+      switch (spec->conversion)
+        {
+        case FMT_PERCENT:
+          argType = GS_ARG_NONE;
+          break;
+        case FMT_INTEGER:
+        case FMT_OCTAL:
+        case FMT_HEX:
+        case FMT_UINTEGER:
+          argType = GSFormatIntegerArgument (spec->length);
           break;
-        case 'j':
-          lengthlist[pos] = FMT_MOD_INTMAX;
+        case FMT_CHARACTER:
+          argType = GS_ARG_INT;
           break;
-        case 'l':
-          if (*fmt == 'l')
+        case FMT_DOUBLE:
+          if (spec->length == FMT_MOD_LDBL)
+            {
+              spec->conversion = FMT_LONG_DOUBLE;
+              argType = GS_ARG_LONG_DOUBLE;
+            }
+          else if (spec->length == FMT_MOD_INT
+                   || spec->length == FMT_MOD_LONG)
             {
-              ++fmt;
-              lengthlist[pos] = FMT_MOD_LONGLONG;
+              argType = GS_ARG_DOUBLE;
             }
           else
             {
-              lengthlist[pos] = FMT_MOD_LONG;
+              goto compile_error;
             }
           break;
-        case 't':
-          lengthlist[pos] = FMT_MOD_PTRDIFF;
-          break;
-        case 'z':
-          lengthlist[pos] = FMT_MOD_SIZE;
+        case FMT_OBJECT:
+        case FMT_POINTER:
+        case FMT_GETCOUNT:
+        case FMT_STRING:
+          argType = GS_ARG_POINTER;
           break;
         default:
-          fmt--;
-          break;
+          goto compile_error;
         }
+      if (spec->length == FMT_MOD_LDBL && spec->conversion != FMT_LONG_DOUBLE)
+        goto compile_error;
 
-      /* Get the type */
-      if (fmt < fmtlimit)
+      /* Only floating point conversions pad with zeros when there is a
+         precision. */
+      if ((spec->prec >= 0 || spec->precArg >= 0)
+          && spec->conversion != FMT_DOUBLE
+          && spec->conversion != FMT_LONG_DOUBLE)
+        spec->flags &= ~GS_FMT_PAD_ZEROS;
+
+      if (argType != GS_ARG_NONE)
         {
-          switch (*fmt++)
-            {
-            case 'C':
-            case 'c':
-            case 'd':
-            case 'i':
-            case 'o':
-            case 'u':
-            case 'X':
-            case 'x':
-              typelist[pos] = FMT_INTEGER;
-              break;
-            case 'A':
-            case 'a':
-            case 'E':
-            case 'e':
-            case 'F':
-            case 'f':
-            case 'G':
-            case 'g':
-              typelist[pos] = FMT_DOUBLE;
-              break;
-            case '@':
-            case 'n':
-            case 'p':
-            case 'S':
-            case 's':
-              typelist[pos] = FMT_POINTER;
-              break;
-            default:
-              goto args_handle_error;
-            }
+          spec->arg = GSFormatAddArgument (f, &positional, pos, argType,
+                                           maxArgs);
+          if (spec->arg < 0)
+            goto compile_error;
         }
     }
 
-  /* Collect the arguments */
-  for (idx = 0; idx < max; ++idx)
+  /* Positional arguments may not leave gaps. */
+  for (idx = 0; idx < f->argCount; ++idx)
+    {
+      if (f->argTypes[idx] == GS_ARG_NONE)
+        goto compile_error;
+    }
+
+  return f;
+
+compile_error:
+  CFAllocatorDeallocate (kCFAllocatorSystemDefault, f);
+
+  return NULL;
+}
+
+void
+GSFormatDestroy (GSFormatRef f)
+{
+  CFAllocatorDeallocate (kCFAllocatorSystemDefault, f);
+}
+
+static void
+GSFormatGetArguments (GSFormatRef f, format_argument_t * args, va_list ap)
+{
+  CFIndex idx;
+
+  for (idx = 0; idx < f->argCount; ++idx)
     {
-      switch (typelist[idx])
+      switch (f->argTypes[idx])
         {
-        case FMT_POINTER:
-          arglist[idx].ptrValue = va_arg (ap, void *);
+        case GS_ARG_INT:
+          args[idx].intValue = va_arg (ap, int);
           break;
-        case FMT_INTEGER:
-          if (lengthlist[idx] == FMT_MOD_LONGLONG)
-            arglist[idx].intValue = va_arg (ap, long long);
-          else if (lengthlist[idx] == FMT_MOD_LONG)
-            arglist[idx].lintValue = va_arg (ap, long);
-          else
-            arglist[idx].intValue = va_arg (ap, int);
+        case GS_ARG_LONG:
+          args[idx].lintValue = va_arg (ap, long int);
           break;
-        case FMT_DOUBLE:
+        case GS_ARG_LONGLONG:
+          args[idx].llintValue = va_arg (ap, long long int);
+          break;
+        case GS_ARG_DOUBLE:
+          args[idx].dblValue = va_arg (ap, double);
+          break;
+        case GS_ARG_LONG_DOUBLE:
 #if SIZEOF_LONG_DOUBLE > SIZEOF_DOUBLE
-          if (lengthlist[idx] == FMT_MOD_LONG)
-            arglist[idx].ldblValue = va_arg (ap, long double);
-          else
+          args[idx].ldblValue = va_arg (ap, long double);
+#else
+          args[idx].dblValue = va_arg (ap, long double);
 #endif
-            arglist[idx].dblValue = va_arg (ap, double);
           break;
-        default:
-          goto args_handle_error;
+        case GS_ARG_POINTER:
+          args[idx].ptrValue = va_arg (ap, void *);
+          break;
         }
     }
-
-  CFAllocatorDeallocate (kCFAllocatorSystemDefault, typelist);
-  CFAllocatorDeallocate (kCFAllocatorSystemDefault, lengthlist);
-
-  return arglist;
-
-args_handle_error:
-  CFAllocatorDeallocate (kCFAllocatorSystemDefault, arglist);
-  CFAllocatorDeallocate (kCFAllocatorSystemDefault, typelist);
-  CFAllocatorDeallocate (kCFAllocatorSystemDefault, lengthlist);
-
-  return NULL;
 }
 
 CFIndex
@@ -1632,31 +2881,22 @@ static const CFIndex nan_inf_string_len = 3;
  * -- Stefan
  */
 
-CFIndex
-GSUnicodeFormatWithArguments (UniChar * __restrict__ s, CFIndex n,
-                              CFTypeRef locale,
-                              const UniChar * __restrict__ format,
-                              CFIndex fmtlen, va_list ap)
+static CFIndex
+GSFormatRender (GSFormatRef f, UniChar * s, CFIndex n, CFTypeRef locale,
+                const format_argument_t * args)
 {
   UniChar *obuf;
   UniChar *obuf_end;
-  const UniChar *fmt;
-  const UniChar *fmtlimit;
-  format_argument_t *arglist;
+  const GSFormatSpec *spec;
+  const GSFormatSpec *specend;
 
-  if (fmtlen == 0)
-    return 0;
   if (s == NULL)
     n = 0;
 
   obuf = s;
   obuf_end = s + n;
-  fmt = format;
-  fmtlimit = fmt + fmtlen;
-  arglist = GSUnicodeCreateArgumentList (fmt, fmtlen, ap);
-  while (fmt < fmtlimit)
+  for (spec = f->specs, specend = spec + f->count; spec < specend; ++spec)
     {
-      const UniChar *prev;
       UniChar buffer[BUFFER_SIZE];
       UniChar *bufend;
       UniChar *string;
@@ -1664,148 +2904,70 @@ GSUnicodeFormatWithArguments (UniChar * __restrict__ s, CFIndex n,
       CFIndex string_len;
       int base;
       unsigned long long number;
-      int position;
+      double dbl_value;
+      const format_argument_t *arg;
+      UInt8 arg_type;
       Boolean is_negative;
       Boolean show_sign;
       Boolean show_space;
       Boolean alternate;
-      Boolean grouping;
       Boolean left_align;
       Boolean pad_zeros;
       int width;
       int prec;
       int length;
 
-      prev = fmt;
-      while (fmt < fmtlimit && *fmt != '%')
-        fmt++;
-      obuf += _write (obuf, obuf_end, prev, fmt - prev);
-      if (!(fmt < fmtlimit))
+      obuf += _write (obuf, obuf_end, f->chars + spec->literal,
+                      spec->literalLength);
+      if (spec->conversion == FMT_UNKNOWN)
         break;
-      fmt++;                    /* skip '%' */
 
       bufend = buffer + BUFFER_SIZE;
+      type = spec->type;
       is_negative = false;
-      show_sign = false;
-      show_space = false;
-      alternate = false;
-      grouping = false;
-      left_align = false;
-      pad_zeros = false;
-      width = 0;                /* 0 for not specified */
-      prec = -1;                /* -1 for not specified */
-      length = FMT_MOD_INT;     /* standard length */
-      STEP_0_JUMP;
-
-      /* Process the flags */
-    flag_space_prefix:
-      show_space = true;
-      STEP_0_JUMP;
-    flag_alternate:
-      alternate = true;
-      STEP_0_JUMP;
-    flag_grouping:
-      grouping = true;
-      STEP_0_JUMP;
-    flag_show_sign:
-      show_sign = true;
-      STEP_0_JUMP;
-    flag_left_align:
-      left_align = true;
-      STEP_0_JUMP;
-    flag_pad_zeros:
-      pad_zeros = true;
-      STEP_0_JUMP;
-
-      /* Process width or position (if '$' exists at the end) */
-    width_number:
-      fmt--;                    /* STEP_0_JUMP would have moved fmt forward */
-      width = _read_number (&fmt);
-      if (width < 0)
-        goto handle_error;
-      STEP_1_JUMP;
-    get_position:
-      if (arglist == NULL)
-        goto handle_error;
-      position = width - 1;
-      width = 0;
-      STEP_0_JUMP;              /* This is a position field, so do step 0 again. */
-    width_asterisk:
-      if (fmt < fmtlimit && (*fmt >= '1' && *fmt <= '9'))
-        {
-          int width_pos = _read_number (&fmt);
-          if (fmt < fmtlimit && (*fmt == '$' && arglist != NULL))
-            width = arglist[width_pos].intValue;
-          else
-            goto handle_error;
-        }
-      else
-        {
-          width = va_arg (ap, int);
-        }
-      STEP_1_JUMP;
-
-      /* Process precision */
-    precision:
-      if (fmt < fmtlimit)
+      show_sign = (spec->flags & GS_FMT_SHOW_SIGN) != 0;
+      show_space = (spec->flags & GS_FMT_SHOW_SPACE) != 0;
+      alternate = (spec->flags & GS_FMT_ALTERNATE) != 0;
+      left_align = (spec->flags & GS_FMT_LEFT_ALIGN) != 0;
+      pad_zeros = (spec->flags & GS_FMT_PAD_ZEROS) != 0;
+      width = spec->width;
+      prec = spec->prec;
+      length = spec->length;
+      if (spec->widthArg >= 0)
         {
-          pad_zeros = false;
-          if (*fmt == '*')
-            {
-              fmt++;
-              if (fmt < fmtlimit && (*fmt >= '1' && *fmt <= '9'))
-                {
-                  int prec_pos = _read_number (&fmt);
-                  if (fmt < fmtlimit && (*fmt == '$' && arglist != NULL))
-                    prec = arglist[prec_pos].intValue;
-                  else
-                    goto handle_error;
-                }
-              else
-                {
-                  prec = va_arg (ap, int);
-                }
-            }
-          else if (*fmt >= '0' && *fmt <= '9')
+          /* A negative width is taken as a '-' flag. */
+          width = args[spec->widthArg].intValue;
+          if (width < 0)
             {
-              prec = _read_number (&fmt);
+              left_align = true;
+              width = -width;
             }
-          else
-            {
-              /* Treat %.? as %.0? */
-              prec = 0;
-            }
-          STEP_2_JUMP;
         }
-      else
+      if (spec->precArg >= 0)
         {
-          goto handle_error;
+          prec = args[spec->precArg].intValue;
+          if (prec < 0)
+            prec = -1;
         }
+      arg = spec->arg >= 0 ? &args[spec->arg] : NULL;
+      arg_type = spec->arg >= 0 ? f->argTypes[spec->arg] : GS_ARG_NONE;
 
-      /* Process length modifiers */
-    mod_char:
-      length = FMT_MOD_CHAR;
-      STEP_4INT_JUMP;
-    mod_short:
-      length = FMT_MOD_SHORT;
-      STEP_3H_JUMP;
-    mod_long:
-      length = FMT_MOD_LONG;
-      STEP_3L_JUMP;
-    mod_longlong:
-      length = FMT_MOD_LONGLONG;
-      STEP_4INT_JUMP;
-    mod_size_t:
-      length = FMT_MOD_SIZE;
-      STEP_4INT_JUMP;
-    mod_ptrdiff_t:
-      length = FMT_MOD_PTRDIFF;
-      STEP_4INT_JUMP;
-    mod_intmax_t:
-      length = FMT_MOD_INTMAX;
-      STEP_4INT_JUMP;
-    mod_ldbl:
-      STEP_4DBL_JUMP;
+      switch (spec->conversion)
+        {
+        case FMT_PERCENT:     goto fmt_percent;
+        case FMT_OBJECT:      goto fmt_object;
+        case FMT_POINTER:     goto fmt_pointer;
+        case FMT_INTEGER:     goto fmt_decimal;
+        case FMT_OCTAL:       goto fmt_octal;
+        case FMT_HEX:         goto fmt_hex;
+        case FMT_UINTEGER:    goto fmt_unsigned_decimal;
+        case FMT_GETCOUNT:    goto fmt_getcount;
+        case FMT_DOUBLE:      goto fmt_double;
+        case FMT_LONG_DOUBLE: goto fmt_long_double;
+        case FMT_CHARACTER:   goto fmt_character;
+        case FMT_STRING:      goto fmt_string;
+        default:              goto handle_error;
+        }
 
       /* Process specification */
     fmt_percent:
@@ -1815,8 +2977,7 @@ GSUnicodeFormatWithArguments (UniChar * __restrict__ s, CFIndex n,
     fmt_object:
       {
         CFTypeRef o;
-        o = arglist == NULL ? va_arg (ap, CFTypeRef) :
-          arglist[position].ptrValue;
+        o = arg->ptrValue;
         if (o == NULL)
           {
             string = (UniChar *) nil_string;
@@ -1848,7 +3009,6 @@ GSUnicodeFormatWithArguments (UniChar * __restrict__ s, CFIndex n,
               {
                 CFRange r;
 
-                width -= string_len;
                 string = buffer;
                 r.location = 0;
                 do
@@ -1871,8 +3031,7 @@ GSUnicodeFormatWithArguments (UniChar * __restrict__ s, CFIndex n,
     fmt_pointer:
       {
         const void *ptr;
-        ptr = arglist == NULL ? va_arg (ap, void *) :
-          arglist[position].ptrValue;
+        ptr = arg->ptrValue;
         if (ptr == NULL)
           {
             string = (UniChar *) nil_string;
@@ -1895,35 +3054,20 @@ GSUnicodeFormatWithArguments (UniChar * __restrict__ s, CFIndex n,
       {
         signed long long int signed_number;
 
-        if (arglist == NULL)
-          {
-            if (length == FMT_MOD_INT)
-              signed_number = va_arg (ap, int);
-            else if (length == FMT_MOD_LONG)
-              signed_number = va_arg (ap, long int);
-            else if (length == FMT_MOD_LONGLONG)
-              signed_number = va_arg (ap, long long int);
-            else if (length == FMT_MOD_SHORT)
-              signed_number = (short int) va_arg (ap, int);
-            else                /* Must be FMT_MOD_CHAR */
-              signed_number = (char) va_arg (ap, int);
-          }
+        if (arg_type == GS_ARG_LONGLONG)
+          signed_number = arg->llintValue;
+        else if (arg_type == GS_ARG_LONG)
+          signed_number = arg->lintValue;
+        else if (length == FMT_MOD_SHORT)
+          signed_number = (short int) arg->intValue;
+        else if (length == FMT_MOD_CHAR)
+          signed_number = (signed char) arg->intValue;
         else
-          {
-            if (length == FMT_MOD_INT)
-              signed_number = arglist[position].intValue;
-            else if (length == FMT_MOD_LONG)
-              signed_number = arglist[position].lintValue;
-            else if (length == FMT_MOD_LONGLONG)
-              signed_number = arglist[position].llintValue;
-            else if (length == FMT_MOD_SHORT)
-              signed_number = (short int) arglist[position].intValue;
-            else                /* Must be FMT_MOD_CHAR */
-              signed_number = (char) arglist[position].intValue;
-          }
+          signed_number = arg->intValue;
         if (signed_number < 0)
           is_negative = true;
-        number = is_negative ? (-signed_number) : signed_number;
+        number = is_negative ? -(unsigned long long) signed_number
+          : (unsigned long long) signed_number;
         base = 10;
       }
       goto fmt_integer;
@@ -1940,32 +3084,16 @@ GSUnicodeFormatWithArguments (UniChar * __restrict__ s, CFIndex n,
       base = 10;
 
     fmt_unsigned_integer:
-      if (arglist == NULL)
-        {
-          if (length == FMT_MOD_INT)
-            number = va_arg (ap, unsigned int);
-          else if (length == FMT_MOD_LONG)
-            number = va_arg (ap, unsigned long int);
-          else if (length == FMT_MOD_LONGLONG)
-            number = va_arg (ap, unsigned long long int);
-          else if (length == FMT_MOD_SHORT)
-            number = (unsigned short int) va_arg (ap, unsigned int);
-          else                  /* Must be FMT_MOD_CHAR */
-            number = (unsigned char) va_arg (ap, unsigned int);
-        }
+      if (arg_type == GS_ARG_LONGLONG)
+        number = (unsigned long long int) arg->llintValue;
+      else if (arg_type == GS_ARG_LONG)
+        number = (unsigned long int) arg->lintValue;
+      else if (length == FMT_MOD_SHORT)
+        number = (unsigned short int) arg->intValue;
+      else if (length == FMT_MOD_CHAR)
+        number = (unsigned char) arg->intValue;
       else
-        {
-          if (length == FMT_MOD_INT)
-            number = arglist[position].intValue;
-          else if (length == FMT_MOD_LONG)
-            number = arglist[position].lintValue;
-          else if (length == FMT_MOD_LONGLONG)
-            number = arglist[position].llintValue;
-          else if (length == FMT_MOD_SHORT)
-            number = (unsigned short int) arglist[position].intValue;
-          else                  /* Must be FMT_MOD_CHAR */
-            number = (unsigned char) arglist[position].intValue;
-        }
+        number = (unsigned int) arg->intValue;
 
       show_sign = false;
       show_space = false;
@@ -1977,7 +3105,8 @@ GSUnicodeFormatWithArguments (UniChar * __restrict__ s, CFIndex n,
           string = bufend;
           if (base == 8 && alternate)
             *--string = '0';
-          continue;
+          string_len = bufend - string;
+          goto print_string;
         }
       else
         {
@@ -2070,32 +3199,35 @@ GSUnicodeFormatWithArguments (UniChar * __restrict__ s, CFIndex n,
 
     fmt_getcount:
       {
-        int written = obuf - s;
-        if (arglist == NULL)
-          {
-            if (length == FMT_MOD_INT)
-              *(int *) va_arg (ap, void *) = written;
-            else if (length == FMT_MOD_LONG)
-              *(long int *) va_arg (ap, void *) = written;
-            else if (length == FMT_MOD_LONGLONG)
-              *(long long int *) va_arg (ap, void *) = written;
-            else if (length == FMT_MOD_SHORT)
-              *(short int *) va_arg (ap, void *) = written;
-            else                /* Must be FMT_MOD_CHAR */
-              *(char *) va_arg (ap, void *) = written;
-          }
-        else
+        CFIndex written = obuf - s;
+        void *count = arg->ptrValue;
+
+        switch (length)
           {
-            if (length == FMT_MOD_INT)
-              *(int *) arglist[position].ptrValue = written;
-            else if (length == FMT_MOD_LONG)
-              *(long int *) arglist[position].ptrValue = written;
-            else if (length == FMT_MOD_LONGLONG)
-              *(long long int *) arglist[position].ptrValue = written;
-            else if (length == FMT_MOD_SHORT)
-              *(short int *) arglist[position].ptrValue = written;
-            else                /* Must be FMT_MOD_CHAR */
-              *(char *) arglist[position].ptrValue = written;
+          case FMT_MOD_CHAR:
+            *(signed char *) count = written;
+            break;
+          case FMT_MOD_SHORT:
+            *(short int *) count = written;
+            break;
+          case FMT_MOD_LONG:
+            *(long int *) count = written;
+            break;
+          case FMT_MOD_LONGLONG:
+            *(long long int *) count = written;
+            break;
+          case FMT_MOD_SIZE:
+            *(size_t *) count = written;
+            break;
+          case FMT_MOD_PTRDIFF:
+            *(ptrdiff_t *) count = written;
+            break;
+          case FMT_MOD_INTMAX:
+            *(intmax_t *) count = written;
+            break;
+          default:
+            *(int *) count = written;
+            break;
           }
       }
       continue;
@@ -2105,10 +3237,7 @@ GSUnicodeFormatWithArguments (UniChar * __restrict__ s, CFIndex n,
       {
         long double ldbl_number;
 
-        if (arglist == NULL)
-          ldbl_number = va_arg (ap, long double);
-        else
-          ldbl_number = arglist[position].ldblValue;
+        ldbl_number = arg->ldblValue;
 
         if (_ldbl_is_nan (ldbl_number))
           {
@@ -2122,7 +3251,18 @@ GSUnicodeFormatWithArguments (UniChar * __restrict__ s, CFIndex n,
           }
         else
           {
-            string = NULL;
+            /* Formatted with the precision of a double. */
+            dbl_value = (double) ldbl_number;
+            is_negative = _dbl_is_negative (dbl_value);
+            if (_dbl_is_inf (dbl_value))
+              {
+                string = (UniChar *) inf_string;
+                string_len = nan_inf_string_len;
+              }
+            else
+              {
+                string = NULL;
+              }
           }
 
         goto fmt_double_parts;
@@ -2133,10 +3273,7 @@ GSUnicodeFormatWithArguments (UniChar * __restrict__ s, CFIndex n,
         double dbl_number;
         int ret;
 
-        if (arglist == NULL)
-          dbl_number = va_arg (ap, double);
-        else
-          dbl_number = arglist[position].dblValue;
+        dbl_number = arg->dblValue;
 
         if ((ret = _dbl_is_nan (dbl_number)))
           {
@@ -2152,7 +3289,8 @@ GSUnicodeFormatWithArguments (UniChar * __restrict__ s, CFIndex n,
           }
         else
           {
-            /* FIXME */
+            dbl_value = dbl_number;
+            is_negative = _dbl_is_negative (dbl_value);
             string = NULL;
           }
       }
@@ -2180,31 +3318,72 @@ GSUnicodeFormatWithArguments (UniChar * __restrict__ s, CFIndex n,
 
           continue;
         }
-      goto handle_error;
+      else
+        {
+          char dbl_digits[GS_DTOA_FIXED_SIZE (DBL_STACK_PREC)];
+          char *digits;
+          UniChar *dbl_string;
+          CFIndex prefix_len;
+
+          /* Large precisions get their own buffers. */
+          if (prec <= DBL_STACK_PREC)
+            {
+              digits = dbl_digits;
+              dbl_string = buffer;
+            }
+          else
+            {
+              dbl_string = CFAllocatorAllocate (kCFAllocatorSystemDefault,
+                DBL_STRING_SIZE (prec) * sizeof (UniChar)
+                + GS_DTOA_FIXED_SIZE (prec), 0);
+              digits = (char *) (dbl_string + DBL_STRING_SIZE (prec));
+            }
+          string_len = _dbl_to_string (is_negative ? -dbl_value : dbl_value,
+                                       type, prec, alternate, digits,
+                                       dbl_string);
+
+          /* Zeros go after the '0x' of hexadecimal values. */
+          prefix_len = (type | 0x20) == 'a' ? 2 : 0;
+          width -= string_len;
+          if (is_negative || show_sign || show_space)
+            --width;
+          if (!left_align && !pad_zeros && width > 0)
+            obuf += _pad (obuf, obuf_end, ' ', width);
+          if (is_negative)
+            _write_char (obuf++, obuf_end, '-');
+          else if (show_sign)
+            _write_char (obuf++, obuf_end, '+');
+          else if (show_space)
+            _write_char (obuf++, obuf_end, ' ');
+          obuf += _write (obuf, obuf_end, dbl_string, prefix_len);
+          if (!left_align && pad_zeros && width > 0)
+            obuf += _pad (obuf, obuf_end, '0', width);
+          obuf += _write (obuf, obuf_end, dbl_string + prefix_len,
+                          string_len - prefix_len);
+          if (left_align && width > 0)
+            obuf += _pad (obuf, obuf_end, ' ', width);
+
+          if (dbl_string != buffer)
+            CFAllocatorDeallocate (kCFAllocatorSystemDefault, dbl_string);
+        }
+      continue;
 
     fmt_character:
       if (length == FMT_MOD_LONG || type == 'C')
         {
-          if (arglist == NULL)
-            buffer[0] = (UniChar) va_arg (ap, int);
-          else
-            buffer[0] = (UniChar) arglist[position].intValue;
+          buffer[0] = (UniChar) arg->intValue;
           string = buffer;
         }
       else
         {
-          if (arglist == NULL)
-            buffer[0] = (char) va_arg (ap, int);
-          else
-            buffer[0] = (char) arglist[position].intValue;
+          buffer[0] = (UInt8) arg->intValue;
           string = buffer;
         }
       string_len = 1;
       goto print_string;
 
     fmt_string:
-      string = arglist == NULL ? va_arg (ap, UniChar *) :
-        arglist[position].ptrValue;
+      string = arg->ptrValue;
       if (string == NULL)
         {
           string = (UniChar *) null_string;
@@ -2217,23 +3396,37 @@ GSUnicodeFormatWithArguments (UniChar * __restrict__ s, CFIndex n,
       else
         {
           UniChar *tmp;
-          const UniChar *tmp_limit;
+          CFStringEncoding enc;
           const UInt8 *cstring = (const UInt8 *) string;
-          string_len = _cstring_length ((const char *) cstring, prec);
+          const UInt8 *climit;
+
+          /* Count the characters first; the conversion would otherwise
+             stop filling the buffer but keep consuming the source. */
+          enc = CFStringGetSystemEncoding ();
+          climit = cstring + _cstring_length ((const char *) cstring, prec);
+          tmp = NULL;
+          string_len = GSUnicodeFromEncoding (&tmp, NULL, enc, &cstring,
+                                              climit, 0);
+          if (string_len < 0)
+            goto handle_error;
+          cstring = (const UInt8 *) string;
+          string = buffer;
+          if (string_len > BUFFER_SIZE)
+            {
+              string = CFAllocatorAllocate (kCFAllocatorSystemDefault,
+                                            string_len * sizeof (UniChar), 0);
+              if (string == NULL)
+                goto handle_error;
+            }
+          tmp = string;
+          GSUnicodeFromEncoding (&tmp, string + string_len, enc, &cstring,
+                                 climit, 0);
           width -= string_len;
           if (!left_align)
             obuf += _pad (obuf, obuf_end, ' ', width);
-          tmp_limit = buffer + BUFFER_SIZE;
-          do
-            {
-              tmp = buffer;
-              GSUnicodeFromEncoding (&tmp, tmp_limit,
-                                     CFStringGetSystemEncoding (), &cstring,
-                                     cstring + string_len, 0);
-              obuf += _write (obuf, obuf_end, buffer, tmp - buffer);
-              string_len -= BUFFER_SIZE;
-            }
-          while (string_len > 0);
+          obuf += _write (obuf, obuf_end, string, string_len);
+          if (string != buffer)
+            CFAllocatorDeallocate (kCFAllocatorSystemDefault, string);
           if (left_align)
             obuf += _pad (obuf, obuf_end, ' ', width);
           continue;
@@ -2248,14 +3441,74 @@ GSUnicodeFormatWithArguments (UniChar * __restrict__ s, CFIndex n,
         obuf += _pad (obuf, obuf_end, ' ', width);
     }
 
-  if (arglist != NULL)
-    CFAllocatorDeallocate (kCFAllocatorSystemDefault, arglist);
-
   return obuf - s;
 
 handle_error:
-  if (arglist != NULL)
-    CFAllocatorDeallocate (kCFAllocatorSystemDefault, arglist);
-
   return -1;
 }
+
+CFIndex
+GSFormatWriteWithArguments (GSFormatRef f, UniChar * buffer, CFIndex size,
+                            UniChar ** result, CFTypeRef locale, va_list ap)
+{
+  format_argument_t stack_args[GS_FORMAT_STACK_ARGUMENTS];
+  format_argument_t *args;
+  CFIndex len;
+
+  args = stack_args;
+  if (f->argCount > GS_FORMAT_STACK_ARGUMENTS)
+    {
+      args = CFAllocatorAllocate (kCFAllocatorSystemDefault,
+                                  f->argCount * sizeof (format_argument_t),
+                                  0);
+      if (args == NULL)
+        return -1;
+    }
+
+  /* The arguments are read once, so the output can be formatted again
+     into a larger buffer without walking the va_list a second time. */
+  GSFormatGetArguments (f, args, ap);
+  if (result != NULL)
+    *result = buffer;
+  len = GSFormatRender (f, buffer, size, locale, args);
+  if (len > size && result != NULL)
+    {
+      *result = CFAllocatorAllocate (kCFAllocatorSystemDefault,
+                                     len * sizeof (UniChar), 0);
+      if (*result != NULL)
+        len = GSFormatRender (f, *result, len, locale, args);
+      if (*result == NULL || len < 0)
+        {
+          if (*result != NULL)
+            CFAllocatorDeallocate (kCFAllocatorSystemDefault, *result);
+          *result = buffer;
+          len = -1;
+        }
+    }
+
+  if (args != stack_args)
+    CFAllocatorDeallocate (kCFAllocatorSystemDefault, args);
+
+  return len;
+}
+
+CFIndex
+GSUnicodeFormatWithArguments (UniChar * __restrict__ s, CFIndex n,
+                              CFTypeRef locale,
+                              const UniChar * __restrict__ format,
+                              CFIndex fmtlen, va_list ap)
+{
+  GSFormatRef f;
+  CFIndex result;
+
+  if (fmtlen == 0)
+    return 0;
+
+  f = GSFormatCompile (format, fmtlen);
+  if (f == NULL)
+    return -1;
+  result = GSFormatWriteWithArguments (f, s, n, NULL, locale, ap);
+  GSFormatDestroy (f);
+
+  return result;
+}
@@ -0,0 +1,35 @@
+#include "CoreFoundation/CFDictionary.h"
+#include "../CFTesting.h"
+
+int main (void)
+{
+  CFMutableDictionaryRef dict;
+  CFIndex idx;
+  Boolean ok;
+
+  /* Each key is looked up before it is added, so a missing key is
+     searched for at every size the table goes through. */
+  dict = CFDictionaryCreateMutable (NULL, 0, NULL, NULL);
+  ok = true;
+  for (idx = 1; idx <= 5000; ++idx)
+    {
+      ok = ok
+        && CFDictionaryGetValue (dict, (const void *) (idx * 16)) == NULL;
+      CFDictionaryAddValue (dict, (const void *) (idx * 16),
+                            (const void *) idx);
+    }
+  PASS_CF(ok && CFDictionaryGetCount (dict) == 5000,
+          "Dictionary grows past 2099 entries.");
+
+  ok = true;
+  for (idx = 1; idx <= 5000; ++idx)
+    ok = ok && CFDictionaryGetValue (dict, (const void *) (idx * 16))
+      == (const void *) idx;
+  PASS_CF(ok, "All values are found after growing.");
+  PASS_CF(CFDictionaryGetValue (dict, (const void *) 8) == NULL,
+          "Missing key is not found.");
+
+  CFRelease (dict);
+
+  return 0;
+}
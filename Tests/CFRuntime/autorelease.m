@@ -0,0 +1,79 @@
+#include <CoreFoundation/CFBase.h>
+#include <CoreFoundation/CFData.h>
+#include <CoreFoundation/CFString.h>
+#include <stdlib.h>
+#include "../CFTesting.h"
+
+static int deallocated = 0;
+
+static void *
+testAllocate (CFIndex size, CFOptionFlags hint, void *info)
+{
+  return malloc (size);
+}
+
+static void
+testDeallocate (void *ptr, void *info)
+{
+  deallocated++;
+  free (ptr);
+}
+
+int main (void)
+{
+  CFAllocatorContext context = { 0, NULL, NULL, NULL, NULL, testAllocate,
+                                 NULL, testDeallocate, NULL };
+  CFAllocatorRef alloc;
+  CFDataRef data;
+  CFStringRef str;
+  void *outer;
+  void *inner;
+  int i;
+
+  alloc = CFAllocatorCreate (NULL, &context);
+
+  outer = CFAutoreleasePoolPush ();
+  PASS_CF(outer != NULL, "Autorelease pool was pushed.");
+
+  str = CFStringCreateWithCString (alloc, "Autoreleased",
+                                   kCFStringEncodingASCII);
+  PASS_CF(CFAutorelease (str) == str, "CFAutorelease() returns its argument.");
+
+  inner = CFAutoreleasePoolPush ();
+  for (i = 0 ; i < 2000 ; ++i)
+    {
+      data = CFDataCreate (alloc, (const UInt8 *) "data", 4);
+      CFAutorelease (data);
+    }
+  CFRetain (str);
+  CFAutorelease (str);
+  CFAutorelease (CFRetain (str));
+  CFAutoreleasePoolPop (inner);
+  PASS_CF(deallocated == 2000,
+          "Inner pool released all of its objects (%d deallocated).",
+          deallocated);
+  PASS_CFEQ(str, CFSTR("Autoreleased"),
+            "Objects autoreleased in the outer pool are still alive.");
+
+  CFAutoreleasePoolPop (outer);
+  PASS_CF(deallocated == 2001, "Outer pool released its objects.");
+
+  outer = CFAutoreleasePoolPush ();
+  inner = CFAutoreleasePoolPush ();
+  data = CFDataCreate (alloc, (const UInt8 *) "data", 4);
+  CFAutorelease (data);
+  CFAutoreleasePoolPop (outer);
+  PASS_CF(deallocated == 2002, "Popping a pool also pops nested pools.");
+
+  outer = CFAutoreleasePoolPush ();
+  data = CFDataCreate (alloc, (const UInt8 *) "data", 4);
+  CFAutorelease (data);
+  CFAutoreleasePoolPop (NULL);
+  PASS_CF(deallocated == 2002, "Popping a NULL pool does nothing.");
+  CFAutoreleasePoolPop (outer);
+  PASS_CF(deallocated == 2003, "Pool is still in place after a NULL pop.");
+
+  CFRelease (alloc);
+
+  return 0;
+}
@@ -0,0 +1,50 @@
+#include <CoreFoundation/CFArray.h>
+#include <CoreFoundation/CFDictionary.h>
+#include <CoreFoundation/CFNumber.h>
+#include <CoreFoundation/CFString.h>
+#include <limits.h>
+#include "../CFTesting.h"
+
+const SInt32 i32 = 42;
+
+int main (void)
+{
+  CFMutableDictionaryRef dict;
+  CFMutableArrayRef array;
+  CFMutableStringRef str;
+  CFNumberRef num;
+  CFIndex i;
+
+  num = CFNumberCreate (NULL, kCFNumberSInt32Type, &i32);
+  str = CFStringCreateMutable (NULL, 0);
+  CFStringAppend (str, CFSTR("value"));
+  array = CFArrayCreateMutable (NULL, 0, &kCFTypeArrayCallBacks);
+  CFArrayAppendValue (array, num);
+  CFArrayAppendValue (array, str);
+  dict = CFDictionaryCreateMutable (NULL, 0, &kCFTypeDictionaryKeyCallBacks,
+                                    &kCFTypeDictionaryValueCallBacks);
+  CFDictionaryAddValue (dict, CFSTR("array"), array);
+  CFDictionaryAddValue (dict, CFSTR("self"), dict);
+
+  PASS_CF(CFMakeImmortal (dict) == dict, "CFMakeImmortal() returns its argument.");
+  PASS_CF(CFGetRetainCount (dict) == UINT_MAX, "Dictionary is immortal.");
+  PASS_CF(CFGetRetainCount (array) == UINT_MAX,
+          "Nested array is immortal.");
+  PASS_CF(CFGetRetainCount (num) == UINT_MAX
+          && CFGetRetainCount (str) == UINT_MAX,
+          "Array values are immortal.");
+
+  for (i = 0 ; i < 4 ; ++i)
+    {
+      CFRelease (array);
+      CFRelease (num);
+      CFRelease (str);
+    }
+  PASS_CF(CFArrayGetCount (array) == 2, "Release does not deallocate.");
+  PASS_CFEQ(CFArrayGetValueAtIndex (array, 1), CFSTR("value"),
+            "Contents are unchanged.");
+  PASS_CF(CFDictionaryGetValue (dict, CFSTR("self")) == dict,
+          "Cycles in the graph are handled.");
+
+  return 0;
+}
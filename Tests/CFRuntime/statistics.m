@@ -0,0 +1,82 @@
+#include <CoreFoundation/CFBase.h>
+#include <CoreFoundation/CFData.h>
+#include <CoreFoundation/CFDictionary.h>
+#include <CoreFoundation/CFNumber.h>
+#include <CoreFoundation/CFRuntime.h>
+#include <CoreFoundation/CFString.h>
+#include "../CFTesting.h"
+
+static CFIndex
+getCount (CFDictionaryRef stats, CFStringRef type, CFStringRef key)
+{
+  CFDictionaryRef entry;
+  CFNumberRef num;
+  CFIndex value;
+
+  entry = CFDictionaryGetValue (stats, type);
+  if (entry == NULL)
+    return 0;
+  num = CFDictionaryGetValue (entry, key);
+  if (num == NULL || !CFNumberGetValue (num, kCFNumberCFIndexType, &value))
+    return -1;
+  return value;
+}
+
+int main (void)
+{
+  CFDictionaryRef before;
+  CFDictionaryRef after;
+  CFDataRef data[3];
+  UInt8 bytes[] = { 1, 2, 3, 4 };
+  CFIndex i;
+
+  PASS_CF(_CFRuntimeGetInstanceStatisticsEnabled () == false,
+          "Instance statistics are off by default.");
+
+  _CFRuntimeSetInstanceStatisticsEnabled (true);
+  PASS_CF(_CFRuntimeGetInstanceStatisticsEnabled () == true,
+          "Instance statistics can be switched on.");
+
+  before = _CFRuntimeCopyInstanceStatistics ();
+  PASS_CF(before != NULL, "Statistics snapshot was created.");
+
+  for (i = 0; i < 3; ++i)
+    data[i] = CFDataCreate (NULL, bytes, sizeof (bytes));
+  CFRetain (data[0]);
+  CFRetain (data[0]);
+  CFRelease (data[0]);
+  CFRelease (data[1]);
+
+  after = _CFRuntimeCopyInstanceStatistics ();
+  PASS_CF(getCount (after, CFSTR("CFData"), CFSTR("Allocations"))
+          - getCount (before, CFSTR("CFData"), CFSTR("Allocations")) == 3,
+          "Allocations are counted.");
+  PASS_CF(getCount (after, CFSTR("CFData"), CFSTR("LiveInstances"))
+          - getCount (before, CFSTR("CFData"), CFSTR("LiveInstances")) == 2,
+          "Deallocations are counted.");
+  PASS_CF(getCount (after, CFSTR("CFData"), CFSTR("Retains"))
+          - getCount (before, CFSTR("CFData"), CFSTR("Retains")) == 2,
+          "Retains are counted.");
+  PASS_CF(getCount (after, CFSTR("CFData"), CFSTR("Releases"))
+          - getCount (before, CFSTR("CFData"), CFSTR("Releases")) == 2,
+          "Releases are counted.");
+  PASS_CF(getCount (after, CFSTR("CFData"), CFSTR("Bytes"))
+          > getCount (before, CFSTR("CFData"), CFSTR("Bytes")),
+          "Allocated bytes are counted.");
+  CFRelease (before);
+  CFRelease (after);
+
+  _CFRuntimeSetInstanceStatisticsEnabled (false);
+  before = _CFRuntimeCopyInstanceStatistics ();
+  CFRelease (data[0]);
+  CFRelease (data[0]);
+  CFRelease (data[2]);
+  after = _CFRuntimeCopyInstanceStatistics ();
+  PASS_CF(getCount (after, CFSTR("CFData"), CFSTR("Releases"))
+          == getCount (before, CFSTR("CFData"), CFSTR("Releases")),
+          "Nothing is counted once statistics are switched off.");
+  CFRelease (before);
+  CFRelease (after);
+
+  return 0;
+}
@@ -0,0 +1,95 @@
+#include "CoreFoundation/CFLocale.h"
+#include "CoreFoundation/CFString.h"
+#include "../CFTesting.h"
+
+static CFMutableStringRef
+makeString (const UniChar *chars, CFIndex length)
+{
+  CFMutableStringRef str;
+
+  str = CFStringCreateMutable (NULL, 0);
+  CFStringAppendCharacters (str, chars, length);
+
+  return str;
+}
+
+int main (void)
+{
+  CFMutableStringRef str;
+  CFStringRef expect;
+  CFLocaleRef locale;
+  UniChar latin1[] = { 'C', 'a', 'f', 0xC9, ' ', 0xE9, 0xD7, 0xF7, 'Z' };
+  UniChar lower[] = { 'c', 'a', 'f', 0xE9, ' ', 0xE9, 0xD7, 0xF7, 'z' };
+  UniChar upper[] = { 'C', 'A', 'F', 0xC9, ' ', 0xC9, 0xD7, 0xF7, 'Z' };
+  UniChar sharp[] = { 's', 't', 'r', 'a', 0xDF, 'e' };
+  UniChar micro[] = { '5', 0xB5, 'm' };
+  UniChar folded[] = { '5', 0x3BC, 'm' };
+  UniChar spaces[] = { 0x3000, ' ', 'a', ' ', 'b', '\n', 0x2028 };
+  CFIndex idx;
+
+  str = makeString (latin1, 9);
+  CFStringLowercase (str, NULL);
+  expect = CFStringCreateWithCharacters (NULL, lower, 9);
+  PASS_CFEQ(str, expect, "ISO-8859-1 letters are lowercased.");
+  CFRelease (expect);
+  CFStringUppercase (str, NULL);
+  expect = CFStringCreateWithCharacters (NULL, upper, 9);
+  PASS_CFEQ(str, expect, "ISO-8859-1 letters are uppercased.");
+  CFRelease (expect);
+  CFRelease (str);
+
+  str = CFStringCreateMutable (NULL, 0);
+  for (idx = 0; idx < 20; ++idx)
+    CFStringAppend (str, CFSTR("Content-Type "));
+  CFStringUppercase (str, NULL);
+  PASS_CF(CFStringHasPrefix (str, CFSTR("CONTENT-TYPE CONTENT-TYPE"))
+          && CFStringHasSuffix (str, CFSTR("CONTENT-TYPE ")),
+          "Long ASCII string is uppercased.");
+  CFRelease (str);
+
+  str = makeString (sharp, 6);
+  CFStringUppercase (str, NULL);
+  PASS_CFEQ(str, CFSTR("STRASSE"), "Uppercase string can be longer.");
+  CFRelease (str);
+
+  str = makeString (micro, 3);
+  CFStringFold (str, kCFCompareCaseInsensitive, NULL);
+  expect = CFStringCreateWithCharacters (NULL, folded, 3);
+  PASS_CFEQ(str, expect, "Micro sign is folded to Greek mu.");
+  CFRelease (expect);
+  CFRelease (str);
+
+  locale = CFLocaleCreate (NULL, CFSTR("tr_TR"));
+  str = CFStringCreateMutable (NULL, 0);
+  CFStringAppend (str, CFSTR("DIYARBAKIR"));
+  CFStringLowercase (str, locale);
+  PASS_CF(CFStringGetCharacterAtIndex (str, 1) == 0x131,
+          "Turkish rules are used with a Turkish locale.");
+  CFRelease (str);
+  CFRelease (locale);
+
+  str = CFStringCreateMutable (NULL, 0);
+  CFStringAppend (str, CFSTR("hello-wORLD (again) don't stop"));
+  CFStringCapitalize (str, NULL);
+  PASS_CFEQ(str, CFSTR("Hello-World (Again) Don't Stop"),
+            "Words are capitalized.");
+  CFRelease (str);
+
+  str = CFStringCreateMutable (NULL, 0);
+  CFStringAppend (str, CFSTR("xyxyxyabcxyxy"));
+  CFStringTrim (str, CFSTR("xy"));
+  PASS_CFEQ(str, CFSTR("abc"), "Repeated trim string is removed.");
+  CFStringTrim (str, CFSTR("abc"));
+  PASS_CF(CFStringGetLength (str) == 0, "Trimming can empty the string.");
+  CFRelease (str);
+
+  str = makeString (spaces, 7);
+  CFStringTrimWhitespace (str);
+  PASS_CFEQ(str, CFSTR("a b"), "Unicode white space is trimmed.");
+  CFStringReplaceAll (str, CFSTR(" \t "));
+  CFStringTrimWhitespace (str);
+  PASS_CF(CFStringGetLength (str) == 0, "String of white space is emptied.");
+  CFRelease (str);
+
+  return 0;
+}
@@ -0,0 +1,86 @@
+#include "CoreFoundation/CFArray.h"
+#include "CoreFoundation/CFString.h"
+#include "../CFTesting.h"
+
+static CFArrayRef
+makeArray (CFStringRef a, CFStringRef b, CFStringRef c)
+{
+  const void *values[3];
+
+  values[0] = a;
+  values[1] = b;
+  values[2] = c;
+  return CFArrayCreate (NULL, values, c ? 3 : (b ? 2 : (a ? 1 : 0)),
+                        &kCFTypeArrayCallBacks);
+}
+
+int main (void)
+{
+  CFArrayRef array;
+  CFStringRef str;
+  CFStringRef latin1;
+  CFStringRef wide;
+  CFStringRef utf8;
+  CFMutableStringRef mutable;
+  UniChar chars[] = { 0x3042, 0x3044 };
+  UniChar joined[] = { 'x', 0x3042, 0x3044, 0xE9, 0x3042, 0x3044, 0x20AC };
+  CFStringRef expect;
+
+  array = makeArray (NULL, NULL, NULL);
+  str = CFStringCreateByCombiningStrings (NULL, array, CFSTR(", "));
+  PASS_CF(str != NULL && CFStringGetLength (str) == 0,
+          "Empty array gives an empty string.");
+  CFRelease (str);
+  CFRelease (array);
+
+  array = makeArray (CFSTR("alone"), NULL, NULL);
+  str = CFStringCreateByCombiningStrings (NULL, array, CFSTR(", "));
+  PASS_CFEQ(str, CFSTR("alone"), "Single string is returned unchanged.");
+  CFRelease (str);
+  CFRelease (array);
+
+  latin1 = CFStringCreateWithCString (NULL, "caf\xE9",
+                                      kCFStringEncodingISOLatin1);
+  array = makeArray (CFSTR("a"), latin1, CFSTR("b"));
+  str = CFStringCreateByCombiningStrings (NULL, array, CFSTR("-"));
+  expect = CFStringCreateWithCString (NULL, "a-caf\xE9-b",
+                                      kCFStringEncodingISOLatin1);
+  PASS_CFEQ(str, expect, "ISO-8859-1 strings are combined.");
+  CFRelease (expect);
+  PASS_CF(CFStringGetCharactersPtr (str) == NULL
+          && CFStringGetCStringPtr (str, kCFStringEncodingISOLatin1) != NULL,
+          "Result of 8-bit strings is kept in 8-bit storage.");
+  CFRelease (str);
+  CFRelease (array);
+
+  wide = CFStringCreateWithCharacters (NULL, chars, 2);
+  utf8 = CFStringCreateWithCString (NULL, "\xE2\x82\xAC",
+                                    kCFStringEncodingUTF8);
+  mutable = CFStringCreateMutable (NULL, 0);
+  CFStringAppend (mutable, CFSTR("x"));
+  CFRelease (latin1);
+  latin1 = CFStringCreateWithCString (NULL, "\xE9", kCFStringEncodingISOLatin1);
+  array = makeArray (mutable, latin1, utf8);
+  str = CFStringCreateByCombiningStrings (NULL, array, wide);
+  expect = CFStringCreateWithCharacters (NULL, joined, 7);
+  PASS_CFEQ(str, expect, "Separator in 16-bit storage widens the result.");
+  CFRelease (str);
+  CFRelease (array);
+  CFRelease (expect);
+
+  array = makeArray (latin1, utf8, NULL);
+  str = CFStringCreateByCombiningStrings (NULL, array, CFSTR(""));
+  PASS_CF(CFStringGetLength (str) == 2
+          && CFStringGetCharacterAtIndex (str, 0) == 0xE9
+          && CFStringGetCharacterAtIndex (str, 1) == 0x20AC,
+          "UTF-8 string widens the result.");
+  CFRelease (str);
+  CFRelease (array);
+
+  CFRelease (latin1);
+  CFRelease (wide);
+  CFRelease (utf8);
+  CFRelease (mutable);
+
+  return 0;
+}
@@ -0,0 +1,49 @@
+#include "CoreFoundation/CFString.h"
+#include "../CFTesting.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char literal[] = "Runtime constant";
+
+int main (void)
+{
+  CFStringRef str1;
+  CFStringRef str2;
+  CFIndex i;
+
+  str1 = NULL;
+  for (i = 0 ; i < 2 ; ++i)
+    {
+      str2 = CFSTR("Constant");
+      if (str1 == NULL)
+        str1 = str2;
+    }
+  PASS_CF(str1 == str2, "CFSTR() returns the same object every time.");
+  PASS_CF(CFGetTypeID (str1) == CFStringGetTypeID (),
+          "CFSTR() returns a CFString.");
+  PASS_CF(CFStringGetLength (str1) == 8, "Constant string has length 8.");
+  PASS_CF(CFGetRetainCount (str1) == UINT_MAX,
+          "Constant string is not reference counted.");
+
+  str1 = __CFStringMakeConstantString (literal);
+  str2 = __CFStringMakeConstantString (literal);
+  PASS_CF(str1 == str2,
+          "Runtime constant strings are unique for the same C string.");
+  PASS_CFEQ(str1, CFSTR("Runtime constant"),
+            "Runtime constant string has the right contents.");
+
+  for (i = 0 ; i < 1000 ; ++i)
+    {
+      char *buf = malloc (16);
+      snprintf (buf, 16, "%ld", (long)i);
+      str1 = __CFStringMakeConstantString (buf);
+      if (__CFStringMakeConstantString (buf) != str1
+          || CFStringGetLength (str1) != (CFIndex)strlen (buf))
+        break;
+    }
+  PASS_CF(i == 1000, "Constant string table grows correctly.");
+
+  return 0;
+}
@@ -0,0 +1,96 @@
+#include "CoreFoundation/CFString.h"
+#include "CoreFoundation/CFStringEncodingExt.h"
+#include "CoreFoundation/GSUnicode.h"
+#include "../CFTesting.h"
+
+static CFMutableStringRef
+decodeBytewise (CFStringEncoding enc, const UInt8 *bytes, CFIndex length)
+{
+  GSUnicodeDecoderRef decoder;
+  CFMutableStringRef str;
+  CFIndex idx;
+
+  decoder = GSUnicodeDecoderCreate (enc, 0xFFFD);
+  str = CFStringCreateMutable (NULL, 0);
+  for (idx = 0; idx < length; ++idx)
+    GSUnicodeDecoderAppend (decoder, str, bytes + idx, 1, false);
+  GSUnicodeDecoderAppend (decoder, str, NULL, 0, true);
+  GSUnicodeDecoderDestroy (decoder);
+
+  return str;
+}
+
+int main (void)
+{
+  const UInt8 utf8[] = { 'a', 0xC3, 0xA9, 0xE2, 0x82, 0xAC, 0xF0, 0x9F,
+    0x98, 0x80, 'z' };
+  const UInt8 utf16[] = { 0xFF, 0xFE, 'a', 0, 0xAC, 0x20, 0x3D, 0xD8,
+    0x00, 0xDE };
+  const UInt8 sjis[] = { 0x93, 0xFA, 0x96, 0x7B, '!' };
+  const UInt8 bad[] = { 'a', 0xFF, 'b' };
+  UniChar chars[] = { 'a', 0xE9, 0x20AC, 0xD83D, 0xDE00, 'z' };
+  UniChar kanji[] = { 0x65E5, 0x672C, '!' };
+  UniChar out[8];
+  GSUnicodeDecoderRef decoder;
+  CFMutableStringRef str;
+  CFStringRef expect;
+  const UInt8 *s;
+  CFIndex n;
+
+  expect = CFStringCreateWithCharacters (NULL, chars, 6);
+  str = decodeBytewise (kCFStringEncodingUTF8, utf8, sizeof (utf8));
+  PASS_CFEQ(str, expect, "UTF-8 sequences split between pieces are decoded.");
+  CFRelease (str);
+  CFRelease (expect);
+
+  expect = CFStringCreateWithCharacters (NULL, chars + 2, 3);
+  str = decodeBytewise (kCFStringEncodingUTF16, utf16 + 4, 6);
+  PASS_CF(CFStringGetLength (str) == 3
+          && CFStringGetCharacterAtIndex (str, 0) == 0x20AC,
+          "UTF-16 without a byte order mark uses the host byte order.");
+  CFRelease (str);
+  str = decodeBytewise (kCFStringEncodingUTF16, utf16, sizeof (utf16));
+  PASS_CF(CFStringGetLength (str) == 4
+          && CFStringGetCharacterAtIndex (str, 0) == 'a'
+          && CFStringGetCharacterAtIndex (str, 3) == 0xDE00,
+          "UTF-16 byte order mark is read from the first piece.");
+  CFRelease (str);
+  CFRelease (expect);
+
+  expect = CFStringCreateWithCharacters (NULL, kanji, 3);
+  str = decodeBytewise (kCFStringEncodingShiftJIS, sjis, sizeof (sjis));
+  PASS_CFEQ(str, expect, "Shift-JIS split between pieces is decoded.");
+  CFRelease (str);
+  CFRelease (expect);
+
+  str = decodeBytewise (kCFStringEncodingUTF8, utf8, 8);
+  PASS_CF(CFStringGetLength (str) > 3
+          && CFStringGetCharacterAtIndex (str, 2) == 0x20AC
+          && CFStringGetCharacterAtIndex (str, 3) == 0xFFFD,
+          "Sequence cut off at the end of the input is replaced.");
+  CFRelease (str);
+
+  decoder = GSUnicodeDecoderCreate (kCFStringEncodingUTF8, 0);
+  str = CFStringCreateMutable (NULL, 0);
+  PASS_CF(!GSUnicodeDecoderAppend (decoder, str, bad, sizeof (bad), true),
+          "Invalid input is an error without a loss character.");
+  CFRelease (str);
+  GSUnicodeDecoderDestroy (decoder);
+
+  decoder = GSUnicodeDecoderCreate (kCFStringEncodingUTF8, 0xFFFD);
+  s = utf8;
+  n = GSUnicodeDecoderDecode (decoder, out, 2, &s, utf8 + sizeof (utf8),
+                              false);
+  PASS_CF(n == 2 && s == utf8 + 3 && out[1] == 0xE9,
+          "Decoding stops when the buffer is full.");
+  n = GSUnicodeDecoderDecode (decoder, out, 8, &s, utf8 + sizeof (utf8),
+                              true);
+  PASS_CF(n == 4 && s == utf8 + sizeof (utf8) && out[3] == 'z',
+          "Decoding continues where it stopped.");
+  GSUnicodeDecoderDestroy (decoder);
+
+  PASS_CF(GSUnicodeDecoderCreate (kCFStringEncodingMacHFS, 0) == NULL,
+          "Decoder is not created for an unsupported encoding.");
+
+  return 0;
+}
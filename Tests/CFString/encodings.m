@@ -69,7 +69,8 @@ int main (void)
                     kCFStringEncodingUTF16, 0, false, buf1, 256, &used1);
   CFStringGetBytes (str_utf16, CFRangeMake (0, CFStringGetLength(str_utf16)),
                     kCFStringEncodingUTF16, 0, true, buf2, 256, &used2);
-  PASS_CF (used1 == used2, "UTF-16 convesion used the same from buffer.");
+  PASS_CF (used1 + sizeof(UniChar) == used2,
+           "External UTF-16 conversion only adds a byte order mark.");
   PASS_CF (memcmp (buf1, utf16_string, used1) == 0,
            "UTF-16 conversion successful.");
   PASS_CF (memcmp (buf2, utf16_ext_string, used2) == 0,
@@ -0,0 +1,93 @@
+#include "CoreFoundation/CFCharacterSet.h"
+#include "CoreFoundation/CFString.h"
+#include "../CFTesting.h"
+
+int main (void)
+{
+  CFStringRef str;
+  CFStringRef eAcute;
+  CFStringRef smiley;
+  CFMutableStringRef mstr;
+  CFMutableCharacterSetRef set;
+  CFCharacterSetRef digits;
+  char text[301];
+  UniChar chars[300];
+  UniChar e = 0xE9;
+  UniChar pair[] = { 0xD83D, 0xDE00 };
+  CFRange r;
+  CFIndex idx;
+
+  digits = CFCharacterSetGetPredefined (kCFCharacterSetDecimalDigit);
+
+  for (idx = 0; idx < 300; ++idx)
+    text[idx] = 'a' + idx % 26;
+  text[300] = '\0';
+  text[100] = '7';
+  text[250] = '3';
+  str = CFStringCreateWithCString (NULL, text, kCFStringEncodingASCII);
+  PASS_CF(CFStringFindCharacterFromSet (str, digits, CFRangeMake (0, 300), 0,
+                                        &r)
+          && r.location == 100 && r.length == 1,
+          "First member of a set is found.");
+  PASS_CF(CFStringFindCharacterFromSet (str, digits, CFRangeMake (0, 300),
+                                        kCFCompareBackwards, &r)
+          && r.location == 250 && r.length == 1,
+          "Last member of a set is found when searching backwards.");
+  PASS_CF(!CFStringFindCharacterFromSet (str, digits, CFRangeMake (101, 149),
+                                         0, &r),
+          "Members outside the range are not found.");
+  PASS_CF(CFStringFindCharacterFromSet (str, digits, CFRangeMake (100, 50),
+                                        kCFCompareAnchored, &r)
+          && !CFStringFindCharacterFromSet (str, digits,
+                                            CFRangeMake (99, 50),
+                                            kCFCompareAnchored, &r),
+          "Anchored search only looks at the first character.");
+  CFRelease (str);
+
+  for (idx = 0; idx < 300; ++idx)
+    chars[idx] = 0x3B1 + idx % 24;
+  chars[40] = 0xE9;
+  chars[200] = 0xD83D;
+  chars[201] = 0xDE00;
+  str = CFStringCreateWithCharacters (NULL, chars, 300);
+  eAcute = CFStringCreateWithCharacters (NULL, &e, 1);
+  smiley = CFStringCreateWithCharacters (NULL, pair, 2);
+  set = CFCharacterSetCreateMutable (NULL);
+  CFCharacterSetAddCharactersInString (set, eAcute);
+  PASS_CF(CFStringFindCharacterFromSet (str, set, CFRangeMake (0, 300), 0, &r)
+          && r.location == 40,
+          "Member is found in UTF-16 contents.");
+  CFCharacterSetAddCharactersInString (set, smiley);
+  PASS_CF(CFStringFindCharacterFromSet (str, set, CFRangeMake (0, 300),
+                                        kCFCompareBackwards, &r)
+          && r.location == 200 && r.length == 2,
+          "Supplementary member is found after the set changes.");
+  PASS_CF(CFStringFindCharacterFromSet (str, set, CFRangeMake (150, 52),
+                                        kCFCompareBackwards
+                                        | kCFCompareAnchored, &r)
+          && r.location == 200 && r.length == 2,
+          "Anchored backwards search matches a surrogate pair at the end.");
+  CFCharacterSetRemoveCharactersInString (set, smiley);
+  PASS_CF(!CFStringFindCharacterFromSet (str, set, CFRangeMake (100, 200), 0,
+                                         &r),
+          "Surrogate pair is not found once removed from the set.");
+  CFRelease (str);
+
+  mstr = CFStringCreateMutable (NULL, 0);
+  CFStringAppend (mstr, CFSTR("abc"));
+  CFStringAppend (mstr, eAcute);
+  CFStringAppend (mstr, CFSTR("def"));
+  CFStringAppendCharacters (mstr, chars, 300);
+  PASS_CF(CFStringFindCharacterFromSet (mstr, set,
+                                        CFRangeMake (0, CFStringGetLength
+                                                     (mstr)),
+                                        kCFCompareBackwards, &r)
+          && r.location == 47,
+          "Member is found in a mutable string.");
+  CFRelease (mstr);
+  CFRelease (set);
+  CFRelease (smiley);
+  CFRelease (eAcute);
+
+  return 0;
+}
@@ -0,0 +1,75 @@
+#include "CoreFoundation/CFString.h"
+#include "../CFTesting.h"
+
+int main (void)
+{
+  CFMutableStringRef str;
+  CFMutableStringRef expect;
+  CFIndex count;
+  CFIndex idx;
+
+  str = CFStringCreateMutable (NULL, 0);
+  CFStringAppend (str, CFSTR("Hello {name}, {name}!"));
+  count = CFStringFindAndReplace (str, CFSTR("{name}"), CFSTR("Ann"),
+                                  CFRangeMake (0, CFStringGetLength (str)), 0);
+  PASS_CF(count == 2, "All occurrences are replaced.");
+  PASS_CFEQ(str, CFSTR("Hello Ann, Ann!"), "Replaced string is correct.");
+
+  count = CFStringFindAndReplace (str, CFSTR("Ann"), CFSTR(""),
+                                  CFRangeMake (0, 9), 0);
+  PASS_CF(count == 1, "Only the search range is used.");
+  PASS_CFEQ(str, CFSTR("Hello , Ann!"), "Occurrence outside the range is kept.");
+  CFRelease (str);
+
+  str = CFStringCreateMutable (NULL, 0);
+  CFStringAppend (str, CFSTR("aaaaa"));
+  count = CFStringFindAndReplace (str, CFSTR("aa"), CFSTR("b"),
+                                  CFRangeMake (0, 5), 0);
+  PASS_CF(count == 2 && CFEqual (str, CFSTR("bba")),
+          "Matches do not overlap.");
+  CFStringReplaceAll (str, CFSTR("aaaaa"));
+  count = CFStringFindAndReplace (str, CFSTR("aa"), CFSTR("b"),
+                                  CFRangeMake (0, 5), kCFCompareBackwards);
+  PASS_CF(count == 2 && CFEqual (str, CFSTR("abb")),
+          "Backwards search matches from the end.");
+  CFRelease (str);
+
+  str = CFStringCreateMutable (NULL, 0);
+  CFStringAppend (str, CFSTR("Tag tag TAG"));
+  count = CFStringFindAndReplace (str, CFSTR("tag"), CFSTR("x"),
+                                  CFRangeMake (0, 11),
+                                  kCFCompareCaseInsensitive);
+  PASS_CF(count == 3 && CFEqual (str, CFSTR("x x x")),
+          "Case insensitive search works.");
+  CFStringReplaceAll (str, CFSTR("ab ab ab"));
+  count = CFStringFindAndReplace (str, CFSTR("ab"), CFSTR("c"),
+                                  CFRangeMake (0, 8), kCFCompareAnchored);
+  PASS_CF(count == 1 && CFEqual (str, CFSTR("c ab ab")),
+          "Anchored search only replaces at the start.");
+  count = CFStringFindAndReplace (str, CFSTR("ab"), CFSTR("d"),
+                                  CFRangeMake (0, 7),
+                                  kCFCompareAnchored | kCFCompareBackwards);
+  PASS_CF(count == 1 && CFEqual (str, CFSTR("c ab d")),
+          "Anchored backwards search only replaces at the end.");
+  count = CFStringFindAndReplace (str, CFSTR("zz"), CFSTR("d"),
+                                  CFRangeMake (0, 6), 0);
+  PASS_CF(count == 0 && CFEqual (str, CFSTR("c ab d")),
+          "Nothing changes if there is no match.");
+  CFRelease (str);
+
+  str = CFStringCreateMutable (NULL, 0);
+  expect = CFStringCreateMutable (NULL, 0);
+  for (idx = 0; idx < 20000; ++idx)
+    {
+      CFStringAppend (str, CFSTR("<%x%>, "));
+      CFStringAppend (expect, CFSTR("value, "));
+    }
+  count = CFStringFindAndReplace (str, CFSTR("<%x%>"), CFSTR("value"),
+                                  CFRangeMake (0, CFStringGetLength (str)), 0);
+  PASS_CF(count == 20000, "Many occurrences are replaced.");
+  PASS_CFEQ(str, expect, "String with many replacements is correct.");
+  CFRelease (expect);
+  CFRelease (str);
+
+  return 0;
+}
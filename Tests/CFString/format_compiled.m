@@ -0,0 +1,128 @@
+#include "CoreFoundation/CFArray.h"
+#include "CoreFoundation/CFString.h"
+#include "../CFTesting.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+
+static int deallocated = 0;
+
+static void *
+testAllocate (CFIndex size, CFOptionFlags hint, void *info)
+{
+  return malloc (size);
+}
+
+static void
+testDeallocate (void *ptr, void *info)
+{
+  deallocated++;
+  free (ptr);
+}
+
+int main (void)
+{
+  CFAllocatorContext context = { 0, NULL, NULL, NULL, NULL, testAllocate,
+                                 NULL, testDeallocate, NULL };
+  CFAllocatorRef alloc;
+  CFStringRef str1;
+  CFStringRef str2;
+  CFStringRef fmt;
+  CFMutableStringRef mfmt;
+  CFMutableStringRef mstr;
+  CFArrayRef array;
+  const void *values[2];
+  char longString[1001];
+  CFIndex idx;
+  Boolean ok;
+
+  ok = true;
+  for (idx = 0; idx < 100; ++idx)
+    {
+      str1 = CFStringCreateWithFormat (NULL, NULL, CFSTR("%d-%s"), (int) idx,
+                                       "x");
+      str2 = CFStringCreateWithFormat (NULL, NULL, CFSTR("%s"), "y");
+      ok = ok && CFStringGetLength (str1) == (idx < 10 ? 3 : 4)
+        && CFEqual (str2, CFSTR("y"));
+      CFRelease (str1);
+      CFRelease (str2);
+    }
+  PASS_CF(ok, "Repeated formats give the same results.");
+
+  str1 = CFStringCreateWithFormat (NULL, NULL, CFSTR("%12d|%-10s|"), 42, "ab");
+  PASS_CFEQ(str1, CFSTR("          42|ab        |"),
+            "Widths with more than one digit work.");
+  CFRelease (str1);
+
+  str1 = CFStringCreateWithFormat (NULL, NULL, CFSTR("%2$s %1$s %2$s"),
+                                   "a", "b");
+  PASS_CFEQ(str1, CFSTR("b a b"), "Positional arguments can be reused.");
+  CFRelease (str1);
+
+  str1 = CFStringCreateWithFormat (NULL, NULL, CFSTR("%1$*2$d|%3$.*4$x"),
+                                   7, 4, 0xab, 3);
+  PASS_CFEQ(str1, CFSTR("   7|0ab"), "Positional width and precision work.");
+  CFRelease (str1);
+
+  str1 = CFStringCreateWithFormat (NULL, NULL, CFSTR("%*d|"), -4, 1);
+  PASS_CFEQ(str1, CFSTR("1   |"), "Negative width aligns to the left.");
+  CFRelease (str1);
+
+  str1 = CFStringCreateWithFormat (NULL, NULL, CFSTR("%zu %td %lld"),
+                                   (size_t) 12, (ptrdiff_t) -3, 1LL << 40);
+  PASS_CFEQ(str1, CFSTR("12 -3 1099511627776"),
+            "Size, pointer difference and long long arguments work.");
+  CFRelease (str1);
+
+  for (idx = 0; idx < 1000; ++idx)
+    longString[idx] = 'a' + idx % 26;
+  longString[1000] = '\0';
+  str1 = CFStringCreateWithFormat (NULL, NULL, CFSTR("%s|%d"), longString, 5);
+  PASS_CF(CFStringGetLength (str1) == 1002
+          && CFStringGetCharacterAtIndex (str1, 1001) == '5',
+          "Output longer than the internal buffer is complete.");
+  CFRelease (str1);
+
+  mfmt = CFStringCreateMutable (NULL, 0);
+  CFStringAppend (mfmt, CFSTR("%d"));
+  str1 = CFStringCreateWithFormat (NULL, NULL, mfmt, 1);
+  CFStringAppend (mfmt, CFSTR("-%d"));
+  str2 = CFStringCreateWithFormat (NULL, NULL, mfmt, 1, 2);
+  PASS_CF(CFEqual (str1, CFSTR("1")) && CFEqual (str2, CFSTR("1-2")),
+          "Changes to a mutable format are seen.");
+  CFRelease (str1);
+  CFRelease (str2);
+  CFRelease (mfmt);
+
+  fmt = CFStringCreateWithCString (NULL, "<%@>", kCFStringEncodingASCII);
+  values[0] = CFSTR("a");
+  values[1] = CFSTR("b");
+  array = CFArrayCreate (NULL, values, 2, &kCFTypeArrayCallBacks);
+  str1 = CFStringCreateWithFormat (NULL, NULL, fmt, array);
+  str2 = CFStringCreateWithFormat (NULL, NULL, fmt, CFSTR("c"));
+  PASS_CF(CFStringGetLength (str1) > 2 && CFEqual (str2, CFSTR("<c>")),
+          "Objects that format themselves can be formatted.");
+  CFRelease (str1);
+  CFRelease (str2);
+  CFRelease (array);
+  CFRelease (fmt);
+
+  alloc = CFAllocatorCreate (NULL, &context);
+  fmt = CFStringCreateWithCString (alloc, "%d", kCFStringEncodingASCII);
+  for (idx = 0; idx < 2; ++idx)
+    CFRelease (CFStringCreateWithFormat (NULL, NULL, fmt, (int) idx));
+  CFRelease (fmt);
+  PASS_CF(deallocated == 1, "Formats that are not constant are not kept.");
+  CFRelease (alloc);
+
+  mstr = CFStringCreateMutable (NULL, 0);
+  for (idx = 0; idx < 3; ++idx)
+    CFStringAppendFormat (mstr, NULL, CFSTR("[%02d]"), (int) idx);
+  PASS_CFEQ(mstr, CFSTR("[00][01][02]"), "Appending a format works.");
+  CFRelease (mstr);
+
+  PASS_CF(CFStringCreateWithFormat (NULL, NULL, CFSTR("%1$d %3$d"), 1, 2, 3)
+          == NULL, "Unused positional arguments are an error.");
+
+  return 0;
+}
@@ -19,5 +19,42 @@ int main (void)
 			  "Formatting not-a-number works.");
   CFRelease (str1);
 
+  str1 = CFStringCreateWithFormat (NULL, NULL, CFSTR("%f %e %g %a"),
+				   1.5, 1.5, 1.5, 1.5);
+  PASS_CFEQ (str1, CFSTR ("1.500000 1.500000e+00 1.5 0x1.8p+0"),
+			  "Formatting finite values works.");
+  CFRelease (str1);
+
+  str1 = CFStringCreateWithFormat (NULL, NULL, CFSTR("%.17g %.2f %.0f %.0f"),
+				   0.1, 2.675, 0.5, 1.5);
+  PASS_CFEQ (str1, CFSTR ("0.10000000000000001 2.67 0 2"),
+			  "Values are correctly rounded.");
+  CFRelease (str1);
+
+  str1 = CFStringCreateWithFormat (NULL, NULL, CFSTR("%g %G %g %#g %g"),
+				   1e-5, 1e20, 123456.0, 1.0, 5e-324);
+  PASS_CFEQ (str1, CFSTR ("1e-05 1E+20 123456 1.00000 4.94066e-324"),
+			  "%%g chooses the right style.");
+  CFRelease (str1);
+
+  str1 = CFStringCreateWithFormat (NULL, NULL, CFSTR("[%+09.2f|%-8.1e|% .3E]"),
+				   -3.14159, 42.0, 0.000123);
+  PASS_CFEQ (str1, CFSTR ("[-00003.14|4.2e+01 | 1.230E-04]"),
+			  "Flags and widths work with finite values.");
+  CFRelease (str1);
+
+  str1 = CFStringCreateWithFormat (NULL, NULL, CFSTR("%f %.1A %010a %Lg"),
+				   -0.0, 255.75, 1.0, (long double) 0.25);
+  PASS_CFEQ (str1, CFSTR ("-0.000000 0X2.0P+7 0x00001p+0 0.25"),
+			  "Negative zero, hexadecimal and long double values work.");
+  CFRelease (str1);
+
+  str1 = CFStringCreateWithFormat (NULL, NULL, CFSTR("%.0f %.30f"),
+				   1e300, 0.1);
+  PASS_CF (CFStringGetLength (str1) == 301 + 1 + 32
+	   && CFStringHasSuffix (str1, CFSTR ("0.100000000000000005551115123126")),
+	   "Long fixed point values are exact.");
+  CFRelease (str1);
+
   return 0;
 }
@@ -0,0 +1,67 @@
+#include "CoreFoundation/CFString.h"
+#include "../CFTesting.h"
+
+static Boolean
+readsLikeString (CFStringRef str, CFRange range, Boolean backwards)
+{
+  CFStringInlineBuffer buf;
+  CFIndex idx;
+  CFIndex n;
+
+  CFStringInitInlineBuffer (str, &buf, range);
+  for (n = 0; n < range.length; ++n)
+    {
+      idx = backwards ? range.length - 1 - n : n;
+      if (CFStringGetCharacterFromInlineBuffer (&buf, idx)
+          != CFStringGetCharacterAtIndex (str, range.location + idx))
+        return false;
+    }
+
+  return true;
+}
+
+int main (void)
+{
+  CFStringInlineBuffer buf;
+  CFStringRef str;
+  CFStringRef sub;
+  UInt8 bytes[300];
+  CFIndex idx;
+
+  for (idx = 0; idx < 300; ++idx)
+    bytes[idx] = idx % 3 == 0 ? 0xC0 + idx % 32 : 'a' + idx % 26;
+  str = CFStringCreateWithBytes (NULL, bytes, 300, kCFStringEncodingISOLatin1,
+                                 false);
+  CFStringInitInlineBuffer (str, &buf, CFRangeMake (10, 200));
+  PASS_CF(CFStringGetCharacterFromInlineBuffer (&buf, 2) == 0xCC
+          && CFStringGetCharacterFromInlineBuffer (&buf, 3) == 'n',
+          "ISO-8859-1 characters are read directly.");
+  PASS_CF(CFStringGetCharacterFromInlineBuffer (&buf, -1) == 0
+          && CFStringGetCharacterFromInlineBuffer (&buf, 200) == 0,
+          "Index outside the range gives 0.");
+  sub = CFStringCreateWithSubstring (NULL, str, CFRangeMake (50, 100));
+  PASS_CF(readsLikeString (sub, CFRangeMake (5, 90), false),
+          "Substring of an 8-bit string is read directly.");
+  CFRelease (sub);
+  CFRelease (str);
+
+  for (idx = 0; idx < 300; ++idx)
+    bytes[idx] = 'a' + idx % 26;
+  bytes[100] = 0xE2;
+  bytes[101] = 0x82;
+  bytes[102] = 0xAC;
+  str = CFStringCreateWithBytes (NULL, bytes, 300, kCFStringEncodingUTF8,
+                                 false);
+  PASS_CF(readsLikeString (str, CFRangeMake (0, 298), false),
+          "UTF-8 string is read forwards.");
+  PASS_CF(readsLikeString (str, CFRangeMake (3, 290), true),
+          "UTF-8 string is read backwards.");
+  CFStringInitInlineBuffer (str, &buf, CFRangeMake (0, 298));
+  PASS_CF(CFStringGetCharacterFromInlineBuffer (&buf, 250) == 'a' + 252 % 26
+          && CFStringGetCharacterFromInlineBuffer (&buf, 100) == 0x20AC
+          && CFStringGetCharacterFromInlineBuffer (&buf, 101) == 'a' + 103 % 26,
+          "UTF-8 string is read out of order.");
+  CFRelease (str);
+
+  return 0;
+}
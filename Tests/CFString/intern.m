@@ -0,0 +1,127 @@
+#include "CoreFoundation/CFDictionary.h"
+#include "CoreFoundation/CFNumber.h"
+#include "CoreFoundation/CFString.h"
+#include "../CFTesting.h"
+
+#include <stdio.h>
+
+static CFIndex
+getStatistic (const char *name)
+{
+  CFDictionaryRef stats;
+  CFStringRef key;
+  CFIndex value;
+
+  stats = _CFStringCopyInternStatistics ();
+  key = CFStringCreateWithCString (NULL, name, kCFStringEncodingASCII);
+  value = -1;
+  CFNumberGetValue (CFDictionaryGetValue (stats, key), kCFNumberCFIndexType,
+                    &value);
+  CFRelease (key);
+  CFRelease (stats);
+
+  return value;
+}
+
+int main (void)
+{
+  CFStringRef a;
+  CFStringRef b;
+  CFStringRef ia;
+  CFStringRef ib;
+  CFStringRef other;
+  CFStringRef piece;
+  CFMutableStringRef m;
+  CFStringRef strs[1000];
+  CFStringRef interned[1000];
+  char buf[32];
+  CFIndex entries;
+  CFIndex hits;
+  CFIndex saved;
+  CFIndex idx;
+  Boolean ok;
+
+  a = CFStringCreateWithCString (NULL, "Content-Type", kCFStringEncodingASCII);
+  b = CFStringCreateWithCString (NULL, "Content-Type", kCFStringEncodingASCII);
+  entries = getStatistic ("Entries");
+  hits = getStatistic ("Hits");
+
+  ia = CFStringCreateInterned (NULL, a);
+  ib = CFStringCreateInterned (NULL, b);
+  PASS_CF(ia == a, "Immutable string becomes the interned string.");
+  PASS_CF(ib == ia, "Equal strings intern to the same object.");
+  PASS_CF(getStatistic ("Hits") == hits + 1
+          && getStatistic ("Entries") == entries + 1,
+          "Hits and entries are counted.");
+  PASS_CF(getStatistic ("BytesSaved") > 0, "Saved bytes are counted.");
+
+  m = CFStringCreateMutable (NULL, 0);
+  CFStringAppend (m, CFSTR("Content-Type"));
+  other = CFStringCreateInterned (NULL, m);
+  PASS_CF(other == ia, "Mutable string interns to the same object.");
+  CFRelease (other);
+  CFRelease (m);
+
+  piece = CFStringCreateWithCString (NULL, "Content-Length",
+                                     kCFStringEncodingASCII);
+  other = CFStringCreateInterned (NULL, piece);
+  CFRelease (piece);
+  PASS_CF(!CFEqual (other, ia), "Different interned strings are not equal.");
+  CFRelease (other);
+
+  CFRelease (ib);
+  CFRelease (b);
+  CFRelease (ia);
+  CFRelease (a);
+  PASS_CF(getStatistic ("Entries") == entries,
+          "String leaves the table when its last reference is released.");
+
+  b = CFStringCreateWithCString (NULL, "Content-Type", kCFStringEncodingASCII);
+  ib = CFStringCreateInterned (NULL, b);
+  PASS_CF(ib == b, "A new string is interned after the old one is gone.");
+  CFRelease (ib);
+  CFRelease (b);
+
+  m = CFStringCreateMutable (NULL, 0);
+  CFStringAppend (m, CFSTR("Accept-Encoding"));
+  hits = getStatistic ("Hits");
+  saved = getStatistic ("BytesSaved");
+  other = CFStringCreateInterned (NULL, m);
+  PASS_CF(other != m && getStatistic ("Hits") == hits
+          && getStatistic ("BytesSaved") == saved,
+          "Interning a new mutable string is not counted as a hit.");
+  CFRelease (other);
+  CFRelease (m);
+
+  for (idx = 0; idx < 1000; ++idx)
+    {
+      snprintf (buf, sizeof (buf), "value-%d", (int) idx);
+      strs[idx] = CFStringCreateWithCString (NULL, buf,
+                                             kCFStringEncodingASCII);
+      interned[idx] = CFStringCreateInterned (NULL, strs[idx]);
+    }
+  for (idx = 0; idx < 1000; idx += 2)
+    {
+      CFRelease (interned[idx]);
+      CFRelease (strs[idx]);
+    }
+  ok = true;
+  for (idx = 1; idx < 1000; idx += 2)
+    {
+      snprintf (buf, sizeof (buf), "value-%d", (int) idx);
+      a = CFStringCreateWithCString (NULL, buf, kCFStringEncodingASCII);
+      ia = CFStringCreateInterned (NULL, a);
+      ok = ok && ia == interned[idx];
+      CFRelease (ia);
+      CFRelease (a);
+    }
+  PASS_CF(ok, "Strings are still found after others were removed.");
+  for (idx = 1; idx < 1000; idx += 2)
+    {
+      CFRelease (interned[idx]);
+      CFRelease (strs[idx]);
+    }
+  PASS_CF(getStatistic ("Entries") == entries, "Table is empty again.");
+
+  return 0;
+}
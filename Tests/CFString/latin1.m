@@ -0,0 +1,141 @@
+#include "CoreFoundation/CFString.h"
+#include "../CFTesting.h"
+
+#include <string.h>
+
+int main (void)
+{
+  CFStringRef str;
+  CFStringRef wide;
+  CFStringRef sub;
+  CFStringRef copy;
+  CFStringInlineBuffer ibuf;
+  const char *ptr;
+  UInt8 bytes[16];
+  UInt8 latin1[] = { 'g', 'r', 0xFC, 0xDF, 'e' };
+  UInt8 longUTF8[2048];
+  UniChar chars[] = { 'c', 'a', 'f', 0xE9 };
+  UniChar longChars[300];
+  UInt8 longBytes[300];
+  CFMutableStringRef mcopy;
+  CFIndex used;
+  CFIndex idx;
+
+  str = CFStringCreateWithBytes (NULL, (const UInt8 *) "caf\xC3\xA9", 5,
+                                 kCFStringEncodingUTF8, false);
+  wide = CFStringCreateWithCharacters (NULL, chars, 4);
+  PASS_CF(CFStringGetLength (str) == 4, "UTF-8 input has the right length.");
+  PASS_CF(CFStringGetCharacterAtIndex (str, 3) == 0xE9,
+          "Character above U+007F is read back.");
+  PASS_CFEQ(str, wide, "String is equal to its UTF-16 version.");
+  PASS_CF(CFHash (str) == CFHash (wide),
+          "Hash is the same as for the UTF-16 version.");
+
+  ptr = CFStringGetCStringPtr (str, kCFStringEncodingISOLatin1);
+  PASS_CF(ptr != NULL && memcmp (ptr, "caf\xE9", 4) == 0,
+          "ISO-8859-1 contents are available directly.");
+  PASS_CF(CFStringGetCStringPtr (str, kCFStringEncodingUTF8) == NULL,
+          "ISO-8859-1 contents are not handed out as UTF-8.");
+  PASS_CF(CFStringGetCStringPtr (str, kCFStringEncodingASCII) == NULL,
+          "ISO-8859-1 contents are not handed out as ASCII.");
+
+  PASS_CF(CFStringGetBytes (str, CFRangeMake (0, 4), kCFStringEncodingUTF8,
+                            0, false, bytes, sizeof (bytes), &used) == 4
+          && used == 5 && memcmp (bytes, "caf\xC3\xA9", 5) == 0,
+          "Converting back to UTF-8 works.");
+
+  CFStringInitInlineBuffer (str, &ibuf, CFRangeMake (0, 4));
+  PASS_CF(CFStringGetCharacterFromInlineBuffer (&ibuf, 3) == 0xE9,
+          "Inline buffer widens ISO-8859-1 contents.");
+
+  sub = CFStringCreateWithSubstring (NULL, str, CFRangeMake (2, 2));
+  PASS_CF(CFStringGetCharacterAtIndex (sub, 1) == 0xE9,
+          "Substring keeps characters above U+007F.");
+  copy = CFStringCreateCopy (kCFAllocatorSystemDefault, str);
+  PASS_CFEQ(copy, str, "Copy is equal to the original.");
+  CFRelease (copy);
+  CFRelease (sub);
+  CFRelease (wide);
+  CFRelease (str);
+
+  str = CFStringCreateWithBytesNoCopy (NULL, latin1, sizeof (latin1),
+                                       kCFStringEncodingISOLatin1, false,
+                                       kCFAllocatorNull);
+  PASS_CF(CFStringGetCStringPtr (str, kCFStringEncodingISOLatin1)
+          == (const char *) latin1,
+          "ISO-8859-1 bytes are not copied by the NoCopy variant.");
+  PASS_CF(CFStringGetCharacterAtIndex (str, 3) == 0xDF,
+          "NoCopy ISO-8859-1 string is read correctly.");
+  CFRelease (str);
+
+  for (idx = 0; idx < 1024; ++idx)
+    {
+      longUTF8[2 * idx] = 0xC3;
+      longUTF8[2 * idx + 1] = 0xA9;
+    }
+  str = CFStringCreateWithBytes (NULL, longUTF8, sizeof (longUTF8),
+                                 kCFStringEncodingUTF8, false);
+  PASS_CF(CFStringGetLength (str) == 1024
+          && CFStringGetCStringPtr (str, kCFStringEncodingISOLatin1) != NULL,
+          "Long UTF-8 input is stored as ISO-8859-1.");
+  PASS_CF(CFStringGetCharacterAtIndex (str, 1023) == 0xE9,
+          "Last character of long input is correct.");
+  CFRelease (str);
+
+  str = CFStringCreateWithBytes (NULL, (const UInt8 *) "\xE2\x82\xAC", 3,
+                                 kCFStringEncodingUTF8, false);
+  PASS_CF(CFStringGetCStringPtr (str, kCFStringEncodingISOLatin1) == NULL
+          && CFStringGetCharacterAtIndex (str, 0) == 0x20AC,
+          "Characters above U+00FF are stored as UTF-16.");
+  CFRelease (str);
+
+  str = CFStringCreateWithBytes (NULL,
+                                 (const UInt8 *) "\xEF\xBB\xBF" "caf\xC3\xA9",
+                                 8, kCFStringEncodingUTF8, false);
+  PASS_CF(CFStringGetLength (str) == 4
+          && CFStringGetCharacterAtIndex (str, 0) == 'c'
+          && CFStringGetCharacterAtIndex (str, 3) == 0xE9,
+          "UTF-8 byte order mark is skipped before ISO-8859-1 text.");
+  CFRelease (str);
+
+  for (idx = 0; idx < 300; ++idx)
+    longBytes[idx] = (idx % 7 == 6) ? 0xE9 : 'a' + idx % 26;
+  str = CFStringCreateWithBytes (NULL, longBytes, 300,
+                                 kCFStringEncodingISOLatin1, false);
+  CFStringGetCharacters (str, CFRangeMake (1, 299), longChars);
+  PASS_CF(longChars[5] == 0xE9 && longChars[298] == longBytes[299],
+          "Long ISO-8859-1 contents are widened correctly.");
+  PASS_CF(CFStringGetSmallestEncoding (str) == kCFStringEncodingISOLatin1,
+          "Smallest encoding of ISO-8859-1 text is ISO-8859-1.");
+  mcopy = CFStringCreateMutableCopy (NULL, 0, str);
+  PASS_CFEQ(mcopy, str, "Mutable copy of ISO-8859-1 text is equal.");
+  CFRelease (mcopy);
+  CFRelease (str);
+
+  for (idx = 0; idx < 300; ++idx)
+    longChars[idx] = 'a' + idx % 26;
+  longChars[280] = 0xE9;
+  longChars[290] = 0x20AC;
+  str = CFStringCreateWithCharacters (NULL, longChars, 300);
+  PASS_CF(CFStringGetBytes (str, CFRangeMake (0, 300),
+                            kCFStringEncodingISOLatin1, '?', false,
+                            longBytes, 300, &used) == 300 && used == 300
+          && longBytes[279] == 't' && longBytes[280] == 0xE9
+          && longBytes[290] == '?' && longBytes[299] == 'n',
+          "Long UTF-16 text is narrowed to ISO-8859-1 with a loss byte.");
+  PASS_CF(CFStringGetBytes (str, CFRangeMake (0, 300),
+                            kCFStringEncodingASCII, '?', false,
+                            longBytes, 300, &used) == 300
+          && longBytes[280] == '?' && longBytes[281] == 'v',
+          "Long UTF-16 text is narrowed to ASCII with a loss byte.");
+  PASS_CF(CFStringGetSmallestEncoding (str) == kCFStringEncodingUnicode,
+          "Smallest encoding of text above U+00FF is UTF-16.");
+  CFRelease (str);
+
+  str = CFStringCreateWithCharacters (NULL, longChars, 280);
+  PASS_CF(CFStringGetSmallestEncoding (str) == kCFStringEncodingASCII,
+          "Smallest encoding of ASCII text is ASCII.");
+  CFRelease (str);
+
+  return 0;
+}
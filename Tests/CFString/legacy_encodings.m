@@ -0,0 +1,72 @@
+#include "CoreFoundation/CFString.h"
+#include "CoreFoundation/CFStringEncodingExt.h"
+#include "../CFTesting.h"
+
+#include <string.h>
+
+int main (void)
+{
+  /* "Café €5" in Windows-1252 and "日本" in Shift-JIS. */
+  const UInt8 cp1252[] = { 'C', 'a', 'f', 0xE9, ' ', 0x80, '5' };
+  const UInt8 sjis[] = { 0x93, 0xFA, 0x96, 0x7B, '!' };
+  const UInt8 badSjis[] = { 'a', 0x85, 0x40, 'b' };
+  UniChar expected[] = { 'C', 'a', 'f', 0xE9, ' ', 0x20AC, '5' };
+  UniChar kanji[] = { 0x65E5, 0x672C, '!' };
+  UniChar chars[16];
+  UInt8 bytes[16];
+  CFStringRef str;
+  CFStringRef expect;
+  CFIndex used;
+  CFIndex num;
+
+  str = CFStringCreateWithBytes (NULL, cp1252, sizeof (cp1252),
+                                 kCFStringEncodingWindowsLatin1, false);
+  expect = CFStringCreateWithCharacters (NULL, expected, 7);
+  PASS_CFEQ(str, expect, "Windows-1252 bytes are decoded.");
+  num = CFStringGetBytes (str, CFRangeMake (0, 7),
+                          kCFStringEncodingWindowsLatin1, 0, false, bytes,
+                          sizeof (bytes), &used);
+  PASS_CF(num == 7 && used == 7 && memcmp (bytes, cp1252, 7) == 0,
+          "Windows-1252 bytes are encoded.");
+  CFRelease (expect);
+  CFRelease (str);
+
+  str = CFStringCreateWithCharacters (NULL, kanji, 3);
+  num = CFStringGetBytes (str, CFRangeMake (0, 3),
+                          kCFStringEncodingWindowsLatin1, '?', false, bytes,
+                          sizeof (bytes), &used);
+  PASS_CF(num == 3 && used == 3 && memcmp (bytes, "??!", 3) == 0,
+          "Loss byte replaces characters that cannot be encoded.");
+  num = CFStringGetBytes (str, CFRangeMake (0, 3),
+                          kCFStringEncodingWindowsLatin1, 0, false, bytes,
+                          sizeof (bytes), &used);
+  PASS_CF(num == 0 && used == 0,
+          "Encoding stops at a character that cannot be encoded.");
+
+  num = CFStringGetBytes (str, CFRangeMake (0, 3), kCFStringEncodingShiftJIS,
+                          0, false, bytes, 3, &used);
+  PASS_CF(num == 1 && used == 2 && memcmp (bytes, sjis, 2) == 0,
+          "Only whole Shift-JIS characters are written.");
+  num = CFStringGetBytes (str, CFRangeMake (0, 3), kCFStringEncodingShiftJIS,
+                          0, false, NULL, 0, &used);
+  PASS_CF(num == 3 && used == 5, "Shift-JIS length is counted.");
+  CFRelease (str);
+
+  str = CFStringCreateWithBytes (NULL, sjis, sizeof (sjis),
+                                 kCFStringEncodingShiftJIS, false);
+  CFStringGetCharacters (str, CFRangeMake (0, 3), chars);
+  PASS_CF(CFStringGetLength (str) == 3 && memcmp (chars, kanji, 6) == 0,
+          "Shift-JIS bytes are decoded.");
+  CFRelease (str);
+
+  str = CFStringCreateWithBytes (NULL, badSjis, sizeof (badSjis),
+                                 kCFStringEncodingShiftJIS, false);
+  PASS_CF(str != NULL && CFStringGetLength (str) == 3
+          && CFStringGetCharacterAtIndex (str, 1) == 0xFFFD
+          && CFStringGetCharacterAtIndex (str, 2) == 'b',
+          "Invalid Shift-JIS input is replaced.");
+  if (str != NULL)
+    CFRelease (str);
+
+  return 0;
+}
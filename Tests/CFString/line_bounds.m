@@ -0,0 +1,57 @@
+#include "CoreFoundation/CFString.h"
+#include "../CFTesting.h"
+
+int main (void)
+{
+  CFMutableStringRef mstr;
+  CFStringRef str;
+  CFIndex begin;
+  CFIndex end;
+  CFIndex contentsEnd;
+  CFIndex idx;
+  UniChar chars[] = { 'o', 'n', 'e', 0x2028, 't', 'w', 'o', 0x2029, 'x' };
+
+  str = CFSTR("first\r\nsecond\nthird");
+  CFStringGetLineBounds (str, CFRangeMake (9, 0), &begin, &end, &contentsEnd);
+  PASS_CF(begin == 7 && end == 14 && contentsEnd == 13,
+          "Bounds of a line ending in LF are found.");
+  CFStringGetLineBounds (str, CFRangeMake (2, 0), &begin, &end, &contentsEnd);
+  PASS_CF(begin == 0 && end == 7 && contentsEnd == 5,
+          "CR LF ends a line as one line ending.");
+  CFStringGetLineBounds (str, CFRangeMake (6, 0), &begin, &end, &contentsEnd);
+  PASS_CF(begin == 0 && end == 7 && contentsEnd == 5,
+          "Location between CR and LF is in the line they end.");
+  CFStringGetLineBounds (str, CFRangeMake (3, 9), &begin, &end, NULL);
+  PASS_CF(begin == 0 && end == 14,
+          "Range over several lines gives the bounds of all of them.");
+  CFStringGetLineBounds (str, CFRangeMake (16, 0), &begin, &end, &contentsEnd);
+  PASS_CF(begin == 14 && end == 19 && contentsEnd == 19,
+          "Last line ends at the end of the string.");
+
+  str = CFStringCreateWithCharacters (NULL, chars, 9);
+  CFStringGetLineBounds (str, CFRangeMake (5, 0), &begin, &end, NULL);
+  CFStringGetParagraphBounds (str, CFRangeMake (5, 0), &idx, &contentsEnd,
+                              NULL);
+  PASS_CF(begin == 4 && end == 8 && idx == 0 && contentsEnd == 8,
+          "Line separator ends a line but not a paragraph.");
+  CFRelease (str);
+
+  mstr = CFStringCreateMutable (NULL, 0);
+  for (idx = 0; idx < 1000; ++idx)
+    CFStringAppend (mstr, CFSTR("a line of a log file\n"));
+  str = CFStringCreateCopy (NULL, mstr);
+  PASS_CF(_CFStringGetLineCount (str) == 1000
+          && _CFStringGetLineCount (mstr) == 1000,
+          "Lines are counted.");
+  PASS_CF(_CFStringGetLineStartIndex (str, 500) == 500 * 21
+          && _CFStringGetLineAtIndex (str, 500 * 21 + 20) == 500
+          && _CFStringGetLineAtIndex (str, 500 * 21 + 21) == 501,
+          "Line is found by number and by index.");
+  PASS_CF(_CFStringGetLineStartIndex (str, 1000) == kCFNotFound
+          && _CFStringGetLineAtIndex (str, 21000) == kCFNotFound,
+          "Line past the end is not found.");
+  CFRelease (str);
+  CFRelease (mstr);
+
+  return 0;
+}
@@ -0,0 +1,66 @@
+#include "CoreFoundation/CFString.h"
+#include "../CFTesting.h"
+
+static CFMutableStringRef
+makeString (const char *prefix, const UniChar *chars, CFIndex length)
+{
+  CFMutableStringRef str;
+  CFStringRef tmp;
+
+  str = CFStringCreateMutable (NULL, 0);
+  tmp = CFStringCreateWithCString (NULL, prefix, kCFStringEncodingISOLatin1);
+  CFStringAppend (str, tmp);
+  CFRelease (tmp);
+  CFStringAppendCharacters (str, chars, length);
+
+  return str;
+}
+
+int main (void)
+{
+  CFMutableStringRef str;
+  const UniChar *ptr;
+  UniChar combining[] = { 'e', 0x301, 'x' };
+  UniChar ligature[] = { 0xFB01, 'n', 'e' };
+  UniChar precomposed[100];
+  CFIndex idx;
+
+  str = makeString ("Identifier_with_a_long_ASCII_prefix_", combining, 3);
+  CFStringNormalize (str, kCFStringNormalizationFormC);
+  PASS_CF(CFStringGetLength (str) == 38
+          && CFStringGetCharacterAtIndex (str, 35) == '_'
+          && CFStringGetCharacterAtIndex (str, 36) == 0xE9,
+          "Combining mark after ASCII is composed.");
+  CFRelease (str);
+
+  str = makeString ("caf\xE9 ", ligature, 3);
+  ptr = CFStringGetCharactersPtr (str);
+  CFStringNormalize (str, kCFStringNormalizationFormKC);
+  PASS_CF(CFStringGetLength (str) == 9
+          && CFStringGetCharacterAtIndex (str, 3) == 0xE9
+          && CFStringGetCharacterAtIndex (str, 5) == 'f'
+          && CFStringGetCharacterAtIndex (str, 6) == 'i',
+          "Compatibility character is decomposed in NFKC.");
+  PASS_CF(CFStringGetCharactersPtr (str) == ptr,
+          "Result that fits is written to the same buffer.");
+  CFStringNormalize (str, kCFStringNormalizationFormD);
+  PASS_CF(CFStringGetLength (str) == 10
+          && CFStringGetCharacterAtIndex (str, 4) == 0x301,
+          "ISO-8859-1 letter is decomposed in NFD.");
+  CFRelease (str);
+
+  for (idx = 0; idx < 100; ++idx)
+    precomposed[idx] = 0xC0 + idx % 6;
+  str = makeString ("", precomposed, 100);
+  CFStringNormalize (str, kCFStringNormalizationFormD);
+  PASS_CF(CFStringGetLength (str) == 200
+          && CFStringGetCharacterAtIndex (str, 198) == 'A',
+          "Result longer than the buffer is complete.");
+  CFStringNormalize (str, kCFStringNormalizationFormC);
+  PASS_CF(CFStringGetLength (str) == 100
+          && CFStringGetCharacterAtIndex (str, 99) == 0xC3,
+          "Decomposed string is composed again.");
+  CFRelease (str);
+
+  return 0;
+}
@@ -0,0 +1,65 @@
+#include "CoreFoundation/CFString.h"
+#include "../CFTesting.h"
+
+#include <math.h>
+
+int main (void)
+{
+  CFStringRef str;
+  CFMutableStringRef mstr;
+  UniChar chars[] = { ' ', 0x3B1, '-', '4', '2', 0x3B2 };
+  CFRange r;
+  SInt64 i;
+  double d;
+  Boolean overflow;
+  CFIndex idx;
+
+  PASS_CF(CFStringGetIntValue (CFSTR("  -123abc")) == -123,
+          "Integer after white space is read.");
+  PASS_CF(CFStringGetIntValue (CFSTR("+7")) == 7, "Plus sign is accepted.");
+  PASS_CF(CFStringGetIntValue (CFSTR("99999999999")) == 2147483647
+          && CFStringGetIntValue (CFSTR("-99999999999")) == -2147483647 - 1,
+          "Integers that do not fit are clamped.");
+  PASS_CF(CFStringGetIntValue (CFSTR("abc")) == 0,
+          "No integer gives zero.");
+
+  PASS_CF(CFStringGetDoubleValue (CFSTR(" 3.25e2xyz")) == 325.0,
+          "Double with an exponent is read.");
+  PASS_CF(CFStringGetDoubleValue (CFSTR("1,5")) == 1.0,
+          "Decimal separator does not depend on the locale.");
+  PASS_CF(CFStringGetDoubleValue (CFSTR("0.1")) == 0.1
+          && CFStringGetDoubleValue (CFSTR("2.2250738585072011e-308"))
+          == 2.2250738585072011e-308,
+          "Doubles are correctly rounded.");
+  PASS_CF(CFStringGetDoubleValue (CFSTR("-Infinity")) == -HUGE_VAL,
+          "Infinity is read.");
+
+  str = CFSTR("x=1e400;");
+  r = CFStringScanDoubleValue (str, CFRangeMake (2, 6), &d, &overflow);
+  PASS_CF(r.location == 2 && r.length == 5 && overflow && d == HUGE_VAL,
+          "Scanning a double reports its range and overflow.");
+
+  str = CFStringCreateWithCharacters (NULL, chars, 6);
+  r = CFStringScanIntValue (str, CFRangeMake (2, 4), &i, &overflow);
+  PASS_CF(r.location == 2 && r.length == 3 && i == -42 && !overflow,
+          "Integer is scanned from UTF-16 contents.");
+  r = CFStringScanIntValue (str, CFRangeMake (0, 6), &i, NULL);
+  PASS_CF(r.location == 0 && r.length == 0, "No integer gives an empty range.");
+  CFRelease (str);
+
+  r = CFStringScanIntValue (CFSTR("12345678901234567890"), CFRangeMake (0, 20),
+                            &i, &overflow);
+  PASS_CF(r.length == 20 && overflow && i == 9223372036854775807LL,
+          "Integer overflow is reported.");
+
+  mstr = CFStringCreateMutable (NULL, 0);
+  CFStringAppend (mstr, CFSTR("0."));
+  for (idx = 0; idx < 100; ++idx)
+    CFStringAppend (mstr, CFSTR("0"));
+  CFStringAppend (mstr, CFSTR("15 rest"));
+  PASS_CF(CFStringGetDoubleValue (mstr) == 1.5e-101,
+          "Long number in a mutable string is read.");
+  CFRelease (mstr);
+
+  return 0;
+}
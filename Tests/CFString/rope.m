@@ -0,0 +1,133 @@
+#include "CoreFoundation/CFString.h"
+#include "../CFTesting.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define LENGTH 100000
+#define EDITS 2000
+
+static UniChar model[2 * (LENGTH + EDITS * 8)];
+static CFIndex modelLength;
+
+static void
+modelReplace (CFRange range, const UniChar *chars, CFIndex length)
+{
+  memmove (model + range.location + length,
+           model + range.location + range.length,
+           (modelLength - range.location - range.length) * sizeof (UniChar));
+  memcpy (model + range.location, chars, length * sizeof (UniChar));
+  modelLength += length - range.length;
+}
+
+static Boolean
+matchesModel (CFStringRef str)
+{
+  UniChar *chars;
+  Boolean ret;
+
+  if (CFStringGetLength (str) != modelLength)
+    return false;
+  chars = malloc (modelLength * sizeof (UniChar));
+  CFStringGetCharacters (str, CFRangeMake (0, modelLength), chars);
+  ret = memcmp (chars, model, modelLength * sizeof (UniChar)) == 0;
+  free (chars);
+
+  return ret;
+}
+
+int main (void)
+{
+  CFMutableStringRef str;
+  CFStringRef copy;
+  CFStringRef sub;
+  CFStringRef piece;
+  CFStringInlineBuffer buffer;
+  const UniChar *ptr;
+  UniChar *saved;
+  UniChar chars[8];
+  CFRange range;
+  CFIndex idx;
+  CFIndex n;
+  Boolean ok;
+
+  for (idx = 0; idx < LENGTH; ++idx)
+    model[idx] = 'a' + idx % 26;
+  modelLength = LENGTH;
+
+  str = CFStringCreateMutable (NULL, 0);
+  CFStringAppendCharacters (str, model, modelLength);
+
+  srand (1);
+  for (idx = 0; idx < EDITS; ++idx)
+    {
+      n = rand () % 8;
+      for (range.length = 0; range.length < n; ++range.length)
+        chars[range.length] = 0x400 + rand () % 256;
+      range.location = rand () % modelLength;
+      range.length = rand () % 6;
+      if (range.location + range.length > modelLength)
+        range.length = modelLength - range.location;
+
+      piece = CFStringCreateWithCharacters (NULL, chars, n);
+      CFStringReplace (str, range, piece);
+      CFRelease (piece);
+      modelReplace (range, chars, n);
+    }
+  PASS_CF(matchesModel (str), "Many small edits to a large string work.");
+
+  ok = true;
+  for (idx = 0; idx < modelLength; idx += 997)
+    ok = ok && CFStringGetCharacterAtIndex (str, idx) == model[idx];
+  PASS_CF(ok, "Characters are found by index.");
+
+  CFStringInitInlineBuffer (str, &buffer, CFRangeMake (0, modelLength));
+  ok = true;
+  for (idx = 0; idx < modelLength; ++idx)
+    ok = ok && CFStringGetCharacterFromInlineBuffer (&buffer, idx)
+      == model[idx];
+  PASS_CF(ok, "Inline buffer iterates over the whole string.");
+
+  copy = CFStringCreateWithCharacters (NULL, model, modelLength);
+  PASS_CFEQ(str, copy, "String is equal to an immutable copy.");
+  PASS_CF(CFHash (str) == CFHash (copy), "Hash matches the immutable copy.");
+  CFRelease (copy);
+
+  sub = CFStringCreateWithSubstring (NULL, str, CFRangeMake (5000, 20));
+  copy = CFStringCreateWithCharacters (NULL, model + 5000, 20);
+  PASS_CFEQ(sub, copy, "Substring is correct.");
+  CFRelease (copy);
+  CFRelease (sub);
+
+  CFStringInsert (str, 10, str);
+  saved = malloc (modelLength * sizeof (UniChar));
+  memcpy (saved, model, modelLength * sizeof (UniChar));
+  modelReplace (CFRangeMake (10, 0), saved, modelLength);
+  free (saved);
+  PASS_CF(matchesModel (str), "String can be inserted into itself.");
+
+  ptr = CFStringGetCharactersPtr (str);
+  PASS_CF(ptr != NULL
+          && memcmp (ptr, model, modelLength * sizeof (UniChar)) == 0,
+          "Characters pointer returns the whole string.");
+
+  CFStringDelete (str, CFRangeMake (100, modelLength - 200));
+  modelReplace (CFRangeMake (100, modelLength - 200), NULL, 0);
+  PASS_CF(matchesModel (str), "Deleting most of the string works.");
+  PASS_CF(CFStringGetCharactersPtr (str) != NULL,
+          "Characters pointer is available after shrinking.");
+
+  CFRelease (str);
+
+  str = CFStringCreateMutable (NULL, 0);
+  CFStringAppendCharacters (str, model, 40000);
+  CFStringInsert (str, 10, CFSTR("x"));
+  CFMakeImmortal (str);
+  CFStringGetCharacters (str, CFRangeMake (39993, 8), chars);
+  PASS_CF(CFStringGetLength (str) == 40001
+          && CFStringGetCharacterAtIndex (str, 10) == 'x'
+          && chars[7] == model[39999],
+          "Edited string can be read after CFMakeImmortal().");
+
+  return 0;
+}
@@ -0,0 +1,102 @@
+#include "CoreFoundation/CFArray.h"
+#include "CoreFoundation/CFString.h"
+#include "../CFTesting.h"
+
+#include <string.h>
+
+int main (void)
+{
+  CFStringRef str;
+  CFStringRef sub;
+  CFStringRef sub2;
+  CFStringRef copy;
+  CFStringRef expect;
+  CFArrayRef array;
+  const CFRange *r;
+  char text[201];
+  UniChar chars[100];
+  CFIndex idx;
+
+  for (idx = 0; idx < 200; ++idx)
+    text[idx] = 'a' + idx % 26;
+  text[200] = '\0';
+  str = CFStringCreateWithCString (NULL, text, kCFStringEncodingASCII);
+
+  sub = CFStringCreateWithSubstring (NULL, str, CFRangeMake (40, 100));
+  expect = CFStringCreateWithBytes (NULL, (const UInt8 *) text + 40, 100,
+                                    kCFStringEncodingASCII, false);
+  PASS_CFEQ(sub, expect, "Substring has the right characters.");
+  PASS_CF(CFHash (sub) == CFHash (expect),
+          "Substring hash matches a copied string.");
+  PASS_CF(CFStringGetCStringPtr (sub, kCFStringEncodingASCII) == NULL,
+          "Substring does not hand out an unterminated C string.");
+
+  sub2 = CFStringCreateWithSubstring (NULL, sub, CFRangeMake (10, 50));
+  CFRelease (expect);
+  expect = CFStringCreateWithBytes (NULL, (const UInt8 *) text + 50, 50,
+                                    kCFStringEncodingASCII, false);
+  PASS_CFEQ(sub2, expect, "Substring of a substring is correct.");
+  CFRelease (expect);
+
+  copy = CFStringCreateCopy (NULL, sub);
+  PASS_CF(copy == sub, "Copy of a large substring is the same object.");
+  CFRelease (copy);
+  CFRelease (sub);
+
+  sub = CFStringCreateWithSubstring (NULL, str, CFRangeMake (0, 40));
+  copy = CFStringCreateCopy (NULL, sub);
+  PASS_CF(copy != sub && CFEqual (copy, sub),
+          "Copy of a small substring gets its own characters.");
+  CFRelease (copy);
+  CFRelease (sub);
+
+  CFRelease (str);
+  PASS_CF(CFStringGetCharacterAtIndex (sub2, 49) == text[99],
+          "Substring outlives the string it was made from.");
+  CFRelease (sub2);
+
+  for (idx = 0; idx < 100; ++idx)
+    chars[idx] = 0x3B1 + idx % 24;
+  str = CFStringCreateWithCharacters (NULL, chars, 100);
+  sub = CFStringCreateWithSubstring (NULL, str, CFRangeMake (60, 40));
+  expect = CFStringCreateWithCharacters (NULL, chars + 60, 40);
+  PASS_CFEQ(sub, expect, "UTF-16 substring is correct.");
+  CFRelease (expect);
+  CFRelease (sub);
+  CFRelease (str);
+
+  str = CFSTR("The first line is long enough to be shared.\n"
+              "The second line is long enough to be shared too.\n"
+              "short");
+  array = CFStringCreateArrayBySeparatingStrings (NULL, str, CFSTR("\n"));
+  PASS_CF(CFArrayGetCount (array) == 3, "String is split into three lines.");
+  PASS_CFEQ(CFArrayGetValueAtIndex (array, 1),
+            CFSTR("The second line is long enough to be shared too."),
+            "Second line is correct.");
+  PASS_CFEQ(CFArrayGetValueAtIndex (array, 2), CFSTR("short"),
+            "Last line is correct.");
+  CFRelease (array);
+
+  str = CFSTR("abcabcabc");
+  array = CFStringCreateArrayWithFindResults (NULL, str, CFSTR("bc"),
+                                              CFRangeMake (0, 9), 0);
+  PASS_CF(array != NULL && CFArrayGetCount (array) == 3,
+          "All occurrences are found.");
+  r = CFArrayGetValueAtIndex (array, 2);
+  PASS_CF(r->location == 7 && r->length == 2, "Last range is correct.");
+  CFRelease (array);
+
+  array = CFStringCreateArrayWithFindResults (NULL, str, CFSTR("bc"),
+                                              CFRangeMake (0, 9),
+                                              kCFCompareBackwards);
+  r = CFArrayGetValueAtIndex (array, 0);
+  PASS_CF(CFArrayGetCount (array) == 3 && r->location == 7,
+          "Backwards search finds the last occurrence first.");
+  CFRelease (array);
+
+  PASS_CF(CFStringCreateArrayWithFindResults (NULL, str, CFSTR("x"),
+                                              CFRangeMake (0, 9), 0)
+          == NULL, "No array is returned if nothing is found.");
+
+  return 0;
+}
@@ -0,0 +1,101 @@
+#include "CoreFoundation/CFString.h"
+#include "../CFTesting.h"
+
+#include <string.h>
+
+/* ASCII runs of every length up to 70, to exercise both the vectorized
+   and the tail code, each followed by a character that needs two, three
+   or four bytes in UTF-8.  A byte that is not valid UTF-8 is put in the
+   middle, so the text is converted to UTF-16 on input. */
+int main (void)
+{
+  UInt8 utf8[8192];
+  UniChar expected[4096];
+  UniChar chars[4096];
+  UInt8 bytes[8192];
+  CFStringRef str;
+  CFStringRef wide;
+  CFIndex numBytes;
+  CFIndex length;
+  CFIndex used;
+  CFIndex run;
+  CFIndex idx;
+  Boolean ok;
+
+  numBytes = 0;
+  length = 0;
+  for (run = 0; run <= 70; ++run)
+    {
+      for (idx = 0; idx < run; ++idx)
+        {
+          utf8[numBytes++] = '0' + idx % 64;
+          expected[length++] = '0' + idx % 64;
+        }
+      switch (run % 3)
+        {
+          case 0:
+            utf8[numBytes++] = 0xC3;
+            utf8[numBytes++] = 0xA9;
+            expected[length++] = 0xE9;
+            break;
+          case 1:
+            utf8[numBytes++] = 0xE2;
+            utf8[numBytes++] = 0x82;
+            utf8[numBytes++] = 0xAC;
+            expected[length++] = 0x20AC;
+            break;
+          case 2:
+            utf8[numBytes++] = 0xF0;
+            utf8[numBytes++] = 0xA4;
+            utf8[numBytes++] = 0xAD;
+            utf8[numBytes++] = 0xA2;
+            expected[length++] = 0xD852;
+            expected[length++] = 0xDF62;
+            break;
+        }
+      if (run == 35)
+        {
+          utf8[numBytes++] = 0xFF;
+          expected[length++] = 0xFFFD;
+        }
+    }
+
+  str = CFStringCreateWithBytes (NULL, utf8, numBytes, kCFStringEncodingUTF8,
+                                 false);
+  PASS_CF(CFStringGetLength (str) == length,
+          "Mixed UTF-8 is decoded to the right length.");
+  CFStringGetCharacters (str, CFRangeMake (0, length), chars);
+  PASS_CF(memcmp (chars, expected, length * sizeof (UniChar)) == 0,
+          "Mixed UTF-8 is decoded correctly.");
+  CFRelease (str);
+
+  wide = CFStringCreateWithCharacters (NULL, expected, length);
+  PASS_CF(CFStringGetBytes (wide, CFRangeMake (0, length),
+                            kCFStringEncodingUTF8, 0, false, bytes,
+                            sizeof (bytes), &used) == length,
+          "Mixed UTF-16 is encoded to UTF-8.");
+  /* The invalid byte came back as U+FFFD. */
+  PASS_CF(used == numBytes + 2, "Encoded UTF-8 has the right length.");
+  PASS_CF(CFStringGetBytes (wide, CFRangeMake (0, length),
+                            kCFStringEncodingUTF8, 0, false, NULL, 0,
+                            &used) == length
+          && used == numBytes + 2,
+          "Length of the UTF-8 is computed without a buffer.");
+  /* 37 characters fit in the first 50 bytes, the next one does not. */
+  PASS_CF(CFStringGetBytes (wide, CFRangeMake (0, 100),
+                            kCFStringEncodingUTF8, 0, false, bytes, 50,
+                            &used) == 37 && used == 48
+          && memcmp (bytes, utf8, 48) == 0,
+          "Encoding stops when the buffer is full.");
+  /* The end of the buffer falls at every place in a character. */
+  ok = true;
+  for (idx = 0; idx <= 60; ++idx)
+    ok = ok && CFStringGetBytes (wide, CFRangeMake (0, 100),
+                                 kCFStringEncodingUTF8, 0, false, bytes, idx,
+                                 &used) < 100
+      && used <= idx && used > idx - 4 && memcmp (bytes, utf8, used) == 0;
+  PASS_CF(ok, "Only whole characters are encoded into a small buffer.");
+  CFRelease (wide);
+
+  return 0;
+}
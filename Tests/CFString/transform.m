@@ -0,0 +1,49 @@
+#include "CoreFoundation/CFString.h"
+#include "../CFTesting.h"
+
+int main (void)
+{
+  CFMutableStringRef str;
+  CFRange range;
+  UniChar accented[] = { 'C', 'r', 0xE8, 'm', 'e', ' ', 'b', 'r', 0xFB, 'l',
+    0xE9, 'e' };
+  int idx;
+
+  for (idx = 0; idx < 3; ++idx)
+    {
+      str = CFStringCreateMutable (NULL, 0);
+      CFStringAppendCharacters (str, accented, 12);
+      PASS_CF(CFStringTransform (str, NULL, kCFStringTransformStripDiacritics,
+                                 false)
+              && CFEqual (str, CFSTR("Creme brulee")),
+              "Diacritics are stripped (pass %d).", idx);
+      CFRelease (str);
+    }
+
+  str = CFStringCreateMutable (NULL, 0);
+  CFStringAppend (str, CFSTR("ka kana"));
+  range = CFRangeMake (3, 4);
+  PASS_CF(CFStringTransform (str, &range, kCFStringTransformLatinKatakana,
+                             false)
+          && range.location == 3 && range.length == 2
+          && CFStringGetLength (str) == 5
+          && CFStringHasPrefix (str, CFSTR("ka ")),
+          "Range is updated to the transformed text.");
+  CFRelease (str);
+
+  str = CFStringCreateMutable (NULL, 0);
+  CFStringAppend (str, CFSTR("Latin"));
+  PASS_CF(CFStringTransform (str, NULL, kCFStringTransformLatinGreek, false)
+          && CFStringTransform (str, NULL, kCFStringTransformLatinGreek, true)
+          && CFEqual (str, CFSTR("Latin")),
+          "Reverse transform undoes the forward transform.");
+  CFRelease (str);
+
+  str = CFStringCreateMutable (NULL, 0);
+  CFStringAppend (str, CFSTR("abc"));
+  PASS_CF(!CFStringTransform (str, NULL, CFSTR("No-Such-Transform"), false),
+          "Unknown transform fails.");
+  CFRelease (str);
+
+  return 0;
+}
@@ -0,0 +1,159 @@
+#include "CoreFoundation/CFString.h"
+#include "../CFTesting.h"
+
+#include <string.h>
+
+/* Builds the same text as UTF-8 and UTF-16, cycling through characters
+   that need one to four bytes. */
+static CFIndex
+makeText (UInt8 *utf8, UniChar *utf16, CFIndex count)
+{
+  CFIndex used;
+  CFIndex idx;
+  CFIndex len;
+
+  used = 0;
+  len = 0;
+  for (idx = 0; idx < count; ++idx)
+    {
+      switch (idx % 4)
+        {
+          case 0:
+            utf8[used++] = 'a' + idx % 26;
+            utf16[len++] = 'a' + idx % 26;
+            break;
+          case 1:                /* U+0416 */
+            utf8[used++] = 0xD0;
+            utf8[used++] = 0x96;
+            utf16[len++] = 0x0416;
+            break;
+          case 2:                /* U+20AC */
+            utf8[used++] = 0xE2;
+            utf8[used++] = 0x82;
+            utf8[used++] = 0xAC;
+            utf16[len++] = 0x20AC;
+            break;
+          case 3:                /* U+24B62 */
+            utf8[used++] = 0xF0;
+            utf8[used++] = 0xA4;
+            utf8[used++] = 0xAD;
+            utf8[used++] = 0xA2;
+            utf16[len++] = 0xD852;
+            utf16[len++] = 0xDF62;
+            break;
+        }
+    }
+  return used;
+}
+
+int main (void)
+{
+  UInt8 utf8[1024 * 4 + 16];
+  UniChar utf16[1024 * 2];
+  UniChar chars[8];
+  UInt8 bytes[1024 * 4];
+  CFStringRef str;
+  CFStringRef wide;
+  CFStringRef sub;
+  CFStringRef sub2;
+  CFMutableStringRef mstr;
+  CFRange range;
+  CFIndex numBytes;
+  CFIndex length;
+  CFIndex used;
+  CFIndex idx;
+  Boolean same;
+
+  numBytes = makeText (utf8, utf16, 1024);
+  length = 1024 / 4 * 5;
+
+  str = CFStringCreateWithBytes (NULL, utf8, numBytes, kCFStringEncodingUTF8,
+                                 false);
+  wide = CFStringCreateWithCharacters (NULL, utf16, length);
+  PASS_CF(CFStringGetLength (str) == length,
+          "Length is counted in UTF-16 code units.");
+  PASS_CF(CFStringGetCStringPtr (str, kCFStringEncodingUTF8) != NULL
+          && memcmp (CFStringGetCStringPtr (str, kCFStringEncodingUTF8),
+                     utf8, numBytes) == 0,
+          "UTF-8 contents are available directly.");
+  PASS_CF(CFStringGetFastestEncoding (str) == kCFStringEncodingUTF8,
+          "Fastest encoding is UTF-8.");
+
+  same = true;
+  for (idx = 0; idx < length; ++idx)
+    {
+      if (CFStringGetCharacterAtIndex (str, idx) != utf16[idx])
+        same = false;
+    }
+  PASS_CF(same, "Every character is found by index.");
+  for (idx = length - 1; idx >= 0; idx -= 7)
+    {
+      if (CFStringGetCharacterAtIndex (str, idx) != utf16[idx])
+        same = false;
+    }
+  PASS_CF(same, "Characters are found by index in reverse order.");
+
+  CFStringGetCharacters (str, CFRangeMake (4, 6), chars);
+  PASS_CF(memcmp (chars, utf16 + 4, 6 * sizeof (UniChar)) == 0,
+          "Characters can be read from the middle of a surrogate pair.");
+
+  PASS_CFEQ(str, wide, "String is equal to its UTF-16 version.");
+  PASS_CF(CFHash (str) == CFHash (wide),
+          "Hash is the same as for the UTF-16 version.");
+
+  range = CFStringGetRangeOfComposedCharactersAtIndex (str, 4);
+  PASS_CF(range.location == 3 && range.length == 2,
+          "Surrogate pair is found as a composed character.");
+
+  PASS_CF(CFStringGetBytes (str, CFRangeMake (0, length),
+                            kCFStringEncodingUTF8, 0, false, bytes,
+                            sizeof (bytes), &used) == length
+          && used == numBytes && memcmp (bytes, utf8, numBytes) == 0,
+          "Converting to UTF-8 gives the original bytes.");
+  PASS_CF(CFStringGetBytes (str, CFRangeMake (0, length),
+                            kCFStringEncodingUTF16, 0, false, bytes,
+                            sizeof (bytes), &used) == length
+          && used == length * sizeof (UniChar)
+          && memcmp (bytes, utf16, used) == 0,
+          "Converting to UTF-16 works.");
+  PASS_CF(CFStringGetBytes (str, CFRangeMake (1, 4), kCFStringEncodingUTF8,
+                            0, false, bytes, sizeof (bytes), &used) == 4
+          && used == 9 && memcmp (bytes, utf8 + 1, 9) == 0,
+          "Part of the string is converted to UTF-8.");
+
+  sub = CFStringCreateWithSubstring (NULL, str, CFRangeMake (5, 10));
+  PASS_CF(CFStringGetLength (sub) == 10
+          && CFStringGetCharacterAtIndex (sub, 0) == utf16[5],
+          "Substring on character boundaries is created.");
+  CFRelease (sub);
+  sub = CFStringCreateWithSubstring (NULL, str, CFRangeMake (4, 3));
+  sub2 = CFStringCreateWithSubstring (NULL, wide, CFRangeMake (4, 3));
+  PASS_CFEQ(sub, sub2,
+            "Substring starting inside a surrogate pair is created.");
+  CFRelease (sub2);
+  CFRelease (sub);
+
+  mstr = CFStringCreateMutableCopy (NULL, 0, str);
+  PASS_CFEQ(mstr, wide, "Mutable copy has the same contents.");
+  CFRelease (mstr);
+  CFRelease (wide);
+  CFRelease (str);
+
+  str = CFStringCreateWithBytesNoCopy (NULL, utf8, numBytes,
+                                       kCFStringEncodingUTF8, false,
+                                       kCFAllocatorNull);
+  PASS_CF(CFStringGetCStringPtr (str, kCFStringEncodingUTF8)
+          == (const char *) utf8,
+          "UTF-8 bytes are not copied by the NoCopy variant.");
+  CFRelease (str);
+
+  utf8[0] = 0xC0;
+  utf8[1] = 0x80;
+  str = CFStringCreateWithBytes (NULL, utf8, 2, kCFStringEncodingUTF8,
+                                 false);
+  PASS_CF(CFStringGetCStringPtr (str, kCFStringEncodingUTF8) == NULL,
+          "Malformed UTF-8 is not kept as UTF-8.");
+  CFRelease (str);
+
+  return 0;
+}